@@ -0,0 +1,109 @@
+// Animation example program for the DGL graphics library, using the
+// coroutine-based frame scheduler.
+// Compile with g++ -std=c++20 animation-example.cpp -o animation-example -ldgl -lpixman.
+
+// Include standard library.
+#include <stdio.h>
+#include <stdlib.h>
+// Include the DGL coroutine header, which includes dgl.h.
+#include "dgl-coroutine.h"
+
+#define NU_BALLS 16
+
+class Ball {
+public :
+	int x, y;
+	int dx, dy;	// Velocity in pixels per frame.
+	int size;
+	uint32_t pixel;
+};
+
+// Each animation is a coroutine. It draws into the back buffer of the frame
+// that is being drawn using the context of the scheduler, and then waits for
+// the next frame with co_await. The scheduler resumes all tasks that wait
+// for a frame one after another before presenting it, so the drawing of all
+// tasks ends up in the same frame.
+
+// The background is drawn by the first task that was started, so that it
+// is drawn before the balls in every frame.
+static dglTask Background(dglFrameScheduler *scheduler) {
+	dglScreenFB *fb = scheduler->fb;
+	for (;;) {
+		dglFill(scheduler->context, 0, 0, fb->xres, fb->yres, 0x000000);
+		co_await dglNextFrame(scheduler);
+	}
+}
+
+// A ball bounces around the screen. co_await dglNextFrame returns the number
+// of frames that have passed, which is larger than one when the scheduler
+// had to skip frames because drawing took too long; the ball moves the
+// distance it would have moved in those frames so that the speed of the
+// animation stays constant.
+static dglTask BouncingBall(dglFrameScheduler *scheduler, Ball *ball) {
+	dglScreenFB *fb = scheduler->fb;
+	for (;;) {
+		dglFill(scheduler->context, ball->x, ball->y, ball->size, ball->size,
+			ball->pixel);
+		int frames = co_await dglNextFrame(scheduler);
+		ball->x += ball->dx * frames;
+		ball->y += ball->dy * frames;
+		if (ball->x < 0 || ball->x + ball->size > fb->xres) {
+			ball->dx = - ball->dx;
+			ball->x = ball->x < 0 ? 0 : fb->xres - ball->size;
+		}
+		if (ball->y < 0 || ball->y + ball->size > fb->yres) {
+			ball->dy = - ball->dy;
+			ball->y = ball->y < 0 ? 0 : fb->yres - ball->size;
+		}
+	}
+}
+
+// A task does not have to draw every frame. This one waits for the given
+// number of frames and then stops the scheduler.
+static dglTask Timeout(dglFrameScheduler *scheduler, int nu_frames) {
+	co_await dglWaitFrames(scheduler, nu_frames);
+	dglStopFrameScheduler(scheduler);
+}
+
+// C/C++ main entry function.
+int main(int arg, char *argv[]) {
+	// Create and initialize the console framebuffer.
+	dglConsoleFB *fb = dglCreateConsoleFramebuffer();
+
+	// Create the frame scheduler. The second parameter is the number of
+	// vertical blanks per frame (1 for the refresh rate of the display).
+	// The presenter of the scheduler chooses between page flipping and
+	// copying from a back buffer (DGL_PRESENT_MODE_AUTO).
+	dglFrameScheduler *scheduler = dglCreateFrameScheduler(fb, 1,
+		DGL_PRESENT_MODE_AUTO);
+
+	Ball ball[NU_BALLS];
+	for (int i = 0; i < NU_BALLS; i++) {
+		ball[i].size = 16 + rand() % 48;
+		ball[i].x = rand() % (fb->xres - ball[i].size);
+		ball[i].y = rand() % (fb->yres - ball[i].size);
+		ball[i].dx = 1 + rand() % 8;
+		ball[i].dy = 1 + rand() % 8;
+		ball[i].pixel = dglConvertColor(fb->format, (rand() % 256) / 255.0f,
+			(rand() % 256) / 255.0f, (rand() % 256) / 255.0f);
+	}
+
+	// Start the tasks. They run in the order in which they were started.
+	dglStartTask(scheduler, Background(scheduler));
+	for (int i = 0; i < NU_BALLS; i++)
+		dglStartTask(scheduler, BouncingBall(scheduler, &ball[i]));
+	// Stop after ten seconds at 60 Hz.
+	dglStartTask(scheduler, Timeout(scheduler, 600));
+
+	// Run the frame loop until the scheduler is stopped.
+	int nu_frames = dglRunFrameScheduler(scheduler);
+	printf("%d frames presented, %d frames skipped.\n", nu_frames,
+		scheduler->nu_skipped_frames);
+
+	// Destroying the scheduler also destroys the tasks that are still
+	// waiting for a frame.
+	dglDestroyFrameScheduler(scheduler);
+
+	// Restore text mode and free the fb structure.
+	dglDestroyConsoleFramebuffer(fb);
+}
@@ -0,0 +1,87 @@
+// Compositor daemon for the DGL graphics library. Owns the screen
+// framebuffer and composites the shared-memory surfaces of client
+// processes that connect to its socket (see dgl-compositor.cpp).
+//
+// Usage: compositord [drm] [vsync] [simulated] [socket path]
+// The default socket path is /tmp/dgl-compositor, or DGL_COMPOSITOR_SOCKET
+// when set. With 'simulated', a simulated 1280x720 screen framebuffer is
+// used so that the compositor and its clients can be tested without a
+// display; the number of frames composited is printed when exiting.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+
+#include "dgl.h"
+
+static volatile sig_atomic_t stop = 0;
+
+static void SignalHandler(int sig) {
+	stop = 1;
+}
+
+int main(int argc, char *argv[]) {
+	bool drm = false;
+	bool vsync = false;
+	bool simulated = false;
+	const char *socket_path = getenv("DGL_COMPOSITOR_SOCKET");
+	if (socket_path == NULL)
+		socket_path = "/tmp/dgl-compositor";
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "drm") == 0)
+			drm = true;
+		else if (strcmp(argv[i], "vsync") == 0)
+			vsync = true;
+		else if (strcmp(argv[i], "simulated") == 0)
+			simulated = true;
+		else
+			socket_path = argv[i];
+	}
+
+	dglScreenFB *fb;
+	if (simulated)
+		fb = dglCreateSimulatedFramebuffer(DGL_FORMAT_XRGB8888, 1280, 720, 2);
+	else if (drm)
+		fb = dglCreateDRMFramebuffer(NULL, 3);
+	else
+		fb = dglCreateConsoleFramebuffer();
+	if (fb == NULL) {
+		printf("Could not open screen framebuffer.\n");
+		exit(1);
+	}
+	dglCompositor *compositor = dglCreateCompositor(fb, socket_path, 0x000000,
+		vsync ? DGL_COMPOSITOR_FLAG_VSYNC : 0);
+	if (compositor == NULL) {
+		printf("Could not create compositor.\n");
+		exit(1);
+	}
+
+	// Exit cleanly (restoring text mode) on SIGINT and SIGTERM.
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SignalHandler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	while (!stop) {
+		// Wait for client requests until the screen is damaged, then
+		// handle the requests that are pending and composite a frame.
+		if (dglCompositorDispatch(compositor, - 1) < 0)
+			break;
+		while (dglCompositorDispatch(compositor, 0) > 0);
+		dglCompositorComposite(compositor);
+	}
+
+	int nu_frames = compositor->nu_frames;
+	dglDestroyCompositor(compositor);
+	if (simulated) {
+		printf("%d frames composited.\n", nu_frames);
+		dglDestroySimulatedFramebuffer((dglSimulatedFB *)fb);
+	}
+	else if (drm)
+		dglDestroyDRMFramebuffer((dglDRMFB *)fb);
+	else
+		dglDestroyConsoleFramebuffer((dglConsoleFB *)fb);
+	exit(0);
+}
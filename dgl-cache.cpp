@@ -0,0 +1,339 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// Surface cache with LRU eviction.
+//
+// Surfaces are looked up by a 64-bit key in a hash table and kept in a
+// doubly-linked list in order of use. Surfaces of up to 256x64 pixels are
+// stored in cells of shared atlas pixmaps; the cell size is the surface size
+// rounded up to a power of two (the size class), so that a freed cell can be
+// reused by any surface of the same class. Every atlas has a stack of free
+// cells and is freed when it becomes empty. Larger surfaces get a pixmap of
+// their own. The memory accounted is that of the allocated atlases and
+// pixmaps; when adding a surface requires a new atlas or pixmap that would
+// exceed the memory budget, the least recently used surfaces are evicted
+// until a cell becomes free or the allocation fits.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dgl.h"
+
+// Size classes: cell widths from 16 to 256 pixels, heights from 8 to 64.
+#define MIN_CELL_WIDTH_SHIFT 4
+#define MAX_CELL_WIDTH_SHIFT 8
+#define MIN_CELL_HEIGHT_SHIFT 3
+#define MAX_CELL_HEIGHT_SHIFT 6
+#define NU_CELL_HEIGHT_CLASSES (MAX_CELL_HEIGHT_SHIFT - MIN_CELL_HEIGHT_SHIFT + 1)
+#define ATLAS_WIDTH 512
+#define ATLAS_HEIGHT 256
+#define INITIAL_HASH_SIZE 256
+
+static int dglCeilShift(int x, int min_shift) {
+	int shift = min_shift;
+	while ((1 << shift) < x)
+		shift++;
+	return shift;
+}
+
+// Return the size class of a surface, or -1 when it is too large for an
+// atlas.
+
+static int dglGetSurfaceSizeClass(int w, int h) {
+	int w_shift = dglCeilShift(w, MIN_CELL_WIDTH_SHIFT);
+	int h_shift = dglCeilShift(h, MIN_CELL_HEIGHT_SHIFT);
+	if (w_shift > MAX_CELL_WIDTH_SHIFT || h_shift > MAX_CELL_HEIGHT_SHIFT)
+		return -1;
+	return (w_shift - MIN_CELL_WIDTH_SHIFT) * NU_CELL_HEIGHT_CLASSES +
+		h_shift - MIN_CELL_HEIGHT_SHIFT;
+}
+
+static dglSurfaceAtlas *dglCreateSurfaceAtlas(dglSurfaceCache *cache, int size_class) {
+	dglSurfaceAtlas *atlas = new dglSurfaceAtlas;
+	atlas->cell_w = 1 << (size_class / NU_CELL_HEIGHT_CLASSES + MIN_CELL_WIDTH_SHIFT);
+	atlas->cell_h = 1 << (size_class % NU_CELL_HEIGHT_CLASSES + MIN_CELL_HEIGHT_SHIFT);
+	atlas->fb = dglCreatePixmapFB(cache->format, ATLAS_WIDTH, ATLAS_HEIGHT);
+	atlas->nu_cells = (ATLAS_WIDTH / atlas->cell_w) * (ATLAS_HEIGHT / atlas->cell_h);
+	atlas->nu_free_cells = atlas->nu_cells;
+	atlas->free_cell = new int[atlas->nu_cells];
+	// Hand out the cells in order.
+	for (int i = 0; i < atlas->nu_cells; i++)
+		atlas->free_cell[i] = atlas->nu_cells - 1 - i;
+	atlas->next = cache->atlas[size_class];
+	cache->atlas[size_class] = atlas;
+	cache->nu_pixmaps++;
+	cache->memory_used += atlas->fb->total_size;
+	return atlas;
+}
+
+static void dglDestroySurfaceAtlas(dglSurfaceCache *cache, int size_class,
+dglSurfaceAtlas *atlas) {
+	dglSurfaceAtlas **p = &cache->atlas[size_class];
+	while (*p != atlas)
+		p = &(*p)->next;
+	*p = atlas->next;
+	cache->memory_used -= atlas->fb->total_size;
+	dglDestroyPixmapFB(atlas->fb);
+	delete [] atlas->free_cell;
+	delete atlas;
+	cache->nu_pixmaps--;
+}
+
+dglSurfaceCache *dglCreateSurfaceCache(uint32_t format, int memory_budget) {
+	dglSurfaceCache *cache = new dglSurfaceCache;
+	cache->format = format;
+	cache->bytes_per_pixel = DGL_FORMAT_GET_BYTES_PER_PIXEL(format);
+	cache->memory_budget = memory_budget;
+	cache->memory_used = 0;
+	cache->nu_surfaces = 0;
+	cache->nu_pixmaps = 0;
+	cache->hash_size = INITIAL_HASH_SIZE;
+	cache->hash = new dglCachedSurface *[cache->hash_size];
+	memset(cache->hash, 0, sizeof(dglCachedSurface *) * cache->hash_size);
+	cache->lru_head = NULL;
+	cache->lru_tail = NULL;
+	for (int i = 0; i < DGL_SURFACE_CACHE_NU_SIZE_CLASSES; i++)
+		cache->atlas[i] = NULL;
+	cache->render_context = dglCreateContext(NULL, NULL);
+	dglResetSurfaceCacheStats(cache);
+	return cache;
+}
+
+DGL_INLINE_ONLY static int dglGetSurfaceHashBucket(dglSurfaceCache *cache, uint64_t key) {
+	uint32_t h = (uint32_t)(key ^ (key >> 32)) * 0x9E3779B1;
+	return (h >> 8) & (cache->hash_size - 1);
+}
+
+static void dglUnlinkCachedSurfaceLRU(dglSurfaceCache *cache, dglCachedSurface *surface) {
+	if (surface->lru_prev)
+		surface->lru_prev->lru_next = surface->lru_next;
+	else
+		cache->lru_head = surface->lru_next;
+	if (surface->lru_next)
+		surface->lru_next->lru_prev = surface->lru_prev;
+	else
+		cache->lru_tail = surface->lru_prev;
+}
+
+static void dglLinkCachedSurfaceLRU(dglSurfaceCache *cache, dglCachedSurface *surface) {
+	surface->lru_prev = NULL;
+	surface->lru_next = cache->lru_head;
+	if (cache->lru_head)
+		cache->lru_head->lru_prev = surface;
+	else
+		cache->lru_tail = surface;
+	cache->lru_head = surface;
+}
+
+static void dglFreeCachedSurface(dglSurfaceCache *cache, dglCachedSurface *surface) {
+	dglCachedSurface **p = &cache->hash[dglGetSurfaceHashBucket(cache, surface->key)];
+	while (*p != surface)
+		p = &(*p)->hash_next;
+	*p = surface->hash_next;
+	dglUnlinkCachedSurfaceLRU(cache, surface);
+	if (surface->atlas) {
+		dglSurfaceAtlas *atlas = surface->atlas;
+		atlas->free_cell[atlas->nu_free_cells++] = surface->cell;
+		if (atlas->nu_free_cells == atlas->nu_cells)
+			dglDestroySurfaceAtlas(cache, dglGetSurfaceSizeClass(atlas->cell_w,
+				atlas->cell_h), atlas);
+	}
+	else {
+		cache->memory_used -= surface->size;
+		dglDestroyPixmapFB(surface->fb);
+		cache->nu_pixmaps--;
+	}
+	cache->nu_surfaces--;
+	delete surface;
+}
+
+void dglDestroySurfaceCache(dglSurfaceCache *cache) {
+	while (cache->lru_head)
+		dglFreeCachedSurface(cache, cache->lru_head);
+	delete [] cache->hash;
+	dglDestroyContext(cache->render_context);
+	delete cache;
+}
+
+static void dglGrowSurfaceHash(dglSurfaceCache *cache) {
+	dglCachedSurface **old_hash = cache->hash;
+	int old_size = cache->hash_size;
+	cache->hash_size *= 2;
+	cache->hash = new dglCachedSurface *[cache->hash_size];
+	memset(cache->hash, 0, sizeof(dglCachedSurface *) * cache->hash_size);
+	for (int i = 0; i < old_size; i++)
+		for (dglCachedSurface *surface = old_hash[i]; surface;) {
+			dglCachedSurface *next = surface->hash_next;
+			int bucket = dglGetSurfaceHashBucket(cache, surface->key);
+			surface->hash_next = cache->hash[bucket];
+			cache->hash[bucket] = surface;
+			surface = next;
+		}
+	delete [] old_hash;
+}
+
+static dglCachedSurface *dglFindCachedSurface(dglSurfaceCache *cache, uint64_t key) {
+	dglCachedSurface *surface = cache->hash[dglGetSurfaceHashBucket(cache, key)];
+	while (surface && surface->key != key)
+		surface = surface->hash_next;
+	return surface;
+}
+
+static dglSurfaceAtlas *dglFindFreeSurfaceAtlas(dglSurfaceCache *cache, int size_class) {
+	dglSurfaceAtlas *atlas = cache->atlas[size_class];
+	while (atlas && atlas->nu_free_cells == 0)
+		atlas = atlas->next;
+	return atlas;
+}
+
+// Allocate space for a new surface, evicting the least recently used
+// surfaces to stay within the memory budget. A surface larger than the
+// budget is still added once the cache is empty.
+
+static dglCachedSurface *dglAllocateCachedSurface(dglSurfaceCache *cache, uint64_t key,
+int w, int h) {
+	int size_class = dglGetSurfaceSizeClass(w, h);
+	int size;
+	int allocation_size;
+	if (size_class >= 0) {
+		size = (1 << (size_class / NU_CELL_HEIGHT_CLASSES + MIN_CELL_WIDTH_SHIFT)) *
+			(1 << (size_class % NU_CELL_HEIGHT_CLASSES + MIN_CELL_HEIGHT_SHIFT)) *
+			cache->bytes_per_pixel;
+		allocation_size = ATLAS_WIDTH * ATLAS_HEIGHT * cache->bytes_per_pixel;
+	}
+	else {
+		size = w * h * cache->bytes_per_pixel;
+		allocation_size = size;
+	}
+	dglSurfaceAtlas *atlas = NULL;
+	for (;;) {
+		// A free cell in an existing atlas needs no new memory.
+		if (size_class >= 0) {
+			atlas = dglFindFreeSurfaceAtlas(cache, size_class);
+			if (atlas)
+				break;
+		}
+		if (!cache->lru_tail ||
+		cache->memory_used + allocation_size <= cache->memory_budget)
+			break;
+		dglFreeCachedSurface(cache, cache->lru_tail);
+		cache->nu_evictions++;
+	}
+	dglCachedSurface *surface = new dglCachedSurface;
+	surface->key = key;
+	surface->w = w;
+	surface->h = h;
+	surface->size = size;
+	if (size_class >= 0) {
+		if (!atlas)
+			atlas = dglCreateSurfaceAtlas(cache, size_class);
+		int cell = atlas->free_cell[--atlas->nu_free_cells];
+		int cells_per_row = ATLAS_WIDTH / atlas->cell_w;
+		surface->atlas = atlas;
+		surface->cell = cell;
+		surface->fb = atlas->fb;
+		surface->x = (cell % cells_per_row) * atlas->cell_w;
+		surface->y = (cell / cells_per_row) * atlas->cell_h;
+	}
+	else {
+		surface->atlas = NULL;
+		surface->cell = 0;
+		surface->fb = dglCreatePixmapFB(cache->format, w, h);
+		surface->x = 0;
+		surface->y = 0;
+		cache->nu_pixmaps++;
+		cache->memory_used += size;
+	}
+	if (cache->nu_surfaces >= cache->hash_size)
+		dglGrowSurfaceHash(cache);
+	int bucket = dglGetSurfaceHashBucket(cache, key);
+	surface->hash_next = cache->hash[bucket];
+	cache->hash[bucket] = surface;
+	dglLinkCachedSurfaceLRU(cache, surface);
+	cache->nu_surfaces++;
+	return surface;
+}
+
+dglCachedSurface *dglGetCachedSurface(dglSurfaceCache *cache, uint64_t key, int w, int h,
+dglRenderSurfaceFunc render_func, void *user_data) {
+	dglCachedSurface *surface = dglFindCachedSurface(cache, key);
+	if (surface) {
+		if (surface->w == w && surface->h == h) {
+			cache->nu_hits++;
+			if (surface != cache->lru_head) {
+				dglUnlinkCachedSurfaceLRU(cache, surface);
+				dglLinkCachedSurfaceLRU(cache, surface);
+			}
+			return surface;
+		}
+		// The size changed; render the surface again.
+		dglFreeCachedSurface(cache, surface);
+	}
+	cache->nu_misses++;
+	surface = dglAllocateCachedSurface(cache, key, w, h);
+	dglContext *context = cache->render_context;
+	dglSetDrawFramebuffer(context, surface->fb);
+	dglSetReadFramebuffer(context, surface->fb);
+	dglSetContextClipRectangle(context, surface->x, surface->y, surface->x + w,
+		surface->y + h);
+	render_func(context, surface->x, surface->y, user_data);
+	return surface;
+}
+
+void dglRemoveCachedSurface(dglSurfaceCache *cache, uint64_t key) {
+	dglCachedSurface *surface = dglFindCachedSurface(cache, key);
+	if (surface)
+		dglFreeCachedSurface(cache, surface);
+}
+
+void dglPutCachedSurface(dglContext *context, int x, int y, dglCachedSurface *surface) {
+	dglContext copy_context = *context;
+	dglSetReadFramebuffer(&copy_context, surface->fb);
+	dglSetReadYOffset(&copy_context, 0);
+	dglCopyArea(&copy_context, surface->x, surface->y, x, y, surface->w, surface->h);
+}
+
+void dglGetSurfaceCacheStats(dglSurfaceCache *cache, dglSurfaceCacheStats *stats) {
+	stats->nu_hits = cache->nu_hits;
+	stats->nu_misses = cache->nu_misses;
+	stats->nu_evictions = cache->nu_evictions;
+	stats->nu_surfaces = cache->nu_surfaces;
+	stats->nu_pixmaps = cache->nu_pixmaps;
+	stats->memory_used = cache->memory_used;
+	stats->memory_budget = cache->memory_budget;
+}
+
+void dglResetSurfaceCacheStats(dglSurfaceCache *cache) {
+	cache->nu_hits = 0;
+	cache->nu_misses = 0;
+	cache->nu_evictions = 0;
+}
+
+// 64-bit FNV-1a hash.
+
+uint64_t dglHashSurfaceKey(const void *data, int size) {
+	const uint8_t *p = (const uint8_t *)data;
+	uint64_t h = 0xCBF29CE484222325ULL;
+	for (int i = 0; i < size; i++) {
+		h ^= p[i];
+		h *= 0x100000001B3ULL;
+	}
+	return h;
+}
@@ -0,0 +1,202 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// Calibration of screen framebuffer CopyArea.
+//
+// With accelerated CopyArea (the FBIOCOPYAREA ioctl of the console
+// framebuffer), every copy is a system call that sets up a DMA transfer and
+// waits for it to complete, which is slower than a CPU copy for small areas.
+// dglCalibrateCopyArea times both paths for a range of size classes and
+// records the faster one for each class, which dglCopyArea then follows.
+// Results can be cached in a text file, which is reused when it was written
+// for the same resolution, stride and pixel format.
+//
+// The copies are made within a page that is not displayed, or onto
+// themselves when there is only one page, so the display is not disturbed.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "dgl.h"
+
+#define COPY_CALIBRATION_FILE_VERSION 1
+// Each measurement is the best of a number of rounds, which each repeat
+// copies for at least a minimum time and number of iterations.
+#define COPY_CALIBRATION_ROUNDS 3
+#define COPY_CALIBRATION_MIN_TIME 0.001
+#define COPY_CALIBRATION_MIN_ITERATIONS 3
+
+// Size class i holds areas up to 64 * 4^i pixels (8x8, 16x16, ... 512x512).
+
+static void dglSetCopySizeClasses(dglCopyCalibration *calibration) {
+	for (int i = 0; i < DGL_COPY_NU_SIZE_CLASSES - 1; i++)
+		calibration->max_area[i] = 64 << (2 * i);
+	calibration->max_area[DGL_COPY_NU_SIZE_CLASSES - 1] = INT_MAX;
+}
+
+// Return the time per copy of a w x h area with dglCopyArea, routed with
+// the given calibration.
+
+static double dglMeasureCopy(dglContext *context, dglCopyCalibration *route,
+int sx, int sy, int dx, int dy, int w, int h) {
+	dglScreenFB *fb = (dglScreenFB *)context->draw_fb;
+	dglCopyCalibration *saved_calibration = fb->copy_calibration;
+	fb->copy_calibration = route;
+	double best = 0;
+	for (int i = 0; i < COPY_CALIBRATION_ROUNDS; i++) {
+		int n = 0;
+		double start = dglGetTime();
+		double t;
+		for (;;) {
+			dglCopyArea(context, sx, sy, dx, dy, w, h);
+			n++;
+			t = dglGetTime() - start;
+			if (n >= COPY_CALIBRATION_MIN_ITERATIONS && t >= COPY_CALIBRATION_MIN_TIME)
+				break;
+		}
+		if (i == 0 || t / n < best)
+			best = t / n;
+	}
+	fb->copy_calibration = saved_calibration;
+	return best;
+}
+
+static void dglMeasureCopyCalibration(dglScreenFB *fb, dglCopyCalibration *calibration) {
+	dglCopyCalibration route_cpu, route_dma;
+	dglSetCopySizeClasses(&route_cpu);
+	dglSetCopySizeClasses(&route_dma);
+	for (int i = 0; i < DGL_COPY_NU_SIZE_CLASSES; i++) {
+		route_cpu.use_dma[i] = false;
+		route_dma.use_dma[i] = true;
+	}
+	// Use a page that is not displayed when possible.
+	int page_y = fb->display_yoffset;
+	if (fb->nu_pages >= 2)
+		page_y = (fb->display_yoffset / fb->yres + 1) % fb->nu_pages * fb->yres;
+	dglContext *context = dglCreateContext(fb, fb);
+	dglSetCopySizeClasses(calibration);
+	for (int i = 0; i < DGL_COPY_NU_SIZE_CLASSES; i++) {
+		int w = fb->xres;
+		int h = fb->yres;
+		if (i < DGL_COPY_NU_SIZE_CLASSES - 1) {
+			// A square with the largest area of the class.
+			int side = 8 << i;
+			if (side < w)
+				w = side;
+			if (side < h)
+				h = side;
+		}
+		int sx = 0;
+		int sy = page_y;
+		int dx = fb->xres - w;
+		int dy = page_y + fb->yres - h;
+		if (fb->nu_pages < 2 || (w * 2 > fb->xres && h * 2 > fb->yres)) {
+			// Copy the area onto itself.
+			dx = sx;
+			dy = sy;
+		}
+		calibration->cpu_time[i] = dglMeasureCopy(context, &route_cpu, sx, sy, dx, dy, w, h);
+		calibration->dma_time[i] = dglMeasureCopy(context, &route_dma, sx, sy, dx, dy, w, h);
+		calibration->use_dma[i] = calibration->dma_time[i] < calibration->cpu_time[i];
+	}
+	dglDestroyContext(context);
+}
+
+static bool dglLoadCopyCalibration(dglScreenFB *fb, const char *filename,
+dglCopyCalibration *calibration) {
+	FILE *f = fopen(filename, "r");
+	if (f == NULL)
+		return false;
+	int version, xres, yres, stride;
+	unsigned int format;
+	bool ok = fscanf(f, "dgl-copy-calibration %d %d %d %d %u", &version, &xres, &yres,
+		&stride, &format) == 5 && version == COPY_CALIBRATION_FILE_VERSION &&
+		xres == fb->xres && yres == fb->yres && stride == fb->stride &&
+		format == fb->format;
+	dglSetCopySizeClasses(calibration);
+	for (int i = 0; ok && i < DGL_COPY_NU_SIZE_CLASSES; i++) {
+		int use_dma;
+		ok = fscanf(f, "%d %lf %lf", &use_dma, &calibration->cpu_time[i],
+			&calibration->dma_time[i]) == 3;
+		calibration->use_dma[i] = (use_dma != 0);
+	}
+	fclose(f);
+	return ok;
+}
+
+static void dglSaveCopyCalibration(dglScreenFB *fb, const char *filename,
+dglCopyCalibration *calibration) {
+	FILE *f = fopen(filename, "w");
+	if (f == NULL) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglCalibrateCopyArea: Cannot write %s\n", filename);
+		return;
+	}
+	fprintf(f, "dgl-copy-calibration %d %d %d %d %u\n", COPY_CALIBRATION_FILE_VERSION,
+		fb->xres, fb->yres, fb->stride, fb->format);
+	for (int i = 0; i < DGL_COPY_NU_SIZE_CLASSES; i++)
+		fprintf(f, "%d %.9f %.9f\n", calibration->use_dma[i] ? 1 : 0,
+			calibration->cpu_time[i], calibration->dma_time[i]);
+	fclose(f);
+}
+
+bool dglCalibrateCopyArea(dglScreenFB *fb, const char *cache_filename) {
+	if (!(fb->flags & DGL_FB_FLAG_HAVE_COPY_AREA)) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglCalibrateCopyArea: Framebuffer has no accelerated CopyArea\n");
+		return false;
+	}
+	dglCopyCalibration *calibration = new dglCopyCalibration;
+	if (cache_filename == NULL ||
+	!dglLoadCopyCalibration(fb, cache_filename, calibration)) {
+		dglMeasureCopyCalibration(fb, calibration);
+		if (cache_filename != NULL)
+			dglSaveCopyCalibration(fb, cache_filename, calibration);
+	}
+	delete fb->copy_calibration;
+	fb->copy_calibration = calibration;
+	return true;
+}
+
+void dglDisableCopyAreaCalibration(dglScreenFB *fb) {
+	delete fb->copy_calibration;
+	fb->copy_calibration = NULL;
+}
+
+const char *dglGetCopyCalibrationString(dglScreenFB *fb) {
+	char *str = new char[128 + DGL_COPY_NU_SIZE_CLASSES * 128];
+	dglCopyCalibration *calibration = fb->copy_calibration;
+	if (calibration == NULL) {
+		strcpy(str, "CopyArea not calibrated\n");
+		return str;
+	}
+	int n = 0;
+	for (int i = 0; i < DGL_COPY_NU_SIZE_CLASSES; i++) {
+		if (i < DGL_COPY_NU_SIZE_CLASSES - 1)
+			n += sprintf(str + n, "Area <= %d pixels: ", calibration->max_area[i]);
+		else
+			n += sprintf(str + n, "Area > %d pixels: ", calibration->max_area[i - 1]);
+		n += sprintf(str + n, "CPU %.1f us, DMA %.1f us, using %s\n",
+			calibration->cpu_time[i] * 1000000.0, calibration->dma_time[i] * 1000000.0,
+			calibration->use_dma[i] ? "DMA" : "CPU");
+	}
+	return str;
+}
@@ -0,0 +1,465 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// Screen capture and frame recording.
+//
+// Reading the memory of a screen framebuffer is slow because it is mapped
+// uncached, and it competes with the application drawing into it. In
+// shadow mode, captures read the cached copy instead. Otherwise, when the
+// framebuffer has accelerated CopyArea and the application gives up a
+// spare page, the displayed area is first copied to the spare page with
+// DMA, which takes a consistent snapshot quickly; the recorder leaves
+// reading the snapshot to its writer thread, so that the application
+// thread only issues the copy.
+//
+// Recording file layout (little-endian 32-bit words): the magic "DGLR",
+// version, pixel format, width, height and flags, followed by the frames.
+// Every frame is the size of its data in bytes and the data: the rows of
+// pixels without padding, or, with DGL_RECORDER_FLAG_COMPRESS, the strip
+// height, the number of strips, the strip offsets and the data of the
+// image compressed with the lossless image codec (see dgl-codec.cpp).
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "dgl.h"
+
+#define RECORDING_MAGIC 0x524C4744	// "DGLR"
+#define RECORDING_VERSION 1
+#define RECORDING_HEADER_WORDS 6
+
+enum {
+	SLOT_FREE,
+	SLOT_CAPTURING,
+	SLOT_QUEUED,
+	SLOT_WRITING
+};
+
+// Capture.
+
+static bool dglCaptureCheckDest(dglScreenFB *fb, dglFB *dest, const char *func) {
+	if (dest->xres != fb->xres || dest->yres != fb->yres || dest->format != fb->format) {
+		dglMessage(DGL_MESSAGE_WARNING, "%s: Destination does not match the "
+			"framebuffer size and format\n", func);
+		return false;
+	}
+	return true;
+}
+
+// Whether a DMA snapshot into the spare page can be used.
+
+static bool dglCanSnapshot(dglScreenFB *fb, int spare_page) {
+	return (fb->flags & DGL_FB_FLAG_HAVE_COPY_AREA) && !(fb->flags & DGL_FB_FLAG_SHADOW) &&
+		spare_page >= 0 && spare_page < fb->virtual_yres / fb->yres &&
+		spare_page * fb->yres != fb->display_yoffset;
+}
+
+// Copy a rectangle of the screen framebuffer starting at row offset
+// src_yoffset to the same position in dest.
+
+static void dglReadScreenArea(dglScreenFB *fb, int src_yoffset, dglFB *dest, int x, int y,
+int w, int h) {
+	int bpp = fb->bytes_per_pixel;
+	const uint8_t *sp = fb->framebuffer_addr + (src_yoffset + y) * fb->stride + x * bpp;
+	uint8_t *dp = dest->framebuffer_addr + y * dest->stride + x * bpp;
+	for (int i = 0; i < h; i++) {
+		memcpy(dp, sp, w * bpp);
+		sp += fb->stride;
+		dp += dest->stride;
+	}
+}
+
+static void dglCaptureArea(dglScreenFB *fb, dglFB *dest, int x, int y, int w, int h,
+int spare_page) {
+	if (dglCanSnapshot(fb, spare_page)) {
+		int spare_yoffset = spare_page * fb->yres;
+		fb->CopyAreaFunc(fb, x, fb->display_yoffset + y, x, spare_yoffset + y, w, h);
+		dglReadScreenArea(fb, spare_yoffset, dest, x, y, w, h);
+	}
+	else
+		dglReadScreenArea(fb, fb->display_yoffset, dest, x, y, w, h);
+}
+
+bool dglCaptureScreen(dglScreenFB *fb, dglFB *dest, int spare_page) {
+	if (!dglCaptureCheckDest(fb, dest, "dglCaptureScreen"))
+		return false;
+	dglCaptureArea(fb, dest, 0, 0, fb->xres, fb->yres, spare_page);
+	return true;
+}
+
+bool dglCaptureScreenRegion(dglScreenFB *fb, dglFB *dest, const dglRegion *region,
+int spare_page) {
+	if (!dglCaptureCheckDest(fb, dest, "dglCaptureScreenRegion"))
+		return false;
+	for (int i = 0; i < region->nu_rects; i++) {
+		dglClipRectangle r = region->rects[i];
+		if (r.x1 < 0)
+			r.x1 = 0;
+		if (r.y1 < 0)
+			r.y1 = 0;
+		if (r.x2 > fb->xres)
+			r.x2 = fb->xres;
+		if (r.y2 > fb->yres)
+			r.y2 = fb->yres;
+		if (r.x1 < r.x2 && r.y1 < r.y2)
+			dglCaptureArea(fb, dest, r.x1, r.y1, r.x2 - r.x1, r.y2 - r.y1, spare_page);
+	}
+	return true;
+}
+
+// Recorder.
+
+static bool dglWriteAll(int fd, const void *data, size_t size) {
+	const uint8_t *p = (const uint8_t *)data;
+	while (size > 0) {
+		ssize_t n = write(fd, p, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+// Write a frame and return the number of bytes written in *nu_bytes.
+
+static bool dglRecorderWriteFrame(dglRecorder *recorder, dglFB *frame, uint64_t *nu_bytes) {
+	int fd = recorder->fd;
+	if (recorder->flags & DGL_RECORDER_FLAG_COMPRESS) {
+		dglCompressedImage *cimage = dglCompressImage(frame, 0);
+		uint32_t header[3];
+		int offsets_size = sizeof(uint32_t) * (cimage->nu_strips + 1);
+		header[0] = 2 * sizeof(uint32_t) + offsets_size + cimage->size;
+		header[1] = cimage->strip_height;
+		header[2] = cimage->nu_strips;
+		bool ok = dglWriteAll(fd, header, sizeof(header)) &&
+			dglWriteAll(fd, cimage->strip_offset, offsets_size) &&
+			dglWriteAll(fd, cimage->data, cimage->size);
+		*nu_bytes = sizeof(header) + offsets_size + cimage->size;
+		dglDestroyCompressedImage(cimage);
+		return ok;
+	}
+	int row_size = frame->xres * frame->bytes_per_pixel;
+	uint32_t size = row_size * frame->yres;
+	if (!dglWriteAll(fd, &size, sizeof(size)))
+		return false;
+	for (int y = 0; y < frame->yres; y++)
+		if (!dglWriteAll(fd, frame->framebuffer_addr + y * frame->stride, row_size))
+			return false;
+	*nu_bytes = sizeof(size) + size;
+	return true;
+}
+
+// Writer thread. Frames are written in the order in which they were
+// captured; the thread exits when it is stopped and all frames are written.
+
+static void *dglRecorderThreadMain(void *arg) {
+	dglRecorder *recorder = (dglRecorder *)arg;
+	pthread_mutex_t *mutex = (pthread_mutex_t *)recorder->mutex;
+	pthread_cond_t *cond = (pthread_cond_t *)recorder->cond;
+	dglScreenFB *fb = recorder->fb;
+	pthread_mutex_lock(mutex);
+	for (;;) {
+		int s = - 1;
+		for (int i = 0; i < recorder->nu_slots; i++)
+			if (recorder->slot_state[i] == SLOT_QUEUED && (s < 0 ||
+			(int)(recorder->slot_sequence[i] - recorder->slot_sequence[s]) < 0))
+				s = i;
+		if (s < 0) {
+			if (recorder->stop)
+				break;
+			pthread_cond_wait(cond, mutex);
+			continue;
+		}
+		recorder->slot_state[s] = SLOT_WRITING;
+		bool in_spare_page = recorder->slot_in_spare_page[s];
+		pthread_mutex_unlock(mutex);
+		if (in_spare_page) {
+			dglReadScreenArea(fb, recorder->spare_page * fb->yres, recorder->slot[s],
+				0, 0, fb->xres, fb->yres);
+			pthread_mutex_lock(mutex);
+			recorder->slot_in_spare_page[s] = false;
+			pthread_mutex_unlock(mutex);
+		}
+		uint64_t nu_bytes = 0;
+		bool ok = !recorder->write_error &&
+			dglRecorderWriteFrame(recorder, recorder->slot[s], &nu_bytes);
+		pthread_mutex_lock(mutex);
+		recorder->bytes_written += nu_bytes;
+		if (ok)
+			recorder->nu_frames_written++;
+		else
+			recorder->write_error = true;
+		recorder->slot_state[s] = SLOT_FREE;
+	}
+	pthread_mutex_unlock(mutex);
+	return NULL;
+}
+
+dglRecorder *dglCreateRecorder(dglScreenFB *fb, const char *filename, int max_queued_frames,
+int spare_page, int flags) {
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglCreateRecorder: Could not open file %s\n",
+			filename);
+		return NULL;
+	}
+	uint32_t header[RECORDING_HEADER_WORDS];
+	header[0] = RECORDING_MAGIC;
+	header[1] = RECORDING_VERSION;
+	header[2] = fb->format;
+	header[3] = fb->xres;
+	header[4] = fb->yres;
+	header[5] = flags & DGL_RECORDER_FLAG_COMPRESS;
+	if (!dglWriteAll(fd, header, sizeof(header))) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglCreateRecorder: Error writing file %s\n",
+			filename);
+		close(fd);
+		return NULL;
+	}
+	if (max_queued_frames < 1)
+		max_queued_frames = 1;
+	dglRecorder *recorder = new dglRecorder;
+	recorder->fb = fb;
+	recorder->fd = fd;
+	recorder->flags = flags;
+	recorder->spare_page = spare_page;
+	recorder->nu_slots = max_queued_frames;
+	recorder->slot = new dglFB *[max_queued_frames];
+	recorder->slot_state = new int[max_queued_frames];
+	recorder->slot_in_spare_page = new bool[max_queued_frames];
+	recorder->slot_sequence = new unsigned int[max_queued_frames];
+	for (int i = 0; i < max_queued_frames; i++) {
+		recorder->slot[i] = dglCreatePixmapFB(fb->format, fb->xres, fb->yres);
+		recorder->slot_state[i] = SLOT_FREE;
+		recorder->slot_in_spare_page[i] = false;
+		recorder->slot_sequence[i] = 0;
+	}
+	recorder->next_sequence = 0;
+	recorder->nu_frames_recorded = 0;
+	recorder->nu_frames_dropped = 0;
+	recorder->nu_frames_written = 0;
+	recorder->bytes_written = sizeof(header);
+	recorder->write_error = false;
+	recorder->stop = false;
+	pthread_mutex_t *mutex = new pthread_mutex_t;
+	pthread_cond_t *cond = new pthread_cond_t;
+	pthread_mutex_init(mutex, NULL);
+	pthread_cond_init(cond, NULL);
+	recorder->mutex = mutex;
+	recorder->cond = cond;
+	pthread_t *thread = new pthread_t;
+	recorder->thread = thread;
+	if (pthread_create(thread, NULL, dglRecorderThreadMain, recorder) != 0) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglCreateRecorder: Could not create thread\n");
+		recorder->thread = NULL;
+		delete thread;
+		dglDestroyRecorder(recorder);
+		return NULL;
+	}
+	return recorder;
+}
+
+// Wait until all captured frames have been written, stop the writer thread
+// and close the file.
+
+void dglDestroyRecorder(dglRecorder *recorder) {
+	pthread_mutex_t *mutex = (pthread_mutex_t *)recorder->mutex;
+	pthread_cond_t *cond = (pthread_cond_t *)recorder->cond;
+	pthread_t *thread = (pthread_t *)recorder->thread;
+	if (thread != NULL) {
+		pthread_mutex_lock(mutex);
+		recorder->stop = true;
+		pthread_cond_broadcast(cond);
+		pthread_mutex_unlock(mutex);
+		pthread_join(*thread, NULL);
+		delete thread;
+	}
+	pthread_mutex_destroy(mutex);
+	pthread_cond_destroy(cond);
+	delete mutex;
+	delete cond;
+	if (close(recorder->fd) != 0 || recorder->write_error)
+		dglMessage(DGL_MESSAGE_WARNING, "dglDestroyRecorder: Error writing recording\n");
+	for (int i = 0; i < recorder->nu_slots; i++)
+		dglDestroyPixmapFB(recorder->slot[i]);
+	delete [] recorder->slot;
+	delete [] recorder->slot_state;
+	delete [] recorder->slot_in_spare_page;
+	delete [] recorder->slot_sequence;
+	delete recorder;
+}
+
+bool dglRecordFrame(dglRecorder *recorder) {
+	pthread_mutex_t *mutex = (pthread_mutex_t *)recorder->mutex;
+	pthread_cond_t *cond = (pthread_cond_t *)recorder->cond;
+	dglScreenFB *fb = recorder->fb;
+	bool snapshot = dglCanSnapshot(fb, recorder->spare_page);
+	pthread_mutex_lock(mutex);
+	int s = - 1;
+	bool spare_page_busy = false;
+	for (int i = 0; i < recorder->nu_slots; i++) {
+		if (recorder->slot_state[i] == SLOT_FREE && s < 0)
+			s = i;
+		if (recorder->slot_in_spare_page[i])
+			spare_page_busy = true;
+	}
+	// While the writer thread has not yet read the previous snapshot, the
+	// frame is dropped rather than read from the uncached screen.
+	if (s < 0 || (snapshot && spare_page_busy) || recorder->write_error) {
+		recorder->nu_frames_dropped++;
+		pthread_mutex_unlock(mutex);
+		return false;
+	}
+	recorder->slot_state[s] = SLOT_CAPTURING;
+	recorder->slot_in_spare_page[s] = snapshot;
+	pthread_mutex_unlock(mutex);
+	if (snapshot)
+		// The writer thread reads the snapshot.
+		fb->CopyAreaFunc(fb, 0, fb->display_yoffset, 0, recorder->spare_page * fb->yres,
+			fb->xres, fb->yres);
+	else
+		dglCaptureArea(fb, recorder->slot[s], 0, 0, fb->xres, fb->yres, - 1);
+	pthread_mutex_lock(mutex);
+	recorder->slot_state[s] = SLOT_QUEUED;
+	recorder->slot_sequence[s] = recorder->next_sequence++;
+	recorder->nu_frames_recorded++;
+	pthread_cond_broadcast(cond);
+	pthread_mutex_unlock(mutex);
+	return true;
+}
+
+// Reading recordings.
+
+dglRecording *dglOpenRecording(const char *filename) {
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglOpenRecording: Could not open file %s\n",
+			filename);
+		return NULL;
+	}
+	uint32_t header[RECORDING_HEADER_WORDS];
+	if (fread(header, sizeof(header), 1, f) != 1 || header[0] != RECORDING_MAGIC ||
+	header[1] != RECORDING_VERSION || header[3] == 0 || header[3] > 32768 ||
+	header[4] == 0 || header[4] > 32768) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglOpenRecording: %s is not a valid recording\n",
+			filename);
+		fclose(f);
+		return NULL;
+	}
+	dglRecording *recording = new dglRecording;
+	recording->file = f;
+	recording->format = header[2];
+	recording->xres = header[3];
+	recording->yres = header[4];
+	recording->flags = header[5];
+	recording->nu_frames_read = 0;
+	return recording;
+}
+
+void dglCloseRecording(dglRecording *recording) {
+	fclose((FILE *)recording->file);
+	delete recording;
+}
+
+// Decode a compressed frame stored in data.
+
+static bool dglDecodeRecordingFrame(dglRecording *recording, const uint8_t *data,
+uint32_t size, dglFB *dest) {
+	if (size < 2 * sizeof(uint32_t))
+		return false;
+	uint32_t strip_height, nu_strips;
+	memcpy(&strip_height, data, sizeof(uint32_t));
+	memcpy(&nu_strips, data + sizeof(uint32_t), sizeof(uint32_t));
+	if (strip_height == 0 || nu_strips != (recording->yres + strip_height - 1) / strip_height)
+		return false;
+	uint32_t offsets_size = sizeof(uint32_t) * (nu_strips + 1);
+	if (size < 2 * sizeof(uint32_t) + offsets_size)
+		return false;
+	dglCompressedImage cimage;
+	cimage.xres = recording->xres;
+	cimage.yres = recording->yres;
+	cimage.strip_height = strip_height;
+	cimage.nu_strips = nu_strips;
+	cimage.strip_offset = new uint32_t[nu_strips + 1];
+	memcpy(cimage.strip_offset, data + 2 * sizeof(uint32_t), offsets_size);
+	cimage.data = (uint8_t *)data + 2 * sizeof(uint32_t) + offsets_size;
+	cimage.size = size - 2 * sizeof(uint32_t) - offsets_size;
+	bool ok = cimage.strip_offset[0] == 0 &&
+		cimage.strip_offset[nu_strips] == (uint32_t)cimage.size;
+	for (uint32_t i = 0; i < nu_strips && ok; i++)
+		if (cimage.strip_offset[i] > cimage.strip_offset[i + 1])
+			ok = false;
+	if (ok) {
+		dglContext *context = dglCreateContext(dest, dest);
+		dglPutCompressedImage(context, 0, 0, &cimage);
+		dglDestroyContext(context);
+	}
+	delete [] cimage.strip_offset;
+	return ok;
+}
+
+// Returns false at the end of the recording or when the frame is invalid.
+
+bool dglReadRecordingFrame(dglRecording *recording, dglFB *dest) {
+	FILE *f = (FILE *)recording->file;
+	if (dest->xres != recording->xres || dest->yres != recording->yres) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglReadRecordingFrame: Destination size does not match recording\n");
+		return false;
+	}
+	bool compressed = (recording->flags & DGL_RECORDER_FLAG_COMPRESS) != 0;
+	if (!compressed && dest->format != recording->format) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglReadRecordingFrame: Destination format does not match recording\n");
+		return false;
+	}
+	uint32_t size;
+	if (fread(&size, sizeof(size), 1, f) != 1)
+		return false;
+	int row_size = recording->xres * dest->bytes_per_pixel;
+	if (!compressed) {
+		if (size != (uint32_t)row_size * recording->yres)
+			return false;
+		for (int y = 0; y < recording->yres; y++)
+			if (fread(dest->framebuffer_addr + y * dest->stride, row_size, 1, f) != 1)
+				return false;
+		recording->nu_frames_read++;
+		return true;
+	}
+	// A compressed frame is never much larger than the raw pixels.
+	if (size > (uint32_t)recording->xres * recording->yres * 8 + 65536)
+		return false;
+	uint8_t *data = new uint8_t[size];
+	bool ok = fread(data, size, 1, f) == 1 &&
+		dglDecodeRecordingFrame(recording, data, size, dest);
+	delete [] data;
+	if (ok)
+		recording->nu_frames_read++;
+	else
+		dglMessage(DGL_MESSAGE_WARNING, "dglReadRecordingFrame: Invalid frame\n");
+	return ok;
+}
@@ -0,0 +1,540 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// Lossless compressed image format with fast decoding straight into a
+// framebuffer.
+//
+// The encoding is similar to QOI: every pixel is coded as a run of the
+// previous pixel, a reference into a 64-entry table of recently seen
+// colors, a small difference from the previous pixel, or a literal color.
+// The image is divided into strips of rows that are coded independently,
+// so that strips can be decoded in parallel and clipped strips can be
+// skipped. Pixels are coded as 8-bit RGBA independent of the pixel format
+// of the source image, and the decoder writes every pixel directly in the
+// format of the destination framebuffer, without an intermediate image.
+// Decoding into a framebuffer with the same pixel format as the source
+// image reproduces the original pixels exactly.
+//
+// File layout (little-endian 32-bit words): the magic "DGLC", width, height,
+// strip height, number of strips, number of strips + 1 offsets of the strips
+// relative to the start of the compressed data, followed by the data.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "dgl.h"
+
+#define DGL_CODEC_MAGIC 0x434C4744	// "DGLC"
+#define DGL_CODEC_HEADER_WORDS 5
+#define DGL_CODEC_MAX_SIZE 32768
+
+enum {
+	OP_INDEX = 0x00,	// 00iiiiii: color table entry i.
+	OP_DIFF = 0x40,		// 01rrggbb: differences -2 to 1 for r, g and b.
+	OP_LUMA = 0x80,		// 10gggggg, rrrrbbbb: green difference -32 to 31,
+				// red and blue difference -8 to 7 relative to it.
+	OP_RUN = 0xC0,		// 11llllll: repeat the previous pixel 1 to 62 times.
+	OP_RGB = 0xFE,		// Followed by r, g, b.
+	OP_RGBA = 0xFF,		// Followed by r, g, b, a.
+	OP_MASK = 0xC0,
+};
+
+#define MAX_RUN 62
+
+// Pixels are handled internally as 0xAARRGGBB.
+
+DGL_INLINE_ONLY static int dglCodecHash(uint32_t px) {
+	uint32_t b = px & 0xFF;
+	uint32_t g = (px >> 8) & 0xFF;
+	uint32_t r = (px >> 16) & 0xFF;
+	uint32_t a = px >> 24;
+	return (r * 3 + g * 5 + b * 7 + a * 11) & 63;
+}
+
+// Encoding.
+
+class dglCodecBuffer {
+public :
+	uint8_t *data;
+	int size;
+	int capacity;
+};
+
+DGL_INLINE_ONLY static void dglCodecEmit(dglCodecBuffer *buffer, uint8_t byte) {
+	if (buffer->size == buffer->capacity) {
+		int capacity = buffer->capacity * 2;
+		uint8_t *data = new uint8_t[capacity];
+		memcpy(data, buffer->data, buffer->size);
+		delete [] buffer->data;
+		buffer->data = data;
+		buffer->capacity = capacity;
+	}
+	buffer->data[buffer->size++] = byte;
+}
+
+static void dglCodecEncodeStrip(dglCodecBuffer *buffer, dglImage *image, int y1, int y2) {
+	uint32_t index[64];
+	memset(index, 0, sizeof(index));
+	uint32_t prev = 0xFF000000;
+	int run = 0;
+	for (int y = y1; y < y2; y++) {
+		uint8_t *sp = image->framebuffer_addr + y * image->stride;
+		for (int x = 0; x < image->xres; x++) {
+			uint32_t pixel;
+			if (image->bytes_per_pixel == 4)
+				pixel = ((uint32_t *)sp)[x];
+			else
+				pixel = ((uint16_t *)sp)[x];
+			uint32_t px = dglPixelToARGB(image->format, pixel);
+			if (px == prev) {
+				run++;
+				if (run == MAX_RUN) {
+					dglCodecEmit(buffer, OP_RUN | (run - 1));
+					run = 0;
+				}
+				continue;
+			}
+			if (run > 0) {
+				dglCodecEmit(buffer, OP_RUN | (run - 1));
+				run = 0;
+			}
+			int h = dglCodecHash(px);
+			if (index[h] == px) {
+				dglCodecEmit(buffer, OP_INDEX | h);
+				prev = px;
+				continue;
+			}
+			index[h] = px;
+			if ((px >> 24) != (prev >> 24)) {
+				dglCodecEmit(buffer, OP_RGBA);
+				dglCodecEmit(buffer, px >> 16);
+				dglCodecEmit(buffer, px >> 8);
+				dglCodecEmit(buffer, px);
+				dglCodecEmit(buffer, px >> 24);
+				prev = px;
+				continue;
+			}
+			int dr = (int8_t)((px >> 16) - (prev >> 16));
+			int dg = (int8_t)((px >> 8) - (prev >> 8));
+			int db = (int8_t)(px - prev);
+			int dr_dg = dr - dg;
+			int db_dg = db - dg;
+			if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+				dglCodecEmit(buffer, OP_DIFF | ((dr + 2) << 4) | ((dg + 2) << 2) |
+					(db + 2));
+			else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 &&
+			db_dg >= -8 && db_dg <= 7) {
+				dglCodecEmit(buffer, OP_LUMA | (dg + 32));
+				dglCodecEmit(buffer, ((dr_dg + 8) << 4) | (db_dg + 8));
+			}
+			else {
+				dglCodecEmit(buffer, OP_RGB);
+				dglCodecEmit(buffer, px >> 16);
+				dglCodecEmit(buffer, px >> 8);
+				dglCodecEmit(buffer, px);
+			}
+			prev = px;
+		}
+	}
+	if (run > 0)
+		dglCodecEmit(buffer, OP_RUN | (run - 1));
+}
+
+// Compress an image. strip_height is the number of rows per independently
+// decodable strip (0 selects a default).
+
+dglCompressedImage *dglCompressImage(dglImage *image, int strip_height) {
+	if (strip_height <= 0)
+		strip_height = DGL_COMPRESSED_IMAGE_DEFAULT_STRIP_HEIGHT;
+	dglCompressedImage *cimage = new dglCompressedImage;
+	cimage->xres = image->xres;
+	cimage->yres = image->yres;
+	cimage->strip_height = strip_height;
+	cimage->nu_strips = (image->yres + strip_height - 1) / strip_height;
+	cimage->strip_offset = new uint32_t[cimage->nu_strips + 1];
+	dglCodecBuffer buffer;
+	buffer.capacity = image->total_size / 4 + 64;
+	buffer.data = new uint8_t[buffer.capacity];
+	buffer.size = 0;
+	for (int i = 0; i < cimage->nu_strips; i++) {
+		cimage->strip_offset[i] = buffer.size;
+		int y2 = (i + 1) * strip_height;
+		if (y2 > image->yres)
+			y2 = image->yres;
+		dglCodecEncodeStrip(&buffer, image, i * strip_height, y2);
+	}
+	cimage->strip_offset[cimage->nu_strips] = buffer.size;
+	cimage->size = buffer.size;
+	cimage->data = new uint8_t[buffer.size];
+	memcpy(cimage->data, buffer.data, buffer.size);
+	delete [] buffer.data;
+	return cimage;
+}
+
+void dglDestroyCompressedImage(dglCompressedImage *cimage) {
+	delete [] cimage->strip_offset;
+	delete [] cimage->data;
+	delete cimage;
+}
+
+bool dglSaveCompressedImage(dglCompressedImage *cimage, const char *filename) {
+	FILE *f = fopen(filename, "wb");
+	if (f == NULL) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglSaveCompressedImage: "
+			"Could not open file %s\n", filename);
+		return false;
+	}
+	uint32_t header[DGL_CODEC_HEADER_WORDS];
+	header[0] = DGL_CODEC_MAGIC;
+	header[1] = cimage->xres;
+	header[2] = cimage->yres;
+	header[3] = cimage->strip_height;
+	header[4] = cimage->nu_strips;
+	bool ok = fwrite(header, sizeof(header), 1, f) == 1 &&
+		fwrite(cimage->strip_offset, sizeof(uint32_t) * (cimage->nu_strips + 1),
+			1, f) == 1 &&
+		fwrite(cimage->data, cimage->size, 1, f) == 1;
+	if (fclose(f) != 0)
+		ok = false;
+	if (!ok)
+		dglMessage(DGL_MESSAGE_WARNING, "dglSaveCompressedImage: "
+			"Error writing file %s\n", filename);
+	return ok;
+}
+
+dglCompressedImage *dglLoadCompressedImage(const char *filename) {
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglLoadCompressedImage: "
+			"Could not open file %s\n", filename);
+		return NULL;
+	}
+	uint32_t header[DGL_CODEC_HEADER_WORDS];
+	if (fread(header, sizeof(header), 1, f) != 1 || header[0] != DGL_CODEC_MAGIC ||
+	header[1] == 0 || header[1] > DGL_CODEC_MAX_SIZE ||
+	header[2] == 0 || header[2] > DGL_CODEC_MAX_SIZE ||
+	header[3] == 0 || header[4] != (header[2] + header[3] - 1) / header[3]) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglLoadCompressedImage: "
+			"%s is not a valid compressed image\n", filename);
+		fclose(f);
+		return NULL;
+	}
+	dglCompressedImage *cimage = new dglCompressedImage;
+	cimage->xres = header[1];
+	cimage->yres = header[2];
+	cimage->strip_height = header[3];
+	cimage->nu_strips = header[4];
+	cimage->strip_offset = new uint32_t[cimage->nu_strips + 1];
+	cimage->data = NULL;
+	bool ok = fread(cimage->strip_offset, sizeof(uint32_t) * (cimage->nu_strips + 1),
+		1, f) == 1 && cimage->strip_offset[0] == 0;
+	for (int i = 0; ok && i < cimage->nu_strips; i++)
+		if (cimage->strip_offset[i + 1] < cimage->strip_offset[i])
+			ok = false;
+	if (ok) {
+		cimage->size = cimage->strip_offset[cimage->nu_strips];
+		cimage->data = new uint8_t[cimage->size];
+		ok = fread(cimage->data, cimage->size, 1, f) == 1;
+	}
+	fclose(f);
+	if (!ok) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglLoadCompressedImage: "
+			"%s is truncated or corrupt\n", filename);
+		delete [] cimage->data;
+		delete [] cimage->strip_offset;
+		delete cimage;
+		return NULL;
+	}
+	return cimage;
+}
+
+// Decoding.
+
+class dglCodecDecoder {
+public :
+	const uint8_t *p;
+	const uint8_t *end;
+	uint32_t px;
+	int run;
+	uint32_t index[64];
+};
+
+// Decode one row of w pixels into dp in the given format. format is a
+// constant in every call, so that the pixel packing is specialized.
+
+DGL_INLINE_ONLY static void dglCodecDecodeRow(dglCodecDecoder *dec, uint32_t format,
+uint8_t *dp, int w) {
+	uint32_t px = dec->px;
+	uint32_t pixel = dglARGBToPixel(format, px);
+	int run = dec->run;
+	const uint8_t *p = dec->p;
+	const uint8_t *end = dec->end;
+	int x = 0;
+	while (x < w) {
+		if (run == 0) {
+			if (p >= end) {
+				// Truncated data; repeat the last pixel.
+				run = w - x;
+			}
+			else {
+				int op = *p++;
+				if (op == OP_RGB) {
+					if (end - p < 3)
+						break;
+					px = (px & 0xFF000000) | (p[0] << 16) | (p[1] << 8) | p[2];
+					p += 3;
+					dec->index[dglCodecHash(px)] = px;
+					run = 1;
+				}
+				else if (op == OP_RGBA) {
+					if (end - p < 4)
+						break;
+					px = ((uint32_t)p[3] << 24) | (p[0] << 16) | (p[1] << 8) | p[2];
+					p += 4;
+					dec->index[dglCodecHash(px)] = px;
+					run = 1;
+				}
+				else if ((op & OP_MASK) == OP_INDEX) {
+					px = dec->index[op];
+					run = 1;
+				}
+				else if ((op & OP_MASK) == OP_DIFF) {
+					uint32_t r = ((px >> 16) + ((op >> 4) & 3) - 2) & 0xFF;
+					uint32_t g = ((px >> 8) + ((op >> 2) & 3) - 2) & 0xFF;
+					uint32_t b = (px + (op & 3) - 2) & 0xFF;
+					px = (px & 0xFF000000) | (r << 16) | (g << 8) | b;
+					dec->index[dglCodecHash(px)] = px;
+					run = 1;
+				}
+				else if ((op & OP_MASK) == OP_LUMA) {
+					if (p >= end)
+						break;
+					int dg = (op & 0x3F) - 32;
+					int dr = dg + (*p >> 4) - 8;
+					int db = dg + (*p & 0xF) - 8;
+					p++;
+					uint32_t r = ((px >> 16) + dr) & 0xFF;
+					uint32_t g = ((px >> 8) + dg) & 0xFF;
+					uint32_t b = (px + db) & 0xFF;
+					px = (px & 0xFF000000) | (r << 16) | (g << 8) | b;
+					dec->index[dglCodecHash(px)] = px;
+					run = 1;
+				}
+				else	// OP_RUN
+					run = (op & 0x3F) + 1;
+				pixel = dglARGBToPixel(format, px);
+			}
+		}
+		int n = w - x;
+		if (n > run)
+			n = run;
+		run -= n;
+		if (format & DGL_FORMAT_PIXEL_SIZE_16_BIT) {
+			uint16_t *dp16 = (uint16_t *)dp + x;
+			for (int i = 0; i < n; i++)
+				dp16[i] = pixel;
+		}
+		else {
+			uint32_t *dp32 = (uint32_t *)dp + x;
+			for (int i = 0; i < n; i++)
+				dp32[i] = pixel;
+		}
+		x += n;
+	}
+	dec->px = px;
+	dec->run = run;
+	dec->p = p;
+}
+
+static void dglCodecDecodeRowAnyFormat(dglCodecDecoder *dec, uint32_t format,
+uint8_t *dp, int w) {
+	switch (format) {
+	case DGL_FORMAT_XRGB8888 :
+		dglCodecDecodeRow(dec, DGL_FORMAT_XRGB8888, dp, w);
+		break;
+	case DGL_FORMAT_ARGB8888 :
+		dglCodecDecodeRow(dec, DGL_FORMAT_ARGB8888, dp, w);
+		break;
+	case DGL_FORMAT_XBGR8888 :
+		dglCodecDecodeRow(dec, DGL_FORMAT_XBGR8888, dp, w);
+		break;
+	case DGL_FORMAT_ABGR8888 :
+		dglCodecDecodeRow(dec, DGL_FORMAT_ABGR8888, dp, w);
+		break;
+	case DGL_FORMAT_RGB565 :
+		dglCodecDecodeRow(dec, DGL_FORMAT_RGB565, dp, w);
+		break;
+	default :
+		dglCodecDecodeRow(dec, DGL_FORMAT_BGR565, dp, w);
+		break;
+	}
+}
+
+// Destination of a decode operation. (x, y) is the position of the image in
+// the framebuffer (including the draw y offset), and the image area from
+// (cx1, cy1) to (cx2 - 1, cy2 - 1) in image coordinates is visible.
+
+class dglCodecTarget {
+public :
+	dglCompressedImage *cimage;
+	dglFB *fb;
+	int x, y;
+	int cx1, cy1, cx2, cy2;
+	int first_strip;
+	int last_strip;
+};
+
+static void dglCodecDecodeStrips(const dglCodecTarget *target, int first_strip,
+int last_strip) {
+	dglCompressedImage *cimage = target->cimage;
+	dglFB *fb = target->fb;
+	int bpp = fb->bytes_per_pixel;
+	bool clipped = target->cx1 > 0 || target->cx2 < cimage->xres;
+	uint8_t *row_buffer = NULL;
+	dglCodecDecoder dec;
+	for (int s = first_strip; s <= last_strip; s++) {
+		dec.p = cimage->data + cimage->strip_offset[s];
+		dec.end = cimage->data + cimage->strip_offset[s + 1];
+		dec.px = 0xFF000000;
+		dec.run = 0;
+		memset(dec.index, 0, sizeof(dec.index));
+		int y1 = s * cimage->strip_height;
+		int y2 = y1 + cimage->strip_height;
+		if (y2 > target->cy2)
+			y2 = target->cy2;
+		for (int y = y1; y < y2; y++) {
+			uint8_t *dp = fb->framebuffer_addr + (target->y + y) * fb->stride +
+				target->x * bpp;
+			if (!clipped && y >= target->cy1) {
+				dglCodecDecodeRowAnyFormat(&dec, fb->format, dp, cimage->xres);
+				continue;
+			}
+			// Rows that are partly visible are decoded into a row buffer.
+			// Rows above the visible area still have to be decoded.
+			if (row_buffer == NULL)
+				row_buffer = new uint8_t[cimage->xres * bpp];
+			dglCodecDecodeRowAnyFormat(&dec, fb->format, row_buffer, cimage->xres);
+			if (y >= target->cy1)
+				memcpy(dp + target->cx1 * bpp, row_buffer + target->cx1 * bpp,
+					(target->cx2 - target->cx1) * bpp);
+		}
+	}
+	delete [] row_buffer;
+}
+
+// Determine the visible part of the image and the range of strips that
+// have to be decoded. Returns false when the image is not visible.
+
+static bool dglCodecSetTarget(dglContext *context, int x, int y, dglCompressedImage *cimage,
+dglCodecTarget *target) {
+	if (context->occlusion)
+		dglFlushOcclusion(context);
+	dglFB *fb;
+	DGL_GET_DRAW_FB(context, fb);
+	target->cimage = cimage;
+	target->fb = fb;
+	target->cx1 = 0;
+	target->cy1 = 0;
+	target->cx2 = cimage->xres;
+	target->cy2 = cimage->yres;
+	if (context->clip_enabled) {
+		if (context->clip.x1 - x > target->cx1)
+			target->cx1 = context->clip.x1 - x;
+		if (context->clip.y1 - y > target->cy1)
+			target->cy1 = context->clip.y1 - y;
+		if (context->clip.x2 - x < target->cx2)
+			target->cx2 = context->clip.x2 - x;
+		if (context->clip.y2 - y < target->cy2)
+			target->cy2 = context->clip.y2 - y;
+		if (target->cx1 >= target->cx2 || target->cy1 >= target->cy2)
+			return false;
+	}
+	target->x = x;
+	target->y = y + context->draw_yoffset;
+	target->first_strip = target->cy1 / cimage->strip_height;
+	target->last_strip = (target->cy2 - 1) / cimage->strip_height;
+	if (fb->damage)
+		dglAddDamage(fb->damage, x + target->cx1, target->y + target->cy1,
+			target->cx2 - target->cx1, target->cy2 - target->cy1);
+	return true;
+}
+
+// Decode a compressed image into the draw framebuffer with its top-left
+// corner at (x, y). Like dglPutImage, the image must fit inside the
+// framebuffer unless the context's clip rectangle is enabled.
+
+void dglPutCompressedImage(dglContext *context, int x, int y, dglCompressedImage *cimage) {
+	dglCodecTarget target;
+	if (!dglCodecSetTarget(context, x, y, cimage, &target))
+		return;
+	dglCodecDecodeStrips(&target, target.first_strip, target.last_strip);
+}
+
+class dglCodecThread {
+public :
+	const dglCodecTarget *target;
+	int first_strip;
+	int last_strip;
+	pthread_t thread;
+};
+
+static void *dglCodecThreadMain(void *arg) {
+	dglCodecThread *thread = (dglCodecThread *)arg;
+	dglCodecDecodeStrips(thread->target, thread->first_strip, thread->last_strip);
+	return NULL;
+}
+
+// Decode a compressed image using nu_threads threads (including the calling
+// thread), each decoding a contiguous range of strips.
+
+void dglPutCompressedImageThreaded(dglContext *context, int x, int y,
+dglCompressedImage *cimage, int nu_threads) {
+	dglCodecTarget target;
+	if (!dglCodecSetTarget(context, x, y, cimage, &target))
+		return;
+	int nu_strips = target.last_strip - target.first_strip + 1;
+	if (nu_threads > nu_strips)
+		nu_threads = nu_strips;
+	if (nu_threads <= 1) {
+		dglCodecDecodeStrips(&target, target.first_strip, target.last_strip);
+		return;
+	}
+	dglCodecThread *thread = new dglCodecThread[nu_threads];
+	for (int i = 0; i < nu_threads; i++) {
+		thread[i].target = &target;
+		thread[i].first_strip = target.first_strip + nu_strips * i / nu_threads;
+		thread[i].last_strip = target.first_strip + nu_strips * (i + 1) / nu_threads - 1;
+	}
+	int nu_started = 1;
+	for (int i = 1; i < nu_threads; i++) {
+		if (pthread_create(&thread[i].thread, NULL, dglCodecThreadMain, &thread[i]) != 0)
+			break;
+		nu_started++;
+	}
+	// Decode the first range in the calling thread, and any ranges for
+	// which no thread could be started.
+	dglCodecDecodeStrips(&target, thread[0].first_strip, thread[0].last_strip);
+	for (int i = nu_started; i < nu_threads; i++)
+		dglCodecDecodeStrips(&target, thread[i].first_strip, thread[i].last_strip);
+	for (int i = 1; i < nu_started; i++)
+		pthread_join(thread[i].thread, NULL);
+	delete [] thread;
+}
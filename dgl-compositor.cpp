@@ -0,0 +1,650 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// Shared-memory compositor for multiple client processes.
+//
+// The compositor owns the screen framebuffer and listens on a Unix
+// sequenced-packet socket. A client requests a surface with a position,
+// size and stacking order; the compositor creates a memfd shared memory
+// object for its pixels, seals its size, maps it read-only and passes the
+// file descriptor to the client with SCM_RIGHTS, which maps it for drawing
+// (refusing memory that is not sealed). Clients send
+// damage notifications for the areas they have drawn, and the compositor
+// accumulates the damaged screen area in a region. When composing a frame,
+// only the damaged area is redrawn, directly from the client surfaces
+// (without an intermediate copy) with occlusion culling so that pixels
+// covered by higher surfaces are not drawn. Frames are presented with a
+// presenter (page flipping when the display can pan); because a page that
+// was drawn several frames ago must also be brought up to date, the damage
+// of the last few frames is kept. After a frame has been presented, every
+// client that sent damage receives a frame done event.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "dgl.h"
+
+#define MAX_SURFACE_SIZE 4096
+// Seals of a surface memfd. A surface whose size can change could be
+// truncated by a client while the compositor reads it, which raises SIGBUS.
+#define SURFACE_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+enum {
+	MESSAGE_CREATE_SURFACE,		// x, y, w, h, z.
+	MESSAGE_SURFACE_CREATED,	// surface_id and format, with the memfd.
+	MESSAGE_DAMAGE,			// surface_id and area within the surface.
+	MESSAGE_MOVE,			// surface_id, x, y.
+	MESSAGE_DESTROY_SURFACE,	// surface_id.
+	MESSAGE_FRAME_DONE,
+	MESSAGE_ERROR
+};
+
+class dglCompositorMessage {
+public :
+	int type;
+	int surface_id;
+	int x, y, w, h;
+	int z;
+	uint32_t format;
+};
+
+// Send a message, optionally passing a file descriptor.
+
+static bool dglCompositorSend(int fd, int type, int surface_id, int x, int y, int w, int h,
+int z, uint32_t format, int pass_fd) {
+	dglCompositorMessage message;
+	memset(&message, 0, sizeof(message));
+	message.type = type;
+	message.surface_id = surface_id;
+	message.x = x;
+	message.y = y;
+	message.w = w;
+	message.h = h;
+	message.z = z;
+	message.format = format;
+	struct iovec iov;
+	iov.iov_base = &message;
+	iov.iov_len = sizeof(message);
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	char control[CMSG_SPACE(sizeof(int))];
+	if (pass_fd >= 0) {
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+	}
+	return sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(message);
+}
+
+// Receive a message. Returns the result of recvmsg (0 when the connection
+// was closed). A passed file descriptor is stored in received_fd (- 1 when
+// there is none).
+
+static int dglCompositorReceive(int fd, dglCompositorMessage *message, int *received_fd,
+int flags) {
+	struct iovec iov;
+	iov.iov_base = message;
+	iov.iov_len = sizeof(dglCompositorMessage);
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	char control[CMSG_SPACE(sizeof(int))];
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	int n = recvmsg(fd, &msg, flags | MSG_CMSG_CLOEXEC);
+	if (received_fd != NULL)
+		*received_fd = - 1;
+	// Every descriptor that was passed has been installed; keep the first
+	// one when requested and close all others.
+	if (n > 0)
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			int nu_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (int i = 0; i < nu_fds; i++) {
+				int passed_fd;
+				memcpy(&passed_fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+				if (received_fd != NULL && *received_fd < 0)
+					*received_fd = passed_fd;
+				else
+					close(passed_fd);
+			}
+		}
+	if (n > 0 && n != sizeof(dglCompositorMessage)) {
+		errno = EPROTO;
+		return - 1;
+	}
+	return n;
+}
+
+static bool dglSurfaceIsSealed(int fd) {
+	int seals = fcntl(fd, F_GET_SEALS);
+	return seals >= 0 && (seals & SURFACE_SEALS) == SURFACE_SEALS;
+}
+
+// Describe shared surface memory as a pixmap framebuffer.
+
+static dglFB *dglCreateSurfaceFB(uint32_t format, int w, int h, uint8_t *addr) {
+	dglFB *fb = new dglFB;
+	fb->format = format;
+	fb->bytes_per_pixel = DGL_FORMAT_GET_BYTES_PER_PIXEL(format);
+	fb->xres = w;
+	fb->yres = h;
+	fb->stride = w * fb->bytes_per_pixel;
+	fb->total_size = fb->stride * h;
+	fb->framebuffer_addr = addr;
+	fb->flags = DGL_FB_TYPE_PIXMAP;
+	fb->damage = NULL;
+	return fb;
+}
+
+static void dglFreeSurface(dglCompositorSurface *surface) {
+	munmap(surface->addr, surface->size);
+	delete surface->fb;
+	delete surface;
+}
+
+// Compositor.
+
+dglCompositor *dglCreateCompositor(dglScreenFB *fb, const char *socket_path,
+uint32_t background, int flags) {
+	struct sockaddr_un addr;
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglCreateCompositor: Socket path too long\n");
+		return NULL;
+	}
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglCreateCompositor: Could not create socket\n");
+		return NULL;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	unlink(socket_path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglCreateCompositor: Could not listen on %s\n",
+			socket_path);
+		close(fd);
+		return NULL;
+	}
+	dglCompositor *compositor = new dglCompositor;
+	compositor->fb = fb;
+	compositor->flags = flags;
+	compositor->background = background;
+	compositor->listen_fd = fd;
+	compositor->socket_path = new char[strlen(socket_path) + 1];
+	strcpy(compositor->socket_path, socket_path);
+	compositor->nu_clients = 0;
+	for (int i = 0; i < DGL_COMPOSITOR_MAX_CLIENTS; i++) {
+		compositor->client_fd[i] = - 1;
+		compositor->client_frame_pending[i] = false;
+	}
+	compositor->nu_surfaces = 0;
+	compositor->next_surface_id = 1;
+	compositor->presenter = dglCreatePresenter(fb, DGL_PRESENT_MODE_AUTO, 0);
+	compositor->context = dglCreateContext(fb, fb);
+	compositor->culler = dglCreateOcclusionCuller();
+	compositor->arena = dglCreateRegionArena();
+	compositor->damage = dglCreateRegion(compositor->arena);
+	for (int i = 0; i < DGL_PRESENTER_MAX_PAGES; i++)
+		compositor->frame_damage[i] = dglCreateRegion(compositor->arena);
+	compositor->repaint = dglCreateRegion(compositor->arena);
+	compositor->nu_frames = 0;
+	// Draw the background in the first frame.
+	dglSetRegionRectangle(compositor->damage, 0, 0, fb->xres, fb->yres);
+	return compositor;
+}
+
+void dglDestroyCompositor(dglCompositor *compositor) {
+	for (int i = 0; i < compositor->nu_surfaces; i++)
+		dglFreeSurface(compositor->surface[i]);
+	for (int i = 0; i < DGL_COMPOSITOR_MAX_CLIENTS; i++)
+		if (compositor->client_fd[i] >= 0)
+			close(compositor->client_fd[i]);
+	close(compositor->listen_fd);
+	unlink(compositor->socket_path);
+	delete [] compositor->socket_path;
+	dglDestroyRegion(compositor->repaint);
+	for (int i = 0; i < DGL_PRESENTER_MAX_PAGES; i++)
+		dglDestroyRegion(compositor->frame_damage[i]);
+	dglDestroyRegion(compositor->damage);
+	dglDestroyRegionArena(compositor->arena);
+	dglDestroyOcclusionCuller(compositor->culler);
+	dglDestroyContext(compositor->context);
+	dglDestroyPresenter(compositor->presenter);
+	delete compositor;
+}
+
+// Add a screen area to the damage of the next frame.
+
+static void dglCompositorAddDamage(dglCompositor *compositor, int x, int y, int w, int h) {
+	int x2 = x + w;
+	int y2 = y + h;
+	if (x < 0)
+		x = 0;
+	if (y < 0)
+		y = 0;
+	if (x2 > compositor->fb->xres)
+		x2 = compositor->fb->xres;
+	if (y2 > compositor->fb->yres)
+		y2 = compositor->fb->yres;
+	if (x < x2 && y < y2)
+		dglAddRegionRectangle(compositor->damage, x, y, x2 - x, y2 - y);
+}
+
+// Find a surface of a client by id. Returns the index in the stacking order,
+// or - 1.
+
+static int dglCompositorFindSurface(dglCompositor *compositor, int client, int id) {
+	for (int i = 0; i < compositor->nu_surfaces; i++)
+		if (compositor->surface[i]->id == id && compositor->surface[i]->client == client)
+			return i;
+	return - 1;
+}
+
+static void dglCompositorRemoveSurface(dglCompositor *compositor, int index) {
+	dglCompositorSurface *surface = compositor->surface[index];
+	if (surface->mapped)
+		dglCompositorAddDamage(compositor, surface->x, surface->y, surface->w, surface->h);
+	dglFreeSurface(surface);
+	compositor->nu_surfaces--;
+	for (int i = index; i < compositor->nu_surfaces; i++)
+		compositor->surface[i] = compositor->surface[i + 1];
+}
+
+static void dglCompositorDisconnectClient(dglCompositor *compositor, int client) {
+	for (int i = compositor->nu_surfaces - 1; i >= 0; i--)
+		if (compositor->surface[i]->client == client)
+			dglCompositorRemoveSurface(compositor, i);
+	close(compositor->client_fd[client]);
+	compositor->client_fd[client] = - 1;
+	compositor->client_frame_pending[client] = false;
+	compositor->nu_clients--;
+}
+
+// Send a message to a client. Client sockets are non-blocking, so that a
+// client that does not read its messages cannot stall the compositor; such
+// a client (or one whose connection failed) is disconnected.
+
+static void dglCompositorSendToClient(dglCompositor *compositor, int client, int type,
+int surface_id, int x, int y, int w, int h, int z, uint32_t format, int pass_fd) {
+	if (!dglCompositorSend(compositor->client_fd[client], type, surface_id, x, y, w, h, z,
+	format, pass_fd))
+		dglCompositorDisconnectClient(compositor, client);
+}
+
+static void dglCompositorCreateSurface(dglCompositor *compositor, int client,
+const dglCompositorMessage *message) {
+	if (compositor->nu_surfaces == DGL_COMPOSITOR_MAX_SURFACES || message->w <= 0 ||
+	message->h <= 0 || message->w > MAX_SURFACE_SIZE || message->h > MAX_SURFACE_SIZE) {
+		dglCompositorSendToClient(compositor, client, MESSAGE_ERROR, 0, 0, 0, 0, 0, 0, 0,
+			- 1);
+		return;
+	}
+	dglScreenFB *fb = compositor->fb;
+	int size = message->w * message->h * fb->bytes_per_pixel;
+	int memfd = memfd_create("dgl-surface", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	uint8_t *addr = (uint8_t *)MAP_FAILED;
+	if (memfd >= 0 && ftruncate(memfd, size) == 0 &&
+	fcntl(memfd, F_ADD_SEALS, SURFACE_SEALS) == 0 && dglSurfaceIsSealed(memfd))
+		addr = (uint8_t *)mmap(NULL, size, PROT_READ, MAP_SHARED, memfd, 0);
+	if (addr == MAP_FAILED) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglCompositorDispatch: Could not create shared memory surface\n");
+		if (memfd >= 0)
+			close(memfd);
+		dglCompositorSendToClient(compositor, client, MESSAGE_ERROR, 0, 0, 0, 0, 0, 0, 0,
+			- 1);
+		return;
+	}
+	dglCompositorSurface *surface = new dglCompositorSurface;
+	surface->id = compositor->next_surface_id++;
+	surface->x = message->x;
+	surface->y = message->y;
+	surface->w = message->w;
+	surface->h = message->h;
+	surface->z = message->z;
+	surface->mapped = false;
+	surface->client = client;
+	surface->addr = addr;
+	surface->size = size;
+	surface->fb = dglCreateSurfaceFB(fb->format, message->w, message->h, addr);
+	// Insert above the surfaces with the same or a lower stacking order.
+	int index = compositor->nu_surfaces;
+	while (index > 0 && compositor->surface[index - 1]->z > surface->z) {
+		compositor->surface[index] = compositor->surface[index - 1];
+		index--;
+	}
+	compositor->surface[index] = surface;
+	compositor->nu_surfaces++;
+	dglCompositorSendToClient(compositor, client, MESSAGE_SURFACE_CREATED, surface->id,
+		surface->x, surface->y, surface->w, surface->h, surface->z, fb->format, memfd);
+	// The client keeps the shared memory object open through its own
+	// descriptor and mapping.
+	close(memfd);
+}
+
+static void dglCompositorHandleMessage(dglCompositor *compositor, int client,
+const dglCompositorMessage *message) {
+	if (message->type == MESSAGE_CREATE_SURFACE) {
+		dglCompositorCreateSurface(compositor, client, message);
+		return;
+	}
+	int index = dglCompositorFindSurface(compositor, client, message->surface_id);
+	if (index < 0)
+		return;
+	dglCompositorSurface *surface = compositor->surface[index];
+	switch (message->type) {
+	case MESSAGE_DAMAGE : {
+		if (!surface->mapped) {
+			// The whole surface becomes visible.
+			surface->mapped = true;
+			dglCompositorAddDamage(compositor, surface->x, surface->y,
+				surface->w, surface->h);
+		}
+		else {
+			// Clip the area to the surface.
+			int x1 = message->x < 0 ? 0 : message->x;
+			int y1 = message->y < 0 ? 0 : message->y;
+			int x2 = message->x + message->w;
+			int y2 = message->y + message->h;
+			if (x2 > surface->w)
+				x2 = surface->w;
+			if (y2 > surface->h)
+				y2 = surface->h;
+			if (x1 < x2 && y1 < y2)
+				dglCompositorAddDamage(compositor, surface->x + x1, surface->y + y1,
+					x2 - x1, y2 - y1);
+		}
+		compositor->client_frame_pending[client] = true;
+		break;
+		}
+	case MESSAGE_MOVE :
+		if (surface->mapped) {
+			dglCompositorAddDamage(compositor, surface->x, surface->y,
+				surface->w, surface->h);
+			dglCompositorAddDamage(compositor, message->x, message->y,
+				surface->w, surface->h);
+		}
+		surface->x = message->x;
+		surface->y = message->y;
+		compositor->client_frame_pending[client] = true;
+		break;
+	case MESSAGE_DESTROY_SURFACE :
+		dglCompositorRemoveSurface(compositor, index);
+		break;
+	}
+}
+
+int dglCompositorDispatch(dglCompositor *compositor, int timeout_ms) {
+	struct pollfd fds[DGL_COMPOSITOR_MAX_CLIENTS + 1];
+	int fd_client[DGL_COMPOSITOR_MAX_CLIENTS + 1];
+	int nu_fds = 0;
+	fds[0].fd = compositor->listen_fd;
+	fds[0].events = POLLIN;
+	fd_client[0] = - 1;
+	nu_fds++;
+	for (int i = 0; i < DGL_COMPOSITOR_MAX_CLIENTS; i++)
+		if (compositor->client_fd[i] >= 0) {
+			fds[nu_fds].fd = compositor->client_fd[i];
+			fds[nu_fds].events = POLLIN;
+			fd_client[nu_fds] = i;
+			nu_fds++;
+		}
+	int r = poll(fds, nu_fds, timeout_ms);
+	if (r <= 0)
+		return (r < 0 && errno != EINTR) ? - 1 : 0;
+	int nu_handled = 0;
+	for (int i = 1; i < nu_fds; i++) {
+		if (fds[i].revents == 0)
+			continue;
+		int client = fd_client[i];
+		for (;;) {
+			dglCompositorMessage message;
+			int n = dglCompositorReceive(compositor->client_fd[client], &message, NULL,
+				MSG_DONTWAIT);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			if (n <= 0) {
+				dglCompositorDisconnectClient(compositor, client);
+				break;
+			}
+			dglCompositorHandleMessage(compositor, client, &message);
+			nu_handled++;
+			// A failed reply disconnects the client.
+			if (compositor->client_fd[client] < 0)
+				break;
+		}
+	}
+	if (fds[0].revents & POLLIN) {
+		int fd = accept4(compositor->listen_fd, NULL, NULL,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd >= 0) {
+			int client = 0;
+			while (client < DGL_COMPOSITOR_MAX_CLIENTS && compositor->client_fd[client] >= 0)
+				client++;
+			if (client == DGL_COMPOSITOR_MAX_CLIENTS) {
+				dglMessage(DGL_MESSAGE_WARNING,
+					"dglCompositorDispatch: Too many clients\n");
+				close(fd);
+			}
+			else {
+				compositor->client_fd[client] = fd;
+				compositor->nu_clients++;
+			}
+		}
+	}
+	return nu_handled;
+}
+
+bool dglCompositorComposite(dglCompositor *compositor) {
+	if (dglRegionIsEmpty(compositor->damage))
+		return false;
+	dglScreenFB *fb = compositor->fb;
+	dglContext *context = compositor->context;
+	int age = dglPresenterAcquire(compositor->presenter, context);
+	// The back buffer misses the damage of the frames presented since it
+	// was drawn.
+	if (age == 0 || age - 1 > DGL_PRESENTER_MAX_PAGES)
+		dglSetRegionRectangle(compositor->repaint, 0, 0, fb->xres, fb->yres);
+	else {
+		dglCopyRegion(compositor->repaint, compositor->damage);
+		for (int i = 0; i < age - 1; i++)
+			dglUnionRegion(compositor->repaint, compositor->repaint,
+				compositor->frame_damage[i]);
+	}
+	dglSetOcclusionCuller(context, compositor->culler);
+	const dglRegion *repaint = compositor->repaint;
+	for (int i = 0; i < repaint->nu_rects; i++) {
+		const dglClipRectangle *r = &repaint->rects[i];
+		dglSetContextClipRectangle(context, r->x1, r->y1, r->x2, r->y2);
+		dglFill(context, r->x1, r->y1, r->x2 - r->x1, r->y2 - r->y1,
+			compositor->background);
+		for (int j = 0; j < compositor->nu_surfaces; j++) {
+			dglCompositorSurface *surface = compositor->surface[j];
+			if (surface->mapped && surface->x < r->x2 && surface->x + surface->w > r->x1 &&
+			surface->y < r->y2 && surface->y + surface->h > r->y1)
+				dglPutImage(context, surface->x, surface->y, surface->fb);
+		}
+	}
+	dglSetOcclusionCuller(context, NULL);
+	dglDisableContextClipping(context);
+	if (compositor->flags & DGL_COMPOSITOR_FLAG_VSYNC)
+		dglWaitVSync(fb);
+	dglPresenterPresent(compositor->presenter);
+	// Remember the damage of this frame.
+	dglRegion *oldest = compositor->frame_damage[DGL_PRESENTER_MAX_PAGES - 1];
+	for (int i = DGL_PRESENTER_MAX_PAGES - 1; i > 0; i--)
+		compositor->frame_damage[i] = compositor->frame_damage[i - 1];
+	compositor->frame_damage[0] = oldest;
+	dglCopyRegion(oldest, compositor->damage);
+	dglClearRegion(compositor->damage);
+	compositor->nu_frames++;
+	for (int i = 0; i < DGL_COMPOSITOR_MAX_CLIENTS; i++)
+		if (compositor->client_frame_pending[i]) {
+			compositor->client_frame_pending[i] = false;
+			dglCompositorSendToClient(compositor, i, MESSAGE_FRAME_DONE, 0, 0, 0, 0, 0, 0, 0,
+				- 1);
+		}
+	return true;
+}
+
+// Client.
+
+dglCompositorClient *dglConnectCompositor(const char *socket_path) {
+	struct sockaddr_un addr;
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglConnectCompositor: Socket path too long\n");
+		return NULL;
+	}
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglConnectCompositor: Could not create socket\n");
+		return NULL;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglConnectCompositor: Could not connect to %s\n",
+			socket_path);
+		close(fd);
+		return NULL;
+	}
+	dglCompositorClient *client = new dglCompositorClient;
+	client->fd = fd;
+	client->format = 0;
+	client->nu_frames_done = 0;
+	return client;
+}
+
+void dglDisconnectCompositor(dglCompositorClient *client) {
+	close(client->fd);
+	delete client;
+}
+
+dglCompositorSurface *dglCreateCompositorSurface(dglCompositorClient *client, int x, int y,
+int w, int h, int z) {
+	if (!dglCompositorSend(client->fd, MESSAGE_CREATE_SURFACE, 0, x, y, w, h, z, 0, - 1))
+		return NULL;
+	// Wait for the reply; frame done events may arrive first.
+	dglCompositorMessage message;
+	int fd;
+	for (;;) {
+		if (dglCompositorReceive(client->fd, &message, &fd, 0) <= 0)
+			return NULL;
+		if (message.type == MESSAGE_FRAME_DONE)
+			client->nu_frames_done++;
+		else if (message.type == MESSAGE_SURFACE_CREATED && fd >= 0)
+			break;
+		else {
+			if (fd >= 0)
+				close(fd);
+			dglMessage(DGL_MESSAGE_WARNING,
+				"dglCreateCompositorSurface: Compositor refused surface\n");
+			return NULL;
+		}
+	}
+	if (!dglSurfaceIsSealed(fd)) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglCreateCompositorSurface: Shared memory is not sealed\n");
+		close(fd);
+		dglCompositorSend(client->fd, MESSAGE_DESTROY_SURFACE, message.surface_id, 0, 0,
+			0, 0, 0, 0, - 1);
+		return NULL;
+	}
+	client->format = message.format;
+	int bytes_per_pixel = DGL_FORMAT_GET_BYTES_PER_PIXEL(message.format);
+	int size = w * h * bytes_per_pixel;
+	uint8_t *addr = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglCreateCompositorSurface: Could not map shared memory\n");
+		dglCompositorSend(client->fd, MESSAGE_DESTROY_SURFACE, message.surface_id, 0, 0,
+			0, 0, 0, 0, - 1);
+		return NULL;
+	}
+	dglCompositorSurface *surface = new dglCompositorSurface;
+	surface->id = message.surface_id;
+	surface->x = x;
+	surface->y = y;
+	surface->w = w;
+	surface->h = h;
+	surface->z = z;
+	surface->mapped = false;
+	surface->client = - 1;
+	surface->addr = addr;
+	surface->size = size;
+	surface->fb = dglCreateSurfaceFB(message.format, w, h, addr);
+	return surface;
+}
+
+void dglDestroyCompositorSurface(dglCompositorClient *client, dglCompositorSurface *surface) {
+	dglCompositorSend(client->fd, MESSAGE_DESTROY_SURFACE, surface->id, 0, 0, 0, 0, 0, 0, - 1);
+	dglFreeSurface(surface);
+}
+
+void dglDamageCompositorSurface(dglCompositorClient *client, dglCompositorSurface *surface,
+int x, int y, int w, int h) {
+	surface->mapped = true;
+	dglCompositorSend(client->fd, MESSAGE_DAMAGE, surface->id, x, y, w, h, 0, 0, - 1);
+}
+
+void dglMoveCompositorSurface(dglCompositorClient *client, dglCompositorSurface *surface,
+int x, int y) {
+	surface->x = x;
+	surface->y = y;
+	dglCompositorSend(client->fd, MESSAGE_MOVE, surface->id, x, y, 0, 0, 0, 0, - 1);
+}
+
+// Wait until the compositor has presented a frame with the damage sent
+// before. Returns false when the connection to the compositor was lost.
+
+bool dglWaitCompositorFrame(dglCompositorClient *client) {
+	if (client->nu_frames_done > 0) {
+		client->nu_frames_done = 0;
+		return true;
+	}
+	for (;;) {
+		dglCompositorMessage message;
+		if (dglCompositorReceive(client->fd, &message, NULL, 0) <= 0)
+			return false;
+		if (message.type == MESSAGE_FRAME_DONE)
+			return true;
+	}
+}
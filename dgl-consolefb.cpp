@@ -75,12 +75,14 @@ OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 // Functions for textmode restoration.
 
+// Accessed atomically, since the restore function may be called from signal
+// handlers in any thread as well as from atexit.
 static bool saved_graphics_mode_set;
 
 static void dglConsoleFBRestoreConsoleState() {
 	// If graphics mode was already enabled before running the
-	// program, do noting.
-	if (!saved_graphics_mode_set)
+	// program, do noting. Only the first caller restores the console.
+	if (!__atomic_exchange_n(&saved_graphics_mode_set, false, __ATOMIC_SEQ_CST))
 		return;
 	fflush(stdout);
 	fflush(stderr);
@@ -151,7 +153,7 @@ static void signal_abort(int num, siginfo_t *info, void *p) {
 
 static void dglConsoleFBInstallConsoleRestoreHandlers(
 bool graphics_mode_set) {
-	saved_graphics_mode_set = graphics_mode_set;
+	__atomic_store_n(&saved_graphics_mode_set, graphics_mode_set, __ATOMIC_SEQ_CST);
 	atexit(dglConsoleFBRestoreConsoleState);
 	struct sigaction act;
 	act.sa_sigaction = signal_quit;
@@ -214,7 +216,9 @@ dglConsoleFB *dglCreateConsoleFramebuffer() {
 		if (ioctl(fd, FBIOCOPYAREA, &copyarea) != 0)
 			copyarea_supported = false;
 	}
-	int flags = DGL_FB_TYPE_CONSOLE;
+	// The memory-mapped console framebuffer is normally mapped uncached
+	// or write-combined by the kernel.
+	int flags = DGL_FB_TYPE_CONSOLE | DGL_FB_FLAG_WRITE_COMBINED;
 	if (copyarea_supported)
 		flags |= DGL_FB_FLAG_HAVE_COPY_AREA;
 
@@ -316,9 +320,25 @@ dglConsoleFB *dglCreateConsoleFramebuffer() {
 	cfb->yres = fb_var.yres;
 	cfb->stride = fb_fix.line_length;
 
+	// Validate the range of pan offsets once. The kernel only accepts
+	// offsets within the virtual resolution, which may be smaller than
+	// what fits in the framebuffer memory.
 	cfb->virtual_xres = cfb->xres;
 	cfb->virtual_yres = cfb->total_size / cfb->stride;
-	cfb->nu_pages = cfb->virtual_yres / cfb->xres;
+	if ((int)fb_var.yres_virtual >= cfb->yres &&
+	(int)fb_var.yres_virtual < cfb->virtual_yres)
+		cfb->virtual_yres = fb_var.yres_virtual;
+	cfb->nu_pages = cfb->virtual_yres / cfb->yres;
+	cfb->pan_var = new struct fb_var_screeninfo;
+	*cfb->pan_var = fb_var;
+	cfb->ypanstep = fb_fix.ypanstep > 0 ? fb_fix.ypanstep : 1;
+	dglResetPanDisplayStats(cfb);
+
+	cfb->display_yoffset = 0;
+	cfb->screen_addr = NULL;
+	cfb->damage = NULL;
+	cfb->copy_calibration = NULL;
+	cfb->front_addr = NULL;
 
 	cfb->fd = fd;
 	cfb->graphics_mode_set = graphics_mode_set;
@@ -343,6 +363,15 @@ dglConsoleFB *dglCreateConsoleFramebuffer() {
 	else
 		cfb->CopyAreaFunc = dglConsoleFBCopyAreaNoOp;
 
+	if (getenv("DGL_SHADOW_FB") != NULL)
+		dglEnableShadowFramebuffer(cfb);
+	if (getenv("DGL_DIRTY_PAGES") != NULL)
+		dglEnableDirtyPageUpdates(cfb, atoi(getenv("DGL_DIRTY_PAGES")));
+	if (getenv("DGL_COPY_CALIBRATION") != NULL && (cfb->flags & DGL_FB_FLAG_HAVE_COPY_AREA))
+		dglCalibrateCopyArea(cfb, getenv("DGL_COPY_CALIBRATION"));
+	// Calibrate the frame-sized copy kernel before the first frame.
+	dglInitLargeCopy();
+
 	dglMessage(DGL_MESSAGE_INFO,
 		"dglCreateConsoleFramebuffer: Succesfully created console framebuffer\n");
 	return cfb;
@@ -355,6 +384,8 @@ invalid_format:
 }
 
 void dglDestroyConsoleFramebuffer(dglConsoleFB *cfb) {
+	dglDisableShadowFramebuffer(cfb);
+	dglDisableCopyAreaCalibration(cfb);
 	if (cfb->graphics_mode_set) {
 		int kd_fd = open("/dev/tty0", O_RDWR);
 		if (ioctl(kd_fd, KDSETMODE, KD_TEXT) < 0)
@@ -363,22 +394,30 @@ void dglDestroyConsoleFramebuffer(dglConsoleFB *cfb) {
 		close(kd_fd);
 	}
 	close(cfb->fd);
+	delete cfb->pan_var;
 	delete cfb;
 }
 
 // Extra or accelerated functions.
 
+// The screen info cached at creation time is reused, so that a page flip
+// takes only a single system call.
+
 void dglConsoleFBPanDisplay(dglScreenFB *fb, int x, int y) {
 	dglConsoleFB *cfb = (dglConsoleFB *)fb;
-	struct fb_var_screeninfo fb_var;
-	ioctl(cfb->fd, FBIOGET_VSCREENINFO, &fb_var);
-	if (x + cfb->xres >= cfb->virtual_xres)
+	if (x + cfb->xres > cfb->virtual_xres)
 		x = cfb->virtual_xres - cfb->xres;
-	if (y + cfb->yres >= cfb->virtual_yres)
+	if (y + cfb->yres > cfb->virtual_yres)
 		y = cfb->virtual_yres - cfb->yres;
-	fb_var.xoffset = x;
-	fb_var.yoffset = y;
-	ioctl(cfb->fd, FBIOPAN_DISPLAY, &fb_var);
+	if (x < 0)
+		x = 0;
+	if (y < 0)
+		y = 0;
+	y -= y % cfb->ypanstep;
+	cfb->pan_var->xoffset = x;
+	cfb->pan_var->yoffset = y;
+	if (ioctl(cfb->fd, FBIOPAN_DISPLAY, cfb->pan_var) < 0)
+		dglMessage(DGL_MESSAGE_WARNING, "FBIOPAN_DISPLAY failed (%d, %d).\n", x, y);
 }
 
 void dglConsoleFBWaitVSync(dglScreenFB *fb) {
@@ -392,20 +431,25 @@ static const char *enabled_str[2] = {
 	"enabled"
 };
 
-const char *dglGetInfoString(dglConsoleFB *cfb) {
-	int pan_display_enabled = (cfb->flags & DGL_FB_FLAG_HAVE_PAN_DISPLAY) != 0;
-	int wait_vsync_enabled = (cfb->flags & DGL_FB_FLAG_HAVE_WAIT_VSYNC) != 0;
-	int copy_area_enabled = (cfb->flags & DGL_FB_FLAG_HAVE_COPY_AREA) != 0;
+const char *dglGetInfoString(dglScreenFB *fb) {
+	int pan_display_enabled = (fb->flags & DGL_FB_FLAG_HAVE_PAN_DISPLAY) != 0;
+	int wait_vsync_enabled = (fb->flags & DGL_FB_FLAG_HAVE_WAIT_VSYNC) != 0;
+	int copy_area_enabled = (fb->flags & DGL_FB_FLAG_HAVE_COPY_AREA) != 0;
+	int write_combined_enabled = (fb->flags & DGL_FB_FLAG_WRITE_COMBINED) != 0;
+	int shadow_enabled = (fb->flags & DGL_FB_FLAG_SHADOW) != 0;
 	char *info_str = new char[1024];
         sprintf(info_str,
 		"Resolution %dx%d, %d bytes per pixel, screen framebuffer size %d, "
                 "total framebuffer size %d, stride %d, virtual resolution %dx%d, "
-                "framebuffer address %p, PanDisplay %s, WaitVSync %s, CopyArea %s\n",
-                cfb->xres, cfb->yres, cfb->bytes_per_pixel, cfb->stride * cfb->yres,
-                cfb->total_size, cfb->stride, cfb->xres, cfb->virtual_yres, cfb->framebuffer_addr,
+                "framebuffer address %p, PanDisplay %s, WaitVSync %s, CopyArea %s, "
+		"streaming stores %s, shadow framebuffer %s\n",
+                fb->xres, fb->yres, fb->bytes_per_pixel, fb->stride * fb->yres,
+                fb->total_size, fb->stride, fb->xres, fb->virtual_yres, fb->framebuffer_addr,
 		enabled_str[pan_display_enabled],
 		enabled_str[wait_vsync_enabled],
-		enabled_str[copy_area_enabled]);
+		enabled_str[copy_area_enabled],
+		enabled_str[write_combined_enabled],
+		enabled_str[shadow_enabled]);
 	return info_str;
 }
 
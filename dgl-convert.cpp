@@ -0,0 +1,247 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+
+// Pixel format conversion.
+//
+// The conversion tables are generated by constexpr functions, so that they
+// are constant data in the library without any initialization at run time.
+// A row conversion function is instantiated from a template for every
+// combination of source and destination pixel format (and with and without
+// dithering); within it, the packing and unpacking functions of dgl.h are
+// called with constant formats and reduce to shifts and table lookups.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dgl.h"
+
+// The six pixel formats have the values 0 to 5.
+#define NU_FORMATS 6
+
+// Compile-time natural logarithm and exponential function, used to
+// generate the sRGB tables (the math library is not constexpr).
+
+static constexpr double dglConstLog(double x) {
+	int k = 0;
+	while (x > 2.0) {
+		x *= 0.5;
+		k++;
+	}
+	while (x < 1.0) {
+		x *= 2.0;
+		k--;
+	}
+	// ln(x) = 2 atanh((x - 1) / (x + 1)).
+	double z = (x - 1.0) / (x + 1.0);
+	double z2 = z * z;
+	double term = z;
+	double sum = 0;
+	for (int n = 1; n < 64; n += 2) {
+		sum += term / n;
+		term *= z2;
+	}
+	return 2.0 * sum + k * 0.69314718055994530942;
+}
+
+static constexpr double dglConstExp(double x) {
+	// Halve the argument until the series converges quickly, and square
+	// the result as many times.
+	int k = 0;
+	while (x < - 0.5 || x > 0.5) {
+		x *= 0.5;
+		k++;
+	}
+	double sum = 1.0;
+	double term = 1.0;
+	for (int n = 1; n < 24; n++) {
+		term *= x / n;
+		sum += term;
+	}
+	for (; k > 0; k--)
+		sum *= sum;
+	return sum;
+}
+
+static constexpr double dglConstPow(double x, double y) {
+	return x <= 0 ? 0 : dglConstExp(y * dglConstLog(x));
+}
+
+static constexpr double dglSRGBToLinear(double c) {
+	return c <= 0.04045 ? c / 12.92 : dglConstPow((c + 0.055) / 1.055, 2.4);
+}
+
+static constexpr double dglLinearToSRGB(double l) {
+	return l <= 0.0031308 ? l * 12.92 : 1.055 * dglConstPow(l, 1.0 / 2.4) - 0.055;
+}
+
+// Element (x, y) of the 4x4 Bayer matrix: the bits of x ^ y and y,
+// interleaved with the least significant bits first.
+
+static constexpr int dglBayer4x4(int x, int y) {
+	int v = 0;
+	for (int bit = 0; bit < 2; bit++)
+		v = (v << 2) | ((((x >> bit) ^ (y >> bit)) & 1) << 1) | ((y >> bit) & 1);
+	return v;
+}
+
+static constexpr dglConversionTables dglGenerateConversionTables() {
+	dglConversionTables t = {};
+	// Expansion replicates the most significant bits into the low bits,
+	// which is within one of i * 255 / 31 (or 63) rounded, and exact at
+	// both ends of the range.
+	for (int i = 0; i < 32; i++)
+		t.expand5[i] = (i << 3) | (i >> 2);
+	for (int i = 0; i < 64; i++)
+		t.expand6[i] = (i << 2) | (i >> 4);
+	for (int i = 0; i < 256; i++) {
+		t.reduce5[i] = (i * 31 + 127) / 255;
+		t.reduce6[i] = (i * 63 + 127) / 255;
+	}
+	for (int y = 0; y < 4; y++)
+		for (int x = 0; x < 4; x++)
+			t.dither_matrix[y][x] = dglBayer4x4(x, y);
+	// A threshold of (m + 0.5) / 16 replaces the rounding offset of 0.5.
+	for (int j = 0; j < 16; j++) {
+		int bias = (dglBayer4x4(j & 3, j >> 2) * 2 + 1) * 255 / 32;
+		for (int i = 0; i < 256; i++) {
+			t.reduce5_dither[j][i] = (i * 31 + bias) / 255;
+			t.reduce6_dither[j][i] = (i * 63 + bias) / 255;
+		}
+	}
+	// The green component is split across the two bytes; because of the
+	// bit replication, the contributions of the two bytes do not overlap.
+	for (int i = 0; i < 256; i++) {
+		t.unpack565_low[i] = t.expand5[i & 0x1F] | ((i >> 5) << 10);
+		t.unpack565_high[i] = 0xFF000000 | ((uint32_t)t.expand5[i >> 3] << 16) |
+			((((i & 7) << 5) | ((i & 7) >> 1)) << 8);
+	}
+	for (int i = 0; i < 256; i++)
+		t.srgb_to_linear[i] = (uint16_t)(dglSRGBToLinear(i / 255.0) * 65535.0 + 0.5);
+	for (int i = 0; i < 4096; i++)
+		t.linear_to_srgb[i] = (uint8_t)(dglLinearToSRGB(i / 4095.0) * 255.0 + 0.5);
+	return t;
+}
+
+constexpr dglConversionTables dgl_conversion_tables = dglGenerateConversionTables();
+
+// Reduction must invert expansion, and the split 565 unpacking must be
+// equal to expanding each component.
+
+static constexpr bool dglCheckConversionTables() {
+	for (int i = 0; i < 32; i++)
+		if (dgl_conversion_tables.reduce5[dgl_conversion_tables.expand5[i]] != i)
+			return false;
+	for (int i = 0; i < 64; i++)
+		if (dgl_conversion_tables.reduce6[dgl_conversion_tables.expand6[i]] != i)
+			return false;
+	for (int i = 0; i < 65536; i++) {
+		uint32_t p = dgl_conversion_tables.unpack565_low[i & 0xFF] |
+			dgl_conversion_tables.unpack565_high[i >> 8];
+		if (p != (0xFF000000 | ((uint32_t)dgl_conversion_tables.expand5[i >> 11] << 16) |
+		((uint32_t)dgl_conversion_tables.expand6[(i >> 5) & 0x3F] << 8) |
+		dgl_conversion_tables.expand5[i & 0x1F]))
+			return false;
+	}
+	return true;
+}
+
+static_assert(dglCheckConversionTables(), "Inconsistent pixel conversion tables");
+
+// Row conversion functions.
+
+template <uint32_t format>
+DGL_INLINE_ONLY static uint32_t dglLoadPixel(const uint8_t *p, int i) {
+	if (format & DGL_FORMAT_PIXEL_SIZE_16_BIT)
+		return ((const uint16_t *)p)[i];
+	return ((const uint32_t *)p)[i];
+}
+
+template <uint32_t format>
+DGL_INLINE_ONLY static void dglStorePixel(uint8_t *p, int i, uint32_t pixel) {
+	if (format & DGL_FORMAT_PIXEL_SIZE_16_BIT)
+		((uint16_t *)p)[i] = pixel;
+	else
+		((uint32_t *)p)[i] = pixel;
+}
+
+// With dithering, y is the row within the dither matrix. The dithered
+// variant is only used for a 16-bit destination.
+
+template <uint32_t dest_format, uint32_t src_format, bool dither>
+static void dglConvertRow(uint8_t *dest, const uint8_t *src, int w, int y) {
+	for (int i = 0; i < w; i++) {
+		uint32_t pixel = dglLoadPixel <src_format>(src, i);
+		if (dest_format & src_format & DGL_FORMAT_PIXEL_SIZE_16_BIT) {
+			// RGB565 and BGR565 only differ in component order; since
+			// reduction inverts expansion, swap the components directly.
+			dglStorePixel <dest_format>(dest, i,
+				((pixel & 0x1F) << 11) | (pixel & 0x07E0) | (pixel >> 11));
+			continue;
+		}
+		uint32_t argb = dglPixelToARGB(src_format, pixel);
+		if (dither)
+			pixel = dglARGBToPixelDither(dest_format, argb, i, y);
+		else
+			pixel = dglARGBToPixel(dest_format, argb);
+		dglStorePixel <dest_format>(dest, i, pixel);
+	}
+}
+
+typedef void (*dglConvertRowFunc)(uint8_t *dest, const uint8_t *src, int w, int y);
+
+#define CONVERT_ROW_FUNCS(dest_format, dither) { \
+	dglConvertRow <dest_format, 0, dither>, dglConvertRow <dest_format, 1, dither>, \
+	dglConvertRow <dest_format, 2, dither>, dglConvertRow <dest_format, 3, dither>, \
+	dglConvertRow <dest_format, 4, dither>, dglConvertRow <dest_format, 5, dither> }
+
+// Indexed by dithering, destination format and source format.
+static const dglConvertRowFunc convert_row_func[2][NU_FORMATS][NU_FORMATS] = {
+	{
+	CONVERT_ROW_FUNCS(0, false), CONVERT_ROW_FUNCS(1, false), CONVERT_ROW_FUNCS(2, false),
+	CONVERT_ROW_FUNCS(3, false), CONVERT_ROW_FUNCS(4, false), CONVERT_ROW_FUNCS(5, false)
+	},
+	{
+	CONVERT_ROW_FUNCS(0, false), CONVERT_ROW_FUNCS(1, false), CONVERT_ROW_FUNCS(2, false),
+	CONVERT_ROW_FUNCS(3, false), CONVERT_ROW_FUNCS(4, true), CONVERT_ROW_FUNCS(5, true)
+	}
+};
+
+void dglConvertRows(uint32_t dest_format, uint8_t *dest, int dest_stride,
+uint32_t src_format, const uint8_t *src, int src_stride, int w, int h, int flags) {
+	if (dest_format >= NU_FORMATS || src_format >= NU_FORMATS) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglConvertRows: Cannot handle pixel format 0x%04X\n",
+			dest_format >= NU_FORMATS ? dest_format : src_format);
+		return;
+	}
+	if (dest_format == src_format) {
+		dglCopyRows(dest, dest_stride, src, src_stride,
+			w * DGL_FORMAT_GET_BYTES_PER_PIXEL(dest_format), h);
+		return;
+	}
+	dglConvertRowFunc func = convert_row_func[(flags & DGL_CONVERT_FLAG_DITHER) != 0]
+		[dest_format][src_format];
+	for (int y = 0; y < h; y++) {
+		func(dest, src, w, y);
+		dest += dest_stride;
+		src += src_stride;
+	}
+}
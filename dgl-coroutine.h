@@ -0,0 +1,146 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+
+#ifndef __DGL_COROUTINE_H__
+#define __DGL_COROUTINE_H__
+
+// Coroutine interface of the frame scheduler. This header requires C++20
+// (compile with -std=c++20); the library itself does not.
+//
+// An animation is written as a coroutine returning dglTask that loops over
+// frames, drawing with scheduler->context and waiting for the next frame
+// with co_await:
+//
+//	dglTask Bounce(dglFrameScheduler *scheduler, Ball *ball) {
+//		for (;;) {
+//			dglFill(scheduler->context, ball->x, ball->y, 16, 16, ball->pixel);
+//			int frames = co_await dglNextFrame(scheduler);
+//			MoveBall(ball, frames);
+//		}
+//	}
+//
+//	dglStartTask(scheduler, Bounce(scheduler, &ball));
+//	dglRunFrameScheduler(scheduler);
+//
+// co_await dglNextFrame and dglWaitFrames return the number of frames that
+// have elapsed, which is larger than the number waited for when frames
+// were skipped because the application fell behind. co_await dglNextVSync
+// resumes right after the current frame has been presented (for work that
+// does not draw) and returns the frame intervals of that present. Tasks are
+// resumed in the order in which they waited, so tasks that draw a
+// background should be started first. A task frees itself when it returns;
+// tasks that are still waiting when the scheduler is destroyed are
+// destroyed with it.
+
+#if !defined(__cpp_impl_coroutine)
+#error "dgl-coroutine.h requires C++20 coroutines (compile with -std=c++20)"
+#endif
+
+#include <stdlib.h>
+#include <coroutine>
+
+#include "dgl.h"
+
+class dglTask {
+public :
+	class promise_type {
+	public :
+		dglTask get_return_object() {
+			return dglTask(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		// A task runs when it is started with dglStartTask.
+		std::suspend_always initial_suspend() noexcept { return std::suspend_always(); }
+		std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+		void return_void() { }
+		void unhandled_exception() { abort(); }
+	};
+
+	std::coroutine_handle<promise_type> handle;	// NULL when started.
+
+	explicit dglTask(std::coroutine_handle<promise_type> h) : handle(h) { }
+	dglTask(dglTask &&task) : handle(task.handle) { task.handle = nullptr; }
+	dglTask(const dglTask &) = delete;
+	dglTask& operator=(const dglTask &) = delete;
+	~dglTask() {
+		if (handle)
+			handle.destroy();
+	}
+};
+
+static inline void dglResumeTask(void *data) {
+	std::coroutine_handle<>::from_address(data).resume();
+}
+
+static inline void dglCancelTask(void *data) {
+	std::coroutine_handle<>::from_address(data).destroy();
+}
+
+class dglFrameAwaiter {
+public :
+	dglFrameScheduler *scheduler;
+	int nu_frames;
+	int frame;
+
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(std::coroutine_handle<> handle) {
+		frame = dglScheduleFrameWaiter(scheduler, nu_frames, dglResumeTask,
+			dglCancelTask, handle.address());
+	}
+	int await_resume() const noexcept {
+		return scheduler->frame - frame + nu_frames;
+	}
+};
+
+class dglVSyncAwaiter {
+public :
+	dglFrameScheduler *scheduler;
+
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(std::coroutine_handle<> handle) {
+		dglScheduleVSyncWaiter(scheduler, dglResumeTask, dglCancelTask, handle.address());
+	}
+	int await_resume() const noexcept {
+		return scheduler->frame_intervals;
+	}
+};
+
+// Start a task. It first runs in the upcoming frame (or, when started by a
+// task that is drawing, in the next frame).
+
+static inline void dglStartTask(dglFrameScheduler *scheduler, dglTask task) {
+	dglScheduleFrameWaiter(scheduler, 1, dglResumeTask, dglCancelTask,
+		task.handle.address());
+	task.handle = nullptr;
+}
+
+static inline dglFrameAwaiter dglWaitFrames(dglFrameScheduler *scheduler, int nu_frames) {
+	dglFrameAwaiter awaiter = { scheduler, nu_frames < 1 ? 1 : nu_frames, 0 };
+	return awaiter;
+}
+
+static inline dglFrameAwaiter dglNextFrame(dglFrameScheduler *scheduler) {
+	return dglWaitFrames(scheduler, 1);
+}
+
+static inline dglVSyncAwaiter dglNextVSync(dglFrameScheduler *scheduler) {
+	dglVSyncAwaiter awaiter = { scheduler };
+	return awaiter;
+}
+
+#endif
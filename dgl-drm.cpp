@@ -0,0 +1,463 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// DRM/KMS screen framebuffer using a dumb buffer.
+//
+// A single dumb buffer that is nu_pages screens high is allocated and
+// memory-mapped, so that the pages are laid out exactly like the pages of
+// the console framebuffer. For every page a KMS framebuffer is created
+// that refers to the dumb buffer with the page's offset. Displaying a page
+// is a vblank-synchronized page flip, completion of which is signalled by
+// a DRM event on the device file descriptor. No superuser priviledges or
+// kernel graphics mode are required, only DRM master status (which is
+// available when no other display server is running). The backend can be
+// tested with the VKMS virtual device (modprobe vkms).
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#ifdef DGL_USE_DRM
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#endif
+
+#include "dgl.h"
+
+#ifdef DGL_USE_DRM
+
+static void dglDRMFBPageFlipHandler(int fd, unsigned int sequence,
+unsigned int tv_sec, unsigned int tv_usec, void *user_data) {
+	dglDRMFB *dfb = (dglDRMFB *)user_data;
+	dfb->flip_pending = false;
+	dfb->displayed_fb_id = dfb->pending_fb_id;
+	dfb->event_sequence = sequence;
+	dfb->event_time_usec = (uint64_t)tv_sec * 1000000 + tv_usec;
+}
+
+static void dglDRMFBVBlankHandler(int fd, unsigned int sequence,
+unsigned int tv_sec, unsigned int tv_usec, void *user_data) {
+	dglDRMFB *dfb = (dglDRMFB *)user_data;
+	dfb->vblank_pending = false;
+	dfb->event_sequence = sequence;
+	dfb->event_time_usec = (uint64_t)tv_sec * 1000000 + tv_usec;
+}
+
+// Read and dispatch the pending events on the DRM file descriptor. Blocks
+// until at least one event is available when wait is true.
+
+static void dglDRMFBHandleEvents(dglDRMFB *dfb, bool wait) {
+	struct pollfd pfd;
+	pfd.fd = dfb->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	int r = poll(&pfd, 1, wait ? 1000 : 0);
+	if (r < 0 && errno != EINTR) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglDRMFB: poll failed\n");
+		return;
+	}
+	if (r <= 0)
+		return;
+	drmEventContext ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.version = 2;
+	ev.vblank_handler = dglDRMFBVBlankHandler;
+	ev.page_flip_handler = dglDRMFBPageFlipHandler;
+	drmHandleEvent(dfb->fd, &ev);
+}
+
+static void dglDRMFBWaitForPendingFlip(dglDRMFB *dfb) {
+	while (dfb->flip_pending)
+		dglDRMFBHandleEvents(dfb, true);
+}
+
+static uint32_t dglDRMFBAddFramebuffer(dglDRMFB *dfb, int y) {
+	uint32_t handles[4] = { dfb->handle, 0, 0, 0 };
+	uint32_t pitches[4] = { (uint32_t)dfb->stride, 0, 0, 0 };
+	uint32_t offsets[4] = { (uint32_t)(y * dfb->stride), 0, 0, 0 };
+	uint32_t fb_id;
+	if (drmModeAddFB2(dfb->fd, dfb->xres, dfb->yres, DRM_FORMAT_XRGB8888,
+	handles, pitches, offsets, &fb_id, 0) != 0)
+		return 0;
+	return fb_id;
+}
+
+// Return the KMS framebuffer that scans out from line y of the dumb buffer.
+// Framebuffers for page boundaries are created in advance, framebuffers for
+// other offsets (used when scrolling) are created on demand in one of two
+// slots, the slot that is not currently being displayed being recycled.
+
+static uint32_t dglDRMFBGetFramebufferID(dglDRMFB *dfb, int y) {
+	if (y % dfb->yres == 0)
+		return dfb->page_fb_id[y / dfb->yres];
+	for (int i = 0; i < 2; i++)
+		if (dfb->extra_fb_id[i] != 0 && dfb->extra_fb_y[i] == y)
+			return dfb->extra_fb_id[i];
+	int slot = (dfb->extra_fb_id[0] == dfb->displayed_fb_id) ? 1 : 0;
+	if (dfb->extra_fb_id[slot] != 0)
+		drmModeRmFB(dfb->fd, dfb->extra_fb_id[slot]);
+	dfb->extra_fb_id[slot] = dglDRMFBAddFramebuffer(dfb, y);
+	dfb->extra_fb_y[slot] = y;
+	return dfb->extra_fb_id[slot];
+}
+
+// Queue a page flip to line y without waiting. Returns false when a flip is
+// still pending or the flip failed; when line y is already displayed, no
+// flip is queued and flip_pending remains false.
+
+bool dglDRMFBRequestPageFlip(dglDRMFB *dfb, int y) {
+	if (dfb->flip_pending)
+		return false;
+	if (y < 0)
+		y = 0;
+	if (y > dfb->virtual_yres - dfb->yres)
+		y = dfb->virtual_yres - dfb->yres;
+	uint32_t fb_id = dglDRMFBGetFramebufferID(dfb, y);
+	if (fb_id == 0) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglDRMFBPanDisplay: Could not create framebuffer for offset %d\n", y);
+		return false;
+	}
+	if (fb_id == dfb->displayed_fb_id)
+		return true;
+	if (drmModePageFlip(dfb->fd, dfb->crtc_id, fb_id,
+	DRM_MODE_PAGE_FLIP_EVENT, dfb) != 0) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglDRMFBPanDisplay: Page flip failed\n");
+		return false;
+	}
+	dfb->pending_fb_id = fb_id;
+	dfb->flip_pending = true;
+	return true;
+}
+
+static void dglDRMFBPanDisplay(dglScreenFB *fb, int x, int y) {
+	dglDRMFB *dfb = (dglDRMFB *)fb;
+	// Only one flip can be queued at a time.
+	dglDRMFBWaitForPendingFlip(dfb);
+	dglDRMFBRequestPageFlip(dfb, y);
+}
+
+// Request an event for the next vertical blank without waiting for it.
+
+bool dglDRMFBRequestVBlankEvent(dglDRMFB *dfb) {
+	if (dfb->vblank_pending)
+		return true;
+	drmVBlank vbl;
+	memset(&vbl, 0, sizeof(vbl));
+	vbl.request.type = (drmVBlankSeqType)(DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT |
+		((dfb->crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK));
+	vbl.request.sequence = 1;
+	vbl.request.signal = (unsigned long)dfb;
+	if (drmWaitVBlank(dfb->fd, &vbl) != 0) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglDRMFBRequestVBlankEvent: drmWaitVBlank failed\n");
+		return false;
+	}
+	dfb->vblank_pending = true;
+	return true;
+}
+
+// Return the current vertical blank sequence number of the CRTC, or the
+// sequence of the last event when it cannot be queried.
+
+unsigned int dglDRMFBGetVBlankSequence(dglDRMFB *dfb) {
+	drmVBlank vbl;
+	memset(&vbl, 0, sizeof(vbl));
+	vbl.request.type = (drmVBlankSeqType)(DRM_VBLANK_RELATIVE |
+		((dfb->crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK));
+	vbl.request.sequence = 0;
+	if (drmWaitVBlank(dfb->fd, &vbl) != 0) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglDRMFBGetVBlankSequence: drmWaitVBlank failed\n");
+		return dfb->event_sequence;
+	}
+	return vbl.reply.sequence;
+}
+
+// Dispatch the events that are pending on the DRM file descriptor, waiting
+// for at least one when wait is true.
+
+void dglDRMFBDispatchEvents(dglDRMFB *dfb, bool wait) {
+	dglDRMFBHandleEvents(dfb, wait);
+}
+
+// Wait for the next vertical blank. When a page flip is pending, wait for
+// its completion instead (which happens at a vertical blank).
+
+static void dglDRMFBWaitVSync(dglScreenFB *fb) {
+	dglDRMFB *dfb = (dglDRMFB *)fb;
+	if (dfb->flip_pending) {
+		dglDRMFBWaitForPendingFlip(dfb);
+		return;
+	}
+	if (!dglDRMFBRequestVBlankEvent(dfb))
+		return;
+	while (dfb->vblank_pending)
+		dglDRMFBHandleEvents(dfb, true);
+}
+
+static void dglDRMFBCopyAreaNoOp(dglScreenFB *fb, int sx, int sy, int dx, int dy,
+int w, int h) {
+}
+
+// Find a connected connector, its preferred mode and a CRTC that can drive it.
+
+static bool dglDRMFBFindOutput(dglDRMFB *dfb, drmModeRes *res, drmModeModeInfo *mode) {
+	for (int i = 0; i < res->count_connectors; i++) {
+		drmModeConnector *conn = drmModeGetConnector(dfb->fd, res->connectors[i]);
+		if (conn == NULL)
+			continue;
+		if (conn->connection != DRM_MODE_CONNECTED || conn->count_modes == 0) {
+			drmModeFreeConnector(conn);
+			continue;
+		}
+		*mode = conn->modes[0];
+		for (int j = 0; j < conn->count_modes; j++)
+			if (conn->modes[j].type & DRM_MODE_TYPE_PREFERRED) {
+				*mode = conn->modes[j];
+				break;
+			}
+		uint32_t crtc_id = 0;
+		if (conn->encoder_id != 0) {
+			drmModeEncoder *enc = drmModeGetEncoder(dfb->fd, conn->encoder_id);
+			if (enc != NULL) {
+				crtc_id = enc->crtc_id;
+				drmModeFreeEncoder(enc);
+			}
+		}
+		for (int j = 0; j < conn->count_encoders && crtc_id == 0; j++) {
+			drmModeEncoder *enc = drmModeGetEncoder(dfb->fd, conn->encoders[j]);
+			if (enc == NULL)
+				continue;
+			for (int k = 0; k < res->count_crtcs; k++)
+				if (enc->possible_crtcs & (1 << k)) {
+					crtc_id = res->crtcs[k];
+					break;
+				}
+			drmModeFreeEncoder(enc);
+		}
+		if (crtc_id != 0) {
+			dfb->connector_id = conn->connector_id;
+			dfb->crtc_id = crtc_id;
+			for (int k = 0; k < res->count_crtcs; k++)
+				if (res->crtcs[k] == crtc_id)
+					dfb->crtc_index = k;
+			drmModeFreeConnector(conn);
+			return true;
+		}
+		drmModeFreeConnector(conn);
+	}
+	return false;
+}
+
+dglDRMFB *dglCreateDRMFramebuffer(const char *device, int nu_pages) {
+	if (device == NULL)
+		device = getenv("DGL_DRM_DEVICE");
+	if (device == NULL)
+		device = "/dev/dri/card0";
+	if (nu_pages < 1)
+		nu_pages = 1;
+	if (nu_pages > DGL_DRM_MAX_PAGES)
+		nu_pages = DGL_DRM_MAX_PAGES;
+
+	int fd = open(device, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglCreateDRMFramebuffer: Cannot open %s\n", device);
+		return NULL;
+	}
+	uint64_t has_dumb;
+	if (drmGetCap(fd, DRM_CAP_DUMB_BUFFER, &has_dumb) < 0 || !has_dumb) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglCreateDRMFramebuffer: %s does not support dumb buffers\n", device);
+		close(fd);
+		return NULL;
+	}
+	drmModeRes *res = drmModeGetResources(fd);
+	if (res == NULL) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglCreateDRMFramebuffer: "
+			"Could not get DRM resources (not a KMS device?)\n");
+		close(fd);
+		return NULL;
+	}
+	dglDRMFB *dfb = new dglDRMFB;
+	memset(dfb, 0, sizeof(dglDRMFB));
+	dfb->fd = fd;
+	drmModeModeInfo *mode = new drmModeModeInfo;
+	bool found = dglDRMFBFindOutput(dfb, res, mode);
+	drmModeFreeResources(res);
+	if (!found) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglCreateDRMFramebuffer: No connected output found\n");
+		delete mode;
+		delete dfb;
+		close(fd);
+		return NULL;
+	}
+	dfb->mode = mode;
+
+	// Create a dumb buffer holding all pages.
+	struct drm_mode_create_dumb create;
+	memset(&create, 0, sizeof(create));
+	create.width = mode->hdisplay;
+	create.height = mode->vdisplay * nu_pages;
+	create.bpp = 32;
+	if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglCreateDRMFramebuffer: Could not create dumb buffer\n");
+		delete mode;
+		delete dfb;
+		close(fd);
+		return NULL;
+	}
+	dfb->handle = create.handle;
+	dfb->format = DGL_FORMAT_XRGB8888;
+	dfb->bytes_per_pixel = 4;
+	dfb->xres = mode->hdisplay;
+	dfb->yres = mode->vdisplay;
+	dfb->stride = create.pitch;
+	dfb->total_size = create.size;
+	dfb->virtual_xres = dfb->xres;
+
+	for (int i = 0; i < nu_pages; i++) {
+		dfb->page_fb_id[i] = dglDRMFBAddFramebuffer(dfb, i * dfb->yres);
+		if (dfb->page_fb_id[i] == 0) {
+			if (i == 0) {
+				dglMessage(DGL_MESSAGE_WARNING, "dglCreateDRMFramebuffer: "
+					"Could not create KMS framebuffer\n");
+				dglDestroyDRMFramebuffer(dfb);
+				return NULL;
+			}
+			// The driver does not accept framebuffer offsets.
+			dglMessage(DGL_MESSAGE_WARNING, "dglCreateDRMFramebuffer: "
+				"Page flipping not supported, using %d page(s)\n", i);
+			nu_pages = i;
+			break;
+		}
+	}
+	dfb->nu_pages = nu_pages;
+	dfb->virtual_yres = dfb->yres * nu_pages;
+
+	struct drm_mode_map_dumb map;
+	memset(&map, 0, sizeof(map));
+	map.handle = dfb->handle;
+	if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglCreateDRMFramebuffer: Could not map dumb buffer\n");
+		dglDestroyDRMFramebuffer(dfb);
+		return NULL;
+	}
+	dfb->framebuffer_addr = (uint8_t *)mmap(0, dfb->total_size,
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, map.offset);
+	if (dfb->framebuffer_addr == MAP_FAILED) {
+		dfb->framebuffer_addr = NULL;
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglCreateDRMFramebuffer: Memory map failed\n");
+		dglDestroyDRMFramebuffer(dfb);
+		return NULL;
+	}
+	memset(dfb->framebuffer_addr, 0, dfb->total_size);
+
+	dfb->saved_crtc = drmModeGetCrtc(fd, dfb->crtc_id);
+	if (drmModeSetCrtc(fd, dfb->crtc_id, dfb->page_fb_id[0], 0, 0,
+	&dfb->connector_id, 1, mode) != 0) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglCreateDRMFramebuffer: "
+			"Could not set mode (DRM master required)\n");
+		dglDestroyDRMFramebuffer(dfb);
+		return NULL;
+	}
+	dfb->displayed_fb_id = dfb->page_fb_id[0];
+
+	// Dumb buffers are normally mapped write-combined.
+	int flags = DGL_FB_TYPE_DRM | DGL_FB_FLAG_WRITE_COMBINED |
+		DGL_FB_FLAG_HAVE_WAIT_VSYNC;
+	if (nu_pages > 1)
+		flags |= DGL_FB_FLAG_HAVE_PAN_DISPLAY;
+	dfb->flags = flags;
+	dfb->PanDisplayFunc = dglDRMFBPanDisplay;
+	dfb->WaitVSyncFunc = dglDRMFBWaitVSync;
+	dfb->CopyAreaFunc = dglDRMFBCopyAreaNoOp;
+	// Calibrate the frame-sized copy kernel before the first frame.
+	dglInitLargeCopy();
+
+	dglMessage(DGL_MESSAGE_INFO, "dglCreateDRMFramebuffer: "
+		"Succesfully created DRM framebuffer (%dx%d, %d pages) on %s\n",
+		dfb->xres, dfb->yres, nu_pages, device);
+	return dfb;
+}
+
+void dglDestroyDRMFramebuffer(dglDRMFB *dfb) {
+	dglDisableShadowFramebuffer(dfb);
+	dglDRMFBWaitForPendingFlip(dfb);
+	drmModeCrtc *saved_crtc = (drmModeCrtc *)dfb->saved_crtc;
+	if (saved_crtc != NULL) {
+		drmModeSetCrtc(dfb->fd, saved_crtc->crtc_id, saved_crtc->buffer_id,
+			saved_crtc->x, saved_crtc->y, &dfb->connector_id, 1,
+			&saved_crtc->mode);
+		drmModeFreeCrtc(saved_crtc);
+	}
+	if (dfb->framebuffer_addr != NULL)
+		munmap(dfb->framebuffer_addr, dfb->total_size);
+	for (int i = 0; i < DGL_DRM_MAX_PAGES; i++)
+		if (dfb->page_fb_id[i] != 0)
+			drmModeRmFB(dfb->fd, dfb->page_fb_id[i]);
+	for (int i = 0; i < 2; i++)
+		if (dfb->extra_fb_id[i] != 0)
+			drmModeRmFB(dfb->fd, dfb->extra_fb_id[i]);
+	struct drm_mode_destroy_dumb destroy;
+	memset(&destroy, 0, sizeof(destroy));
+	destroy.handle = dfb->handle;
+	drmIoctl(dfb->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	close(dfb->fd);
+	delete (drmModeModeInfo *)dfb->mode;
+	delete dfb;
+}
+
+#else
+
+dglDRMFB *dglCreateDRMFramebuffer(const char *device, int nu_pages) {
+	dglMessage(DGL_MESSAGE_WARNING, "dglCreateDRMFramebuffer: "
+		"DGL was compiled without DRM support (libdrm not installed)\n");
+	return NULL;
+}
+
+void dglDestroyDRMFramebuffer(dglDRMFB *dfb) {
+}
+
+bool dglDRMFBRequestPageFlip(dglDRMFB *dfb, int y) {
+	return false;
+}
+
+bool dglDRMFBRequestVBlankEvent(dglDRMFB *dfb) {
+	return false;
+}
+
+unsigned int dglDRMFBGetVBlankSequence(dglDRMFB *dfb) {
+	return 0;
+}
+
+void dglDRMFBDispatchEvents(dglDRMFB *dfb, bool wait) {
+}
+
+#endif
@@ -0,0 +1,212 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// Event loop integration with pollable vsync events.
+//
+// dglWaitVSync blocks the calling thread, which does not fit applications
+// built around poll/epoll. A vsync event source provides a file descriptor
+// that becomes readable at vertical blanks and page flip completions, so
+// that rendering, input and network I/O can share one loop. For the DRM
+// framebuffer this is the DRM file descriptor itself, with a vblank event
+// kept requested and page flips queued without waiting. For other screen
+// framebuffers an internal thread waits for vertical blanks (or sleeps
+// until the predicted one when WaitVSync is not available) and signals an
+// eventfd.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "dgl.h"
+
+// Refresh rate assumed when the framebuffer does not support WaitVSync.
+#define NOMINAL_REFRESH_RATE 60.0
+
+static bool dglIsDRMFramebuffer(dglScreenFB *fb) {
+	return (fb->flags & DGL_FB_TYPE_MASK) == DGL_FB_TYPE_DRM;
+}
+
+// The vsync thread only waits and signals; all framebuffer state is updated
+// by dglHandleVSyncEvents in the application's thread.
+
+static void *dglVSyncThreadMain(void *data) {
+	dglVSyncEvents *events = (dglVSyncEvents *)data;
+	dglScreenFB *fb = events->fb;
+	while (!__atomic_load_n(&events->stop, __ATOMIC_ACQUIRE)) {
+		// Number each wait before it starts. Only a vertical blank that
+		// ends a wait started after a display page request is known to
+		// display the requested page.
+		uint64_t sequence = events->wait_sequence + 1;
+		__atomic_store_n(&events->wait_sequence, sequence, __ATOMIC_SEQ_CST);
+		if (fb->flags & DGL_FB_FLAG_HAVE_WAIT_VSYNC)
+			fb->WaitVSyncFunc(fb);
+		else
+			dglSleepUntilNextNominalVSync(1.0 / NOMINAL_REFRESH_RATE);
+		__atomic_store_n(&events->vsync_time_ns, dglGetTimeNs(), __ATOMIC_RELAXED);
+		__atomic_store_n(&events->vsync_sequence, sequence, __ATOMIC_RELEASE);
+		uint64_t one = 1;
+		if (write(events->event_fd, &one, sizeof(one)) != sizeof(one))
+			dglMessage(DGL_MESSAGE_WARNING, "dglVSyncThread: eventfd write failed\n");
+	}
+	return NULL;
+}
+
+dglVSyncEvents *dglCreateVSyncEvents(dglScreenFB *fb) {
+	dglVSyncEvents *events = new dglVSyncEvents;
+	events->fb = fb;
+	events->event_fd = -1;
+	events->present_pending = false;
+	events->vsync_time_ns = 0;
+	events->wait_sequence = 0;
+	events->vsync_sequence = 0;
+	events->request_sequence = 0;
+	events->nu_vsyncs = 0;
+	events->last_sequence = 0;
+	events->stop = false;
+	events->thread = NULL;
+	if (dglIsDRMFramebuffer(fb)) {
+		dglDRMFB *dfb = (dglDRMFB *)fb;
+		events->fd = dfb->fd;
+		// Count vertical blanks from now, so that the first event does not
+		// report the absolute hardware counter on a fresh framebuffer.
+		events->last_sequence = dglDRMFBGetVBlankSequence(dfb);
+		if (!dglDRMFBRequestVBlankEvent(dfb)) {
+			delete events;
+			return NULL;
+		}
+		return events;
+	}
+	events->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (events->event_fd < 0) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglCreateVSyncEvents: eventfd failed\n");
+		delete events;
+		return NULL;
+	}
+	events->fd = events->event_fd;
+	pthread_t *thread = new pthread_t;
+	if (pthread_create(thread, NULL, dglVSyncThreadMain, events) != 0) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglCreateVSyncEvents: Could not create vsync thread\n");
+		delete thread;
+		close(events->event_fd);
+		delete events;
+		return NULL;
+	}
+	events->thread = thread;
+	return events;
+}
+
+void dglDestroyVSyncEvents(dglVSyncEvents *events) {
+	if (events->thread != NULL) {
+		// The thread exits after the next vertical blank.
+		__atomic_store_n(&events->stop, true, __ATOMIC_RELEASE);
+		pthread_t *thread = (pthread_t *)events->thread;
+		pthread_join(*thread, NULL);
+		delete thread;
+		close(events->event_fd);
+	}
+	else {
+		// Consume the outstanding DRM events.
+		dglDRMFB *dfb = (dglDRMFB *)events->fb;
+		while (dfb->vblank_pending || dfb->flip_pending)
+			dglDRMFBDispatchEvents(dfb, true);
+	}
+	delete events;
+}
+
+// Handle the pending events. Returns the number of vertical blanks since
+// the previous call (0 when the file descriptor was not readable).
+
+int dglHandleVSyncEvents(dglVSyncEvents *events) {
+	dglScreenFB *fb = events->fb;
+	int nu_vsyncs = 0;
+	if (dglIsDRMFramebuffer(fb)) {
+		dglDRMFB *dfb = (dglDRMFB *)fb;
+		dglDRMFBDispatchEvents(dfb, false);
+		nu_vsyncs = (int)(dfb->event_sequence - events->last_sequence);
+		events->last_sequence = dfb->event_sequence;
+		if (nu_vsyncs > 0)
+			events->vsync_time_ns = dfb->event_time_usec * 1000;
+		if (!dfb->vblank_pending)
+			dglDRMFBRequestVBlankEvent(dfb);
+		events->present_pending = dfb->flip_pending;
+	}
+	else {
+		uint64_t count;
+		if (read(events->event_fd, &count, sizeof(count)) == sizeof(count))
+			nu_vsyncs = (int)count;
+		// The page requested with PanDisplay is displayed from the end of
+		// the first wait that started after the request.
+		if (events->present_pending && __atomic_load_n(&events->vsync_sequence,
+		__ATOMIC_ACQUIRE) > events->request_sequence)
+			events->present_pending = false;
+	}
+	if (nu_vsyncs > 0) {
+		events->nu_vsyncs += nu_vsyncs;
+		// Update the displayed area during the vertical blanking period,
+		// like dglWaitVSync.
+		if (fb->flags & DGL_FB_FLAG_SHADOW)
+			dglFlushShadowFramebufferArea(fb, fb->display_yoffset, fb->yres);
+	}
+	return nu_vsyncs;
+}
+
+bool dglRequestDisplayPage(dglVSyncEvents *events, int page) {
+	if (events->present_pending)
+		return false;
+	dglScreenFB *fb = events->fb;
+	int y = page * fb->yres;
+	if (dglIsDRMFramebuffer(fb)) {
+		dglDRMFB *dfb = (dglDRMFB *)fb;
+		if (fb->flags & DGL_FB_FLAG_SHADOW)
+			dglFlushShadowFramebufferArea(fb, y, fb->yres);
+		if (!dglDRMFBRequestPageFlip(dfb, y))
+			return false;
+		fb->display_yoffset = y;
+		events->present_pending = dfb->flip_pending;
+		return true;
+	}
+	// Console PanDisplay requests take effect at the next vertical blank
+	// without waiting for it.
+	dglPanDisplay(fb, 0, y);
+	// The wait in progress may have started before the request.
+	events->request_sequence = __atomic_load_n(&events->wait_sequence, __ATOMIC_SEQ_CST);
+	events->present_pending = true;
+	return true;
+}
+
+// The events are handled before every poll, because a page flip completion
+// may already have been consumed (by dglWaitVSync on the DRM framebuffer).
+
+void dglWaitForDisplayPage(dglVSyncEvents *events) {
+	for (;;) {
+		dglHandleVSyncEvents(events);
+		if (!events->present_pending)
+			return;
+		struct pollfd pfd;
+		pfd.fd = events->fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		poll(&pfd, 1, 1000);
+	}
+}
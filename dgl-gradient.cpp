@@ -0,0 +1,483 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// Gradient and repeating pattern fills.
+//
+// Gradient colors are interpolated once into a lookup table of
+// DGL_GRADIENT_LUT_SIZE pixels in the destination format, so that filling
+// only has to find the table index of every pixel. For linear gradients the
+// index is a linear function of x along each row, which is stepped with a 16-bit
+// fraction; because it is monotonic, the row is filled as runs of
+// identical pixels using the fill functions, which reduces to a single fill
+// per row when the gradient is vertical. Horizontal gradients are generated
+// once and copied to every row. For radial gradients the squared
+// distance to the center is stepped incrementally, scaled to a fixed-point
+// fraction of the squared radius and mapped to a table index with a square
+// root lookup table, and the parts of a row outside the circle are filled
+// with the outer color.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "dgl.h"
+
+// Number of fractional bits of the lookup table index of linear gradients.
+#define INDEX_FRACTION_BITS 16
+#define INDEX_ONE (1 << INDEX_FRACTION_BITS)
+#define MAX_INDEX ((DGL_GRADIENT_LUT_SIZE - 1) << INDEX_FRACTION_BITS)
+// When the index of a linear gradient changes by more than this amount per
+// pixel, runs are too short to be worth finding.
+#define MAX_RUN_INDEX_STEP (INDEX_ONE / 4)
+// Number of entries of the square root table of radial gradients, indexed
+// by the squared distance as a fraction of the squared radius. The table is
+// shared by all radial gradients; 16 bits are needed for full precision
+// close to the center, where the square root is steep.
+#define SQRT_LUT_BITS 16
+#define SQRT_LUT_SIZE (1 << SQRT_LUT_BITS)
+// Tiles narrower than this number of bytes are repeated horizontally before
+// filling, so that rows are copied in reasonably large blocks.
+#define MIN_TILE_ROW_SIZE 256
+
+static uint8_t *sqrt_lut = NULL;
+static pthread_once_t sqrt_lut_once = PTHREAD_ONCE_INIT;
+
+static void dglInitGradientSqrtLUT() {
+	sqrt_lut = new uint8_t[SQRT_LUT_SIZE];
+	for (int i = 0; i < SQRT_LUT_SIZE; i++)
+		sqrt_lut[i] = (uint8_t)floorf(sqrtf((float)i / SQRT_LUT_SIZE) *
+			(DGL_GRADIENT_LUT_SIZE - 1) + 0.5f);
+}
+
+static dglGradient *dglCreateGradient(uint32_t format, int type, uint32_t color0,
+uint32_t color1) {
+	dglGradient *gradient = new dglGradient;
+	gradient->type = type;
+	gradient->format = format;
+	gradient->lut = new uint32_t[DGL_GRADIENT_LUT_SIZE];
+	const float position[2] = { 0, 1.0f };
+	const uint32_t color[2] = { color0, color1 };
+	dglSetGradientColorStops(gradient, 2, position, color);
+	return gradient;
+}
+
+dglGradient *dglCreateLinearGradient(uint32_t format, int x0, int y0, int x1, int y1,
+uint32_t color0, uint32_t color1) {
+	dglGradient *gradient = dglCreateGradient(format, DGL_GRADIENT_LINEAR, color0, color1);
+	gradient->x0 = x0;
+	gradient->y0 = y0;
+	gradient->x1 = x1;
+	gradient->y1 = y1;
+	gradient->radius = 0;
+	return gradient;
+}
+
+dglGradient *dglCreateRadialGradient(uint32_t format, int x, int y, int radius,
+uint32_t color0, uint32_t color1) {
+	dglGradient *gradient = dglCreateGradient(format, DGL_GRADIENT_RADIAL, color0, color1);
+	gradient->x0 = x;
+	gradient->y0 = y;
+	gradient->x1 = x;
+	gradient->y1 = y;
+	gradient->radius = radius < 1 ? 1 : radius;
+	pthread_once(&sqrt_lut_once, dglInitGradientSqrtLUT);
+	return gradient;
+}
+
+void dglSetGradientColorStops(dglGradient *gradient, int nu_stops, const float *position,
+const uint32_t *color) {
+	if (nu_stops < 1) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglSetGradientColorStops: At least one color stop is required\n");
+		return;
+	}
+	int stop = 0;
+	for (int i = 0; i < DGL_GRADIENT_LUT_SIZE; i++) {
+		float t = (float)i / (DGL_GRADIENT_LUT_SIZE - 1);
+		// Find the last stop at or before t.
+		while (stop + 1 < nu_stops && position[stop + 1] <= t)
+			stop++;
+		uint32_t c0 = color[stop];
+		uint32_t c1 = c0;
+		float f = 0;
+		if (stop + 1 < nu_stops && t > position[stop]) {
+			c1 = color[stop + 1];
+			f = (t - position[stop]) / (position[stop + 1] - position[stop]);
+		}
+		uint32_t rgb = 0;
+		for (int shift = 0; shift < 24; shift += 8) {
+			float v0 = (c0 >> shift) & 0xFF;
+			float v1 = (c1 >> shift) & 0xFF;
+			rgb |= (uint32_t)floorf(v0 + (v1 - v0) * f + 0.5f) << shift;
+		}
+		gradient->lut[i] = dglARGBToPixel(gradient->format, rgb | 0xFF000000);
+	}
+}
+
+void dglDestroyGradient(dglGradient *gradient) {
+	delete [] gradient->lut;
+	delete gradient;
+}
+
+// Clip a fill area to the context's clip rectangle. Returns false when
+// nothing remains to be drawn.
+
+DGL_INLINE_ONLY static bool dglClipFillArea(const dglContext *context, int& x, int& y,
+int& w, int& h) {
+	const dglClipRectangle *cr = &context->clip;
+	if (x < cr->x1) {
+		w -= cr->x1 - x;
+		x = cr->x1;
+	}
+	if (y < cr->y1) {
+		h -= cr->y1 - y;
+		y = cr->y1;
+	}
+	if (x + w > cr->x2)
+		w = cr->x2 - x;
+	if (y + h > cr->y2)
+		h = cr->y2 - y;
+	return w > 0 && h > 0;
+}
+
+DGL_INLINE_ONLY static void dglGradientFillSpan(uint8_t *dp, int bpp, uint32_t pixel, int n,
+bool streaming) {
+	if (bpp == 4) {
+		if (streaming)
+			dglStreamFill32(dp, pixel, n);
+		else
+			for (int i = 0; i < n; i++)
+				((uint32_t *)dp)[i] = pixel;
+	}
+	else {
+		if (streaming)
+			dglStreamFill16(dp, pixel, n);
+		else
+			for (int i = 0; i < n; i++)
+				((uint16_t *)dp)[i] = (uint16_t)pixel;
+	}
+}
+
+// Return the number of pixels, starting with the current one, that map to the
+// same lookup table entry, given a fixed-point index and its step per pixel.
+
+DGL_INLINE_ONLY static int dglGradientRunLength(int index, int step) {
+	int entry_start = (index >> INDEX_FRACTION_BITS) << INDEX_FRACTION_BITS;
+	if (step > 0)
+		return (entry_start + INDEX_ONE - index + step - 1) / step;
+	return (index - entry_start) / (- step) + 1;
+}
+
+// Fill a row of a linear gradient, given the fixed-point lookup table index
+// of the first pixel and its step per pixel. The parts of the row where the
+// index is outside the table are filled with the end colors, so that the
+// index can be stepped without clamping or overflow in between.
+
+static void dglFillLinearGradientRow(uint8_t *dp, int bpp, const dglGradient *gradient,
+int64_t row_index, int step, int w, bool streaming) {
+	const uint32_t *lut = gradient->lut;
+	uint32_t first_pixel = lut[0];
+	uint32_t last_pixel = lut[DGL_GRADIENT_LUT_SIZE - 1];
+	int64_t low = 0;
+	int64_t high = (DGL_GRADIENT_LUT_SIZE << INDEX_FRACTION_BITS) - 1;
+	if (step < 0) {
+		// Mirror the index so that it increases along the row.
+		row_index = high - row_index;
+		first_pixel = last_pixel;
+		last_pixel = lut[0];
+	}
+	int abs_step = step < 0 ? - step : step;
+	// Determine the range [i0, i1) of pixels inside the table.
+	int64_t i0 = 0;
+	int64_t i1 = w;
+	if (row_index < low)
+		i0 = abs_step == 0 ? w : (low - row_index + abs_step - 1) / abs_step;
+	if (row_index > high)
+		i1 = 0;
+	else if (abs_step != 0)
+		i1 = (high - row_index) / abs_step + 1;
+	if (i0 > w)
+		i0 = w;
+	if (i1 > w)
+		i1 = w;
+	if (i1 < i0)
+		i1 = i0;
+	if (i0 > 0)
+		dglGradientFillSpan(dp, bpp, first_pixel, i0, streaming);
+	if (i1 < w)
+		dglGradientFillSpan(dp + i1 * bpp, bpp, last_pixel, w - i1, streaming);
+	if (i0 == i1)
+		return;
+	int index = (int)(row_index + i0 * abs_step);
+	if (step < 0)
+		index = (int)high - index;
+	dp += i0 * bpp;
+	int n = i1 - i0;
+	if (abs_step >= MAX_RUN_INDEX_STEP) {
+		if (bpp == 4)
+			for (int i = 0; i < n; i++) {
+				((uint32_t *)dp)[i] = lut[index >> INDEX_FRACTION_BITS];
+				index += step;
+			}
+		else
+			for (int i = 0; i < n; i++) {
+				((uint16_t *)dp)[i] = lut[index >> INDEX_FRACTION_BITS];
+				index += step;
+			}
+		return;
+	}
+	if (step == 0) {
+		dglGradientFillSpan(dp, bpp, lut[index >> INDEX_FRACTION_BITS], n, streaming);
+		return;
+	}
+	while (n > 0) {
+		int k = dglGradientRunLength(index, step);
+		if (k > n)
+			k = n;
+		dglGradientFillSpan(dp, bpp, lut[index >> INDEX_FRACTION_BITS], k, streaming);
+		dp += k * bpp;
+		index += k * step;
+		n -= k;
+	}
+}
+
+static void dglFillLinearGradient(dglFB *fb, int x, int y, int w, int h, int page_y,
+const dglGradient *gradient, bool streaming) {
+	int bpp = fb->bytes_per_pixel;
+	int vx = gradient->x1 - gradient->x0;
+	int vy = gradient->y1 - gradient->y0;
+	int64_t length_sq = (int64_t)vx * vx + (int64_t)vy * vy;
+	uint8_t *dp = fb->framebuffer_addr + y * fb->stride + x * bpp;
+	if (length_sq == 0) {
+		// Degenerate gradient; use the end color.
+		for (; h > 0; h--) {
+			dglGradientFillSpan(dp, bpp, gradient->lut[DGL_GRADIENT_LUT_SIZE - 1],
+				w, streaming);
+			dp += fb->stride;
+		}
+		return;
+	}
+	// The index is the projection of a pixel onto the gradient vector, in
+	// units of lookup table entries with INDEX_FRACTION_BITS fraction bits.
+	// It is calculated exactly at the start of each row; the rounding error
+	// of the step accumulates to less than one entry along a row.
+	int64_t scale = (int64_t)MAX_INDEX;
+	int64_t step_numerator = vx * scale;
+	int step = (int)((step_numerator + (step_numerator < 0 ? - length_sq : length_sq) / 2) /
+		length_sq);
+	if (vy == 0 && h > 1) {
+		// All rows are the same; generate one row in system memory and
+		// copy it, avoiding reads from the framebuffer.
+		uint8_t *row = new uint8_t[w * bpp];
+		dglFillLinearGradientRow(row, bpp, gradient, (int64_t)(x - gradient->x0) * vx *
+			scale / length_sq + INDEX_ONE / 2, step, w, false);
+		for (; h > 0; h--) {
+			if (streaming)
+				dglStreamCopy(dp, row, w * bpp);
+			else
+				memcpy(dp, row, w * bpp);
+			dp += fb->stride;
+		}
+		delete [] row;
+		return;
+	}
+	for (int j = 0; j < h; j++) {
+		int64_t dot = (int64_t)(x - gradient->x0) * vx +
+			(int64_t)(page_y + j - gradient->y0) * vy;
+		// Round to the nearest table entry.
+		dglFillLinearGradientRow(dp, bpp, gradient, dot * scale / length_sq + INDEX_ONE / 2,
+			step, w, streaming);
+		dp += fb->stride;
+	}
+}
+
+static void dglFillRadialGradient(dglFB *fb, int x, int y, int w, int h, int page_y,
+const dglGradient *gradient, bool streaming) {
+	int bpp = fb->bytes_per_pixel;
+	uint32_t outer_pixel = gradient->lut[DGL_GRADIENT_LUT_SIZE - 1];
+	int64_t radius_sq = (int64_t)gradient->radius * gradient->radius;
+	// Multiplier that scales a squared distance to a square root table index
+	// with 32 fraction bits.
+	uint64_t scale = ((uint64_t)SQRT_LUT_SIZE << 32) / radius_sq;
+	uint8_t *dp = fb->framebuffer_addr + y * fb->stride + x * bpp;
+	for (int j = 0; j < h; j++, dp += fb->stride) {
+		int64_t dy = page_y + j - gradient->y0;
+		int64_t remaining_sq = radius_sq - dy * dy;
+		if (remaining_sq <= 0) {
+			dglGradientFillSpan(dp, bpp, outer_pixel, w, streaming);
+			continue;
+		}
+		// Determine the part of the row inside the circle.
+		int half_width = (int)sqrtf((float)remaining_sq);
+		while ((int64_t)(half_width + 1) * (half_width + 1) < remaining_sq)
+			half_width++;
+		while (half_width > 0 && (int64_t)half_width * half_width >= remaining_sq)
+			half_width--;
+		int inside_x1 = gradient->x0 - half_width - x;
+		int inside_x2 = gradient->x0 + half_width + 1 - x;
+		if (inside_x1 < 0)
+			inside_x1 = 0;
+		if (inside_x2 > w)
+			inside_x2 = w;
+		if (inside_x1 >= inside_x2) {
+			dglGradientFillSpan(dp, bpp, outer_pixel, w, streaming);
+			continue;
+		}
+		if (inside_x1 > 0)
+			dglGradientFillSpan(dp, bpp, outer_pixel, inside_x1, streaming);
+		if (inside_x2 < w)
+			dglGradientFillSpan(dp + inside_x2 * bpp, bpp, outer_pixel,
+				w - inside_x2, streaming);
+		// Step the squared distance incrementally; within the circle it
+		// is smaller than the squared radius.
+		int dx = x + inside_x1 - gradient->x0;
+		uint32_t distance_sq = (uint32_t)(dx * dx + dy * dy);
+		const uint32_t *lut = gradient->lut;
+		if (bpp == 4) {
+			uint32_t *p = (uint32_t *)dp;
+			for (int i = inside_x1; i < inside_x2; i++) {
+				p[i] = lut[sqrt_lut[(distance_sq * scale) >> 32]];
+				distance_sq += 2 * dx + 1;
+				dx++;
+			}
+		}
+		else {
+			uint16_t *p = (uint16_t *)dp;
+			for (int i = inside_x1; i < inside_x2; i++) {
+				p[i] = lut[sqrt_lut[(distance_sq * scale) >> 32]];
+				distance_sq += 2 * dx + 1;
+				dx++;
+			}
+		}
+	}
+}
+
+void dglFillGradient(dglContext *context, int x, int y, int w, int h,
+dglGradient *gradient) {
+	if (w <= 0 || h <= 0)
+		return;
+	if (context->clip_enabled && !dglClipFillArea(context, x, y, w, h))
+		return;
+	if (context->occlusion) {
+		dglOcclusionOp *op = dglAddOcclusionOp(context->occlusion,
+			DGL_OCCLUSION_OP_GRADIENT, x, y, w, h);
+		op->gradient = gradient;
+		return;
+	}
+	dglFB *fb;
+	DGL_GET_DRAW_FB(context, fb);
+	if (fb->format != gradient->format) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglFillGradient: Gradient pixel format "
+			"does not match framebuffer\n");
+		return;
+	}
+	bool streaming = (fb->flags & DGL_FB_FLAG_WRITE_COMBINED) != 0;
+	int page_y = y;
+	y += context->draw_yoffset;
+	if (gradient->type == DGL_GRADIENT_LINEAR)
+		dglFillLinearGradient(fb, x, y, w, h, page_y, gradient, streaming);
+	else
+		dglFillRadialGradient(fb, x, y, w, h, page_y, gradient, streaming);
+	if (fb->damage)
+		dglAddDamage(fb->damage, x, y, w, h);
+}
+
+// Pattern fills.
+
+// Copy part of a tile row to the destination.
+
+DGL_INLINE_ONLY static void dglPatternCopy(uint8_t *dp, const uint8_t *sp, int size,
+bool streaming) {
+	if (streaming)
+		dglStreamCopy(dp, sp, size);
+	else
+		memcpy(dp, sp, size);
+}
+
+void dglFillPattern(dglContext *context, int x, int y, int w, int h, dglImage *tile,
+int origin_x, int origin_y) {
+	if (w <= 0 || h <= 0)
+		return;
+	if (context->clip_enabled && !dglClipFillArea(context, x, y, w, h))
+		return;
+	if (context->occlusion) {
+		dglOcclusionOp *op = dglAddOcclusionOp(context->occlusion,
+			DGL_OCCLUSION_OP_PATTERN, x, y, w, h);
+		op->sx = origin_x;
+		op->sy = origin_y;
+		op->image = tile;
+		return;
+	}
+	dglFB *fb;
+	DGL_GET_DRAW_FB(context, fb);
+	int bpp = fb->bytes_per_pixel;
+	if (tile->bytes_per_pixel != bpp) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglFillPattern: Tile pixel size does not "
+			"match framebuffer\n");
+		return;
+	}
+	// Repeat narrow tiles horizontally.
+	int tile_w = tile->xres;
+	int tile_stride = tile->stride;
+	const uint8_t *tile_pixels = tile->framebuffer_addr;
+	uint8_t *wide_tile = NULL;
+	if (tile_w * bpp < MIN_TILE_ROW_SIZE && tile_w < w) {
+		int repeat = (MIN_TILE_ROW_SIZE + tile_w * bpp - 1) / (tile_w * bpp);
+		int row_size = tile_w * bpp;
+		tile_stride = row_size * repeat;
+		wide_tile = new uint8_t[tile_stride * tile->yres];
+		for (int j = 0; j < tile->yres; j++)
+			for (int i = 0; i < repeat; i++)
+				memcpy(wide_tile + j * tile_stride + i * row_size,
+					tile->framebuffer_addr + j * tile->stride, row_size);
+		tile_w *= repeat;
+		tile_pixels = wide_tile;
+	}
+	bool streaming = (fb->flags & DGL_FB_FLAG_WRITE_COMBINED) != 0;
+	int tx0 = (x - origin_x) % tile_w;
+	if (tx0 < 0)
+		tx0 += tile_w;
+	int ty = (y - origin_y) % tile->yres;
+	if (ty < 0)
+		ty += tile->yres;
+	y += context->draw_yoffset;
+	uint8_t *dp = fb->framebuffer_addr + y * fb->stride + x * bpp;
+	for (int j = 0; j < h; j++) {
+		const uint8_t *sp = tile_pixels + ty * tile_stride;
+		int n = tile_w - tx0;
+		if (n > w)
+			n = w;
+		dglPatternCopy(dp, sp + tx0 * bpp, n * bpp, streaming);
+		for (int i = n; i < w; i += tile_w) {
+			n = w - i;
+			if (n > tile_w)
+				n = tile_w;
+			dglPatternCopy(dp + i * bpp, sp, n * bpp, streaming);
+		}
+		dp += fb->stride;
+		ty++;
+		if (ty == tile->yres)
+			ty = 0;
+	}
+	delete [] wide_tile;
+	if (fb->damage)
+		dglAddDamage(fb->damage, x, y, w, h);
+}
@@ -23,11 +23,13 @@ OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <math.h>
 #include <signal.h>
 #include <linux/fb.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <time.h>
 #ifdef DGL_USE_PIXMAN
 #include <pixman.h>
 #endif
@@ -37,13 +39,16 @@ OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 // General functions.
 
+// The debug message level may be changed and read from multiple threads.
 static int dgl_internal_debug_message_level = DGL_MESSAGE_INFO;
 
 void dglMessage(int priority, const char *format, ...) {
-	if (priority > dgl_internal_debug_message_level)
+	if (priority > __atomic_load_n(&dgl_internal_debug_message_level, __ATOMIC_RELAXED))
 		return;
 	va_list args;
 	va_start(args, format);
+	// Keep the message together when multiple threads print messages.
+	flockfile(stdout);
 	printf("dgl: ");
 	if (priority == DGL_MESSAGE_WARNING)
 		printf("WARNING: ");
@@ -53,12 +58,42 @@ void dglMessage(int priority, const char *format, ...) {
 	va_end(args);
 	if (priority <= DGL_MESSAGE_WARNING)
 		fflush(stdout);
+	funlockfile(stdout);
 	if (priority == DGL_MESSAGE_FATAL_ERROR)
 		raise(SIGABRT);
 }
 
 void dglSetDebugMessageLevel(int level) {
-	dgl_internal_debug_message_level = level;
+	__atomic_store_n(&dgl_internal_debug_message_level, level, __ATOMIC_RELAXED);
+}
+
+// Time functions, all based on CLOCK_MONOTONIC.
+
+double dglGetTime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 0.000000001;
+}
+
+uint64_t dglGetTimeNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void dglSleepUntil(double t) {
+	struct timespec ts;
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1000000000.0);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+// Without a real vertical blank, vertical blanks are taken to occur at
+// multiples of the refresh period.
+
+void dglSleepUntilNextNominalVSync(double refresh_period) {
+	double now = dglGetTime();
+	dglSleepUntil((floor(now / refresh_period) + 1.0) * refresh_period);
 }
 
 // Pixmap framebuffer.
@@ -73,19 +108,46 @@ dglFB *dglCreatePixmapFB(uint32_t format, int w, int h) {
 	fb->total_size = h * fb->stride;
 	fb->framebuffer_addr = new uint8_t[h * fb->stride];
 	fb->flags = DGL_FB_TYPE_PIXMAP;
+	fb->damage = NULL;
 	return fb;
 }
 
 void dglDestroyPixmapFB(dglFB *fb) {
-	delete fb->framebuffer_addr;
+	delete [] fb->framebuffer_addr;
 	delete fb;
 }
 
 // Screen framebuffer
 
 void dglPanDisplay(dglScreenFB *fb, int x, int y) {
-	if (fb->flags & DGL_FB_FLAG_HAVE_PAN_DISPLAY)
+	// Make sure the area that is about to be displayed is up-to-date.
+	if (fb->flags & DGL_FB_FLAG_SHADOW)
+		dglFlushShadowFramebufferArea(fb, y, fb->yres);
+	if (fb->flags & DGL_FB_FLAG_HAVE_PAN_DISPLAY) {
+		uint64_t t0 = dglGetTimeNs();
 		fb->PanDisplayFunc(fb, x, y);
+		uint64_t ns = dglGetTimeNs() - t0;
+		fb->display_yoffset = y;
+		fb->nu_pan_display_calls++;
+		fb->pan_display_time_total_ns += ns;
+		if (ns > fb->pan_display_time_max_ns)
+			fb->pan_display_time_max_ns = ns;
+	}
+}
+
+void dglGetPanDisplayStats(dglScreenFB *fb, dglPanDisplayStats *stats) {
+	stats->count = fb->nu_pan_display_calls;
+	stats->mean_latency = 0;
+	if (fb->nu_pan_display_calls > 0)
+		stats->mean_latency = fb->pan_display_time_total_ns * 0.000000001 /
+			fb->nu_pan_display_calls;
+	stats->max_latency = fb->pan_display_time_max_ns * 0.000000001;
+}
+
+void dglResetPanDisplayStats(dglScreenFB *fb) {
+	fb->nu_pan_display_calls = 0;
+	fb->pan_display_time_total_ns = 0;
+	fb->pan_display_time_max_ns = 0;
 }
 
 void dglSetDisplayPage(dglScreenFB *fb, int page) {
@@ -95,6 +157,9 @@ void dglSetDisplayPage(dglScreenFB *fb, int page) {
 void dglWaitVSync(dglScreenFB *fb) {
 	if (fb->flags & DGL_FB_FLAG_HAVE_WAIT_VSYNC)
 		fb->WaitVSyncFunc(fb);
+	// Update the displayed area during the vertical blanking period.
+	if (fb->flags & DGL_FB_FLAG_SHADOW)
+		dglFlushShadowFramebufferArea(fb, fb->display_yoffset, fb->yres);
 }
 
 DGL_INLINE_ONLY static void dglCopyArea(dglScreenFB *fb, int sx, int sy, int dx, int dy, int w, int h) {
@@ -110,6 +175,9 @@ dglContext *dglCreateContext(dglFB *read_fb, dglFB *draw_fb) {
 	context->draw_fb = draw_fb;
 	context->read_yoffset = 0;
 	context->draw_yoffset = 0;
+	context->clip_enabled = false;
+	context->occlusion = NULL;
+	context->tracer = NULL;
 	return context;
 }
 
@@ -122,9 +190,24 @@ void dglSetReadFramebuffer(dglContext *context, dglFB *fb) {
 }
 
 void dglSetDrawFramebuffer(dglContext *context, dglFB *fb) {
+	if (context->occlusion)
+		dglFlushOcclusion(context);
 	context->draw_fb = fb;
 }
 
+// Restrict drawing with the context to the rectangle from (x1, y1) to
+// (x2 - 1, y2 - 1) of the draw page. Render threads drawing into the same
+// framebuffer can each use a context with a disjoint clip rectangle.
+
+void dglSetContextClipRectangle(dglContext *context, int x1, int y1, int x2, int y2) {
+	dglSetClipRectangle(x1, y1, x2, y2, context->clip);
+	context->clip_enabled = true;
+}
+
+void dglDisableContextClipping(dglContext *context) {
+	context->clip_enabled = false;
+}
+
 // Image handling.
 
 dglImage *dglCreateImageFromBuffer(uint32_t format, int w, int h, uint8_t *buffer) {
@@ -137,6 +220,7 @@ dglImage *dglCreateImageFromBuffer(uint32_t format, int w, int h, uint8_t *buffe
 	image->stride = w * image->bytes_per_pixel;
 	image->total_size = h * image->stride;
 	image->flags = DGL_FB_TYPE_IMAGE;
+	image->damage = NULL;
 	return image;
 }
 
@@ -152,7 +236,46 @@ void dglDestroyImage(dglImage *image) {
 
 // Generic drawing functions.
 
+// Clip a destination area to the context's clip rectangle, adjusting the
+// source coordinates by the same amount. Returns false when nothing remains
+// to be drawn.
+
+DGL_INLINE_ONLY static bool dglClipDrawArea(const dglContext *context, int& sx, int& sy,
+int& dx, int& dy, int& w, int& h) {
+	const dglClipRectangle *cr = &context->clip;
+	if (dx < cr->x1) {
+		w -= cr->x1 - dx;
+		sx += cr->x1 - dx;
+		dx = cr->x1;
+	}
+	if (dy < cr->y1) {
+		h -= cr->y1 - dy;
+		sy += cr->y1 - dy;
+		dy = cr->y1;
+	}
+	if (dx + w > cr->x2)
+		w = cr->x2 - dx;
+	if (dy + h > cr->y2)
+		h = cr->y2 - dy;
+	return w > 0 && h > 0;
+}
+
+// Record the area written by a drawing function when damage tracking is
+// enabled for the framebuffer.
+
+DGL_INLINE_ONLY static void dglAddDrawDamage(dglFB *fb, int x, int y, int w, int h) {
+	if (fb->damage)
+		dglAddDamage(fb->damage, x, y, w, h);
+}
+
 void dglPutPixel(dglContext *context, int x, int y, uint32_t pixel) {
+	if (context->tracer)
+		dglTracePutPixel(context, x, y, pixel);
+	if (context->occlusion)
+		dglFlushOcclusion(context);
+	if (context->clip_enabled && (x < context->clip.x1 || x >= context->clip.x2 ||
+	y < context->clip.y1 || y >= context->clip.y2))
+		return;
 	y += context->draw_yoffset;
 	dglFB *fb;
 	DGL_GET_DRAW_FB(context, fb);
@@ -162,6 +285,8 @@ void dglPutPixel(dglContext *context, int x, int y, uint32_t pixel) {
 		*((uint32_t *)dp) = pixel;
 	else
 		*((uint16_t *)dp) = pixel;
+	if (fb->damage)
+		dglAddDamagePixel(fb->damage, x, y);
 }
 
 // Uncomplicated region copy within the same framebuffer. Detects whether
@@ -174,8 +299,8 @@ static void dglCopyAreaSimple(dglFB *fb, int sx, int sy, int dx, int dy, int w,
 		dx * fb->bytes_per_pixel;
 	int stride = fb->stride;
 	if (w * fb->bytes_per_pixel == fb->stride && (dy < sy || dy >= sy + h)) {
-		// Contiguous area.
-		memcpy(dp, sp, fb->stride * h);
+		// Contiguous area, which may overlap when dy < sy.
+		memmove(dp, sp, fb->stride * h);
 		return;
 	}
 	if (dy > sy) {
@@ -184,8 +309,13 @@ static void dglCopyAreaSimple(dglFB *fb, int sx, int sy, int dx, int dy, int w,
 		sp += (h - 1) * fb->stride;
 		dp += (h - 1) * fb->stride;
 	}
+	if (dy != sy) {
+		dglCopyRows(dp, stride, sp, stride, w * fb->bytes_per_pixel, h);
+		return;
+	}
+	// Rows overlap when dy == sy.
 	while (h > 0) {
-		memcpy(dp, sp, w * fb->bytes_per_pixel);
+		memmove(dp, sp, w * fb->bytes_per_pixel);
 		sp += stride;
 		dp += stride;
 		h--;
@@ -202,8 +332,8 @@ static void dglCopyAreaDifficult(dglFB *fb, int sx, int sy, int dx, int dy, int
 		dx * fb->bytes_per_pixel;
 	int stride = fb->stride;
 	if (w * fb->bytes_per_pixel == fb->stride && (dy < sy || dy >= sy + h)) {
-		// Contiguous area.
-		memcpy(dp, sp, fb->stride * h);
+		// Contiguous area, which may overlap when dy < sy.
+		memmove(dp, sp, fb->stride * h);
 		return;
 	}
 	if (dy > sy) {
@@ -223,65 +353,173 @@ static void dglCopyAreaDifficult(dglFB *fb, int sx, int sy, int dx, int dy, int
 	delete [] scratch_buffer;
 }
 
-// Copy area across different framebuffers, same pixel format.
+#ifdef DGL_USE_PIXMAN
 
-#ifndef DGL_USE_PIXMAN
+// Copy area using pixman library blit function. 
+
+DGL_INLINE_ONLY static void dglCopyAreaBasicPixman(dglFB *read_fb, dglFB *draw_fb, int sx, int sy,
+int dx, int dy, int w, int h) {
+	pixman_blt(
+		(uint32_t *)read_fb->framebuffer_addr,
+		(uint32_t *)draw_fb->framebuffer_addr,
+		read_fb->stride / 4, draw_fb->stride / 4,
+		read_fb->bytes_per_pixel * 8, draw_fb->bytes_per_pixel * 8,
+		sx, sy, dx, dy, w, h);
+}
+
+#endif
+
+// Copy area across different framebuffers, same pixel format. With pixman,
+// pixman is used except for frame-sized copies, which use the prefetching
+// large copy kernel.
 
 static void dglCopyAreaAcross(dglFB *read_fb, dglFB *draw_fb, int sx, int sy,
 int dx, int dy, int w, int h) {
+#ifdef DGL_USE_PIXMAN
+	if (w * h * draw_fb->bytes_per_pixel < DGL_LARGE_COPY_THRESHOLD) {
+		dglCopyAreaBasicPixman(read_fb, draw_fb, sx, sy, dx, dy, w, h);
+		return;
+	}
+#endif
 	uint8_t *sp = read_fb->framebuffer_addr + sy * read_fb->stride +
 		sx * draw_fb->bytes_per_pixel;
 	uint8_t *dp = draw_fb->framebuffer_addr + dy * draw_fb->stride +
 		dx * draw_fb->bytes_per_pixel;
-	if (w * draw_fb->bytes_per_pixel == read_fb->stride &&
-	read_fb->stride == draw_fb->stride) {
-		// Contiguous area.
-		memcpy(dp, sp, draw_fb->stride * h);
+	dglCopyRows(dp, draw_fb->stride, sp, read_fb->stride, w * draw_fb->bytes_per_pixel, h);
+}
+
+// Copy area to a write-combined framebuffer. The destination is only written
+// sequentially with streaming stores. When the source is also write-combined
+// (which includes copies within the same framebuffer), rows are first read
+// in bulk into a cached bounce buffer, so that reads and writes to uncached
+// memory are not interleaved. Because a chunk of rows is completely read
+// before it is written, overlapping copies are handled as long as chunks are
+// processed in the right vertical order.
+
+#define WRITE_COMBINED_BOUNCE_BUFFER_SIZE 32768
+
+static void dglCopyAreaWriteCombined(dglFB *read_fb, dglFB *draw_fb, int sx, int sy,
+int dx, int dy, int w, int h) {
+	int row_size = w * draw_fb->bytes_per_pixel;
+	uint8_t *sp = read_fb->framebuffer_addr + sy * read_fb->stride +
+		sx * read_fb->bytes_per_pixel;
+	uint8_t *dp = draw_fb->framebuffer_addr + dy * draw_fb->stride +
+		dx * draw_fb->bytes_per_pixel;
+	if ((read_fb->flags & DGL_FB_FLAG_WRITE_COMBINED) == 0) {
+		if (row_size * h >= DGL_LARGE_COPY_THRESHOLD) {
+			dglCopyRowsLarge(dp, draw_fb->stride, sp, read_fb->stride, row_size, h, true);
+			return;
+		}
+		for (int i = 0; i < h; i++) {
+			dglStreamCopy(dp, sp, row_size);
+			sp += read_fb->stride;
+			dp += draw_fb->stride;
+		}
 		return;
 	}
-	while (h > 0) {
-		memcpy(dp, sp, w * draw_fb->bytes_per_pixel);
-		sp += read_fb->stride;
-		dp += draw_fb->stride;
-		h--;
+	int chunk_rows = WRITE_COMBINED_BOUNCE_BUFFER_SIZE / row_size;
+	if (chunk_rows < 1)
+		chunk_rows = 1;
+	if (chunk_rows > h)
+		chunk_rows = h;
+	uint8_t *bounce_buffer = new uint8_t[chunk_rows * row_size];
+	bool bottom_to_top = (read_fb == draw_fb && dy > sy);
+	int y = 0;
+	while (y < h) {
+		int n = h - y;
+		if (n > chunk_rows)
+			n = chunk_rows;
+		int first_row = y;
+		if (bottom_to_top)
+			first_row = h - y - n;
+		uint8_t *chunk_sp = sp + first_row * read_fb->stride;
+		uint8_t *chunk_dp = dp + first_row * draw_fb->stride;
+		dglCopyRows(bounce_buffer, row_size, chunk_sp, read_fb->stride, row_size, n);
+		for (int i = 0; i < n; i++)
+			dglStreamCopy(chunk_dp + i * draw_fb->stride,
+				bounce_buffer + i * row_size, row_size);
+		y += n;
 	}
+	delete [] bounce_buffer;
 }
 
-#endif
+// Pixel formats that differ in more than the meaning of the high byte of a
+// 32-bit pixel require conversion when copying.
 
-#ifdef DGL_USE_PIXMAN
+DGL_INLINE_ONLY static bool dglFormatsNeedConversion(uint32_t format1, uint32_t format2) {
+	return ((format1 ^ format2) & ~DGL_FORMAT_ALPHA_BIT) != 0;
+}
 
-// Copy area using pixman library blit function. 
+// Size of the stack buffer that pixels for a write-combined destination are
+// converted into.
+#define CONVERT_BUFFER_SIZE 4096
 
-DGL_INLINE_ONLY static void dglCopyAreaBasicPixman(dglFB *read_fb, dglFB *draw_fb, int sx, int sy,
+// Copy area between framebuffers of different pixel formats, converting the
+// pixels. A write-combined destination is written with streaming stores from
+// a cached stack buffer, converting each row in chunks that fit into it.
+
+static void dglCopyAreaConvert(dglFB *read_fb, dglFB *draw_fb, int sx, int sy,
 int dx, int dy, int w, int h) {
-	pixman_blt(
-		(uint32_t *)read_fb->framebuffer_addr,
-		(uint32_t *)draw_fb->framebuffer_addr,
-		read_fb->stride / 4, draw_fb->stride / 4,
-		read_fb->bytes_per_pixel * 8, draw_fb->bytes_per_pixel * 8,
-		sx, sy, dx, dy, w, h);
+	const uint8_t *sp = read_fb->framebuffer_addr + sy * read_fb->stride +
+		sx * read_fb->bytes_per_pixel;
+	uint8_t *dp = draw_fb->framebuffer_addr + dy * draw_fb->stride +
+		dx * draw_fb->bytes_per_pixel;
+	if ((draw_fb->flags & DGL_FB_FLAG_WRITE_COMBINED) == 0) {
+		dglConvertRows(draw_fb->format, dp, draw_fb->stride, read_fb->format, sp,
+			read_fb->stride, w, h, 0);
+		return;
+	}
+	uint8_t buffer[CONVERT_BUFFER_SIZE];
+	int chunk_pixels = CONVERT_BUFFER_SIZE / draw_fb->bytes_per_pixel;
+	for (int i = 0; i < h; i++) {
+		for (int x = 0; x < w; x += chunk_pixels) {
+			int n = w - x;
+			if (n > chunk_pixels)
+				n = chunk_pixels;
+			int size = n * draw_fb->bytes_per_pixel;
+			dglConvertRows(draw_fb->format, buffer, size, read_fb->format,
+				sp + x * read_fb->bytes_per_pixel, read_fb->stride, n, 1, 0);
+			dglStreamCopy(dp + x * draw_fb->bytes_per_pixel, buffer, size);
+		}
+		sp += read_fb->stride;
+		dp += draw_fb->stride;
+	}
 }
 
-#endif
-
 #define HORIZONTAL_BLT_PIXEL_MARGIN 0
 
 void dglCopyArea(dglContext *context, int sx, int sy, int dx, int dy, int w, int h) {
 	if (w <= 0 || h <= 0)
 		return;
+	if (context->tracer)
+		dglTraceCopyArea(context, sx, sy, dx, dy, w, h);
+	if (context->occlusion)
+		dglFlushOcclusion(context);
+	if (context->clip_enabled && !dglClipDrawArea(context, sx, sy, dx, dy, w, h))
+		return;
 	sy += context->read_yoffset;
 	dy += context->draw_yoffset;
 
 	dglFB *read_fb, *draw_fb;
 	DGL_GET_READ_FB(context, read_fb);
 	DGL_GET_DRAW_FB(context, draw_fb);
+	dglAddDrawDamage(draw_fb, dx, dy, w, h);
 	// Check whether the read and draw framebuffers are the same.
 	if (read_fb == draw_fb) {
 		// If the framebuffer supports accelerated copy area blits, use that,
+		// unless calibration found the CPU path to be faster for this size.
 		if (draw_fb->flags & DGL_FB_FLAG_HAVE_COPY_AREA) {
 			dglScreenFB *fb = (dglScreenFB *)draw_fb;
-			dglCopyArea(fb, sx, sy, dx, dy, w, h);
+			dglCopyCalibration *calibration = fb->copy_calibration;
+			if (calibration == NULL ||
+			calibration->use_dma[dglGetCopySizeClass(calibration, w, h)]) {
+				dglCopyArea(fb, sx, sy, dx, dy, w, h);
+				return;
+			}
+		}
+		// Avoid interleaved reads and writes to uncached memory.
+		if (draw_fb->flags & DGL_FB_FLAG_WRITE_COMBINED) {
+			dglCopyAreaWriteCombined(read_fb, draw_fb, sx, sy, dx, dy, w, h);
 			return;
 		}
 
@@ -307,41 +545,64 @@ void dglCopyArea(dglContext *context, int sx, int sy, int dx, int dy, int w, int
 			return;
 		}
 		dglCopyAreaDifficult(draw_fb, sx, sy, dx, dy, w, h);
-		dglMessage(DGL_MESSAGE_WARNING,
-			"dglCopyArea: Difficult software blit not yet supported.\n");
 		return;
 	}
 
-	if (read_fb->bytes_per_pixel == draw_fb->bytes_per_pixel)
-#ifdef DGL_USE_PIXMAN
-		dglCopyAreaBasicPixman(read_fb, draw_fb, sx, sy, dx, dy, w, h);
-#else
-		dglCopyAreaAcross(read_fb, draw_fb, sx, sy, dx, dy, w, h);
-#endif
+	if (dglFormatsNeedConversion(read_fb->format, draw_fb->format))
+		dglCopyAreaConvert(read_fb, draw_fb, sx, sy, dx, dy, w, h);
+	else if (draw_fb->flags & DGL_FB_FLAG_WRITE_COMBINED)
+		dglCopyAreaWriteCombined(read_fb, draw_fb, sx, sy, dx, dy, w, h);
 	else
-		dglMessage(DGL_MESSAGE_WARNING,
-			"dglCopyArea: Read and draw framebuffers differ in format.\n");
+		dglCopyAreaAcross(read_fb, draw_fb, sx, sy, dx, dy, w, h);
 }
 
 void dglPutImage(dglContext *context, int x, int y, dglImage *image) {
+	if (context->clip_enabled || context->occlusion || context->tracer) {
+		dglPutPartialImage(context, 0, 0, x, y, image->xres, image->yres, image);
+		return;
+	}
 	dglFB *fb;
 	DGL_GET_DRAW_FB(context, fb);
-#ifdef DGL_USE_PIXMAN
-	dglCopyAreaBasicPixman(image, fb, 0, 0, x, y, image->xres, image->yres);
-#else
+	y += context->draw_yoffset;
+	dglAddDrawDamage(fb, x, y, image->xres, image->yres);
+	if (dglFormatsNeedConversion(image->format, fb->format)) {
+		dglCopyAreaConvert(image, fb, 0, 0, x, y, image->xres, image->yres);
+		return;
+	}
+	if (fb->flags & DGL_FB_FLAG_WRITE_COMBINED) {
+		dglCopyAreaWriteCombined(image, fb, 0, 0, x, y, image->xres, image->yres);
+		return;
+	}
 	dglCopyAreaAcross(image, fb, 0, 0, x, y, image->xres, image->yres);
-#endif
 }
 
 void dglPutPartialImage(dglContext *context, int sx, int sy, int dx, int dy, int w, int h,
 dglImage *image) {
+	if (context->tracer)
+		dglTracePutImage(context, sx, sy, dx, dy, w, h, image);
+	if (context->clip_enabled && !dglClipDrawArea(context, sx, sy, dx, dy, w, h))
+		return;
+	if (context->occlusion) {
+		dglOcclusionOp *op = dglAddOcclusionOp(context->occlusion,
+			DGL_OCCLUSION_OP_IMAGE, dx, dy, w, h);
+		op->sx = sx;
+		op->sy = sy;
+		op->image = image;
+		return;
+	}
 	dglFB *fb;
 	DGL_GET_DRAW_FB(context, fb);
-#ifdef DGL_USE_PIXMAN
-	dglCopyAreaBasicPixman(image, fb, sx, sy, dx, dy, w, h);
-#else
+	dy += context->draw_yoffset;
+	dglAddDrawDamage(fb, dx, dy, w, h);
+	if (dglFormatsNeedConversion(image->format, fb->format)) {
+		dglCopyAreaConvert(image, fb, sx, sy, dx, dy, w, h);
+		return;
+	}
+	if (fb->flags & DGL_FB_FLAG_WRITE_COMBINED) {
+		dglCopyAreaWriteCombined(image, fb, sx, sy, dx, dy, w, h);
+		return;
+	}
 	dglCopyAreaAcross(image, fb, sx, sy, dx, dy, w, h);
-#endif
 }
 
 #ifndef DGL_USE_PIXMAN
@@ -386,10 +647,40 @@ static void memset16(uint8_t *destp, uint32_t value, int size) {
 void dglFill(dglContext *context, int x, int y, int w, int h, uint32_t pixel) {
 	if (w <= 0 || h <= 0)
 		return;
+	if (context->tracer)
+		dglTraceFill(context, x, y, w, h, pixel);
+	if (context->clip_enabled) {
+		int sx = 0, sy = 0;
+		if (!dglClipDrawArea(context, sx, sy, x, y, w, h))
+			return;
+	}
+	if (context->occlusion) {
+		dglOcclusionOp *op = dglAddOcclusionOp(context->occlusion,
+			DGL_OCCLUSION_OP_FILL, x, y, w, h);
+		op->pixel = pixel;
+		return;
+	}
 	y += context->draw_yoffset;
 
 	dglFB *fb;
 	DGL_GET_DRAW_FB(context, fb);
+	dglAddDrawDamage(fb, x, y, w, h);
+
+	if (fb->flags & DGL_FB_FLAG_WRITE_COMBINED) {
+		uint8_t *dp = fb->framebuffer_addr + y * fb->stride +
+			x * fb->bytes_per_pixel;
+		if (fb->bytes_per_pixel == 4)
+			for (; h > 0; h--) {
+				dglStreamFill32(dp, pixel, w);
+				dp += fb->stride;
+			}
+		else
+			for (; h > 0; h--) {
+				dglStreamFill16(dp, pixel, w);
+				dp += fb->stride;
+			}
+		return;
+	}
 
 #ifdef DGL_USE_PIXMAN
 	bool r = pixman_fill((uint32_t *)fb->framebuffer_addr, fb->stride / 4,
@@ -415,32 +706,27 @@ void dglFill(dglContext *context, int x, int y, int w, int h, uint32_t pixel) {
 #endif
 }
 
+// Components are rounded to 8 bits and then reduced with the conversion
+// tables.
+
+DGL_INLINE_ONLY static uint32_t dglConvertColorComponent(float c) {
+	if (c <= 0)
+		return 0;
+	if (c >= 1.0f)
+		return 255;
+	return floorf(c * 255.5f);
+}
+
 uint32_t dglConvertColor(uint32_t format, float r_float, float g_float,
 float b_float) {
-	uint32_t r = floorf(r_float * 255.5f);
-	uint32_t g = floorf(g_float * 255.5f);
-	uint32_t b = floorf(b_float * 255.5f);
-	if ((format & (DGL_FORMAT_PIXEL_SIZE_16_BIT |
-	DGL_FORMAT_LSB_ORDER_RGB_BIT)) == 0)
-		return (r << 16) + (g << 8) + b;
-	else if ((format & (DGL_FORMAT_PIXEL_SIZE_16_BIT |
-	DGL_FORMAT_LSB_ORDER_RGB_BIT)) == DGL_FORMAT_PIXEL_SIZE_16_BIT) {
-		r += 4;
-		if (r >= 256)
-			r = 255;
-		r >>= 3;
-		g += 2;
-		if (g >= 256)
-			g = 255;
-		g >>= 2;
-		b += 4;
-		if (b >= 256)
-			b = 255;
-		b >>= 3;
-		return (r << 11) + (g << 5) + b;
+	if (format > DGL_FORMAT_BGR565) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dlgConvertPixel: Cannot handle pixel format 0x%04X\n",
+			format);
+		return 0;
 	}
-	dglMessage(DGL_MESSAGE_WARNING,
-		"dlgConvertPixel: Cannot handle pixel format 0x%04X\n",
-		format);
-	return 0;
+	uint32_t r = dglConvertColorComponent(r_float);
+	uint32_t g = dglConvertColorComponent(g_float);
+	uint32_t b = dglConvertColorComponent(b_float);
+	return dglARGBToPixel(format, (r << 16) | (g << 8) | b);
 }
@@ -0,0 +1,582 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// Low-level memory functions for write-combined (uncached) framebuffer
+// memory, such as the memory-mapped console framebuffer.
+//
+// Write-combined memory is fast when it is written sequentially in
+// large aligned bursts, and very slow when it is read or written in a
+// scattered fashion. The functions in this module never read from the
+// destination, align the destination to 16 bytes and then write in
+// bursts of 64 bytes (a full cache line/write-combining buffer on most
+// ARM and x86 CPUs).
+//
+// The module also contains the 2D row copy used for copies between cached
+// buffers, which are often narrow (sidebars, glyphs, sprites) so that the
+// cost of a memcpy call per row dominates.
+//
+// Frame-sized copies (such as presenting a pixmap) use a kernel that
+// aligns the destination to 64 bytes, copies in 64-byte bursts and
+// prefetches the source a configurable distance ahead, continuing into
+// the next row at the end of a row. The prefetch distance is calibrated
+// once at startup, and the kernel is only used for cached destinations
+// when it beats memcpy.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DGL_MEMORY_USE_NEON
+#endif
+
+#include "dgl.h"
+
+// Fill size bytes at the 4-byte aligned address dp with a repeating 32-bit
+// pattern. size must be a multiple of 4.
+
+static void dglStreamFillPattern32(uint8_t *dp, uint32_t pattern, int size) {
+	// Align to 16 bytes.
+	while (((uintptr_t)dp & 15) != 0 && size >= 4) {
+		*(uint32_t *)dp = pattern;
+		dp += 4;
+		size -= 4;
+	}
+#if defined(__SSE2__)
+	__m128i v = _mm_set1_epi32(pattern);
+	while (size >= 64) {
+		_mm_stream_si128((__m128i *)dp, v);
+		_mm_stream_si128((__m128i *)(dp + 16), v);
+		_mm_stream_si128((__m128i *)(dp + 32), v);
+		_mm_stream_si128((__m128i *)(dp + 48), v);
+		dp += 64;
+		size -= 64;
+	}
+	while (size >= 16) {
+		_mm_stream_si128((__m128i *)dp, v);
+		dp += 16;
+		size -= 16;
+	}
+	_mm_sfence();
+#elif defined(DGL_MEMORY_USE_NEON)
+	uint32x4_t v = vdupq_n_u32(pattern);
+	while (size >= 64) {
+		vst1q_u32((uint32_t *)dp, v);
+		vst1q_u32((uint32_t *)(dp + 16), v);
+		vst1q_u32((uint32_t *)(dp + 32), v);
+		vst1q_u32((uint32_t *)(dp + 48), v);
+		dp += 64;
+		size -= 64;
+	}
+	while (size >= 16) {
+		vst1q_u32((uint32_t *)dp, v);
+		dp += 16;
+		size -= 16;
+	}
+#else
+	uint64_t v = pattern | ((uint64_t)pattern << 32);
+	while (size >= 64) {
+		uint64_t *dp64 = (uint64_t *)dp;
+		dp64[0] = v;
+		dp64[1] = v;
+		dp64[2] = v;
+		dp64[3] = v;
+		dp64[4] = v;
+		dp64[5] = v;
+		dp64[6] = v;
+		dp64[7] = v;
+		dp += 64;
+		size -= 64;
+	}
+	while (size >= 16) {
+		uint64_t *dp64 = (uint64_t *)dp;
+		dp64[0] = v;
+		dp64[1] = v;
+		dp += 16;
+		size -= 16;
+	}
+#endif
+	while (size >= 4) {
+		*(uint32_t *)dp = pattern;
+		dp += 4;
+		size -= 4;
+	}
+}
+
+void dglStreamFill32(uint8_t *dest, uint32_t pixel, int n) {
+	dglStreamFillPattern32(dest, pixel, n * 4);
+}
+
+void dglStreamFill16(uint8_t *dest, uint32_t pixel, int n) {
+	uint8_t *dp = dest;
+	if (((uintptr_t)dp & 0x2) && n > 0) {
+		*(uint16_t *)dp = (uint16_t)pixel;
+		dp += 2;
+		n--;
+	}
+	uint32_t pattern = (pixel & 0xFFFF) | (pixel << 16);
+	dglStreamFillPattern32(dp, pattern, (n & ~1) * 2);
+	if (n & 1)
+		*(uint16_t *)(dp + (n & ~1) * 2) = (uint16_t)pixel;
+}
+
+void dglStreamCopy(uint8_t *dest, const uint8_t *src, int size) {
+	uint8_t *dp = dest;
+	const uint8_t *sp = src;
+	// Align the destination to 16 bytes.
+	while (((uintptr_t)dp & 3) != 0 && size > 0) {
+		*dp = *sp;
+		dp++;
+		sp++;
+		size--;
+	}
+	while (((uintptr_t)dp & 15) != 0 && size >= 4) {
+		uint32_t v;
+		memcpy(&v, sp, 4);
+		*(uint32_t *)dp = v;
+		dp += 4;
+		sp += 4;
+		size -= 4;
+	}
+#if defined(__SSE2__)
+	while (size >= 64) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)sp);
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(sp + 16));
+		__m128i v2 = _mm_loadu_si128((const __m128i *)(sp + 32));
+		__m128i v3 = _mm_loadu_si128((const __m128i *)(sp + 48));
+		_mm_stream_si128((__m128i *)dp, v0);
+		_mm_stream_si128((__m128i *)(dp + 16), v1);
+		_mm_stream_si128((__m128i *)(dp + 32), v2);
+		_mm_stream_si128((__m128i *)(dp + 48), v3);
+		dp += 64;
+		sp += 64;
+		size -= 64;
+	}
+	while (size >= 16) {
+		_mm_stream_si128((__m128i *)dp, _mm_loadu_si128((const __m128i *)sp));
+		dp += 16;
+		sp += 16;
+		size -= 16;
+	}
+	_mm_sfence();
+#elif defined(DGL_MEMORY_USE_NEON)
+	while (size >= 64) {
+		uint8x16_t v0 = vld1q_u8(sp);
+		uint8x16_t v1 = vld1q_u8(sp + 16);
+		uint8x16_t v2 = vld1q_u8(sp + 32);
+		uint8x16_t v3 = vld1q_u8(sp + 48);
+		vst1q_u8(dp, v0);
+		vst1q_u8(dp + 16, v1);
+		vst1q_u8(dp + 32, v2);
+		vst1q_u8(dp + 48, v3);
+		dp += 64;
+		sp += 64;
+		size -= 64;
+	}
+	while (size >= 16) {
+		vst1q_u8(dp, vld1q_u8(sp));
+		dp += 16;
+		sp += 16;
+		size -= 16;
+	}
+#else
+	while (size >= 64) {
+		uint64_t v[8];
+		memcpy(v, sp, 64);
+		uint64_t *dp64 = (uint64_t *)dp;
+		dp64[0] = v[0];
+		dp64[1] = v[1];
+		dp64[2] = v[2];
+		dp64[3] = v[3];
+		dp64[4] = v[4];
+		dp64[5] = v[5];
+		dp64[6] = v[6];
+		dp64[7] = v[7];
+		dp += 64;
+		sp += 64;
+		size -= 64;
+	}
+	while (size >= 16) {
+		uint64_t v[2];
+		memcpy(v, sp, 16);
+		((uint64_t *)dp)[0] = v[0];
+		((uint64_t *)dp)[1] = v[1];
+		dp += 16;
+		sp += 16;
+		size -= 16;
+	}
+#endif
+	while (size >= 4) {
+		uint32_t v;
+		memcpy(&v, sp, 4);
+		*(uint32_t *)dp = v;
+		dp += 4;
+		sp += 4;
+		size -= 4;
+	}
+	while (size > 0) {
+		*dp = *sp;
+		dp++;
+		sp++;
+		size--;
+	}
+}
+
+// 2D row copies.
+
+// Number of rows ahead of the current row that are prefetched.
+#define COPY_ROWS_PREFETCH_DISTANCE 4
+// Rows narrower than this are copied with inline code instead of memcpy.
+#define COPY_ROWS_SMALL_SIZE 128
+// Rows narrower than this are never copied with the large copy kernel.
+#define LARGE_COPY_MIN_ROW_SIZE 256
+
+// Copy rows of a fixed size, four rows at a time. The size is a constant
+// after inlining, so that every row is copied with a few loads and stores.
+
+DGL_INLINE_ONLY static void dglCopyRowsFixed(uint8_t *dp, int dest_stride, const uint8_t *sp,
+int src_stride, int size, int h) {
+	while (h >= 4) {
+		__builtin_prefetch(sp + COPY_ROWS_PREFETCH_DISTANCE * src_stride);
+		__builtin_prefetch(sp + (COPY_ROWS_PREFETCH_DISTANCE + 1) * src_stride);
+		__builtin_prefetch(sp + (COPY_ROWS_PREFETCH_DISTANCE + 2) * src_stride);
+		__builtin_prefetch(sp + (COPY_ROWS_PREFETCH_DISTANCE + 3) * src_stride);
+		memcpy(dp, sp, size);
+		memcpy(dp + dest_stride, sp + src_stride, size);
+		memcpy(dp + dest_stride * 2, sp + src_stride * 2, size);
+		memcpy(dp + dest_stride * 3, sp + src_stride * 3, size);
+		sp += src_stride * 4;
+		dp += dest_stride * 4;
+		h -= 4;
+	}
+	while (h > 0) {
+		memcpy(dp, sp, size);
+		sp += src_stride;
+		dp += dest_stride;
+		h--;
+	}
+}
+
+// Copy rows of any small size (at least two bytes). The last bytes of a
+// row are copied with a block that may overlap the previous one.
+
+static void dglCopyRowsSmall(uint8_t *dp, int dest_stride, const uint8_t *sp, int src_stride,
+int size, int h) {
+	for (; h > 0; h--) {
+		__builtin_prefetch(sp + COPY_ROWS_PREFETCH_DISTANCE * src_stride);
+		if (size >= 8) {
+			for (int i = 0; i < size - 8; i += 8)
+				memcpy(dp + i, sp + i, 8);
+			memcpy(dp + size - 8, sp + size - 8, 8);
+		}
+		else if (size >= 4) {
+			memcpy(dp, sp, 4);
+			memcpy(dp + size - 4, sp + size - 4, 4);
+		}
+		else
+			memcpy(dp, sp, 2);
+		sp += src_stride;
+		dp += dest_stride;
+	}
+}
+
+// Copy h rows of row_size bytes (a multiple of two) between buffers with
+// different strides; a negative stride copies from the bottom up. Rows are
+// copied in order, so the source and destination may be in the same buffer
+// as long as no row is written before it has been read.
+
+void dglCopyRows(uint8_t *dest, int dest_stride, const uint8_t *src, int src_stride,
+int row_size, int h) {
+	if (row_size >= LARGE_COPY_MIN_ROW_SIZE && row_size * h >= DGL_LARGE_COPY_THRESHOLD) {
+		dglCopyRowsLarge(dest, dest_stride, src, src_stride, row_size, h, false);
+		return;
+	}
+	if (row_size == src_stride && row_size == dest_stride) {
+		// Contiguous area.
+		memcpy(dest, src, row_size * h);
+		return;
+	}
+	switch (row_size) {
+	case 4 :
+		dglCopyRowsFixed(dest, dest_stride, src, src_stride, 4, h);
+		return;
+	case 8 :
+		dglCopyRowsFixed(dest, dest_stride, src, src_stride, 8, h);
+		return;
+	case 16 :
+		dglCopyRowsFixed(dest, dest_stride, src, src_stride, 16, h);
+		return;
+	case 32 :
+		dglCopyRowsFixed(dest, dest_stride, src, src_stride, 32, h);
+		return;
+	case 64 :
+		dglCopyRowsFixed(dest, dest_stride, src, src_stride, 64, h);
+		return;
+	}
+	if (row_size < COPY_ROWS_SMALL_SIZE) {
+		dglCopyRowsSmall(dest, dest_stride, src, src_stride, row_size, h);
+		return;
+	}
+	for (; h > 0; h--) {
+		__builtin_prefetch(src + COPY_ROWS_PREFETCH_DISTANCE * src_stride);
+		memcpy(dest, src, row_size);
+		src += src_stride;
+		dest += dest_stride;
+	}
+}
+
+// Large copies.
+
+// Prefetch distances (in bytes) tried by the calibration. A distance of
+// zero disables prefetching.
+#define NU_LARGE_COPY_PREFETCH_DISTANCES 6
+static const int large_copy_prefetch_distance_candidate[NU_LARGE_COPY_PREFETCH_DISTANCES] = {
+	0, 64, 128, 256, 512, 1024 };
+#define LARGE_COPY_DEFAULT_PREFETCH_DISTANCE 256
+// Size of the buffers used for calibration, larger than the L2 cache of
+// common ARM SoCs.
+#define LARGE_COPY_CALIBRATION_SIZE (2 * 1024 * 1024)
+#define LARGE_COPY_CALIBRATION_ITERATIONS 3
+
+// The configuration may be changed while other threads copy, so it is
+// accessed atomically. Until it is configured, the defaults are used.
+static int large_copy_prefetch_distance = LARGE_COPY_DEFAULT_PREFETCH_DISTANCE;
+// Whether the large copy kernel is faster than memcpy for cached memory.
+static bool large_copy_use_kernel = true;
+static bool large_copy_configured = false;
+static pthread_once_t large_copy_once = PTHREAD_ONCE_INIT;
+
+// Copy one row in 64-byte bursts, with the destination aligned to 64 bytes
+// and prefetching distance bytes ahead of the source. When the prefetch
+// address passes the end of the row, it continues at the start of the next
+// source row (skip bytes further).
+
+DGL_INLINE_ONLY static void dglCopyLargeRow(uint8_t *dp, const uint8_t *sp, int size,
+int distance, int skip, bool streaming) {
+	int head = (int)(- (uintptr_t)dp & 63);
+	if (head > size)
+		head = size;
+	if (head > 0) {
+		if (streaming)
+			dglStreamCopy(dp, sp, head);
+		else
+			memcpy(dp, sp, head);
+		dp += head;
+		sp += head;
+		size -= head;
+	}
+	const uint8_t *row_end = sp + size;
+#if defined(__SSE2__)
+	while (size >= 64) {
+		if (distance > 0) {
+			const uint8_t *pf = sp + distance;
+			if (pf >= row_end)
+				pf += skip;
+			__builtin_prefetch(pf);
+		}
+		__m128i v0 = _mm_loadu_si128((const __m128i *)sp);
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(sp + 16));
+		__m128i v2 = _mm_loadu_si128((const __m128i *)(sp + 32));
+		__m128i v3 = _mm_loadu_si128((const __m128i *)(sp + 48));
+		if (streaming) {
+			_mm_stream_si128((__m128i *)dp, v0);
+			_mm_stream_si128((__m128i *)(dp + 16), v1);
+			_mm_stream_si128((__m128i *)(dp + 32), v2);
+			_mm_stream_si128((__m128i *)(dp + 48), v3);
+		}
+		else {
+			_mm_store_si128((__m128i *)dp, v0);
+			_mm_store_si128((__m128i *)(dp + 16), v1);
+			_mm_store_si128((__m128i *)(dp + 32), v2);
+			_mm_store_si128((__m128i *)(dp + 48), v3);
+		}
+		dp += 64;
+		sp += 64;
+		size -= 64;
+	}
+	if (streaming)
+		_mm_sfence();
+#elif defined(DGL_MEMORY_USE_NEON)
+	while (size >= 64) {
+		if (distance > 0) {
+			const uint8_t *pf = sp + distance;
+			if (pf >= row_end)
+				pf += skip;
+			__builtin_prefetch(pf);
+		}
+		uint8x16_t v0 = vld1q_u8(sp);
+		uint8x16_t v1 = vld1q_u8(sp + 16);
+		uint8x16_t v2 = vld1q_u8(sp + 32);
+		uint8x16_t v3 = vld1q_u8(sp + 48);
+		vst1q_u8(dp, v0);
+		vst1q_u8(dp + 16, v1);
+		vst1q_u8(dp + 32, v2);
+		vst1q_u8(dp + 48, v3);
+		dp += 64;
+		sp += 64;
+		size -= 64;
+	}
+#else
+	while (size >= 64) {
+		if (distance > 0) {
+			const uint8_t *pf = sp + distance;
+			if (pf >= row_end)
+				pf += skip;
+			__builtin_prefetch(pf);
+		}
+		uint64_t v[8];
+		memcpy(v, sp, 64);
+		uint64_t *dp64 = (uint64_t *)dp;
+		dp64[0] = v[0];
+		dp64[1] = v[1];
+		dp64[2] = v[2];
+		dp64[3] = v[3];
+		dp64[4] = v[4];
+		dp64[5] = v[5];
+		dp64[6] = v[6];
+		dp64[7] = v[7];
+		dp += 64;
+		sp += 64;
+		size -= 64;
+	}
+#endif
+	// Tail of fewer than 64 bytes; the destination is still aligned.
+	if (size > 0) {
+		if (streaming)
+			dglStreamCopy(dp, sp, size);
+		else
+			memcpy(dp, sp, size);
+	}
+}
+
+static void dglCopyRowsLargeKernel(uint8_t *dest, int dest_stride, const uint8_t *src,
+int src_stride, int row_size, int h, int distance, bool streaming) {
+	int skip = src_stride - row_size;
+	for (; h > 0; h--) {
+		dglCopyLargeRow(dest, src, row_size, distance, skip, streaming);
+		src += src_stride;
+		dest += dest_stride;
+	}
+}
+
+// Return the best time of a few copies of the calibration buffer, as rows
+// of 4096 bytes. A distance of -1 measures memcpy.
+
+static double dglMeasureLargeCopy(uint8_t *dest, const uint8_t *src, int distance) {
+	double best = 0;
+	for (int i = 0; i < LARGE_COPY_CALIBRATION_ITERATIONS; i++) {
+		double start = dglGetTime();
+		if (distance < 0)
+			for (int j = 0; j < LARGE_COPY_CALIBRATION_SIZE; j += 4096)
+				memcpy(dest + j, src + j, 4096);
+		else
+			dglCopyRowsLargeKernel(dest, 4096, src, 4096, 4096,
+				LARGE_COPY_CALIBRATION_SIZE / 4096, distance, false);
+		double t = dglGetTime() - start;
+		if (i == 0 || t < best)
+			best = t;
+	}
+	return best;
+}
+
+int dglCalibrateLargeCopy() {
+	uint8_t *src = new uint8_t[LARGE_COPY_CALIBRATION_SIZE];
+	uint8_t *dest = new uint8_t[LARGE_COPY_CALIBRATION_SIZE];
+	memset(src, 0x55, LARGE_COPY_CALIBRATION_SIZE);
+	memset(dest, 0, LARGE_COPY_CALIBRATION_SIZE);
+	// Warm up (fault in the pages).
+	dglMeasureLargeCopy(dest, src, -1);
+	int best_distance = LARGE_COPY_DEFAULT_PREFETCH_DISTANCE;
+	double best_time = 0;
+	for (int i = 0; i < NU_LARGE_COPY_PREFETCH_DISTANCES; i++) {
+		int distance = large_copy_prefetch_distance_candidate[i];
+		double t = dglMeasureLargeCopy(dest, src, distance);
+		if (i == 0 || t < best_time) {
+			best_time = t;
+			best_distance = distance;
+		}
+	}
+	double memcpy_time = dglMeasureLargeCopy(dest, src, -1);
+	delete [] dest;
+	delete [] src;
+	__atomic_store_n(&large_copy_prefetch_distance, best_distance, __ATOMIC_RELAXED);
+	__atomic_store_n(&large_copy_use_kernel, best_time < memcpy_time, __ATOMIC_RELAXED);
+	__atomic_store_n(&large_copy_configured, true, __ATOMIC_RELAXED);
+	dglMessage(DGL_MESSAGE_INFO, "dglCalibrateLargeCopy: Prefetch distance %d bytes, "
+		"%.1f MB/s (memcpy %.1f MB/s)\n", best_distance,
+		LARGE_COPY_CALIBRATION_SIZE / best_time / 1000000.0,
+		LARGE_COPY_CALIBRATION_SIZE / memcpy_time / 1000000.0);
+	return best_distance;
+}
+
+// The prefetch distance can be set with the DGL_LARGE_COPY_PREFETCH
+// environment variable, which skips the calibration.
+
+static void dglInitLargeCopyOnce() {
+	if (__atomic_load_n(&large_copy_configured, __ATOMIC_RELAXED))
+		return;
+	const char *s = getenv("DGL_LARGE_COPY_PREFETCH");
+	if (s != NULL) {
+		dglSetLargeCopyPrefetchDistance(atoi(s));
+		return;
+	}
+	dglCalibrateLargeCopy();
+}
+
+void dglInitLargeCopy() {
+	pthread_once(&large_copy_once, dglInitLargeCopyOnce);
+}
+
+void dglSetLargeCopyPrefetchDistance(int distance) {
+	__atomic_store_n(&large_copy_prefetch_distance, distance < 0 ? 0 : distance,
+		__ATOMIC_RELAXED);
+	__atomic_store_n(&large_copy_use_kernel, true, __ATOMIC_RELAXED);
+	__atomic_store_n(&large_copy_configured, true, __ATOMIC_RELAXED);
+}
+
+int dglGetLargeCopyPrefetchDistance() {
+	dglInitLargeCopy();
+	return __atomic_load_n(&large_copy_prefetch_distance, __ATOMIC_RELAXED);
+}
+
+// Copy a large area of h rows of row_size bytes. When streaming is true the
+// destination is only written sequentially with streaming stores (for
+// write-combined memory). Areas smaller than DGL_LARGE_COPY_THRESHOLD bytes
+// should use dglCopyRows or dglStreamCopy instead.
+
+void dglCopyRowsLarge(uint8_t *dest, int dest_stride, const uint8_t *src, int src_stride,
+int row_size, int h, bool streaming) {
+	if (row_size == src_stride && row_size == dest_stride) {
+		// Contiguous area.
+		row_size *= h;
+		h = 1;
+	}
+	if (!streaming && !__atomic_load_n(&large_copy_use_kernel, __ATOMIC_RELAXED)) {
+		for (; h > 0; h--) {
+			memcpy(dest, src, row_size);
+			src += src_stride;
+			dest += dest_stride;
+		}
+		return;
+	}
+	dglCopyRowsLargeKernel(dest, dest_stride, src, src_stride, row_size, h,
+		__atomic_load_n(&large_copy_prefetch_distance, __ATOMIC_RELAXED), streaming);
+}
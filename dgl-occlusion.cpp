@@ -0,0 +1,176 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// Deferred occlusion culling of opaque drawing operations.
+//
+// While an occlusion culler is set for a context, the drawing functions for
+// opaque fills and images record their clipped destination rectangle instead
+// of drawing. When the operations are flushed, they are walked from the last
+// (front-most) to the first while a region of covered pixels is accumulated.
+// Of every operation only the part that is not yet covered is drawn, one
+// rectangle of the visible region at a time, and operations that are
+// completely hidden are skipped, so that every pixel is written once per
+// flush. A frame that clears its background and then draws overlapping
+// panels on top only clears the background where it remains visible.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dgl.h"
+
+#define INITIAL_MAX_OPS 64
+
+dglOcclusionCuller *dglCreateOcclusionCuller() {
+	dglOcclusionCuller *culler = new dglOcclusionCuller;
+	culler->nu_ops = 0;
+	culler->max_ops = INITIAL_MAX_OPS;
+	culler->ops = new dglOcclusionOp[INITIAL_MAX_OPS];
+	culler->arena = dglCreateRegionArena();
+	culler->covered = dglCreateRegion(culler->arena);
+	culler->visible = dglCreateRegion(culler->arena);
+	culler->rectangle = dglCreateRegion(culler->arena);
+	dglResetOcclusionStats(culler);
+	return culler;
+}
+
+void dglDestroyOcclusionCuller(dglOcclusionCuller *culler) {
+	dglDestroyRegion(culler->rectangle);
+	dglDestroyRegion(culler->visible);
+	dglDestroyRegion(culler->covered);
+	dglDestroyRegionArena(culler->arena);
+	delete [] culler->ops;
+	delete culler;
+}
+
+void dglSetOcclusionCuller(dglContext *context, dglOcclusionCuller *culler) {
+	if (context->occlusion)
+		dglFlushOcclusion(context);
+	context->occlusion = culler;
+}
+
+// Record an operation; the caller fills in the remaining fields.
+
+dglOcclusionOp *dglAddOcclusionOp(dglOcclusionCuller *culler, int type, int x, int y,
+int w, int h) {
+	if (culler->nu_ops == culler->max_ops) {
+		dglOcclusionOp *ops = new dglOcclusionOp[culler->max_ops * 2];
+		memcpy(ops, culler->ops, sizeof(dglOcclusionOp) * culler->nu_ops);
+		delete [] culler->ops;
+		culler->ops = ops;
+		culler->max_ops *= 2;
+	}
+	dglOcclusionOp *op = &culler->ops[culler->nu_ops];
+	culler->nu_ops++;
+	op->type = type;
+	op->x = x;
+	op->y = y;
+	op->w = w;
+	op->h = h;
+	return op;
+}
+
+// Draw the part of an operation within rectangle r.
+
+static void dglDrawOcclusionOp(dglContext *context, const dglOcclusionOp *op,
+const dglClipRectangle *r) {
+	int w = r->x2 - r->x1;
+	int h = r->y2 - r->y1;
+	switch (op->type) {
+	case DGL_OCCLUSION_OP_FILL :
+		dglFill(context, r->x1, r->y1, w, h, op->pixel);
+		break;
+	case DGL_OCCLUSION_OP_IMAGE :
+		dglPutPartialImage(context, op->sx + r->x1 - op->x, op->sy + r->y1 - op->y,
+			r->x1, r->y1, w, h, op->image);
+		break;
+	case DGL_OCCLUSION_OP_GRADIENT :
+		dglFillGradient(context, r->x1, r->y1, w, h, op->gradient);
+		break;
+	case DGL_OCCLUSION_OP_PATTERN :
+		dglFillPattern(context, r->x1, r->y1, w, h, op->image, op->sx, op->sy);
+		break;
+	}
+}
+
+void dglFlushOcclusion(dglContext *context) {
+	dglOcclusionCuller *culler = context->occlusion;
+	if (culler == NULL || culler->nu_ops == 0)
+		return;
+	// The operations were clipped (and traced) when they were recorded;
+	// draw them directly.
+	context->occlusion = NULL;
+	dglTracer *tracer = context->tracer;
+	context->tracer = NULL;
+	bool clip_enabled = context->clip_enabled;
+	context->clip_enabled = false;
+	dglClearRegion(culler->covered);
+	for (int i = culler->nu_ops - 1; i >= 0; i--) {
+		const dglOcclusionOp *op = &culler->ops[i];
+		culler->pixels_submitted += (double)op->w * op->h;
+		dglSetRegionRectangle(culler->rectangle, op->x, op->y, op->w, op->h);
+		const dglRegion *visible = culler->rectangle;
+		if (!dglRegionIsEmpty(culler->covered)) {
+			dglSubtractRegion(culler->visible, culler->rectangle, culler->covered);
+			visible = culler->visible;
+		}
+		if (dglRegionIsEmpty(visible)) {
+			culler->nu_culled_ops++;
+			continue;
+		}
+		for (int j = 0; j < visible->nu_rects; j++)
+			dglDrawOcclusionOp(context, op, &visible->rects[j]);
+		culler->nu_rects_drawn += visible->nu_rects;
+		culler->pixels_drawn += dglGetRegionArea(visible);
+		dglUnionRegion(culler->covered, culler->covered, culler->rectangle);
+	}
+	culler->pixels_covered += dglGetRegionArea(culler->covered);
+	culler->nu_ops_total += culler->nu_ops;
+	culler->nu_flushes++;
+	culler->nu_ops = 0;
+	context->clip_enabled = clip_enabled;
+	context->occlusion = culler;
+	context->tracer = tracer;
+}
+
+void dglGetOcclusionStats(dglOcclusionCuller *culler, dglOcclusionStats *stats) {
+	stats->nu_flushes = culler->nu_flushes;
+	stats->nu_ops = culler->nu_ops_total;
+	stats->nu_culled_ops = culler->nu_culled_ops;
+	stats->nu_rects_drawn = culler->nu_rects_drawn;
+	stats->pixels_submitted = culler->pixels_submitted;
+	stats->pixels_drawn = culler->pixels_drawn;
+	stats->pixels_covered = culler->pixels_covered;
+	stats->overdraw = 0;
+	stats->overdraw_culled = 0;
+	if (culler->pixels_covered > 0) {
+		stats->overdraw = culler->pixels_submitted / culler->pixels_covered;
+		stats->overdraw_culled = culler->pixels_drawn / culler->pixels_covered;
+	}
+}
+
+void dglResetOcclusionStats(dglOcclusionCuller *culler) {
+	culler->nu_flushes = 0;
+	culler->nu_ops_total = 0;
+	culler->nu_culled_ops = 0;
+	culler->nu_rects_drawn = 0;
+	culler->pixels_submitted = 0;
+	culler->pixels_drawn = 0;
+	culler->pixels_covered = 0;
+}
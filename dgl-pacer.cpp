@@ -0,0 +1,221 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// Vsync-aware frame pacing with timing statistics.
+//
+// The frame pacer replaces a plain dglWaitVSync call at the end of each
+// frame. It timestamps every vsync return, estimates the refresh period of
+// the display, and waits for the number of vertical blanks that matches the
+// requested frame interval (1 = display refresh rate, 2 = 30 fps on a 60 Hz
+// display, 3 = 20 fps). When the screen framebuffer does not support
+// WaitVSync, the pacer sleeps until the predicted vertical blank based on a
+// nominal refresh rate.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "dgl.h"
+
+// Nominal refresh rate used when the vsync period cannot be measured.
+#define NOMINAL_REFRESH_RATE 60.0
+// Plausible range of display refresh rates.
+#define MIN_REFRESH_PERIOD (1.0 / 240.0)
+#define MAX_REFRESH_PERIOD (1.0 / 20.0)
+// Weight of a new measurement in the refresh period estimate.
+#define REFRESH_PERIOD_FILTER_WEIGHT 0.05
+// Once the estimate is based on this many measurements, measurements that
+// deviate from it by more than the given fraction (late wakeups) are ignored.
+#define REFRESH_PERIOD_SETTLED_SAMPLES 8
+#define REFRESH_PERIOD_MAX_DEVIATION 0.1
+
+dglFramePacer *dglCreateFramePacer(dglScreenFB *fb, int vsync_interval) {
+	dglFramePacer *pacer = new dglFramePacer;
+	pacer->fb = fb;
+	pacer->vsync_interval = vsync_interval < 1 ? 1 : vsync_interval;
+	pacer->refresh_period = 1.0 / NOMINAL_REFRESH_RATE;
+	pacer->nu_refresh_period_samples = 0;
+	pacer->last_vsync_time = dglGetTime();
+	pacer->have_vsync_time = false;
+	pacer->last_frame_time = pacer->last_vsync_time;
+	pacer->histogram = new int[DGL_FRAME_PACER_HISTOGRAM_SIZE + 1];
+	dglResetFramePacerStats(pacer);
+	return pacer;
+}
+
+void dglDestroyFramePacer(dglFramePacer *pacer) {
+	delete [] pacer->histogram;
+	delete pacer;
+}
+
+void dglSetFramePacerInterval(dglFramePacer *pacer, int vsync_interval) {
+	pacer->vsync_interval = vsync_interval < 1 ? 1 : vsync_interval;
+}
+
+void dglResetFramePacerStats(dglFramePacer *pacer) {
+	pacer->nu_frames = 0;
+	pacer->nu_missed_vblanks = 0;
+	pacer->nu_dropped_frames = 0;
+	pacer->frame_time_sum = 0;
+	pacer->frame_time_sum_sq = 0;
+	pacer->frame_time_max = 0;
+	pacer->latency_sum = 0;
+	pacer->latency_max = 0;
+	pacer->last_latency = 0;
+	memset(pacer->histogram, 0, sizeof(int) * (DGL_FRAME_PACER_HISTOGRAM_SIZE + 1));
+	pacer->stats_started = false;
+}
+
+// Return the predicted time (CLOCK_MONOTONIC, in seconds) of the next
+// vertical blank.
+
+double dglFramePacerPredictNextVSync(dglFramePacer *pacer) {
+	double now = dglGetTime();
+	double t = pacer->last_vsync_time + pacer->refresh_period;
+	if (t < now)
+		t += ceil((now - t) / pacer->refresh_period) * pacer->refresh_period;
+	return t;
+}
+
+// Wait for one vertical blank, timestamp it and update the refresh period
+// estimate.
+//
+// A wait measures exactly one refresh period since the previous vsync when
+// it blocked for longer than the time from the previous vsync to its start,
+// because it then started less than a period after the previous vsync. This
+// includes back-to-back waits, but also the first wait of a call when the
+// frame took less than half a period, so that the estimate follows the
+// actual refresh rate with a frame interval of 1.
+
+static void dglFramePacerWaitOneVSync(dglFramePacer *pacer) {
+	double t;
+	if (pacer->fb->flags & DGL_FB_FLAG_HAVE_WAIT_VSYNC) {
+		double start = dglGetTime();
+		dglWaitVSync(pacer->fb);
+		t = dglGetTime();
+		double period = t - pacer->last_vsync_time;
+		bool plausible = pacer->nu_refresh_period_samples < REFRESH_PERIOD_SETTLED_SAMPLES ?
+			period >= MIN_REFRESH_PERIOD && period <= MAX_REFRESH_PERIOD :
+			fabs(period - pacer->refresh_period) <=
+			pacer->refresh_period * REFRESH_PERIOD_MAX_DEVIATION;
+		if (pacer->have_vsync_time && t - start > start - pacer->last_vsync_time &&
+		plausible) {
+			// Average the first measurements, then filter.
+			pacer->nu_refresh_period_samples++;
+			double weight = 1.0 / pacer->nu_refresh_period_samples;
+			if (weight < REFRESH_PERIOD_FILTER_WEIGHT)
+				weight = REFRESH_PERIOD_FILTER_WEIGHT;
+			pacer->refresh_period += (period - pacer->refresh_period) * weight;
+		}
+		pacer->have_vsync_time = true;
+	}
+	else {
+		t = dglFramePacerPredictNextVSync(pacer);
+		dglSleepUntil(t);
+		// Flush the shadow framebuffer like dglWaitVSync would.
+		dglWaitVSync(pacer->fb);
+	}
+	pacer->last_vsync_time = t;
+}
+
+// Wait until the next frame should be presented. Returns the number of frame
+// intervals that have elapsed since the previous frame (normally 1; larger
+// when the application is running behind and frames were dropped, which can
+// be used to advance animations by the right amount of time).
+
+int dglFramePacerWait(dglFramePacer *pacer) {
+	double start = dglGetTime();
+	double period = pacer->refresh_period;
+	// Number of vertical blanks that have already passed since the
+	// previous frame was presented.
+	int passed = (int)floor((start - pacer->last_vsync_time) / period);
+	int remaining = pacer->vsync_interval - passed;
+	int intervals = 1;
+	if (remaining < 1) {
+		// Running behind; present at the next vertical blank and skip
+		// the frame intervals that were missed.
+		intervals = (passed + 1 + pacer->vsync_interval - 1) / pacer->vsync_interval;
+		remaining = 1;
+	}
+	for (int i = 0; i < remaining; i++)
+		dglFramePacerWaitOneVSync(pacer);
+
+	double t = pacer->last_vsync_time;
+	if (pacer->stats_started) {
+		double frame_time = t - pacer->last_frame_time;
+		double latency = t - start;
+		pacer->nu_frames++;
+		pacer->frame_time_sum += frame_time;
+		pacer->frame_time_sum_sq += frame_time * frame_time;
+		if (frame_time > pacer->frame_time_max)
+			pacer->frame_time_max = frame_time;
+		pacer->latency_sum += latency;
+		if (latency > pacer->latency_max)
+			pacer->latency_max = latency;
+		pacer->last_latency = latency;
+		// Every vertical blank beyond the requested interval displayed
+		// the previous frame once more.
+		int vblanks = (int)floor(frame_time / period + 0.5);
+		if (vblanks > pacer->vsync_interval)
+			pacer->nu_missed_vblanks += vblanks - pacer->vsync_interval;
+		pacer->nu_dropped_frames += intervals - 1;
+		int bucket = (int)(frame_time * 1000.0 / DGL_FRAME_PACER_HISTOGRAM_BUCKET_MS);
+		if (bucket > DGL_FRAME_PACER_HISTOGRAM_SIZE)
+			bucket = DGL_FRAME_PACER_HISTOGRAM_SIZE;
+		pacer->histogram[bucket]++;
+	}
+	pacer->stats_started = true;
+	pacer->last_frame_time = t;
+	return intervals;
+}
+
+static double dglFramePacerPercentile(dglFramePacer *pacer, double fraction) {
+	int target = (int)ceil(pacer->nu_frames * fraction);
+	if (target < 1)
+		target = 1;
+	int count = 0;
+	for (int i = 0; i <= DGL_FRAME_PACER_HISTOGRAM_SIZE; i++) {
+		count += pacer->histogram[i];
+		if (count >= target)
+			return (i + 1) * DGL_FRAME_PACER_HISTOGRAM_BUCKET_MS * 0.001;
+	}
+	return pacer->frame_time_max;
+}
+
+void dglGetFramePacerStats(dglFramePacer *pacer, dglFramePacerStats *stats) {
+	memset(stats, 0, sizeof(dglFramePacerStats));
+	stats->refresh_rate = 1.0 / pacer->refresh_period;
+	stats->target_frame_time = pacer->refresh_period * pacer->vsync_interval;
+	stats->nu_frames = pacer->nu_frames;
+	stats->nu_missed_vblanks = pacer->nu_missed_vblanks;
+	stats->nu_dropped_frames = pacer->nu_dropped_frames;
+	if (pacer->nu_frames == 0)
+		return;
+	double mean = pacer->frame_time_sum / pacer->nu_frames;
+	stats->mean_frame_time = mean;
+	double variance = pacer->frame_time_sum_sq / pacer->nu_frames - mean * mean;
+	stats->jitter = variance > 0 ? sqrt(variance) : 0;
+	stats->max_frame_time = pacer->frame_time_max;
+	stats->mean_latency = pacer->latency_sum / pacer->nu_frames;
+	stats->max_latency = pacer->latency_max;
+	stats->p50_frame_time = dglFramePacerPercentile(pacer, 0.50);
+	stats->p90_frame_time = dglFramePacerPercentile(pacer, 0.90);
+	stats->p99_frame_time = dglFramePacerPercentile(pacer, 0.99);
+}
@@ -0,0 +1,253 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// Presentation with automatic selection of the fastest strategy.
+//
+// A presenter hides how a finished frame reaches the display. When the
+// screen framebuffer can pan and has at least two pages, frames are drawn
+// into successive pages and the display is panned to the finished page.
+// Otherwise frames are drawn either into a spare page that is copied to the
+// displayed page with CopyArea (DMA on the console framebuffer when
+// available), or into a pixmap in system memory of which only the rows that
+// were drawn into (tracked with damage tracking) are copied to the screen.
+// When both copying strategies are possible, a full-screen present is timed
+// for each when the presenter is created, and the faster one is used.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dgl.h"
+
+// Number of timed presents per strategy; the fastest is used.
+#define BENCHMARK_ITERATIONS 3
+
+bool dglIsPresentModeSupported(dglScreenFB *fb, int mode, int flags) {
+	int nu_pages = fb->virtual_yres / fb->yres;
+	switch (mode) {
+	case DGL_PRESENT_MODE_PAN : {
+		int type = fb->flags & DGL_FB_TYPE_MASK;
+		return (type == DGL_FB_TYPE_CONSOLE || type == DGL_FB_TYPE_DRM ||
+			type == DGL_FB_TYPE_SIMULATED) &&
+			(fb->flags & DGL_FB_FLAG_HAVE_PAN_DISPLAY) && nu_pages >= 2 &&
+			!(flags & DGL_PRESENTER_FLAG_NO_PAN);
+		}
+	case DGL_PRESENT_MODE_COPY_AREA :
+		// A software copy within uncached memory is too slow to consider.
+		return nu_pages >= 2 && ((fb->flags & DGL_FB_FLAG_HAVE_COPY_AREA) ||
+			!(fb->flags & DGL_FB_FLAG_WRITE_COMBINED));
+	case DGL_PRESENT_MODE_PIXMAP :
+		return true;
+	}
+	return false;
+}
+
+// Copy the damaged rows of a pixmap to the screen framebuffer starting at
+// row dest_y. Consecutive rows with the same damaged span are copied
+// together, so that large runs (such as full-screen updates) use the large
+// copy kernel.
+
+static void dglPresenterCopyPixmap(dglFB *pixmap, dglScreenFB *fb, int dest_y) {
+	int bpp = fb->bytes_per_pixel;
+	bool streaming = (fb->flags & DGL_FB_FLAG_WRITE_COMBINED) != 0;
+	dglDamage *damage = pixmap->damage;
+	int h;
+	for (int y = damage->y1; y < damage->y2; y += h) {
+		int x1 = damage->x1[y];
+		int x2 = damage->x2[y];
+		h = 1;
+		while (y + h < damage->y2 && damage->x1[y + h] == x1 && damage->x2[y + h] == x2)
+			h++;
+		if (x1 >= x2)
+			continue;
+		int row_size = (x2 - x1) * bpp;
+		uint8_t *dp = fb->framebuffer_addr + (dest_y + y) * fb->stride + x1 * bpp;
+		const uint8_t *sp = pixmap->framebuffer_addr + y * pixmap->stride + x1 * bpp;
+		if (row_size * h >= DGL_LARGE_COPY_THRESHOLD)
+			dglCopyRowsLarge(dp, fb->stride, sp, pixmap->stride, row_size, h, streaming);
+		else
+			for (int i = 0; i < h; i++) {
+				if (streaming)
+					dglStreamCopy(dp, sp, row_size);
+				else
+					memcpy(dp, sp, row_size);
+				dp += fb->stride;
+				sp += pixmap->stride;
+			}
+		if (fb->damage)
+			dglAddDamage(fb->damage, x1, dest_y + y, x2 - x1, h);
+	}
+	dglClearDamage(damage, 0, pixmap->yres);
+}
+
+// Time a full-screen present with the given mode, copying into the spare
+// page so that the display is not disturbed. The pixmap is copied with the
+// same damage-driven path as dglPresenterPresent.
+
+static double dglMeasurePresent(dglPresenter *presenter, int mode) {
+	dglScreenFB *fb = presenter->fb;
+	dglFB *pixmap = NULL;
+	if (mode == DGL_PRESENT_MODE_PIXMAP) {
+		pixmap = dglCreatePixmapFB(fb->format, fb->xres, fb->yres);
+		pixmap->damage = dglCreateDamage(fb->xres, fb->yres);
+		memset(pixmap->framebuffer_addr, 0, pixmap->total_size);
+	}
+	double best = 0;
+	for (int i = 0; i < BENCHMARK_ITERATIONS; i++) {
+		double start = dglGetTime();
+		if (mode == DGL_PRESENT_MODE_COPY_AREA) {
+			dglSetReadPage(presenter->copy_context, 0);
+			dglSetDrawPage(presenter->copy_context, 1);
+			dglCopyArea(presenter->copy_context, 0, 0, 0, 0, fb->xres, fb->yres);
+		}
+		else {
+			dglAddDamage(pixmap->damage, 0, 0, fb->xres, fb->yres);
+			dglPresenterCopyPixmap(pixmap, fb, fb->yres);
+		}
+		double t = dglGetTime() - start;
+		if (i == 0 || t < best)
+			best = t;
+	}
+	if (pixmap) {
+		dglDestroyDamage(pixmap->damage);
+		pixmap->damage = NULL;
+		dglDestroyPixmapFB(pixmap);
+	}
+	return best;
+}
+
+dglPresenter *dglCreatePresenter(dglScreenFB *fb, int mode, int flags) {
+	if (mode != DGL_PRESENT_MODE_AUTO && !dglIsPresentModeSupported(fb, mode, flags)) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglCreatePresenter: Presentation mode not supported by framebuffer\n");
+		return NULL;
+	}
+	// Calibrate the frame-sized copy kernel before the first present.
+	dglInitLargeCopy();
+	dglPresenter *presenter = new dglPresenter;
+	presenter->fb = fb;
+	presenter->copy_context = dglCreateContext(fb, fb);
+	presenter->pixmap = NULL;
+	presenter->events = NULL;
+	presenter->replaced_page = - 1;
+	presenter->nu_presents = 0;
+	for (int i = 0; i < DGL_NU_PRESENT_MODES; i++)
+		presenter->present_time[i] = 0;
+	if (mode == DGL_PRESENT_MODE_AUTO) {
+		if (dglIsPresentModeSupported(fb, DGL_PRESENT_MODE_PAN, flags))
+			mode = DGL_PRESENT_MODE_PAN;
+		else if (dglIsPresentModeSupported(fb, DGL_PRESENT_MODE_COPY_AREA, flags)) {
+			for (int i = DGL_PRESENT_MODE_COPY_AREA; i <= DGL_PRESENT_MODE_PIXMAP; i++)
+				presenter->present_time[i] = dglMeasurePresent(presenter, i);
+			mode = presenter->present_time[DGL_PRESENT_MODE_COPY_AREA] <=
+				presenter->present_time[DGL_PRESENT_MODE_PIXMAP] ?
+				DGL_PRESENT_MODE_COPY_AREA : DGL_PRESENT_MODE_PIXMAP;
+		}
+		else
+			mode = DGL_PRESENT_MODE_PIXMAP;
+	}
+	presenter->mode = mode;
+	presenter->nu_pages = 1;
+	presenter->back_page = 0;
+	if (mode == DGL_PRESENT_MODE_PAN) {
+		presenter->nu_pages = fb->virtual_yres / fb->yres;
+		if (presenter->nu_pages > DGL_PRESENTER_MAX_PAGES)
+			presenter->nu_pages = DGL_PRESENTER_MAX_PAGES;
+		// Start drawing into a page that is not displayed.
+		presenter->back_page = (fb->display_yoffset / fb->yres + 1) % presenter->nu_pages;
+	}
+	else {
+		if (mode == DGL_PRESENT_MODE_PIXMAP) {
+			presenter->pixmap = dglCreatePixmapFB(fb->format, fb->xres, fb->yres);
+			presenter->pixmap->damage = dglCreateDamage(fb->xres, fb->yres);
+		}
+		if (fb->display_yoffset != 0 && (fb->flags & DGL_FB_FLAG_HAVE_PAN_DISPLAY))
+			dglSetDisplayPage(fb, 0);
+	}
+	for (int i = 0; i < DGL_PRESENTER_MAX_PAGES; i++)
+		presenter->page_frame[i] = - 1;
+	return presenter;
+}
+
+// In pan mode, the display is reset to the first page.
+
+void dglDestroyPresenter(dglPresenter *presenter) {
+	if (presenter->mode == DGL_PRESENT_MODE_PAN && presenter->fb->display_yoffset != 0)
+		dglSetDisplayPage(presenter->fb, 0);
+	if (presenter->pixmap) {
+		dglDestroyDamage(presenter->pixmap->damage);
+		presenter->pixmap->damage = NULL;
+		dglDestroyPixmapFB(presenter->pixmap);
+	}
+	dglDestroyContext(presenter->copy_context);
+	delete presenter;
+}
+
+int dglPresenterAcquire(dglPresenter *presenter, dglContext *context) {
+	dglFB *fb = presenter->fb;
+	int page = 1;
+	if (presenter->mode == DGL_PRESENT_MODE_PIXMAP) {
+		fb = presenter->pixmap;
+		page = 0;
+	}
+	else if (presenter->mode == DGL_PRESENT_MODE_PAN)
+		page = presenter->back_page;
+	dglSetDrawFramebuffer(context, fb);
+	dglSetReadFramebuffer(context, fb);
+	dglSetDrawPage(context, page);
+	dglSetReadPage(context, page);
+	if (presenter->mode == DGL_PRESENT_MODE_PAN) {
+		// Do not draw into a page that is still displayed until the
+		// requested page replaces it.
+		if (presenter->events != NULL && presenter->back_page == presenter->replaced_page)
+			dglWaitForDisplayPage(presenter->events);
+		int frame = presenter->page_frame[presenter->back_page];
+		return frame < 0 ? 0 : presenter->nu_presents - frame;
+	}
+	return presenter->nu_presents > 0 ? 1 : 0;
+}
+
+void dglPresenterPresent(dglPresenter *presenter) {
+	dglScreenFB *fb = presenter->fb;
+	switch (presenter->mode) {
+	case DGL_PRESENT_MODE_PAN :
+		if (presenter->events != NULL) {
+			// Only one request can be pending.
+			dglWaitForDisplayPage(presenter->events);
+			presenter->replaced_page = fb->display_yoffset / fb->yres;
+			dglRequestDisplayPage(presenter->events, presenter->back_page);
+		}
+		else
+			dglSetDisplayPage(fb, presenter->back_page);
+		presenter->page_frame[presenter->back_page] = presenter->nu_presents;
+		presenter->back_page = (presenter->back_page + 1) % presenter->nu_pages;
+		break;
+	case DGL_PRESENT_MODE_COPY_AREA :
+		dglSetReadPage(presenter->copy_context, 1);
+		dglSetDrawPage(presenter->copy_context, 0);
+		dglCopyArea(presenter->copy_context, 0, 0, 0, 0, fb->xres, fb->yres);
+		break;
+	case DGL_PRESENT_MODE_PIXMAP :
+		dglPresenterCopyPixmap(presenter->pixmap, fb, 0);
+		break;
+	}
+	if (presenter->mode != DGL_PRESENT_MODE_PAN && (fb->flags & DGL_FB_FLAG_SHADOW))
+		dglFlushShadowFramebufferArea(fb, 0, fb->yres);
+	presenter->nu_presents++;
+}
@@ -0,0 +1,574 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// Regions with set operations.
+//
+// Regions are stored in y-x banded form like X11 and pixman regions. Set
+// operations walk the bands of both operands from top to bottom, splitting
+// them into horizontal segments where the set of bands that overlap does
+// not change. For every segment, the horizontal spans of the two bands are
+// combined with the operation, and the result is appended as a new band,
+// which is merged with the previous band when it continues it with the same
+// spans. Rectangle arrays are allocated from an optional arena that keeps
+// freed arrays on free lists per power-of-two capacity.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "dgl.h"
+
+#define ARENA_BLOCK_SIZE 65536
+// The first bytes of a block hold the pointer to the previous block.
+#define ARENA_BLOCK_HEADER_SIZE 16
+#define MIN_CAPACITY 4
+
+enum {
+	REGION_OP_UNION,
+	REGION_OP_INTERSECT,
+	REGION_OP_SUBTRACT
+};
+
+// Arena.
+
+dglRegionArena *dglCreateRegionArena() {
+	dglRegionArena *arena = new dglRegionArena;
+	for (int i = 0; i < DGL_REGION_ARENA_NU_CLASSES; i++)
+		arena->free_list[i] = NULL;
+	arena->block = NULL;
+	arena->block_used = ARENA_BLOCK_SIZE;
+	return arena;
+}
+
+void dglDestroyRegionArena(dglRegionArena *arena) {
+	uint8_t *block = arena->block;
+	while (block) {
+		uint8_t *previous = *(uint8_t **)block;
+		delete [] block;
+		block = previous;
+	}
+	delete arena;
+}
+
+// Return the size class of a rectangle array capacity (a power of two of at
+// least MIN_CAPACITY).
+
+static int dglGetRegionCapacityClass(int capacity) {
+	int c = 0;
+	while ((MIN_CAPACITY << c) < capacity)
+		c++;
+	return c;
+}
+
+static dglClipRectangle *dglAllocateRegionRects(dglRegionArena *arena, int n, int *capacity) {
+	int c = dglGetRegionCapacityClass(n);
+	*capacity = MIN_CAPACITY << c;
+	if (arena == NULL || c >= DGL_REGION_ARENA_NU_CLASSES)
+		return new dglClipRectangle[*capacity];
+	if (arena->free_list[c]) {
+		void *p = arena->free_list[c];
+		arena->free_list[c] = *(void **)p;
+		return (dglClipRectangle *)p;
+	}
+	int size = *capacity * sizeof(dglClipRectangle);
+	if (arena->block_used + size > ARENA_BLOCK_SIZE) {
+		uint8_t *block = new uint8_t[ARENA_BLOCK_SIZE];
+		*(uint8_t **)block = arena->block;
+		arena->block = block;
+		arena->block_used = ARENA_BLOCK_HEADER_SIZE;
+	}
+	dglClipRectangle *rects = (dglClipRectangle *)(arena->block + arena->block_used);
+	arena->block_used += size;
+	return rects;
+}
+
+static void dglFreeRegionRects(dglRegionArena *arena, dglClipRectangle *rects, int capacity) {
+	if (rects == NULL)
+		return;
+	int c = dglGetRegionCapacityClass(capacity);
+	if (arena == NULL || c >= DGL_REGION_ARENA_NU_CLASSES) {
+		delete [] rects;
+		return;
+	}
+	*(void **)rects = arena->free_list[c];
+	arena->free_list[c] = rects;
+}
+
+// Basic region functions.
+
+dglRegion *dglCreateRegion(dglRegionArena *arena) {
+	dglRegion *region = new dglRegion;
+	region->arena = arena;
+	region->nu_rects = 0;
+	region->capacity = 0;
+	region->rects = NULL;
+	dglSetClipRectangle(0, 0, 0, 0, region->extents);
+	return region;
+}
+
+void dglDestroyRegion(dglRegion *region) {
+	dglFreeRegionRects(region->arena, region->rects, region->capacity);
+	delete region;
+}
+
+void dglClearRegion(dglRegion *region) {
+	region->nu_rects = 0;
+	dglSetClipRectangle(0, 0, 0, 0, region->extents);
+}
+
+static void dglReserveRegionRects(dglRegion *region, int n) {
+	if (n <= region->capacity)
+		return;
+	dglFreeRegionRects(region->arena, region->rects, region->capacity);
+	region->rects = dglAllocateRegionRects(region->arena, n, &region->capacity);
+}
+
+void dglSetRegionRectangle(dglRegion *region, int x, int y, int w, int h) {
+	if (w <= 0 || h <= 0) {
+		dglClearRegion(region);
+		return;
+	}
+	dglReserveRegionRects(region, 1);
+	dglSetClipRectangle(x, y, x + w, y + h, region->rects[0]);
+	region->nu_rects = 1;
+	region->extents = region->rects[0];
+}
+
+void dglCopyRegion(dglRegion *dest, const dglRegion *src) {
+	if (dest == src)
+		return;
+	dglReserveRegionRects(dest, src->nu_rects);
+	memcpy(dest->rects, src->rects, src->nu_rects * sizeof(dglClipRectangle));
+	dest->nu_rects = src->nu_rects;
+	dest->extents = src->extents;
+}
+
+static void dglUpdateRegionExtents(dglRegion *region) {
+	if (region->nu_rects == 0) {
+		dglSetClipRectangle(0, 0, 0, 0, region->extents);
+		return;
+	}
+	dglClipRectangle *e = &region->extents;
+	e->y1 = region->rects[0].y1;
+	e->y2 = region->rects[region->nu_rects - 1].y2;
+	e->x1 = INT_MAX;
+	e->x2 = INT_MIN;
+	for (int i = 0; i < region->nu_rects; i++) {
+		if (region->rects[i].x1 < e->x1)
+			e->x1 = region->rects[i].x1;
+		if (region->rects[i].x2 > e->x2)
+			e->x2 = region->rects[i].x2;
+	}
+}
+
+void dglTranslateRegion(dglRegion *region, int dx, int dy) {
+	if (region->nu_rects == 0)
+		return;
+	for (int i = 0; i < region->nu_rects; i++) {
+		region->rects[i].x1 += dx;
+		region->rects[i].y1 += dy;
+		region->rects[i].x2 += dx;
+		region->rects[i].y2 += dy;
+	}
+	region->extents.x1 += dx;
+	region->extents.y1 += dy;
+	region->extents.x2 += dx;
+	region->extents.y2 += dy;
+}
+
+bool dglRegionContainsPoint(const dglRegion *region, int x, int y) {
+	const dglClipRectangle *e = &region->extents;
+	if (region->nu_rects == 0 || x < e->x1 || x >= e->x2 || y < e->y1 || y >= e->y2)
+		return false;
+	for (int i = 0; i < region->nu_rects; i++) {
+		const dglClipRectangle *r = &region->rects[i];
+		if (r->y1 > y)
+			break;
+		if (y < r->y2 && x >= r->x1 && x < r->x2)
+			return true;
+	}
+	return false;
+}
+
+int dglGetRegionArea(const dglRegion *region) {
+	int area = 0;
+	for (int i = 0; i < region->nu_rects; i++)
+		area += (region->rects[i].x2 - region->rects[i].x1) *
+			(region->rects[i].y2 - region->rects[i].y1);
+	return area;
+}
+
+// Set operations.
+
+// Output of a set operation, built band by band.
+
+class dglRegionBuilder {
+public :
+	dglRegionArena *arena;
+	dglClipRectangle *rects;
+	int nu_rects;
+	int capacity;
+	int previous_band;	// Start of the previous band, or -1.
+	int current_band;	// Start of the band being built.
+	int y1, y2;		// Vertical extent of the band being built.
+};
+
+static void dglBeginRegionBand(dglRegionBuilder *builder, int y1, int y2) {
+	builder->current_band = builder->nu_rects;
+	builder->y1 = y1;
+	builder->y2 = y2;
+}
+
+// Append a span to the current band. Spans must be added in order of x1;
+// a span that touches or overlaps the previous one extends it.
+
+static void dglAddRegionSpan(dglRegionBuilder *builder, int x1, int x2) {
+	if (x1 >= x2)
+		return;
+	if (builder->nu_rects > builder->current_band &&
+	x1 <= builder->rects[builder->nu_rects - 1].x2) {
+		if (x2 > builder->rects[builder->nu_rects - 1].x2)
+			builder->rects[builder->nu_rects - 1].x2 = x2;
+		return;
+	}
+	if (builder->nu_rects == builder->capacity) {
+		int capacity;
+		dglClipRectangle *rects = dglAllocateRegionRects(builder->arena,
+			builder->capacity * 2, &capacity);
+		memcpy(rects, builder->rects, builder->nu_rects * sizeof(dglClipRectangle));
+		dglFreeRegionRects(builder->arena, builder->rects, builder->capacity);
+		builder->rects = rects;
+		builder->capacity = capacity;
+	}
+	dglSetClipRectangle(x1, builder->y1, x2, builder->y2,
+		builder->rects[builder->nu_rects]);
+	builder->nu_rects++;
+}
+
+// Finish the current band, merging it with the previous band when that ends
+// where it starts and has the same spans.
+
+static void dglEndRegionBand(dglRegionBuilder *builder) {
+	int start = builder->current_band;
+	int n = builder->nu_rects - start;
+	if (n == 0)
+		return;
+	int previous = builder->previous_band;
+	if (previous >= 0 && start - previous == n &&
+	builder->rects[previous].y2 == builder->y1) {
+		bool same = true;
+		for (int i = 0; i < n; i++)
+			if (builder->rects[previous + i].x1 != builder->rects[start + i].x1 ||
+			builder->rects[previous + i].x2 != builder->rects[start + i].x2) {
+				same = false;
+				break;
+			}
+		if (same) {
+			for (int i = 0; i < n; i++)
+				builder->rects[previous + i].y2 = builder->y2;
+			builder->nu_rects = start;
+			return;
+		}
+	}
+	builder->previous_band = start;
+}
+
+// Return the end of the band starting at rectangle i.
+
+DGL_INLINE_ONLY static int dglGetRegionBandEnd(const dglRegion *region, int i) {
+	int y1 = region->rects[i].y1;
+	int n = i + 1;
+	while (n < region->nu_rects && region->rects[n].y1 == y1)
+		n++;
+	return n;
+}
+
+// Add the spans of the part of a band of a single operand.
+
+static void dglAddRegionBand(dglRegionBuilder *builder, const dglClipRectangle *rects,
+int start, int end, int y1, int y2) {
+	dglBeginRegionBand(builder, y1, y2);
+	for (int i = start; i < end; i++)
+		dglAddRegionSpan(builder, rects[i].x1, rects[i].x2);
+	dglEndRegionBand(builder);
+}
+
+// Combine the spans of overlapping bands of both operands.
+
+static void dglCombineRegionBands(dglRegionBuilder *builder, int op,
+const dglClipRectangle *a, int a_start, int a_end,
+const dglClipRectangle *b, int b_start, int b_end, int y1, int y2) {
+	dglBeginRegionBand(builder, y1, y2);
+	int i = a_start;
+	int j = b_start;
+	if (op == REGION_OP_UNION) {
+		while (i < a_end || j < b_end) {
+			if (j >= b_end || (i < a_end && a[i].x1 <= b[j].x1)) {
+				dglAddRegionSpan(builder, a[i].x1, a[i].x2);
+				i++;
+			}
+			else {
+				dglAddRegionSpan(builder, b[j].x1, b[j].x2);
+				j++;
+			}
+		}
+	}
+	else if (op == REGION_OP_INTERSECT) {
+		while (i < a_end && j < b_end) {
+			int x1 = a[i].x1 > b[j].x1 ? a[i].x1 : b[j].x1;
+			int x2 = a[i].x2 < b[j].x2 ? a[i].x2 : b[j].x2;
+			dglAddRegionSpan(builder, x1, x2);
+			if (a[i].x2 < b[j].x2)
+				i++;
+			else
+				j++;
+		}
+	}
+	else {
+		for (; i < a_end; i++) {
+			int x = a[i].x1;
+			// Skip the spans of b that end before this span.
+			while (j < b_end && b[j].x2 <= x)
+				j++;
+			for (int k = j; k < b_end && b[k].x1 < a[i].x2; k++) {
+				if (b[k].x1 > x)
+					dglAddRegionSpan(builder, x, b[k].x1);
+				if (b[k].x2 > x)
+					x = b[k].x2;
+				if (x >= a[i].x2)
+					break;
+			}
+			dglAddRegionSpan(builder, x, a[i].x2);
+		}
+	}
+	dglEndRegionBand(builder);
+}
+
+static void dglRegionOp(dglRegion *dest, const dglRegion *region1, const dglRegion *region2,
+int op) {
+	dglRegionBuilder builder;
+	builder.arena = dest->arena;
+	builder.rects = dglAllocateRegionRects(dest->arena,
+		region1->nu_rects + region2->nu_rects + 1, &builder.capacity);
+	builder.nu_rects = 0;
+	builder.previous_band = -1;
+	const dglClipRectangle *a = region1->rects;
+	const dglClipRectangle *b = region2->rects;
+	int i = 0;
+	int j = 0;
+	int y = INT_MIN;	// Everything above y has been processed.
+	while (i < region1->nu_rects && j < region2->nu_rects) {
+		int i_end = dglGetRegionBandEnd(region1, i);
+		int j_end = dglGetRegionBandEnd(region2, j);
+		int a_top = a[i].y1 > y ? a[i].y1 : y;
+		int b_top = b[j].y1 > y ? b[j].y1 : y;
+		if (a_top < b_top) {
+			// Only region1 has a band here.
+			int bottom = a[i].y2 < b_top ? a[i].y2 : b_top;
+			if (op != REGION_OP_INTERSECT)
+				dglAddRegionBand(&builder, a, i, i_end, a_top, bottom);
+			y = bottom;
+		}
+		else if (b_top < a_top) {
+			int bottom = b[j].y2 < a_top ? b[j].y2 : a_top;
+			if (op == REGION_OP_UNION)
+				dglAddRegionBand(&builder, b, j, j_end, b_top, bottom);
+			y = bottom;
+		}
+		else {
+			int bottom = a[i].y2 < b[j].y2 ? a[i].y2 : b[j].y2;
+			dglCombineRegionBands(&builder, op, a, i, i_end, b, j, j_end, a_top, bottom);
+			y = bottom;
+		}
+		if (y >= a[i].y2)
+			i = i_end;
+		if (y >= b[j].y2)
+			j = j_end;
+	}
+	// Add the remaining bands of a single region.
+	if (op != REGION_OP_INTERSECT)
+		while (i < region1->nu_rects) {
+			int i_end = dglGetRegionBandEnd(region1, i);
+			dglAddRegionBand(&builder, a, i, i_end, a[i].y1 > y ? a[i].y1 : y, a[i].y2);
+			i = i_end;
+		}
+	if (op == REGION_OP_UNION)
+		while (j < region2->nu_rects) {
+			int j_end = dglGetRegionBandEnd(region2, j);
+			dglAddRegionBand(&builder, b, j, j_end, b[j].y1 > y ? b[j].y1 : y, b[j].y2);
+			j = j_end;
+		}
+	dglFreeRegionRects(dest->arena, dest->rects, dest->capacity);
+	dest->rects = builder.rects;
+	dest->capacity = builder.capacity;
+	dest->nu_rects = builder.nu_rects;
+	dglUpdateRegionExtents(dest);
+}
+
+DGL_INLINE_ONLY static bool dglRegionExtentsOverlap(const dglRegion *region1,
+const dglRegion *region2) {
+	const dglClipRectangle *e1 = &region1->extents;
+	const dglClipRectangle *e2 = &region2->extents;
+	return e1->x1 < e2->x2 && e2->x1 < e1->x2 && e1->y1 < e2->y2 && e2->y1 < e1->y2;
+}
+
+void dglUnionRegion(dglRegion *dest, const dglRegion *region1, const dglRegion *region2) {
+	if (region2->nu_rects == 0)
+		dglCopyRegion(dest, region1);
+	else if (region1->nu_rects == 0)
+		dglCopyRegion(dest, region2);
+	else
+		dglRegionOp(dest, region1, region2, REGION_OP_UNION);
+}
+
+void dglIntersectRegion(dglRegion *dest, const dglRegion *region1,
+const dglRegion *region2) {
+	if (region1->nu_rects == 0 || region2->nu_rects == 0 ||
+	!dglRegionExtentsOverlap(region1, region2))
+		dglClearRegion(dest);
+	else
+		dglRegionOp(dest, region1, region2, REGION_OP_INTERSECT);
+}
+
+void dglSubtractRegion(dglRegion *dest, const dglRegion *region1, const dglRegion *region2) {
+	if (region1->nu_rects == 0 || region2->nu_rects == 0 ||
+	!dglRegionExtentsOverlap(region1, region2))
+		dglCopyRegion(dest, region1);
+	else
+		dglRegionOp(dest, region1, region2, REGION_OP_SUBTRACT);
+}
+
+void dglAddRegionRectangle(dglRegion *region, int x, int y, int w, int h) {
+	if (w <= 0 || h <= 0)
+		return;
+	dglRegion rectangle;
+	dglSetClipRectangle(x, y, x + w, y + h, rectangle.extents);
+	rectangle.rects = &rectangle.extents;
+	rectangle.nu_rects = 1;
+	rectangle.capacity = 1;
+	rectangle.arena = NULL;
+	dglUnionRegion(region, region, &rectangle);
+}
+
+// Drawing functions.
+
+void dglFillRegion(dglContext *context, const dglRegion *region, uint32_t pixel) {
+	if (context->occlusion) {
+		// Record the rectangles as separate fills.
+		for (int i = 0; i < region->nu_rects; i++) {
+			const dglClipRectangle *r = &region->rects[i];
+			dglFill(context, r->x1, r->y1, r->x2 - r->x1, r->y2 - r->y1, pixel);
+		}
+		return;
+	}
+	dglFB *fb;
+	DGL_GET_DRAW_FB(context, fb);
+	int bpp = fb->bytes_per_pixel;
+	bool streaming = (fb->flags & DGL_FB_FLAG_WRITE_COMBINED) != 0;
+	for (int i = 0; i < region->nu_rects; i++) {
+		dglClipRectangle r = region->rects[i];
+		if (context->clip_enabled) {
+			const dglClipRectangle *cr = &context->clip;
+			if (r.y1 >= cr->y2)
+				break;
+			if (r.x1 < cr->x1)
+				r.x1 = cr->x1;
+			if (r.y1 < cr->y1)
+				r.y1 = cr->y1;
+			if (r.x2 > cr->x2)
+				r.x2 = cr->x2;
+			if (r.y2 > cr->y2)
+				r.y2 = cr->y2;
+			if (r.x1 >= r.x2 || r.y1 >= r.y2)
+				continue;
+		}
+		int w = r.x2 - r.x1;
+		int y = r.y1 + context->draw_yoffset;
+		uint8_t *dp = fb->framebuffer_addr + y * fb->stride + r.x1 * bpp;
+		for (int j = r.y1; j < r.y2; j++) {
+			if (bpp == 4) {
+				if (streaming)
+					dglStreamFill32(dp, pixel, w);
+				else
+					for (int k = 0; k < w; k++)
+						((uint32_t *)dp)[k] = pixel;
+			}
+			else {
+				if (streaming)
+					dglStreamFill16(dp, pixel, w);
+				else
+					for (int k = 0; k < w; k++)
+						((uint16_t *)dp)[k] = (uint16_t)pixel;
+			}
+			dp += fb->stride;
+		}
+		if (fb->damage)
+			dglAddDamage(fb->damage, r.x1, y, w, r.y2 - r.y1);
+	}
+}
+
+// Copy the rectangles in an order that does not overwrite the source of a
+// rectangle before it is copied: bands from the bottom up when copying
+// downwards, and rectangles within a band from right to left when copying
+// to the right.
+
+void dglCopyAreaRegion(dglContext *context, const dglRegion *region, int dx, int dy) {
+	int n = region->nu_rects;
+	int band_start = dy > 0 ? n : 0;
+	while (dy > 0 ? band_start > 0 : band_start < n) {
+		// Find the band.
+		int start, end;
+		if (dy > 0) {
+			end = band_start;
+			start = end - 1;
+			while (start > 0 && region->rects[start - 1].y1 == region->rects[end - 1].y1)
+				start--;
+			band_start = start;
+		}
+		else {
+			start = band_start;
+			end = dglGetRegionBandEnd(region, start);
+			band_start = end;
+		}
+		for (int k = 0; k < end - start; k++) {
+			const dglClipRectangle *r = &region->rects[dx > 0 ? end - 1 - k : start + k];
+			dglCopyArea(context, r->x1, r->y1, r->x1 + dx, r->y1 + dy, r->x2 - r->x1,
+				r->y2 - r->y1);
+		}
+	}
+}
+
+void dglPutImageRegion(dglContext *context, int x, int y, dglImage *image,
+const dglRegion *region) {
+	for (int i = 0; i < region->nu_rects; i++) {
+		dglClipRectangle r = region->rects[i];
+		if (r.x1 < x)
+			r.x1 = x;
+		if (r.y1 < y)
+			r.y1 = y;
+		if (r.x2 > x + image->xres)
+			r.x2 = x + image->xres;
+		if (r.y2 > y + image->yres)
+			r.y2 = y + image->yres;
+		if (r.x1 < r.x2 && r.y1 < r.y2)
+			dglPutPartialImage(context, r.x1 - x, r.y1 - y, r.x1, r.y1, r.x2 - r.x1,
+				r.y2 - r.y1, image);
+	}
+}
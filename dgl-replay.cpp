@@ -0,0 +1,154 @@
+// Trace replay tool for the DGL graphics library. Replays a trace recorded
+// with dglCreateTracer (see dgl-trace.cpp) into pixmaps with every drawing
+// kernel variant, checks the framebuffers against the checksums stored in
+// the trace and against each other, and reports the time of each variant.
+//
+// Usage: dgl-replay [threads <n>] [save-golden <prefix>] [golden <prefix>]
+//        <trace file>
+// save-golden stores the framebuffers after the regular replay as compressed
+// images named <prefix>-<n>.img, and golden compares the framebuffers of
+// every variant with such images, for example saved by a build with a
+// different configuration (such as DGL_USE_PIXMAN). The exit status is
+// non-zero when any variant does not match.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dgl.h"
+
+static const char *variant_name[DGL_NU_REPLAY_VARIANTS] = {
+	"regular", "streaming", "occlusion", "threaded"
+};
+
+// View of all rows of a replayed framebuffer (the pages of a screen
+// framebuffer are replayed into one pixmap).
+
+static void GetFullView(dglFB *fb, dglImage *view) {
+	*view = *fb;
+	view->yres = fb->total_size / fb->stride;
+}
+
+static bool SaveGolden(dglFB *fb, const char *prefix, int index) {
+	char filename[1024];
+	snprintf(filename, sizeof(filename), "%s-%d.img", prefix, index);
+	dglImage view;
+	GetFullView(fb, &view);
+	dglCompressedImage *cimage = dglCompressImage(&view, 0);
+	bool ok = dglSaveCompressedImage(cimage, filename);
+	dglDestroyCompressedImage(cimage);
+	return ok;
+}
+
+// Return the checksum of a golden image decoded into the pixel format of
+// fb, or false when it cannot be loaded or differs in size.
+
+static bool GetGoldenChecksum(dglFB *fb, const char *prefix, int index, uint64_t *checksum) {
+	char filename[1024];
+	snprintf(filename, sizeof(filename), "%s-%d.img", prefix, index);
+	dglCompressedImage *cimage = dglLoadCompressedImage(filename);
+	if (cimage == NULL)
+		return false;
+	dglImage view;
+	GetFullView(fb, &view);
+	bool ok = cimage->xres == view.xres && cimage->yres == view.yres;
+	if (ok) {
+		dglFB *golden = dglCreatePixmapFB(fb->format, cimage->xres, cimage->yres);
+		dglContext *context = dglCreateContext(golden, golden);
+		dglPutCompressedImage(context, 0, 0, cimage);
+		dglDestroyContext(context);
+		*checksum = dglGetFramebufferChecksum(golden);
+		dglDestroyPixmapFB(golden);
+	}
+	else
+		printf("Golden image %s differs in size.\n", filename);
+	dglDestroyCompressedImage(cimage);
+	return ok;
+}
+
+int main(int argc, char *argv[]) {
+	int nu_threads = 4;
+	const char *save_golden_prefix = NULL;
+	const char *golden_prefix = NULL;
+	const char *filename = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "threads") == 0 && i + 1 < argc)
+			nu_threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "save-golden") == 0 && i + 1 < argc)
+			save_golden_prefix = argv[++i];
+		else if (strcmp(argv[i], "golden") == 0 && i + 1 < argc)
+			golden_prefix = argv[++i];
+		else
+			filename = argv[i];
+	}
+	if (filename == NULL) {
+		printf("Usage: dgl-replay [threads <n>] [save-golden <prefix>] "
+			"[golden <prefix>] <trace file>\n");
+		exit(1);
+	}
+	dglTrace *trace = dglLoadTrace(filename);
+	if (trace == NULL)
+		exit(1);
+	printf("Trace: %d operations, %d frames, %d framebuffers, %d images\n",
+		trace->nu_ops, trace->nu_frames, trace->nu_fbs, trace->nu_images);
+
+	uint64_t *golden_checksum = NULL;
+	uint64_t *reference_checksum = new uint64_t[trace->nu_fbs];
+	bool failed = false;
+	for (int variant = 0; variant < DGL_NU_REPLAY_VARIANTS; variant++) {
+		dglReplayResult result;
+		dglReplayTrace(trace, variant, nu_threads, &result);
+		printf("%-10s %10.3f ms", variant_name[variant], result.time * 1000.0);
+		if (variant == DGL_REPLAY_VARIANT_THREADED)
+			printf(" (%d threads)", nu_threads);
+		if (result.nu_frames_checked > 0) {
+			printf(", %d frames checked", result.nu_frames_checked);
+			if (result.nu_mismatched_frames > 0) {
+				printf(", %d MISMATCHED (first frame %d)", result.nu_mismatched_frames,
+					result.first_mismatched_frame);
+				failed = true;
+			}
+		}
+		for (int i = 0; i < result.nu_fbs; i++) {
+			uint64_t checksum = dglGetFramebufferChecksum(result.fb[i]);
+			if (variant == DGL_REPLAY_VARIANT_REGULAR) {
+				reference_checksum[i] = checksum;
+				if (save_golden_prefix != NULL &&
+				!SaveGolden(result.fb[i], save_golden_prefix, i))
+					failed = true;
+			}
+			else if (checksum != reference_checksum[i]) {
+				printf(", framebuffer %d DIFFERS from regular", i);
+				failed = true;
+			}
+		}
+		if (golden_prefix != NULL) {
+			if (golden_checksum == NULL) {
+				golden_checksum = new uint64_t[result.nu_fbs];
+				for (int i = 0; i < result.nu_fbs; i++)
+					if (!GetGoldenChecksum(result.fb[i], golden_prefix, i,
+					&golden_checksum[i])) {
+						failed = true;
+						golden_prefix = NULL;
+						break;
+					}
+			}
+			for (int i = 0; golden_prefix != NULL && i < result.nu_fbs; i++)
+				if (dglGetFramebufferChecksum(result.fb[i]) != golden_checksum[i]) {
+					printf(", framebuffer %d DIFFERS from golden image", i);
+					failed = true;
+				}
+		}
+		printf("\n");
+		dglFreeReplayResult(&result);
+	}
+	delete [] reference_checksum;
+	delete [] golden_checksum;
+	dglDestroyTrace(trace);
+	if (failed) {
+		printf("Replay FAILED.\n");
+		exit(1);
+	}
+	printf("All variants match.\n");
+	exit(0);
+}
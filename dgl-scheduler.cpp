@@ -0,0 +1,212 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+
+// Frame scheduler for animated applications.
+//
+// Instead of interleaving object updates, drawing and vsync waits by hand,
+// an application registers waiters (normally coroutines, see
+// dgl-coroutine.h) that are resumed when the frame they wait for is drawn.
+// All waiters of a frame draw into the same back buffer, which is then
+// presented once with a presenter (so that with page flipping the next
+// frame is drawn into another page while the previous one is displayed),
+// paced by a frame pacer. When a frame is presented late, the frame counter
+// advances by all the frame intervals that have elapsed, so that waiters
+// skip the missed frames rather than falling further behind.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dgl.h"
+
+#define INITIAL_MAX_WAITERS 16
+
+dglFrameScheduler *dglCreateFrameScheduler(dglScreenFB *fb, int vsync_interval,
+int present_mode) {
+	dglPresenter *presenter = dglCreatePresenter(fb, present_mode, 0);
+	if (presenter == NULL)
+		return NULL;
+	dglFramePacer *pacer = NULL;
+	if (vsync_interval > 0) {
+		pacer = dglCreateFramePacer(fb, vsync_interval);
+		if (pacer == NULL) {
+			dglDestroyPresenter(presenter);
+			return NULL;
+		}
+	}
+	dglFrameScheduler *scheduler = new dglFrameScheduler;
+	scheduler->fb = fb;
+	scheduler->presenter = presenter;
+	scheduler->context = dglCreateContext(fb, fb);
+	scheduler->pacer = pacer;
+	// With page flipping, the next frame may only be drawn into the page
+	// that was displayed once the flip to the presented page has completed.
+	// The frame pacer's vsync wait guarantees that (see dglRunFrame);
+	// without one, flips are tracked with a vsync event source.
+	scheduler->events = NULL;
+	if (presenter->mode == DGL_PRESENT_MODE_PAN && pacer == NULL) {
+		scheduler->events = dglCreateVSyncEvents(fb);
+		presenter->events = scheduler->events;
+	}
+	scheduler->frame = 0;
+	scheduler->drawing = false;
+	scheduler->back_buffer_age = 0;
+	scheduler->frame_intervals = 1;
+	scheduler->nu_frames = 0;
+	scheduler->nu_skipped_frames = 0;
+	scheduler->frame_time = dglGetTime();
+	scheduler->stop = false;
+	scheduler->nu_waiters = 0;
+	scheduler->max_waiters = INITIAL_MAX_WAITERS;
+	scheduler->waiter = new dglFrameWaiter[INITIAL_MAX_WAITERS];
+	scheduler->nu_vsync_waiters = 0;
+	scheduler->max_vsync_waiters = INITIAL_MAX_WAITERS;
+	scheduler->vsync_waiter = new dglFrameWaiter[INITIAL_MAX_WAITERS];
+	return scheduler;
+}
+
+// Waiters that are still pending are cancelled.
+
+void dglDestroyFrameScheduler(dglFrameScheduler *scheduler) {
+	for (int i = 0; i < scheduler->nu_waiters; i++)
+		if (scheduler->waiter[i].cancel != NULL)
+			scheduler->waiter[i].cancel(scheduler->waiter[i].data);
+	for (int i = 0; i < scheduler->nu_vsync_waiters; i++)
+		if (scheduler->vsync_waiter[i].cancel != NULL)
+			scheduler->vsync_waiter[i].cancel(scheduler->vsync_waiter[i].data);
+	delete [] scheduler->waiter;
+	delete [] scheduler->vsync_waiter;
+	if (scheduler->pacer != NULL)
+		dglDestroyFramePacer(scheduler->pacer);
+	if (scheduler->events != NULL) {
+		dglWaitForDisplayPage(scheduler->events);
+		scheduler->presenter->events = NULL;
+		dglDestroyVSyncEvents(scheduler->events);
+	}
+	dglDestroyContext(scheduler->context);
+	dglDestroyPresenter(scheduler->presenter);
+	delete scheduler;
+}
+
+static void dglAddFrameWaiter(dglFrameWaiter *&waiter, int &nu_waiters, int &max_waiters,
+dglFrameWaiterFunc func, dglFrameWaiterFunc cancel, void *data, int frame) {
+	if (nu_waiters == max_waiters) {
+		dglFrameWaiter *new_waiter = new dglFrameWaiter[max_waiters * 2];
+		memcpy(new_waiter, waiter, sizeof(dglFrameWaiter) * nu_waiters);
+		delete [] waiter;
+		waiter = new_waiter;
+		max_waiters *= 2;
+	}
+	waiter[nu_waiters].func = func;
+	waiter[nu_waiters].cancel = cancel;
+	waiter[nu_waiters].data = data;
+	waiter[nu_waiters].frame = frame;
+	nu_waiters++;
+}
+
+int dglScheduleFrameWaiter(dglFrameScheduler *scheduler, int nu_frames,
+dglFrameWaiterFunc func, dglFrameWaiterFunc cancel, void *data) {
+	if (nu_frames < 1)
+		nu_frames = 1;
+	// Outside a frame, scheduler->frame is already the upcoming frame.
+	int frame = scheduler->frame + nu_frames - (scheduler->drawing ? 0 : 1);
+	dglAddFrameWaiter(scheduler->waiter, scheduler->nu_waiters, scheduler->max_waiters,
+		func, cancel, data, frame);
+	return frame;
+}
+
+void dglScheduleVSyncWaiter(dglFrameScheduler *scheduler,
+dglFrameWaiterFunc func, dglFrameWaiterFunc cancel, void *data) {
+	dglAddFrameWaiter(scheduler->vsync_waiter, scheduler->nu_vsync_waiters,
+		scheduler->max_vsync_waiters, func, cancel, data, scheduler->frame);
+}
+
+// Resume the first nu waiters that are due at the given frame (all of them
+// when frame is negative). Waiters that are added by the resumed ones are
+// appended and not resumed in this pass. Resumed waiters are removed while
+// preserving the order of the others.
+
+static void dglResumeFrameWaiters(dglFrameWaiter *&waiter, int &nu_waiters, int frame) {
+	int nu = nu_waiters;
+	bool resumed = false;
+	for (int i = 0; i < nu; i++) {
+		if (frame >= 0 && waiter[i].frame > frame)
+			continue;
+		// The array may be reallocated by the callback.
+		dglFrameWaiter w = waiter[i];
+		waiter[i].func = NULL;
+		resumed = true;
+		w.func(w.data);
+	}
+	if (!resumed)
+		return;
+	int j = 0;
+	for (int i = 0; i < nu_waiters; i++)
+		if (waiter[i].func != NULL)
+			waiter[j++] = waiter[i];
+	nu_waiters = j;
+}
+
+// Draw and present one frame.
+
+bool dglRunFrame(dglFrameScheduler *scheduler) {
+	if (scheduler->nu_waiters == 0 && scheduler->nu_vsync_waiters == 0)
+		return false;
+	// The frame is paced before it is drawn and presented as soon as it is
+	// done. A page flip takes effect at the first vertical blank after it
+	// is requested, so when the pacer's wait (which starts after the
+	// previous present) ends, the previous frame is displayed and the page
+	// it replaced can be drawn into. On the DRM framebuffer, dglWaitVSync
+	// waits for the pending flip itself.
+	int intervals = 1;
+	if (scheduler->pacer != NULL)
+		intervals = dglFramePacerWait(scheduler->pacer);
+	scheduler->back_buffer_age = dglPresenterAcquire(scheduler->presenter,
+		scheduler->context);
+	scheduler->drawing = true;
+	dglResumeFrameWaiters(scheduler->waiter, scheduler->nu_waiters, scheduler->frame);
+	scheduler->drawing = false;
+	dglFlushOcclusion(scheduler->context);
+	dglPresenterPresent(scheduler->presenter);
+	scheduler->frame_time = scheduler->pacer != NULL ?
+		scheduler->pacer->last_vsync_time : dglGetTime();
+	scheduler->frame_intervals = intervals;
+	scheduler->nu_frames++;
+	scheduler->nu_skipped_frames += intervals - 1;
+	scheduler->frame += intervals;
+	dglResumeFrameWaiters(scheduler->vsync_waiter, scheduler->nu_vsync_waiters, - 1);
+	return true;
+}
+
+// Run frames until no waiters are left or dglStopFrameScheduler is called.
+// Returns the number of frames presented.
+
+int dglRunFrameScheduler(dglFrameScheduler *scheduler) {
+	int nu_frames = scheduler->nu_frames;
+	scheduler->stop = false;
+	while (!scheduler->stop)
+		if (!dglRunFrame(scheduler))
+			break;
+	return scheduler->nu_frames - nu_frames;
+}
+
+void dglStopFrameScheduler(dglFrameScheduler *scheduler) {
+	scheduler->stop = true;
+}
@@ -0,0 +1,174 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// Scrolling regions.
+//
+// A scroller covering the whole screen of a screen framebuffer that can pan
+// over a virtual framebuffer at least two screens high treats the virtual
+// framebuffer as a ring buffer. Scrolling moves the displayed area by the
+// scroll amount, so that only the newly exposed rows have to be drawn. When
+// the displayed area would extend beyond the end of the virtual framebuffer,
+// the rows that remain visible are first copied to the other end with a
+// single CopyArea, which happens once every (virtual_yres - yres) / dy
+// scrolls. Other scrollers copy the contents of the region with CopyArea,
+// which uses the framebuffer's accelerated (DMA) copy when available.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dgl.h"
+
+static bool dglScrollerCanPan(dglContext *context, int x, int y, int w, int h) {
+	dglFB *fb;
+	DGL_GET_DRAW_FB(context, fb);
+	int type = fb->flags & DGL_FB_TYPE_MASK;
+	if (type != DGL_FB_TYPE_CONSOLE && type != DGL_FB_TYPE_DRM &&
+	type != DGL_FB_TYPE_SIMULATED)
+		return false;
+	dglScreenFB *sfb = (dglScreenFB *)fb;
+	if (!(sfb->flags & DGL_FB_FLAG_HAVE_PAN_DISPLAY) || sfb->virtual_yres < sfb->yres * 2)
+		return false;
+	// The console framebuffer may only pan in steps of several rows.
+	if (type == DGL_FB_TYPE_CONSOLE && ((dglConsoleFB *)sfb)->ypanstep != 1)
+		return false;
+	return x == 0 && y == 0 && w == sfb->xres && h == sfb->yres;
+}
+
+dglScroller *dglCreateScroller(dglContext *context, int x, int y, int w, int h,
+uint32_t background, int flags) {
+	dglFB *fb;
+	DGL_GET_DRAW_FB(context, fb);
+	dglScroller *scroller = new dglScroller;
+	scroller->context = dglCreateContext(fb, fb);
+	scroller->x = x;
+	scroller->y = y;
+	scroller->w = w;
+	scroller->h = h;
+	scroller->background = background;
+	scroller->nu_scrolls = 0;
+	scroller->nu_wrap_copies = 0;
+	scroller->fb = NULL;
+	if (!(flags & DGL_SCROLLER_FLAG_NO_PAN) && dglScrollerCanPan(context, x, y, w, h)) {
+		scroller->mode = DGL_SCROLL_MODE_PAN;
+		scroller->fb = (dglScreenFB *)fb;
+		// Start with the currently displayed area.
+		dglSetReadYOffset(scroller->context, scroller->fb->display_yoffset);
+		dglSetDrawYOffset(scroller->context, scroller->fb->display_yoffset);
+	}
+	else {
+		if (fb->flags & DGL_FB_FLAG_HAVE_COPY_AREA)
+			scroller->mode = DGL_SCROLL_MODE_COPY_AREA;
+		else
+			scroller->mode = DGL_SCROLL_MODE_SOFTWARE;
+		dglSetReadYOffset(scroller->context, context->draw_yoffset);
+		dglSetDrawYOffset(scroller->context, context->draw_yoffset);
+	}
+	dglSetContextClipRectangle(scroller->context, x, y, x + w, y + h);
+	return scroller;
+}
+
+void dglDestroyScroller(dglScroller *scroller) {
+	dglDestroyContext(scroller->context);
+	delete scroller;
+}
+
+// Scroll by panning the displayed area through the virtual framebuffer.
+
+static void dglScrollPan(dglScroller *scroller, int dy) {
+	dglScreenFB *fb = scroller->fb;
+	dglContext *context = scroller->context;
+	int h = scroller->h;
+	int offset = context->draw_yoffset;
+	int new_offset = offset + dy;
+	if (new_offset < 0 || new_offset + h > fb->virtual_yres) {
+		// Copy the rows that remain visible to the other end of the
+		// virtual framebuffer. Source and destination do not overlap
+		// because the virtual framebuffer is at least two screens high.
+		dglContext copy_context = *context;
+		copy_context.clip_enabled = false;
+		dglSetReadYOffset(&copy_context, 0);
+		dglSetDrawYOffset(&copy_context, 0);
+		if (dy > 0) {
+			dglCopyArea(&copy_context, 0, offset + dy, 0, 0, scroller->w, h - dy);
+			new_offset = 0;
+		}
+		else {
+			new_offset = fb->virtual_yres - h;
+			dglCopyArea(&copy_context, 0, offset, 0, new_offset - dy, scroller->w,
+				h + dy);
+		}
+		scroller->nu_wrap_copies++;
+	}
+	dglSetReadYOffset(context, new_offset);
+	dglSetDrawYOffset(context, new_offset);
+	if (dy > 0)
+		dglFill(context, 0, h - dy, scroller->w, dy, scroller->background);
+	else
+		dglFill(context, 0, 0, scroller->w, - dy, scroller->background);
+	dglPanDisplay(fb, 0, new_offset);
+}
+
+// Scroll by copying the region.
+
+static void dglScrollCopy(dglScroller *scroller, int dy) {
+	dglContext *context = scroller->context;
+	int x = scroller->x;
+	int y = scroller->y;
+	int w = scroller->w;
+	int h = scroller->h;
+	if (dy > 0) {
+		// A top-to-bottom copy handles the overlap.
+		dglCopyArea(context, x, y + dy, x, y, w, h - dy);
+		dglFill(context, x, y + h - dy, w, dy, scroller->background);
+		return;
+	}
+	int amount = - dy;
+	if (scroller->mode == DGL_SCROLL_MODE_SOFTWARE) {
+		// The software copy handles the overlap with a bottom-to-top copy.
+		dglCopyArea(context, x, y, x, y + amount, w, h - amount);
+		dglFill(context, x, y, w, amount, scroller->background);
+		return;
+	}
+	// Copy downwards in bands no higher than the scroll amount, starting
+	// at the bottom, so that source and destination of each accelerated
+	// copy do not overlap.
+	for (int remaining = h - amount; remaining > 0;) {
+		int band = remaining < amount ? remaining : amount;
+		remaining -= band;
+		dglCopyArea(context, x, y + remaining, x, y + remaining + amount, w, band);
+	}
+	dglFill(context, x, y, w, amount, scroller->background);
+}
+
+void dglScroll(dglScroller *scroller, int dy) {
+	if (dy == 0)
+		return;
+	scroller->nu_scrolls++;
+	if (dy >= scroller->h || - dy >= scroller->h) {
+		// Everything scrolls out of view.
+		dglFill(scroller->context, scroller->x, scroller->y, scroller->w, scroller->h,
+			scroller->background);
+		return;
+	}
+	if (scroller->mode == DGL_SCROLL_MODE_PAN)
+		dglScrollPan(scroller, dy);
+	else
+		dglScrollCopy(scroller, dy);
+}
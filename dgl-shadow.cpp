@@ -0,0 +1,269 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// Damage tracking, shadow framebuffer mode and dirty-page updates.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dgl.h"
+
+// Damage tracking.
+
+dglDamage *dglCreateDamage(int width, int nu_rows) {
+	dglDamage *damage = new dglDamage;
+	damage->width = width;
+	damage->nu_rows = nu_rows;
+	damage->x1 = new int[nu_rows];
+	damage->x2 = new int[nu_rows];
+	for (int y = 0; y < nu_rows; y++) {
+		damage->x1[y] = width;
+		damage->x2[y] = 0;
+	}
+	damage->y1 = nu_rows;
+	damage->y2 = 0;
+	return damage;
+}
+
+void dglDestroyDamage(dglDamage *damage) {
+	delete [] damage->x1;
+	delete [] damage->x2;
+	delete damage;
+}
+
+void dglAddDamage(dglDamage *damage, int x, int y, int w, int h) {
+	int x2 = x + w;
+	int y2 = y + h;
+	if (x < 0)
+		x = 0;
+	if (y < 0)
+		y = 0;
+	if (x2 > damage->width)
+		x2 = damage->width;
+	if (y2 > damage->nu_rows)
+		y2 = damage->nu_rows;
+	if (x >= x2 || y >= y2)
+		return;
+	for (int i = y; i < y2; i++) {
+		dglAtomicMin(&damage->x1[i], x);
+		dglAtomicMax(&damage->x2[i], x2);
+	}
+	dglAtomicMin(&damage->y1, y);
+	dglAtomicMax(&damage->y2, y2);
+}
+
+// Mark the rows from y to y + h - 1 as clean. Unlike dglAddDamage, this
+// must not be called while other threads are drawing.
+
+void dglClearDamage(dglDamage *damage, int y, int h) {
+	int y2 = y + h;
+	if (y < damage->y1)
+		y = damage->y1;
+	if (y2 > damage->y2)
+		y2 = damage->y2;
+	if (y >= y2)
+		return;
+	for (int i = y; i < y2; i++) {
+		damage->x1[i] = damage->width;
+		damage->x2[i] = 0;
+	}
+	// Shrink the range of damaged rows when the cleared rows were at
+	// one of its ends.
+	if (y <= damage->y1)
+		damage->y1 = y2;
+	if (y2 >= damage->y2)
+		damage->y2 = y;
+	if (damage->y1 >= damage->y2) {
+		damage->y1 = damage->nu_rows;
+		damage->y2 = 0;
+	}
+}
+
+// Shadow framebuffer mode.
+
+bool dglEnableShadowFramebuffer(dglScreenFB *fb) {
+	if (fb->flags & DGL_FB_FLAG_SHADOW)
+		return true;
+	if (fb->framebuffer_addr == NULL) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglEnableShadowFramebuffer: "
+			"Framebuffer is not memory-mapped\n");
+		return false;
+	}
+	uint8_t *shadow_addr = new uint8_t[fb->total_size];
+	// Read back the current contents once, in one sequential pass.
+	memcpy(shadow_addr, fb->framebuffer_addr, fb->total_size);
+	fb->screen_addr = fb->framebuffer_addr;
+	fb->framebuffer_addr = shadow_addr;
+	fb->damage = dglCreateDamage(fb->virtual_xres, fb->virtual_yres);
+	fb->shadow_saved_flags = fb->flags;
+	// The shadow copy is regular cached memory. DMA copies would operate
+	// on the real screen memory, bypassing the shadow copy.
+	fb->flags &= ~(DGL_FB_FLAG_WRITE_COMBINED | DGL_FB_FLAG_HAVE_COPY_AREA);
+	fb->flags |= DGL_FB_FLAG_SHADOW;
+	dglMessage(DGL_MESSAGE_LOG, "dglEnableShadowFramebuffer: "
+		"Shadow framebuffer mode enabled\n");
+	return true;
+}
+
+void dglDisableShadowFramebuffer(dglScreenFB *fb) {
+	if ((fb->flags & DGL_FB_FLAG_SHADOW) == 0)
+		return;
+	dglDisableDirtyPageUpdates(fb);
+	dglFlushShadowFramebuffer(fb);
+	delete [] fb->framebuffer_addr;
+	fb->framebuffer_addr = fb->screen_addr;
+	fb->screen_addr = NULL;
+	dglDestroyDamage(fb->damage);
+	fb->damage = NULL;
+	fb->flags = fb->shadow_saved_flags;
+}
+
+// Dirty-page updates.
+
+// Write page number page of the shadow copy to the screen memory when it
+// differs from the copy of the screen contents.
+
+static void dglFlushDirtyPage(dglScreenFB *fb, int page, bool streaming) {
+	int offset = page * fb->dirty_page_size;
+	int size = fb->dirty_page_size;
+	if (offset + size > fb->total_size)
+		size = fb->total_size - offset;
+	dglDirtyPageStats *stats = &fb->dirty_page_stats;
+	stats->nu_pages_compared++;
+	if (memcmp(fb->framebuffer_addr + offset, fb->front_addr + offset, size) == 0) {
+		stats->bytes_avoided += size;
+		return;
+	}
+	if (streaming)
+		dglStreamCopy(fb->screen_addr + offset, fb->framebuffer_addr + offset, size);
+	else
+		memcpy(fb->screen_addr + offset, fb->framebuffer_addr + offset, size);
+	memcpy(fb->front_addr + offset, fb->framebuffer_addr + offset, size);
+	stats->nu_pages_written++;
+	stats->bytes_written += size;
+}
+
+// Flush the pages touched by the damaged spans of rows y1 to y2 - 1, in
+// increasing order. The shadow copy holds the complete contents, so whole
+// pages can be written even when only part of a page is damaged.
+
+static void dglFlushDirtyPages(dglScreenFB *fb, int y1, int y2) {
+	dglDamage *damage = fb->damage;
+	bool streaming = (fb->shadow_saved_flags & DGL_FB_FLAG_WRITE_COMBINED) != 0;
+	int bpp = fb->bytes_per_pixel;
+	int page_size = fb->dirty_page_size;
+	int last_page = -1;
+	for (int i = y1; i < y2; i++) {
+		int x1 = damage->x1[i];
+		int x2 = damage->x2[i];
+		if (x1 >= x2)
+			continue;
+		fb->dirty_page_stats.bytes_damaged += (x2 - x1) * bpp;
+		int first = (i * fb->stride + x1 * bpp) / page_size;
+		int last = (i * fb->stride + x2 * bpp - 1) / page_size;
+		if (first <= last_page)
+			first = last_page + 1;
+		for (int page = first; page <= last; page++)
+			dglFlushDirtyPage(fb, page, streaming);
+		if (last > last_page)
+			last_page = last;
+	}
+	fb->dirty_page_stats.nu_flushes++;
+}
+
+bool dglEnableDirtyPageUpdates(dglScreenFB *fb, int page_size) {
+	if (!dglEnableShadowFramebuffer(fb))
+		return false;
+	if (page_size <= 0)
+		page_size = sysconf(_SC_PAGESIZE);
+	fb->dirty_page_size = page_size;
+	if (fb->front_addr != NULL)
+		return true;
+	// Bring the screen up to date, then copy its contents.
+	dglFlushShadowFramebuffer(fb);
+	fb->front_addr = new uint8_t[fb->total_size];
+	memcpy(fb->front_addr, fb->framebuffer_addr, fb->total_size);
+	dglResetDirtyPageStats(fb);
+	dglMessage(DGL_MESSAGE_LOG, "dglEnableDirtyPageUpdates: "
+		"Dirty-page updates enabled (page size %d)\n", page_size);
+	return true;
+}
+
+void dglDisableDirtyPageUpdates(dglScreenFB *fb) {
+	if (fb->front_addr == NULL)
+		return;
+	dglFlushShadowFramebuffer(fb);
+	delete [] fb->front_addr;
+	fb->front_addr = NULL;
+}
+
+void dglGetDirtyPageStats(dglScreenFB *fb, dglDirtyPageStats *stats) {
+	*stats = fb->dirty_page_stats;
+}
+
+void dglResetDirtyPageStats(dglScreenFB *fb) {
+	memset(&fb->dirty_page_stats, 0, sizeof(dglDirtyPageStats));
+}
+
+// Write the damaged parts of the rows from y to y + h - 1 to the real
+// screen memory. Rows are processed in order so that the screen memory is
+// written sequentially.
+
+void dglFlushShadowFramebufferArea(dglScreenFB *fb, int y, int h) {
+	if ((fb->flags & DGL_FB_FLAG_SHADOW) == 0)
+		return;
+	dglDamage *damage = fb->damage;
+	int y1 = y;
+	int y2 = y + h;
+	if (y1 < damage->y1)
+		y1 = damage->y1;
+	if (y2 > damage->y2)
+		y2 = damage->y2;
+	if (y1 >= y2)
+		return;
+	if (fb->front_addr != NULL) {
+		dglFlushDirtyPages(fb, y1, y2);
+		dglClearDamage(damage, y1, y2 - y1);
+		return;
+	}
+	bool streaming = (fb->shadow_saved_flags & DGL_FB_FLAG_WRITE_COMBINED) != 0;
+	int bpp = fb->bytes_per_pixel;
+	for (int i = y1; i < y2; i++) {
+		int x1 = damage->x1[i];
+		int x2 = damage->x2[i];
+		if (x1 >= x2)
+			continue;
+		int offset = i * fb->stride + x1 * bpp;
+		if (streaming)
+			dglStreamCopy(fb->screen_addr + offset, fb->framebuffer_addr + offset,
+				(x2 - x1) * bpp);
+		else
+			memcpy(fb->screen_addr + offset, fb->framebuffer_addr + offset,
+				(x2 - x1) * bpp);
+	}
+	dglClearDamage(damage, y1, y2 - y1);
+}
+
+void dglFlushShadowFramebuffer(dglScreenFB *fb) {
+	if ((fb->flags & DGL_FB_FLAG_SHADOW) == 0)
+		return;
+	dglFlushShadowFramebufferArea(fb, 0, fb->virtual_yres);
+}
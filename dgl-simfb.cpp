@@ -0,0 +1,94 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// Simulated screen framebuffer.
+//
+// The simulated framebuffer behaves like a console or DRM framebuffer with
+// the given number of pages, but lives in system memory and is not shown
+// anywhere. Panning only changes the displayed offset, and WaitVSync sleeps
+// until the next vertical blank of a display refreshing at a nominal rate.
+// It allows code that presents frames to a screen framebuffer (presenters,
+// scrollers, the compositor) to be run and tested without a display or
+// superuser privileges; the displayed page can be read back from memory.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dgl.h"
+
+#define NOMINAL_REFRESH_RATE 60.0
+
+static void dglSimulatedFBPanDisplay(dglScreenFB *fb, int x, int y) {
+	// dglPanDisplay updates the displayed offset.
+}
+
+static void dglSimulatedFBWaitVSync(dglScreenFB *fb) {
+	dglSimulatedFB *sfb = (dglSimulatedFB *)fb;
+	dglSleepUntilNextNominalVSync(sfb->refresh_period);
+}
+
+dglSimulatedFB *dglCreateSimulatedFramebuffer(uint32_t format, int width, int height,
+int nu_pages) {
+	if (width <= 0 || height <= 0) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglCreateSimulatedFramebuffer: Invalid dimensions\n");
+		return NULL;
+	}
+	if (nu_pages < 1)
+		nu_pages = 1;
+	dglSimulatedFB *sfb = new dglSimulatedFB;
+	sfb->format = format;
+	sfb->bytes_per_pixel = DGL_FORMAT_GET_BYTES_PER_PIXEL(format);
+	sfb->xres = width;
+	sfb->yres = height;
+	sfb->stride = (width * sfb->bytes_per_pixel + 15) & ~15;
+	sfb->virtual_xres = width;
+	sfb->virtual_yres = height * nu_pages;
+	sfb->nu_pages = nu_pages;
+	sfb->total_size = sfb->stride * sfb->virtual_yres;
+	sfb->framebuffer_addr = new uint8_t[sfb->total_size];
+	memset(sfb->framebuffer_addr, 0, sfb->total_size);
+	sfb->flags = DGL_FB_TYPE_SIMULATED | DGL_FB_FLAG_HAVE_PAN_DISPLAY |
+		DGL_FB_FLAG_HAVE_WAIT_VSYNC;
+	sfb->damage = NULL;
+	sfb->display_yoffset = 0;
+	sfb->screen_addr = NULL;
+	sfb->shadow_saved_flags = 0;
+	sfb->copy_calibration = NULL;
+	sfb->front_addr = NULL;
+	sfb->nu_pan_display_calls = 0;
+	sfb->pan_display_time_total_ns = 0;
+	sfb->pan_display_time_max_ns = 0;
+	sfb->PanDisplayFunc = dglSimulatedFBPanDisplay;
+	sfb->WaitVSyncFunc = dglSimulatedFBWaitVSync;
+	sfb->CopyAreaFunc = NULL;
+	sfb->refresh_period = 1.0 / NOMINAL_REFRESH_RATE;
+	// Calibrate the frame-sized copy kernel before the first frame.
+	dglInitLargeCopy();
+	return sfb;
+}
+
+void dglDestroySimulatedFramebuffer(dglSimulatedFB *sfb) {
+	if (sfb->flags & DGL_FB_FLAG_SHADOW)
+		dglDisableShadowFramebuffer(sfb);
+	dglDisableCopyAreaCalibration(sfb);
+	delete [] sfb->framebuffer_addr;
+	delete sfb;
+}
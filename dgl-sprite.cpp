@@ -0,0 +1,194 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// Sprites with transparent pixels.
+//
+// A sprite is encoded once from an image, using either a color key or an
+// alpha threshold to decide which pixels are transparent. For every row,
+// only the runs of opaque pixels are stored, so that drawing a sprite
+// skips transparent areas entirely and copies each opaque run with a single
+// memory copy, without testing individual pixels.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dgl.h"
+
+DGL_INLINE_ONLY static uint32_t dglGetImagePixel(dglImage *image, int x, int y) {
+	uint8_t *p = image->framebuffer_addr + y * image->stride + x * image->bytes_per_pixel;
+	if (image->bytes_per_pixel == 4)
+		return *(uint32_t *)p;
+	else
+		return *(uint16_t *)p;
+}
+
+// Return whether a pixel is opaque. When alpha is set, value is the minimum
+// alpha of an opaque pixel, otherwise it is the color key.
+
+DGL_INLINE_ONLY static bool dglSpritePixelIsOpaque(dglImage *image, int x, int y,
+bool alpha, uint32_t value) {
+	uint32_t pixel = dglGetImagePixel(image, x, y);
+	if (alpha)
+		return (pixel >> 24) >= value;
+	return pixel != value;
+}
+
+static dglSprite *dglCreateSprite(dglImage *image, bool alpha, uint32_t value) {
+	// Count the runs and opaque pixels.
+	int nu_runs = 0;
+	int nu_opaque_pixels = 0;
+	for (int y = 0; y < image->yres; y++) {
+		bool in_run = false;
+		for (int x = 0; x < image->xres; x++) {
+			bool opaque = dglSpritePixelIsOpaque(image, x, y, alpha, value);
+			if (opaque) {
+				if (!in_run)
+					nu_runs++;
+				nu_opaque_pixels++;
+			}
+			in_run = opaque;
+		}
+	}
+	dglSprite *sprite = new dglSprite;
+	sprite->format = image->format;
+	sprite->bytes_per_pixel = image->bytes_per_pixel;
+	sprite->xres = image->xres;
+	sprite->yres = image->yres;
+	sprite->nu_runs = nu_runs;
+	sprite->nu_opaque_pixels = nu_opaque_pixels;
+	sprite->row_run = new int[image->yres + 1];
+	sprite->run = new dglSpriteRun[nu_runs];
+	sprite->pixels = new uint8_t[nu_opaque_pixels * image->bytes_per_pixel];
+	// Encode the runs.
+	int bpp = image->bytes_per_pixel;
+	int run_index = 0;
+	int offset = 0;
+	for (int y = 0; y < image->yres; y++) {
+		sprite->row_run[y] = run_index;
+		int x = 0;
+		while (x < image->xres) {
+			if (!dglSpritePixelIsOpaque(image, x, y, alpha, value)) {
+				x++;
+				continue;
+			}
+			int x1 = x;
+			while (x < image->xres && dglSpritePixelIsOpaque(image, x, y, alpha, value))
+				x++;
+			dglSpriteRun *run = &sprite->run[run_index];
+			run->x = x1;
+			run->w = x - x1;
+			run->offset = offset;
+			memcpy(sprite->pixels + offset, image->framebuffer_addr +
+				y * image->stride + x1 * bpp, run->w * bpp);
+			offset += run->w * bpp;
+			run_index++;
+		}
+	}
+	sprite->row_run[image->yres] = run_index;
+	return sprite;
+}
+
+// Create a sprite from an image in which pixels equal to color_key are
+// transparent.
+
+dglSprite *dglCreateSpriteFromImage(dglImage *image, uint32_t color_key) {
+	return dglCreateSprite(image, false, color_key);
+}
+
+// Create a sprite from an image with an alpha channel (DGL_FORMAT_ARGB8888 or
+// DGL_FORMAT_ABGR8888). Pixels with an alpha value lower than alpha_threshold
+// (0 to 255) are transparent; all other pixels are drawn fully opaque.
+
+dglSprite *dglCreateSpriteFromImageWithAlpha(dglImage *image, int alpha_threshold) {
+	if ((image->format & DGL_FORMAT_ALPHA_BIT) == 0 || image->bytes_per_pixel != 4) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglCreateSpriteFromImageWithAlpha: "
+			"Image does not have an alpha channel\n");
+		return NULL;
+	}
+	return dglCreateSprite(image, true, alpha_threshold);
+}
+
+void dglDestroySprite(dglSprite *sprite) {
+	delete [] sprite->row_run;
+	delete [] sprite->run;
+	delete [] sprite->pixels;
+	delete sprite;
+}
+
+// Draw a sprite with its top-left corner at (x, y). Unlike most drawing
+// functions, the sprite is clipped to the draw page (and the context's clip
+// rectangle when enabled), so that it may be partly outside the screen.
+
+void dglPutSprite(dglContext *context, int x, int y, dglSprite *sprite) {
+	if (context->occlusion)
+		dglFlushOcclusion(context);
+	dglFB *fb;
+	DGL_GET_DRAW_FB(context, fb);
+	if (sprite->bytes_per_pixel != fb->bytes_per_pixel) {
+		dglMessage(DGL_MESSAGE_WARNING,
+			"dglPutSprite: Sprite and draw framebuffer differ in format.\n");
+		return;
+	}
+	dglClipRectangle cr;
+	dglSetClipRectangleFromFramebufferDimensions(fb, cr);
+	if (context->clip_enabled) {
+		if (context->clip.x1 > cr.x1)
+			cr.x1 = context->clip.x1;
+		if (context->clip.y1 > cr.y1)
+			cr.y1 = context->clip.y1;
+		if (context->clip.x2 < cr.x2)
+			cr.x2 = context->clip.x2;
+		if (context->clip.y2 < cr.y2)
+			cr.y2 = context->clip.y2;
+	}
+	// Visible part of the sprite in sprite coordinates.
+	int sx1 = cr.x1 - x > 0 ? cr.x1 - x : 0;
+	int sy1 = cr.y1 - y > 0 ? cr.y1 - y : 0;
+	int sx2 = cr.x2 - x < sprite->xres ? cr.x2 - x : sprite->xres;
+	int sy2 = cr.y2 - y < sprite->yres ? cr.y2 - y : sprite->yres;
+	if (sx1 >= sx2 || sy1 >= sy2)
+		return;
+	y += context->draw_yoffset;
+	int bpp = fb->bytes_per_pixel;
+	bool streaming = (fb->flags & DGL_FB_FLAG_WRITE_COMBINED) != 0;
+	uint8_t *row = fb->framebuffer_addr + (y + sy1) * fb->stride;
+	for (int i = sy1; i < sy2; i++) {
+		for (int j = sprite->row_run[i]; j < sprite->row_run[i + 1]; j++) {
+			const dglSpriteRun *run = &sprite->run[j];
+			int rx1 = run->x;
+			int rx2 = run->x + run->w;
+			if (rx1 < sx1)
+				rx1 = sx1;
+			if (rx2 > sx2)
+				rx2 = sx2;
+			if (rx1 >= rx2)
+				continue;
+			uint8_t *dp = row + (x + rx1) * bpp;
+			const uint8_t *sp = sprite->pixels + run->offset + (rx1 - run->x) * bpp;
+			if (streaming)
+				dglStreamCopy(dp, sp, (rx2 - rx1) * bpp);
+			else
+				memcpy(dp, sp, (rx2 - rx1) * bpp);
+		}
+		row += fb->stride;
+	}
+	if (fb->damage)
+		dglAddDamage(fb->damage, x + sx1, y + sy1, sx2 - sx1, sy2 - sy1);
+}
@@ -0,0 +1,98 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// Support for multi-threaded rendering.
+//
+// Each render thread uses its own context, typically with a clip rectangle
+// covering the part of the screen it is responsible for. At the end of a
+// frame every thread calls dglPresentBarrierWait. The last thread to arrive
+// performs the presentation (page flip, vsync wait or shadow framebuffer
+// flush) through the present function while the other threads are still
+// blocked, so that no thread draws into the framebuffer during the
+// presentation and the new draw page is known when they are released.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "dgl.h"
+
+dglPresentBarrier *dglCreatePresentBarrier(int nu_threads, dglPresentFunc present_func,
+void *user_data) {
+	if (nu_threads < 1) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglCreatePresentBarrier: "
+			"Invalid number of threads\n");
+		return NULL;
+	}
+	dglPresentBarrier *barrier = new dglPresentBarrier;
+	barrier->nu_threads = nu_threads;
+	barrier->nu_waiting = 0;
+	barrier->generation = 0;
+	barrier->present_func = present_func;
+	barrier->user_data = user_data;
+	pthread_mutex_t *mutex = new pthread_mutex_t;
+	pthread_cond_t *cond = new pthread_cond_t;
+	pthread_mutex_init(mutex, NULL);
+	pthread_cond_init(cond, NULL);
+	barrier->mutex = mutex;
+	barrier->cond = cond;
+	barrier->nu_frames = 0;
+	barrier->wait_time_total = 0;
+	return barrier;
+}
+
+void dglDestroyPresentBarrier(dglPresentBarrier *barrier) {
+	pthread_mutex_t *mutex = (pthread_mutex_t *)barrier->mutex;
+	pthread_cond_t *cond = (pthread_cond_t *)barrier->cond;
+	pthread_mutex_destroy(mutex);
+	pthread_cond_destroy(cond);
+	delete mutex;
+	delete cond;
+	delete barrier;
+}
+
+// Wait until all render threads have finished the current frame and the
+// frame has been presented. The mutex also orders the drawing (including
+// lock-free damage updates) of all threads before the present function, and
+// the present function before the drawing of the next frame.
+
+void dglPresentBarrierWait(dglPresentBarrier *barrier) {
+	pthread_mutex_t *mutex = (pthread_mutex_t *)barrier->mutex;
+	pthread_cond_t *cond = (pthread_cond_t *)barrier->cond;
+	double start = dglGetTime();
+	pthread_mutex_lock(mutex);
+	unsigned int generation = barrier->generation;
+	barrier->nu_waiting++;
+	if (barrier->nu_waiting == barrier->nu_threads) {
+		// Last thread to arrive; present while the others are blocked.
+		barrier->wait_time_total += dglGetTime() - start;
+		if (barrier->present_func != NULL)
+			barrier->present_func(barrier->user_data);
+		barrier->nu_waiting = 0;
+		barrier->generation++;
+		barrier->nu_frames++;
+		pthread_cond_broadcast(cond);
+	}
+	else {
+		while (generation == barrier->generation)
+			pthread_cond_wait(cond, mutex);
+		barrier->wait_time_total += dglGetTime() - start;
+	}
+	pthread_mutex_unlock(mutex);
+}
@@ -0,0 +1,993 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// Recording and replay of drawing operations.
+//
+// A tracer attached to a context records dglFill, dglCopyArea,
+// dglPutPartialImage (dglPutImage is recorded as such) and dglPutPixel
+// (also from the inline dglPutPixel32 and dglPutPixel16) calls into a
+// compact binary trace, before clipping, together with the context state
+// (framebuffers, y offsets and clip rectangle) whenever it changes.
+// Replaying a trace into pixmaps with each kernel variant and comparing
+// checksums at every frame checks the optimized drawing paths against each
+// other and against the framebuffer contents of the recorded application.
+//
+// Trace file layout: the magic "DGLT" and version as little-endian 32-bit
+// words, followed by operations. Every operation is an operation code byte
+// followed by its arguments, stored as variable-length integers (seven bits
+// per byte, least significant first; signed values are zigzag encoded).
+// Framebuffers and images are defined before their first use, with their
+// pixels compressed with the lossless image codec (see dgl-codec.cpp):
+//
+//   DEFINE_FB     format, xres, yres (page height), number of rows, pixels
+//   DEFINE_IMAGE  format, xres, yres, pixels
+//   SET_DRAW      framebuffer, y offset
+//   SET_READ      framebuffer, y offset
+//   SET_CLIP      x1, y1, x2, y2
+//   DISABLE_CLIP
+//   FILL          x, y, w, h, pixel
+//   COPY_AREA     sx, sy, dx, dy, w, h
+//   PUT_IMAGE     image, sx, sy, dx, dy, w, h
+//   PUT_PIXEL     x, y, pixel
+//   FRAME         number of checksums, checksums (64-bit)
+//
+// Compressed pixels are stored as the strip height, the number of strips,
+// the strip offsets and the compressed data.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "dgl.h"
+
+#define TRACE_MAGIC 0x544C4744	// "DGLT"
+#define TRACE_VERSION 1
+// Operation codes that only occur in trace files.
+#define TRACE_FILE_OP_DEFINE_FB 16
+#define TRACE_FILE_OP_DEFINE_IMAGE 17
+
+#define TRACER_BUFFER_SIZE 65536
+#define TRACER_INITIAL_IMAGE_TABLE_SIZE 64
+// Limits for values read from trace files.
+#define TRACE_MAX_COORDINATE (1 << 24)
+#define TRACE_MAX_DIMENSION 32768
+#define TRACE_MAX_PIXELS (1 << 28)
+
+// Checksum of the pixels of all rows of a pixel buffer, ignoring padding
+// at the end of rows. Only the bits of each 32-bit word set in mask are
+// included.
+
+static uint64_t dglChecksumRows(const uint8_t *p, int stride, int row_size, int nu_rows,
+uint32_t mask) {
+	uint64_t checksum = 0xCBF29CE484222325ULL;
+	for (int y = 0; y < nu_rows; y++) {
+		const uint8_t *rp = p + y * stride;
+		int i = 0;
+		for (; i + 4 <= row_size; i += 4) {
+			uint32_t word;
+			memcpy(&word, rp + i, 4);
+			checksum = (checksum ^ (word & mask)) * 0x100000001B3ULL;
+		}
+		for (; i < row_size; i++)
+			checksum = (checksum ^ rp[i]) * 0x100000001B3ULL;
+	}
+	return checksum;
+}
+
+// The unused byte of 32-bit pixel formats without alpha is not part of the
+// checksum, because it is not preserved by all drawing functions (nor by the
+// image codec).
+
+uint64_t dglGetFramebufferChecksum(dglFB *fb) {
+	uint32_t mask = 0xFFFFFFFF;
+	if (!(fb->format & (DGL_FORMAT_PIXEL_SIZE_16_BIT | DGL_FORMAT_ALPHA_BIT)))
+		mask = 0x00FFFFFF;
+	return dglChecksumRows(fb->framebuffer_addr, fb->stride, fb->xres * fb->bytes_per_pixel,
+		fb->total_size / fb->stride, mask);
+}
+
+// Tracer output.
+
+static void dglTracerFlush(dglTracer *tracer) {
+	if (tracer->buffer_size > 0 && fwrite(tracer->buffer, tracer->buffer_size, 1,
+	(FILE *)tracer->file) != 1)
+		tracer->write_error = true;
+	tracer->bytes_written += tracer->buffer_size;
+	tracer->buffer_size = 0;
+}
+
+static void dglTracerPutBytes(dglTracer *tracer, const void *data, int size) {
+	if (tracer->buffer_size + size > TRACER_BUFFER_SIZE)
+		dglTracerFlush(tracer);
+	if (size > TRACER_BUFFER_SIZE) {
+		if (fwrite(data, size, 1, (FILE *)tracer->file) != 1)
+			tracer->write_error = true;
+		tracer->bytes_written += size;
+		return;
+	}
+	memcpy(tracer->buffer + tracer->buffer_size, data, size);
+	tracer->buffer_size += size;
+}
+
+static void dglTracerPutUnsigned(dglTracer *tracer, uint32_t value) {
+	uint8_t bytes[5];
+	int n = 0;
+	while (value >= 0x80) {
+		bytes[n++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	bytes[n++] = value;
+	dglTracerPutBytes(tracer, bytes, n);
+}
+
+static void dglTracerPutSigned(dglTracer *tracer, int value) {
+	dglTracerPutUnsigned(tracer, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+}
+
+static void dglTracerPutOpCode(dglTracer *tracer, int code) {
+	uint8_t byte = code;
+	dglTracerPutBytes(tracer, &byte, 1);
+}
+
+// Store all rows of a pixel buffer compressed.
+
+static void dglTracerPutPixels(dglTracer *tracer, dglPixelBuffer *buffer, int nu_rows) {
+	dglImage view = *buffer;
+	view.yres = nu_rows;
+	view.total_size = nu_rows * view.stride;
+	dglCompressedImage *cimage = dglCompressImage(&view, 0);
+	dglTracerPutUnsigned(tracer, cimage->strip_height);
+	dglTracerPutUnsigned(tracer, cimage->nu_strips);
+	for (int i = 0; i <= cimage->nu_strips; i++)
+		dglTracerPutUnsigned(tracer, cimage->strip_offset[i]);
+	dglTracerPutBytes(tracer, cimage->data, cimage->size);
+	dglDestroyCompressedImage(cimage);
+}
+
+// Return the number of a framebuffer in the trace, defining it with its
+// current contents when it is new.
+
+static int dglTracerGetFramebufferId(dglTracer *tracer, dglFB *fb) {
+	for (int i = 0; i < tracer->nu_fbs; i++)
+		if (tracer->fb[i] == fb)
+			return i;
+	if (tracer->nu_fbs == tracer->max_fbs) {
+		dglFB **fbs = new dglFB *[tracer->max_fbs * 2];
+		memcpy(fbs, tracer->fb, sizeof(dglFB *) * tracer->nu_fbs);
+		delete [] tracer->fb;
+		tracer->fb = fbs;
+		tracer->max_fbs *= 2;
+	}
+	int nu_rows = fb->total_size / fb->stride;
+	dglTracerPutOpCode(tracer, TRACE_FILE_OP_DEFINE_FB);
+	dglTracerPutUnsigned(tracer, fb->format);
+	dglTracerPutUnsigned(tracer, fb->xres);
+	dglTracerPutUnsigned(tracer, fb->yres);
+	dglTracerPutUnsigned(tracer, nu_rows);
+	dglTracerPutPixels(tracer, fb, nu_rows);
+	tracer->fb[tracer->nu_fbs] = fb;
+	return tracer->nu_fbs++;
+}
+
+static void dglTracerInsertImage(dglTracer *tracer, uint64_t checksum, int id) {
+	int mask = tracer->image_table_size - 1;
+	int i = checksum & mask;
+	while (tracer->image_id[i] >= 0)
+		i = (i + 1) & mask;
+	tracer->image_checksum[i] = checksum;
+	tracer->image_id[i] = id;
+}
+
+// Return the number of an image in the trace, identified by its contents.
+
+static int dglTracerGetImageId(dglTracer *tracer, dglImage *image) {
+	uint64_t checksum = dglChecksumRows(image->framebuffer_addr, image->stride,
+		image->xres * image->bytes_per_pixel, image->yres, 0xFFFFFFFF);
+	checksum ^= ((uint64_t)image->format << 32) ^ ((uint64_t)image->xres << 16) ^ image->yres;
+	int mask = tracer->image_table_size - 1;
+	for (int i = checksum & mask; tracer->image_id[i] >= 0; i = (i + 1) & mask)
+		if (tracer->image_checksum[i] == checksum)
+			return tracer->image_id[i];
+	if (tracer->nu_images * 2 >= tracer->image_table_size) {
+		uint64_t *old_checksum = tracer->image_checksum;
+		int *old_id = tracer->image_id;
+		int old_size = tracer->image_table_size;
+		tracer->image_table_size *= 2;
+		tracer->image_checksum = new uint64_t[tracer->image_table_size];
+		tracer->image_id = new int[tracer->image_table_size];
+		for (int i = 0; i < tracer->image_table_size; i++)
+			tracer->image_id[i] = - 1;
+		for (int i = 0; i < old_size; i++)
+			if (old_id[i] >= 0)
+				dglTracerInsertImage(tracer, old_checksum[i], old_id[i]);
+		delete [] old_checksum;
+		delete [] old_id;
+	}
+	dglTracerPutOpCode(tracer, TRACE_FILE_OP_DEFINE_IMAGE);
+	dglTracerPutUnsigned(tracer, image->format);
+	dglTracerPutUnsigned(tracer, image->xres);
+	dglTracerPutUnsigned(tracer, image->yres);
+	dglTracerPutPixels(tracer, image, image->yres);
+	dglTracerInsertImage(tracer, checksum, tracer->nu_images);
+	return tracer->nu_images++;
+}
+
+// Record the context state that an operation depends on where it differs
+// from the state of the trace.
+
+static void dglTracerSetState(dglTracer *tracer, dglContext *context, bool read) {
+	int id = dglTracerGetFramebufferId(tracer, context->draw_fb);
+	if (id != tracer->draw_fb_id || context->draw_yoffset != tracer->draw_yoffset) {
+		dglTracerPutOpCode(tracer, DGL_TRACE_OP_SET_DRAW);
+		dglTracerPutUnsigned(tracer, id);
+		dglTracerPutSigned(tracer, context->draw_yoffset);
+		tracer->draw_fb_id = id;
+		tracer->draw_yoffset = context->draw_yoffset;
+	}
+	if (read) {
+		id = dglTracerGetFramebufferId(tracer, context->read_fb);
+		if (id != tracer->read_fb_id || context->read_yoffset != tracer->read_yoffset) {
+			dglTracerPutOpCode(tracer, DGL_TRACE_OP_SET_READ);
+			dglTracerPutUnsigned(tracer, id);
+			dglTracerPutSigned(tracer, context->read_yoffset);
+			tracer->read_fb_id = id;
+			tracer->read_yoffset = context->read_yoffset;
+		}
+	}
+	if (context->clip_enabled) {
+		const dglClipRectangle *cr = &context->clip;
+		if (!tracer->clip_enabled || cr->x1 != tracer->clip.x1 || cr->y1 != tracer->clip.y1 ||
+		cr->x2 != tracer->clip.x2 || cr->y2 != tracer->clip.y2) {
+			dglTracerPutOpCode(tracer, DGL_TRACE_OP_SET_CLIP);
+			dglTracerPutSigned(tracer, cr->x1);
+			dglTracerPutSigned(tracer, cr->y1);
+			dglTracerPutSigned(tracer, cr->x2);
+			dglTracerPutSigned(tracer, cr->y2);
+			tracer->clip_enabled = true;
+			tracer->clip = *cr;
+		}
+	}
+	else if (tracer->clip_enabled) {
+		dglTracerPutOpCode(tracer, DGL_TRACE_OP_DISABLE_CLIP);
+		tracer->clip_enabled = false;
+	}
+}
+
+dglTracer *dglCreateTracer(const char *filename, int flags) {
+	FILE *f = fopen(filename, "wb");
+	if (f == NULL) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglCreateTracer: Could not open file %s\n",
+			filename);
+		return NULL;
+	}
+	dglTracer *tracer = new dglTracer;
+	tracer->file = f;
+	tracer->flags = flags;
+	tracer->nu_fbs = 0;
+	tracer->max_fbs = 4;
+	tracer->fb = new dglFB *[tracer->max_fbs];
+	tracer->image_table_size = TRACER_INITIAL_IMAGE_TABLE_SIZE;
+	tracer->image_checksum = new uint64_t[tracer->image_table_size];
+	tracer->image_id = new int[tracer->image_table_size];
+	for (int i = 0; i < tracer->image_table_size; i++)
+		tracer->image_id[i] = - 1;
+	tracer->nu_images = 0;
+	tracer->draw_fb_id = - 1;
+	tracer->read_fb_id = - 1;
+	tracer->draw_yoffset = 0;
+	tracer->read_yoffset = 0;
+	tracer->clip_enabled = false;
+	tracer->buffer = new uint8_t[TRACER_BUFFER_SIZE];
+	tracer->buffer_size = 0;
+	tracer->nu_ops = 0;
+	tracer->nu_frames = 0;
+	tracer->bytes_written = 0;
+	tracer->write_error = false;
+	uint32_t header[2];
+	header[0] = TRACE_MAGIC;
+	header[1] = TRACE_VERSION;
+	dglTracerPutBytes(tracer, header, sizeof(header));
+	return tracer;
+}
+
+void dglDestroyTracer(dglTracer *tracer) {
+	dglTracerFlush(tracer);
+	if (fclose((FILE *)tracer->file) != 0 || tracer->write_error)
+		dglMessage(DGL_MESSAGE_WARNING, "dglDestroyTracer: Error writing trace\n");
+	delete [] tracer->fb;
+	delete [] tracer->image_checksum;
+	delete [] tracer->image_id;
+	delete [] tracer->buffer;
+	delete tracer;
+}
+
+void dglSetTracer(dglContext *context, dglTracer *tracer) {
+	// Operations deferred by the occlusion culler were recorded when they
+	// were submitted.
+	if (context->occlusion)
+		dglFlushOcclusion(context);
+	context->tracer = tracer;
+}
+
+void dglTraceFill(dglContext *context, int x, int y, int w, int h, uint32_t pixel) {
+	dglTracer *tracer = context->tracer;
+	dglTracerSetState(tracer, context, false);
+	dglTracerPutOpCode(tracer, DGL_TRACE_OP_FILL);
+	dglTracerPutSigned(tracer, x);
+	dglTracerPutSigned(tracer, y);
+	dglTracerPutSigned(tracer, w);
+	dglTracerPutSigned(tracer, h);
+	dglTracerPutUnsigned(tracer, pixel);
+	tracer->nu_ops++;
+}
+
+void dglTraceCopyArea(dglContext *context, int sx, int sy, int dx, int dy, int w, int h) {
+	dglTracer *tracer = context->tracer;
+	dglTracerSetState(tracer, context, true);
+	dglTracerPutOpCode(tracer, DGL_TRACE_OP_COPY_AREA);
+	dglTracerPutSigned(tracer, sx);
+	dglTracerPutSigned(tracer, sy);
+	dglTracerPutSigned(tracer, dx);
+	dglTracerPutSigned(tracer, dy);
+	dglTracerPutSigned(tracer, w);
+	dglTracerPutSigned(tracer, h);
+	tracer->nu_ops++;
+}
+
+void dglTracePutImage(dglContext *context, int sx, int sy, int dx, int dy, int w, int h,
+dglImage *image) {
+	if (w <= 0 || h <= 0)
+		return;
+	dglTracer *tracer = context->tracer;
+	int id = dglTracerGetImageId(tracer, image);
+	dglTracerSetState(tracer, context, false);
+	dglTracerPutOpCode(tracer, DGL_TRACE_OP_PUT_IMAGE);
+	dglTracerPutUnsigned(tracer, id);
+	dglTracerPutSigned(tracer, sx);
+	dglTracerPutSigned(tracer, sy);
+	dglTracerPutSigned(tracer, dx);
+	dglTracerPutSigned(tracer, dy);
+	dglTracerPutSigned(tracer, w);
+	dglTracerPutSigned(tracer, h);
+	tracer->nu_ops++;
+}
+
+void dglTracePutPixel(dglContext *context, int x, int y, uint32_t pixel) {
+	dglTracer *tracer = context->tracer;
+	dglTracerSetState(tracer, context, false);
+	dglTracerPutOpCode(tracer, DGL_TRACE_OP_PUT_PIXEL);
+	dglTracerPutSigned(tracer, x);
+	dglTracerPutSigned(tracer, y);
+	dglTracerPutUnsigned(tracer, pixel);
+	tracer->nu_ops++;
+}
+
+void dglTraceFrame(dglContext *context) {
+	dglTracer *tracer = context->tracer;
+	if (tracer == NULL)
+		return;
+	if (context->occlusion)
+		dglFlushOcclusion(context);
+	dglTracerPutOpCode(tracer, DGL_TRACE_OP_FRAME);
+	if (tracer->flags & DGL_TRACER_FLAG_CHECKSUMS) {
+		dglTracerPutUnsigned(tracer, tracer->nu_fbs);
+		for (int i = 0; i < tracer->nu_fbs; i++) {
+			uint64_t checksum = dglGetFramebufferChecksum(tracer->fb[i]);
+			dglTracerPutBytes(tracer, &checksum, sizeof(checksum));
+		}
+	}
+	else
+		dglTracerPutUnsigned(tracer, 0);
+	tracer->nu_frames++;
+}
+
+// Trace loading. Every operation is checked so that replaying it stays
+// within the framebuffers and images.
+
+class dglTraceReader {
+public :
+	const uint8_t *p;
+	const uint8_t *end;
+	bool error;
+};
+
+static uint32_t dglTraceGetUnsigned(dglTraceReader *reader) {
+	uint32_t value = 0;
+	for (int shift = 0; shift < 35; shift += 7) {
+		if (reader->p == reader->end) {
+			reader->error = true;
+			return 0;
+		}
+		uint8_t byte = *reader->p++;
+		value |= (uint32_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+			return value;
+	}
+	reader->error = true;
+	return 0;
+}
+
+static int dglTraceGetSigned(dglTraceReader *reader) {
+	uint32_t value = dglTraceGetUnsigned(reader);
+	int v = (int)(value >> 1) ^ - (int)(value & 1);
+	if (v < - TRACE_MAX_COORDINATE || v > TRACE_MAX_COORDINATE)
+		reader->error = true;
+	return v;
+}
+
+// Read compressed pixels and decode them into dest.
+
+static bool dglTraceGetPixels(dglTraceReader *reader, dglImage *dest) {
+	uint32_t strip_height = dglTraceGetUnsigned(reader);
+	uint32_t nu_strips = dglTraceGetUnsigned(reader);
+	if (reader->error || strip_height == 0 ||
+	nu_strips != (dest->yres + strip_height - 1) / strip_height)
+		return false;
+	dglCompressedImage cimage;
+	cimage.xres = dest->xres;
+	cimage.yres = dest->yres;
+	cimage.strip_height = strip_height;
+	cimage.nu_strips = nu_strips;
+	cimage.strip_offset = new uint32_t[nu_strips + 1];
+	bool ok = true;
+	for (uint32_t i = 0; i <= nu_strips; i++) {
+		cimage.strip_offset[i] = dglTraceGetUnsigned(reader);
+		if (i == 0 ? cimage.strip_offset[0] != 0 :
+		cimage.strip_offset[i] < cimage.strip_offset[i - 1])
+			ok = false;
+	}
+	cimage.size = cimage.strip_offset[nu_strips];
+	if (ok && !reader->error && cimage.strip_offset[nu_strips] <=
+	(uint32_t)(reader->end - reader->p)) {
+		cimage.data = (uint8_t *)reader->p;
+		reader->p += cimage.size;
+		dglContext *context = dglCreateContext(dest, dest);
+		dglPutCompressedImage(context, 0, 0, &cimage);
+		dglDestroyContext(context);
+	}
+	else
+		ok = false;
+	delete [] cimage.strip_offset;
+	return ok;
+}
+
+static bool dglTraceGetDimensions(dglTraceReader *reader, uint32_t& format, int& xres,
+int& yres) {
+	format = dglTraceGetUnsigned(reader);
+	xres = dglTraceGetUnsigned(reader);
+	yres = dglTraceGetUnsigned(reader);
+	return !reader->error && xres > 0 && xres <= TRACE_MAX_DIMENSION && yres > 0 &&
+		(uint64_t)xres * yres <= TRACE_MAX_PIXELS;
+}
+
+// State of a trace during loading.
+
+class dglTraceLoadState {
+public :
+	int draw_fb_id;
+	int read_fb_id;
+	int draw_yoffset;
+	int read_yoffset;
+	bool clip_enabled;
+	dglClipRectangle clip;
+};
+
+// Clip an area like the drawing functions and check that what remains lies
+// within the draw framebuffer (and the source within src, when not NULL).
+
+static bool dglTraceAreaValid(dglTrace *trace, const dglTraceLoadState *state,
+const dglPixelBuffer *src, int src_yoffset, int sx, int sy, int dx, int dy, int w, int h) {
+	if (state->draw_fb_id < 0)
+		return false;
+	if (state->clip_enabled) {
+		const dglClipRectangle *cr = &state->clip;
+		if (dx < cr->x1) {
+			w -= cr->x1 - dx;
+			sx += cr->x1 - dx;
+			dx = cr->x1;
+		}
+		if (dy < cr->y1) {
+			h -= cr->y1 - dy;
+			sy += cr->y1 - dy;
+			dy = cr->y1;
+		}
+		if (dx + w > cr->x2)
+			w = cr->x2 - dx;
+		if (dy + h > cr->y2)
+			h = cr->y2 - dy;
+		if (w <= 0 || h <= 0)
+			return true;
+	}
+	const dglImage *fb = trace->fb_contents[state->draw_fb_id];
+	dy += state->draw_yoffset;
+	if (dx < 0 || dx + w > fb->xres || dy < 0 || dy + h > fb->yres)
+		return false;
+	if (src == NULL)
+		return true;
+	sy += src_yoffset;
+	return sx >= 0 && sx + w <= src->xres && sy >= 0 && sy + h <= src->yres;
+}
+
+static bool dglTraceParse(dglTrace *trace, dglTraceReader *reader) {
+	int max_fbs = 4, max_images = 16, max_ops = 1024, max_checksums = 64;
+	trace->fb_yres = new int[max_fbs];
+	trace->fb_contents = new dglImage *[max_fbs];
+	trace->image = new dglImage *[max_images];
+	trace->op = new dglTraceOp[max_ops];
+	trace->frame_checksum = new uint64_t[max_checksums];
+	int nu_checksums = 0;
+	dglTraceLoadState state;
+	state.draw_fb_id = - 1;
+	state.read_fb_id = - 1;
+	state.draw_yoffset = 0;
+	state.read_yoffset = 0;
+	state.clip_enabled = false;
+	while (reader->p < reader->end) {
+		int code = *reader->p++;
+		if (code == TRACE_FILE_OP_DEFINE_FB || code == TRACE_FILE_OP_DEFINE_IMAGE) {
+			uint32_t format;
+			int xres, yres, nu_rows;
+			if (!dglTraceGetDimensions(reader, format, xres, yres))
+				return false;
+			nu_rows = yres;
+			if (code == TRACE_FILE_OP_DEFINE_FB) {
+				nu_rows = dglTraceGetUnsigned(reader);
+				if (reader->error || nu_rows < yres ||
+				(uint64_t)xres * nu_rows > TRACE_MAX_PIXELS)
+					return false;
+			}
+			dglImage *image = dglCreateImage(format, xres, nu_rows);
+			if (!dglTraceGetPixels(reader, image)) {
+				dglDestroyImage(image);
+				return false;
+			}
+			if (code == TRACE_FILE_OP_DEFINE_FB) {
+				if (trace->nu_fbs == max_fbs) {
+					int *fb_yres = new int[max_fbs * 2];
+					dglImage **fb_contents = new dglImage *[max_fbs * 2];
+					memcpy(fb_yres, trace->fb_yres, sizeof(int) * max_fbs);
+					memcpy(fb_contents, trace->fb_contents, sizeof(dglImage *) * max_fbs);
+					delete [] trace->fb_yres;
+					delete [] trace->fb_contents;
+					trace->fb_yres = fb_yres;
+					trace->fb_contents = fb_contents;
+					max_fbs *= 2;
+				}
+				trace->fb_yres[trace->nu_fbs] = yres;
+				trace->fb_contents[trace->nu_fbs] = image;
+				trace->nu_fbs++;
+			}
+			else {
+				if (trace->nu_images == max_images) {
+					dglImage **images = new dglImage *[max_images * 2];
+					memcpy(images, trace->image, sizeof(dglImage *) * max_images);
+					delete [] trace->image;
+					trace->image = images;
+					max_images *= 2;
+				}
+				trace->image[trace->nu_images++] = image;
+			}
+			continue;
+		}
+		if (trace->nu_ops == max_ops) {
+			dglTraceOp *ops = new dglTraceOp[max_ops * 2];
+			memcpy(ops, trace->op, sizeof(dglTraceOp) * max_ops);
+			delete [] trace->op;
+			trace->op = ops;
+			max_ops *= 2;
+		}
+		dglTraceOp *op = &trace->op[trace->nu_ops];
+		op->type = code;
+		op->id = 0;
+		bool valid = true;
+		switch (code) {
+		case DGL_TRACE_OP_SET_DRAW :
+		case DGL_TRACE_OP_SET_READ :
+			op->id = dglTraceGetUnsigned(reader);
+			op->args[0] = dglTraceGetSigned(reader);
+			valid = op->id >= 0 && op->id < trace->nu_fbs;
+			if (code == DGL_TRACE_OP_SET_DRAW) {
+				state.draw_fb_id = op->id;
+				state.draw_yoffset = op->args[0];
+			}
+			else {
+				state.read_fb_id = op->id;
+				state.read_yoffset = op->args[0];
+			}
+			break;
+		case DGL_TRACE_OP_SET_CLIP :
+			for (int i = 0; i < 4; i++)
+				op->args[i] = dglTraceGetSigned(reader);
+			state.clip_enabled = true;
+			dglSetClipRectangle(op->args[0], op->args[1], op->args[2], op->args[3],
+				state.clip);
+			break;
+		case DGL_TRACE_OP_DISABLE_CLIP :
+			state.clip_enabled = false;
+			break;
+		case DGL_TRACE_OP_FILL :
+			for (int i = 0; i < 4; i++)
+				op->args[i] = dglTraceGetSigned(reader);
+			op->pixel = dglTraceGetUnsigned(reader);
+			valid = op->args[2] > 0 && op->args[3] > 0 && dglTraceAreaValid(trace, &state,
+				NULL, 0, 0, 0, op->args[0], op->args[1], op->args[2], op->args[3]);
+			break;
+		case DGL_TRACE_OP_COPY_AREA :
+			for (int i = 0; i < 6; i++)
+				op->args[i] = dglTraceGetSigned(reader);
+			valid = op->args[4] > 0 && op->args[5] > 0 && state.read_fb_id >= 0 &&
+				dglTraceAreaValid(trace, &state, trace->fb_contents[state.read_fb_id],
+				state.read_yoffset, op->args[0], op->args[1], op->args[2], op->args[3],
+				op->args[4], op->args[5]);
+			break;
+		case DGL_TRACE_OP_PUT_IMAGE :
+			op->id = dglTraceGetUnsigned(reader);
+			for (int i = 0; i < 6; i++)
+				op->args[i] = dglTraceGetSigned(reader);
+			valid = op->id >= 0 && op->id < trace->nu_images && state.draw_fb_id >= 0 &&
+				trace->image[op->id]->bytes_per_pixel ==
+				trace->fb_contents[state.draw_fb_id]->bytes_per_pixel &&
+				op->args[4] > 0 && op->args[5] > 0 && dglTraceAreaValid(trace, &state,
+				trace->image[op->id], 0, op->args[0], op->args[1], op->args[2],
+				op->args[3], op->args[4], op->args[5]);
+			break;
+		case DGL_TRACE_OP_PUT_PIXEL :
+			op->args[0] = dglTraceGetSigned(reader);
+			op->args[1] = dglTraceGetSigned(reader);
+			op->pixel = dglTraceGetUnsigned(reader);
+			valid = dglTraceAreaValid(trace, &state, NULL, 0, 0, 0, op->args[0],
+				op->args[1], 1, 1);
+			break;
+		case DGL_TRACE_OP_FRAME : {
+			int n = dglTraceGetUnsigned(reader);
+			if (reader->error || n < 0 || n > trace->nu_fbs ||
+			(size_t)(reader->end - reader->p) < n * sizeof(uint64_t))
+				return false;
+			if (nu_checksums + n > max_checksums) {
+				while (nu_checksums + n > max_checksums)
+					max_checksums *= 2;
+				uint64_t *checksums = new uint64_t[max_checksums];
+				memcpy(checksums, trace->frame_checksum, sizeof(uint64_t) * nu_checksums);
+				delete [] trace->frame_checksum;
+				trace->frame_checksum = checksums;
+			}
+			memcpy(&trace->frame_checksum[nu_checksums], reader->p, n * sizeof(uint64_t));
+			reader->p += n * sizeof(uint64_t);
+			op->id = trace->nu_frames;
+			op->args[0] = n;
+			op->args[1] = nu_checksums;
+			nu_checksums += n;
+			trace->nu_frames++;
+			break;
+			}
+		default :
+			return false;
+		}
+		if (reader->error || !valid)
+			return false;
+		trace->nu_ops++;
+	}
+	trace->frame_nu_checksums = new int[trace->nu_frames];
+	trace->frame_checksum_index = new int[trace->nu_frames];
+	for (int i = 0; i < trace->nu_ops; i++)
+		if (trace->op[i].type == DGL_TRACE_OP_FRAME) {
+			trace->frame_nu_checksums[trace->op[i].id] = trace->op[i].args[0];
+			trace->frame_checksum_index[trace->op[i].id] = trace->op[i].args[1];
+		}
+	return true;
+}
+
+dglTrace *dglLoadTrace(const char *filename) {
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglLoadTrace: Could not open file %s\n", filename);
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t *data = NULL;
+	bool ok = size >= 8;
+	if (ok) {
+		data = new uint8_t[size];
+		ok = fread(data, size, 1, f) == 1;
+	}
+	fclose(f);
+	uint32_t header[2];
+	if (ok) {
+		memcpy(header, data, sizeof(header));
+		ok = header[0] == TRACE_MAGIC && header[1] == TRACE_VERSION;
+	}
+	if (!ok) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglLoadTrace: %s is not a valid trace\n", filename);
+		delete [] data;
+		return NULL;
+	}
+	dglTrace *trace = new dglTrace;
+	trace->nu_fbs = 0;
+	trace->nu_images = 0;
+	trace->nu_ops = 0;
+	trace->nu_frames = 0;
+	trace->frame_nu_checksums = NULL;
+	trace->frame_checksum_index = NULL;
+	dglTraceReader reader;
+	reader.p = data + sizeof(header);
+	reader.end = data + size;
+	reader.error = false;
+	ok = dglTraceParse(trace, &reader);
+	delete [] data;
+	if (!ok) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglLoadTrace: Invalid operation in %s\n",
+			filename);
+		dglDestroyTrace(trace);
+		return NULL;
+	}
+	return trace;
+}
+
+void dglDestroyTrace(dglTrace *trace) {
+	for (int i = 0; i < trace->nu_fbs; i++)
+		dglDestroyImage(trace->fb_contents[i]);
+	for (int i = 0; i < trace->nu_images; i++)
+		dglDestroyImage(trace->image[i]);
+	delete [] trace->fb_yres;
+	delete [] trace->fb_contents;
+	delete [] trace->image;
+	delete [] trace->op;
+	delete [] trace->frame_nu_checksums;
+	delete [] trace->frame_checksum_index;
+	delete [] trace->frame_checksum;
+	delete trace;
+}
+
+// Replay.
+
+class dglReplayState;
+
+class dglReplayThread {
+public :
+	dglReplayState *state;
+	int index;
+	dglContext *context;
+	// Clip rectangle of the trace.
+	bool clip_enabled;
+	dglClipRectangle clip;
+	pthread_t thread;
+};
+
+class dglReplayState {
+public :
+	dglTrace *trace;
+	int variant;
+	int nu_threads;
+	dglFB **fb;
+	dglReplayThread *thread;
+	pthread_barrier_t barrier;
+	dglReplayResult *result;
+	double checksum_time;
+};
+
+// Set the clip rectangle of a thread's context to the clip rectangle of
+// the trace, intersected with the thread's band of the draw page for the
+// threaded variant.
+
+static void dglReplaySetClip(dglReplayThread *thread) {
+	dglReplayState *state = thread->state;
+	dglContext *context = thread->context;
+	if (state->variant != DGL_REPLAY_VARIANT_THREADED) {
+		if (thread->clip_enabled)
+			dglSetContextClipRectangle(context, thread->clip.x1, thread->clip.y1,
+				thread->clip.x2, thread->clip.y2);
+		else
+			dglDisableContextClipping(context);
+		return;
+	}
+	int h = context->draw_fb->yres;
+	dglClipRectangle band;
+	dglSetClipRectangle(- TRACE_MAX_COORDINATE * 4, thread->index * h / state->nu_threads,
+		TRACE_MAX_COORDINATE * 4, (thread->index + 1) * h / state->nu_threads, band);
+	if (thread->index == 0)
+		band.y1 = - TRACE_MAX_COORDINATE * 4;
+	if (thread->index == state->nu_threads - 1)
+		band.y2 = TRACE_MAX_COORDINATE * 4;
+	if (thread->clip_enabled) {
+		if (thread->clip.x1 > band.x1)
+			band.x1 = thread->clip.x1;
+		if (thread->clip.y1 > band.y1)
+			band.y1 = thread->clip.y1;
+		if (thread->clip.x2 < band.x2)
+			band.x2 = thread->clip.x2;
+		if (thread->clip.y2 < band.y2)
+			band.y2 = thread->clip.y2;
+	}
+	dglSetContextClipRectangle(context, band.x1, band.y1, band.x2, band.y2);
+}
+
+// Compare the framebuffers with the checksums stored for a frame.
+
+static void dglReplayCheckFrame(dglReplayState *state, int frame) {
+	dglTrace *trace = state->trace;
+	int n = trace->frame_nu_checksums[frame];
+	if (n == 0)
+		return;
+	double start = dglGetTime();
+	const uint64_t *checksum = &trace->frame_checksum[trace->frame_checksum_index[frame]];
+	bool match = true;
+	for (int i = 0; i < n; i++)
+		if (dglGetFramebufferChecksum(state->fb[i]) != checksum[i])
+			match = false;
+	dglReplayResult *result = state->result;
+	result->nu_frames_checked++;
+	if (!match) {
+		if (result->nu_mismatched_frames == 0)
+			result->first_mismatched_frame = frame;
+		result->nu_mismatched_frames++;
+	}
+	state->checksum_time += dglGetTime() - start;
+}
+
+static void *dglReplayThreadMain(void *arg) {
+	dglReplayThread *thread = (dglReplayThread *)arg;
+	dglReplayState *state = thread->state;
+	dglTrace *trace = state->trace;
+	dglContext *context = thread->context;
+	bool threaded = state->variant == DGL_REPLAY_VARIANT_THREADED;
+	for (int i = 0; i < trace->nu_ops; i++) {
+		const dglTraceOp *op = &trace->op[i];
+		const int *a = op->args;
+		switch (op->type) {
+		case DGL_TRACE_OP_SET_DRAW :
+			dglSetDrawFramebuffer(context, state->fb[op->id]);
+			dglSetDrawYOffset(context, a[0]);
+			if (threaded)
+				dglReplaySetClip(thread);
+			break;
+		case DGL_TRACE_OP_SET_READ :
+			dglSetReadFramebuffer(context, state->fb[op->id]);
+			dglSetReadYOffset(context, a[0]);
+			break;
+		case DGL_TRACE_OP_SET_CLIP :
+			thread->clip_enabled = true;
+			dglSetClipRectangle(a[0], a[1], a[2], a[3], thread->clip);
+			dglReplaySetClip(thread);
+			break;
+		case DGL_TRACE_OP_DISABLE_CLIP :
+			thread->clip_enabled = false;
+			dglReplaySetClip(thread);
+			break;
+		case DGL_TRACE_OP_FILL :
+			dglFill(context, a[0], a[1], a[2], a[3], op->pixel);
+			break;
+		case DGL_TRACE_OP_COPY_AREA :
+			if (!threaded) {
+				dglCopyArea(context, a[0], a[1], a[2], a[3], a[4], a[5]);
+				break;
+			}
+			// The source may have been drawn by other threads and
+			// the destination may lie in other bands; the first
+			// thread copies the whole area.
+			pthread_barrier_wait(&state->barrier);
+			if (thread->index == 0) {
+				bool clip_enabled = context->clip_enabled;
+				dglClipRectangle clip = context->clip;
+				context->clip = thread->clip;
+				context->clip_enabled = thread->clip_enabled;
+				dglCopyArea(context, a[0], a[1], a[2], a[3], a[4], a[5]);
+				context->clip = clip;
+				context->clip_enabled = clip_enabled;
+			}
+			pthread_barrier_wait(&state->barrier);
+			break;
+		case DGL_TRACE_OP_PUT_IMAGE :
+			dglPutPartialImage(context, a[0], a[1], a[2], a[3], a[4], a[5],
+				trace->image[op->id]);
+			break;
+		case DGL_TRACE_OP_PUT_PIXEL :
+			dglPutPixel(context, a[0], a[1], op->pixel);
+			break;
+		case DGL_TRACE_OP_FRAME :
+			if (context->occlusion)
+				dglFlushOcclusion(context);
+			if (threaded)
+				pthread_barrier_wait(&state->barrier);
+			if (thread->index == 0)
+				dglReplayCheckFrame(state, op->id);
+			if (threaded)
+				pthread_barrier_wait(&state->barrier);
+			break;
+		}
+	}
+	if (context->occlusion)
+		dglFlushOcclusion(context);
+	return NULL;
+}
+
+bool dglReplayTrace(dglTrace *trace, int variant, int nu_threads, dglReplayResult *result) {
+	if (variant < 0 || variant >= DGL_NU_REPLAY_VARIANTS) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglReplayTrace: Invalid variant\n");
+		return false;
+	}
+	if (variant != DGL_REPLAY_VARIANT_THREADED || nu_threads < 1)
+		nu_threads = 1;
+	dglReplayState state;
+	state.trace = trace;
+	state.variant = variant;
+	state.nu_threads = nu_threads;
+	state.result = result;
+	state.checksum_time = 0;
+	state.fb = new dglFB *[trace->nu_fbs];
+	for (int i = 0; i < trace->nu_fbs; i++) {
+		dglImage *contents = trace->fb_contents[i];
+		state.fb[i] = dglCreatePixmapFB(contents->format, contents->xres, contents->yres);
+		memcpy(state.fb[i]->framebuffer_addr, contents->framebuffer_addr,
+			contents->total_size);
+		state.fb[i]->yres = trace->fb_yres[i];
+		if (variant == DGL_REPLAY_VARIANT_STREAMING)
+			state.fb[i]->flags |= DGL_FB_FLAG_WRITE_COMBINED;
+	}
+	result->nu_frames_checked = 0;
+	result->nu_mismatched_frames = 0;
+	result->first_mismatched_frame = - 1;
+	result->nu_fbs = trace->nu_fbs;
+	result->fb = state.fb;
+	// A trace without framebuffers has no drawing operations.
+	if (trace->nu_fbs == 0) {
+		result->time = 0;
+		return true;
+	}
+	dglOcclusionCuller *culler = NULL;
+	if (variant == DGL_REPLAY_VARIANT_OCCLUSION)
+		culler = dglCreateOcclusionCuller();
+	state.thread = new dglReplayThread[nu_threads];
+	for (int i = 0; i < nu_threads; i++) {
+		dglReplayThread *thread = &state.thread[i];
+		thread->state = &state;
+		thread->index = i;
+		thread->context = dglCreateContext(state.fb[0], state.fb[0]);
+		thread->clip_enabled = false;
+		dglReplaySetClip(thread);
+		if (culler != NULL)
+			dglSetOcclusionCuller(thread->context, culler);
+	}
+	pthread_barrier_init(&state.barrier, NULL, nu_threads);
+	double start = dglGetTime();
+	for (int i = 1; i < nu_threads; i++)
+		pthread_create(&state.thread[i].thread, NULL, dglReplayThreadMain,
+			&state.thread[i]);
+	dglReplayThreadMain(&state.thread[0]);
+	for (int i = 1; i < nu_threads; i++)
+		pthread_join(state.thread[i].thread, NULL);
+	result->time = dglGetTime() - start - state.checksum_time;
+	pthread_barrier_destroy(&state.barrier);
+	for (int i = 0; i < nu_threads; i++)
+		dglDestroyContext(state.thread[i].context);
+	delete [] state.thread;
+	if (culler != NULL)
+		dglDestroyOcclusionCuller(culler);
+	for (int i = 0; i < trace->nu_fbs; i++)
+		state.fb[i]->flags &= ~DGL_FB_FLAG_WRITE_COMBINED;
+	return true;
+}
+
+void dglFreeReplayResult(dglReplayResult *result) {
+	for (int i = 0; i < result->nu_fbs; i++)
+		dglDestroyPixmapFB(result->fb[i]);
+	delete [] result->fb;
+}
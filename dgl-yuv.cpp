@@ -0,0 +1,741 @@
+/*
+
+Copyright (c) 2015 Harm Hanemaaijer <fgenfb@yahoo.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+// YUV video frame upload.
+//
+// dglPutYUVImage converts a YUV frame (I420, NV12 or YUYV) to RGB, scales it
+// with nearest-neighbour sampling when the destination size differs, and
+// writes the pixels directly into the draw framebuffer in its pixel format,
+// so that each frame is read and written only once. The conversion uses
+// BT.601 limited range coefficients in fixed point. The SIMD kernels
+// (SSE2 or NEON, for unscaled rows and 32-bit destinations) use the same
+// arithmetic as the C code, so the results are identical; a kernel is
+// checked against the C code before it is first used and disabled when
+// they differ.
+//
+// A video queue lets a decoder thread hand over frames in one of two YUV
+// buffers. A worker thread converts each frame into a back page of the
+// screen framebuffer while the flip to the previous frame is still
+// pending, and then flips to it, so that conversion overlaps the
+// presentation of the previous frame and decoding of the next frame.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DGL_YUV_USE_NEON
+#endif
+
+#include "dgl.h"
+
+// Fixed-point coefficients. The luma term is calculated as the high 16 bits
+// of (Y * 257) * Y_SCALE, which is equal to 1.164 * 64 * Y; the chroma terms
+// use 6-bit fractions.
+#define Y_SCALE 19003
+#define Y_OFFSET 1192		// 16 * 1.164 * 64
+#define V_TO_R 102		// 1.596 * 64
+#define U_TO_G 25		// 0.392 * 64
+#define V_TO_G 52		// 0.813 * 64
+#define U_TO_B 129		// 2.017 * 64
+
+DGL_INLINE_ONLY static int dglYUVClamp(int x) {
+	if (x < 0)
+		return 0;
+	if (x > 255)
+		return 255;
+	return x;
+}
+
+// Convert a pixel to 0xRRGGBB.
+
+DGL_INLINE_ONLY static uint32_t dglYUVToRGB(int y, int u, int v) {
+	int y64 = ((y * 257 * Y_SCALE) >> 16) - Y_OFFSET;
+	u -= 128;
+	v -= 128;
+	int r = dglYUVClamp((y64 + V_TO_R * v + 32) >> 6);
+	int g = dglYUVClamp((y64 - U_TO_G * u - V_TO_G * v + 32) >> 6);
+	int b = dglYUVClamp((y64 + U_TO_B * u + 32) >> 6);
+	return (r << 16) | (g << 8) | b;
+}
+
+// YUV frames.
+
+dglYUVImage *dglCreateYUVImageFromBuffer(int format, int w, int h, uint8_t *buffer) {
+	if ((w & 1) || (format != DGL_YUV_FORMAT_YUYV && (h & 1))) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglCreateYUVImageFromBuffer: "
+			"Frame dimensions must be even\n");
+		return NULL;
+	}
+	dglYUVImage *yuv = new dglYUVImage;
+	yuv->format = format;
+	yuv->xres = w;
+	yuv->yres = h;
+	yuv->buffer = buffer;
+	yuv->plane[0] = buffer;
+	yuv->plane[1] = NULL;
+	yuv->plane[2] = NULL;
+	yuv->stride[1] = 0;
+	yuv->stride[2] = 0;
+	if (format == DGL_YUV_FORMAT_YUYV)
+		yuv->stride[0] = w * 2;
+	else {
+		yuv->stride[0] = w;
+		yuv->plane[1] = buffer + w * h;
+		if (format == DGL_YUV_FORMAT_NV12)
+			yuv->stride[1] = w;
+		else {
+			yuv->stride[1] = w / 2;
+			yuv->plane[2] = yuv->plane[1] + (w / 2) * (h / 2);
+			yuv->stride[2] = w / 2;
+		}
+	}
+	return yuv;
+}
+
+int dglGetYUVImageSize(int format, int w, int h) {
+	if (format == DGL_YUV_FORMAT_YUYV)
+		return w * h * 2;
+	return w * h * 3 / 2;
+}
+
+dglYUVImage *dglCreateYUVImage(int format, int w, int h) {
+	uint8_t *buffer = new uint8_t[dglGetYUVImageSize(format, w, h)];
+	dglYUVImage *yuv = dglCreateYUVImageFromBuffer(format, w, h, buffer);
+	if (yuv == NULL)
+		delete [] buffer;
+	return yuv;
+}
+
+void dglDestroyYUVImage(dglYUVImage *yuv) {
+	delete [] yuv->buffer;
+	delete yuv;
+}
+
+// Pointers to the samples of one source row. The luma sample of pixel x is
+// at yp[x * y_step], its chroma samples at up[(x >> 1) * uv_step] and
+// vp[(x >> 1) * uv_step].
+
+class dglYUVRow {
+public :
+	const uint8_t *yp;
+	const uint8_t *up;
+	const uint8_t *vp;
+	int y_step;
+	int uv_step;
+};
+
+static void dglYUVGetRow(const dglYUVImage *yuv, int y, dglYUVRow *row) {
+	if (yuv->format == DGL_YUV_FORMAT_YUYV) {
+		row->yp = yuv->plane[0] + y * yuv->stride[0];
+		row->up = row->yp + 1;
+		row->vp = row->yp + 3;
+		row->y_step = 2;
+		row->uv_step = 4;
+		return;
+	}
+	row->yp = yuv->plane[0] + y * yuv->stride[0];
+	row->y_step = 1;
+	if (yuv->format == DGL_YUV_FORMAT_NV12) {
+		row->up = yuv->plane[1] + (y >> 1) * yuv->stride[1];
+		row->vp = row->up + 1;
+		row->uv_step = 2;
+	}
+	else {
+		row->up = yuv->plane[1] + (y >> 1) * yuv->stride[1];
+		row->vp = yuv->plane[2] + (y >> 1) * yuv->stride[2];
+		row->uv_step = 1;
+	}
+}
+
+DGL_INLINE_ONLY static void dglYUVStorePixel(uint32_t format, uint8_t *dp, int i,
+uint32_t pixel) {
+	if (format & DGL_FORMAT_PIXEL_SIZE_16_BIT)
+		((uint16_t *)dp)[i] = pixel;
+	else
+		((uint32_t *)dp)[i] = pixel;
+}
+
+// Convert n pixels starting at source pixel sx without scaling.
+
+DGL_INLINE_ONLY static void dglYUVConvertRowC(uint32_t format, const dglYUVRow *row,
+int sx, uint8_t *dp, int n) {
+	for (int i = 0; i < n; i++) {
+		int x = sx + i;
+		uint32_t rgb = dglYUVToRGB(row->yp[x * row->y_step],
+			row->up[(x >> 1) * row->uv_step], row->vp[(x >> 1) * row->uv_step]);
+		dglYUVStorePixel(format, dp, i, dglARGBToPixel(format, rgb | 0xFF000000));
+	}
+}
+
+// Convert n pixels with nearest-neighbour scaling; x_map holds the source
+// pixel of every destination pixel.
+
+DGL_INLINE_ONLY static void dglYUVConvertRowScaled(uint32_t format, const dglYUVRow *row,
+const int *x_map, uint8_t *dp, int n) {
+	for (int i = 0; i < n; i++) {
+		int x = x_map[i];
+		uint32_t rgb = dglYUVToRGB(row->yp[x * row->y_step],
+			row->up[(x >> 1) * row->uv_step], row->vp[(x >> 1) * row->uv_step]);
+		dglYUVStorePixel(format, dp, i, dglARGBToPixel(format, rgb | 0xFF000000));
+	}
+}
+
+#if defined(__SSE2__)
+
+// Convert eight pixels. y16 holds Y * 257, u16 and v16 the chroma samples
+// minus 128, all in 16-bit lanes.
+
+DGL_INLINE_ONLY static void dglYUVConvert8PixelsSSE2(__m128i y16, __m128i u16, __m128i v16,
+bool swap_rb, bool alpha, uint8_t *dp) {
+	__m128i y64 = _mm_sub_epi16(_mm_mulhi_epu16(y16, _mm_set1_epi16(Y_SCALE)),
+		_mm_set1_epi16(Y_OFFSET));
+	__m128i round = _mm_set1_epi16(32);
+	__m128i r = _mm_adds_epi16(y64, _mm_mullo_epi16(v16, _mm_set1_epi16(V_TO_R)));
+	__m128i g = _mm_adds_epi16(y64, _mm_mullo_epi16(u16, _mm_set1_epi16(- U_TO_G)));
+	g = _mm_adds_epi16(g, _mm_mullo_epi16(v16, _mm_set1_epi16(- V_TO_G)));
+	__m128i b = _mm_adds_epi16(y64, _mm_mullo_epi16(u16, _mm_set1_epi16(U_TO_B)));
+	r = _mm_srai_epi16(_mm_adds_epi16(r, round), 6);
+	g = _mm_srai_epi16(_mm_adds_epi16(g, round), 6);
+	b = _mm_srai_epi16(_mm_adds_epi16(b, round), 6);
+	if (swap_rb) {
+		__m128i t = r;
+		r = b;
+		b = t;
+	}
+	__m128i a = alpha ? _mm_set1_epi16(0xFF) : _mm_setzero_si128();
+	// Pack to bytes (clamping to 0-255) and interleave to B, G, R, A.
+	__m128i bg = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), _mm_packus_epi16(g, g));
+	__m128i ra = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), _mm_packus_epi16(a, a));
+	_mm_storeu_si128((__m128i *)dp, _mm_unpacklo_epi16(bg, ra));
+	_mm_storeu_si128((__m128i *)(dp + 16), _mm_unpackhi_epi16(bg, ra));
+}
+
+// Convert n pixels (a multiple of 8) starting at the even source pixel sx
+// to a 32-bit format.
+
+static void dglYUVConvertRowSIMD(const dglYUVRow *row, int sx, uint8_t *dp, int n,
+bool swap_rb, bool alpha) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i bias = _mm_set1_epi16(128);
+	for (int i = 0; i < n; i += 8) {
+		int x = sx + i;
+		__m128i y16, u16, v16;
+		if (row->y_step == 2) {
+			// YUYV: Y in the low bytes, U and V alternating in the
+			// high bytes of the 16-bit lanes.
+			__m128i yuyv = _mm_loadu_si128((const __m128i *)(row->yp + x * 2));
+			y16 = _mm_and_si128(yuyv, _mm_set1_epi16(0xFF));
+			__m128i uv = _mm_srli_epi16(yuyv, 8);
+			u16 = _mm_and_si128(uv, _mm_set1_epi32(0xFFFF));
+			v16 = _mm_srli_epi32(uv, 16);
+		}
+		else {
+			y16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(row->yp + x)),
+				zero);
+			if (row->uv_step == 2) {
+				__m128i uv = _mm_unpacklo_epi8(_mm_loadl_epi64(
+					(const __m128i *)(row->up + x)), zero);
+				u16 = _mm_and_si128(uv, _mm_set1_epi32(0xFFFF));
+				v16 = _mm_srli_epi32(uv, 16);
+			}
+			else {
+				uint32_t u, v;
+				memcpy(&u, row->up + (x >> 1), 4);
+				memcpy(&v, row->vp + (x >> 1), 4);
+				u16 = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(u),
+					zero), zero);
+				v16 = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v),
+					zero), zero);
+			}
+		}
+		// Y * 257 and duplicate the chroma samples of each pixel pair.
+		y16 = _mm_or_si128(y16, _mm_slli_epi16(y16, 8));
+		u16 = _mm_sub_epi16(_mm_or_si128(u16, _mm_slli_epi32(u16, 16)), bias);
+		v16 = _mm_sub_epi16(_mm_or_si128(v16, _mm_slli_epi32(v16, 16)), bias);
+		dglYUVConvert8PixelsSSE2(y16, u16, v16, swap_rb, alpha, dp + i * 4);
+	}
+}
+
+#define DGL_YUV_HAVE_SIMD
+
+#elif defined(DGL_YUV_USE_NEON)
+
+// Convert eight pixels. y holds the luma samples, u and v the chroma
+// samples of each pixel.
+
+DGL_INLINE_ONLY static void dglYUVConvert8PixelsNEON(uint8x8_t y, uint8x8_t u, uint8x8_t v,
+bool swap_rb, bool alpha, uint8_t *dp) {
+	uint16x8_t y16 = vmovl_u8(y);
+	y16 = vorrq_u16(y16, vshlq_n_u16(y16, 8));
+	uint32x4_t lo = vmull_u16(vget_low_u16(y16), vdup_n_u16(Y_SCALE));
+	uint32x4_t hi = vmull_u16(vget_high_u16(y16), vdup_n_u16(Y_SCALE));
+	int16x8_t y64 = vsubq_s16(vreinterpretq_s16_u16(vcombine_u16(vshrn_n_u32(lo, 16),
+		vshrn_n_u32(hi, 16))), vdupq_n_s16(Y_OFFSET));
+	int16x8_t u16 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u)), vdupq_n_s16(128));
+	int16x8_t v16 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v)), vdupq_n_s16(128));
+	int16x8_t round = vdupq_n_s16(32);
+	int16x8_t r = vqaddq_s16(y64, vmulq_n_s16(v16, V_TO_R));
+	int16x8_t g = vqaddq_s16(y64, vmulq_n_s16(u16, - U_TO_G));
+	g = vqaddq_s16(g, vmulq_n_s16(v16, - V_TO_G));
+	int16x8_t b = vqaddq_s16(y64, vmulq_n_s16(u16, U_TO_B));
+	uint8x8x4_t bgra;
+	bgra.val[0] = vqmovun_s16(vshrq_n_s16(vqaddq_s16(b, round), 6));
+	bgra.val[1] = vqmovun_s16(vshrq_n_s16(vqaddq_s16(g, round), 6));
+	bgra.val[2] = vqmovun_s16(vshrq_n_s16(vqaddq_s16(r, round), 6));
+	bgra.val[3] = vdup_n_u8(alpha ? 0xFF : 0);
+	if (swap_rb) {
+		uint8x8_t t = bgra.val[0];
+		bgra.val[0] = bgra.val[2];
+		bgra.val[2] = t;
+	}
+	vst4_u8(dp, bgra);
+}
+
+// Convert n pixels (a multiple of 8) starting at the even source pixel sx
+// to a 32-bit format.
+
+static void dglYUVConvertRowSIMD(const dglYUVRow *row, int sx, uint8_t *dp, int n,
+bool swap_rb, bool alpha) {
+	for (int i = 0; i < n; i += 8) {
+		int x = sx + i;
+		uint8x8_t y, u, v;
+		if (row->y_step == 2) {
+			uint8x8x2_t yuyv = vld2_u8(row->yp + x * 2);
+			y = yuyv.val[0];
+			// U and V alternate in the odd bytes.
+			uint8x8x2_t uv = vuzp_u8(yuyv.val[1], yuyv.val[1]);
+			u = vzip_u8(uv.val[0], uv.val[0]).val[0];
+			v = vzip_u8(uv.val[1], uv.val[1]).val[0];
+		}
+		else {
+			y = vld1_u8(row->yp + x);
+			uint8x8_t u4, v4;
+			if (row->uv_step == 2) {
+				uint8x8_t uv = vld1_u8(row->up + x);
+				uint8x8x2_t t = vuzp_u8(uv, uv);
+				u4 = t.val[0];
+				v4 = t.val[1];
+			}
+			else {
+				uint32_t u32, v32;
+				memcpy(&u32, row->up + (x >> 1), 4);
+				memcpy(&v32, row->vp + (x >> 1), 4);
+				u4 = vreinterpret_u8_u32(vdup_n_u32(u32));
+				v4 = vreinterpret_u8_u32(vdup_n_u32(v32));
+			}
+			// Duplicate the chroma samples of each pixel pair.
+			u = vzip_u8(u4, u4).val[0];
+			v = vzip_u8(v4, v4).val[0];
+		}
+		dglYUVConvert8PixelsNEON(y, u, v, swap_rb, alpha, dp + i * 4);
+	}
+}
+
+#define DGL_YUV_HAVE_SIMD
+
+#endif
+
+#ifdef DGL_YUV_HAVE_SIMD
+
+// The SIMD kernel is checked against the C code once, on all three row
+// layouts and both channel orders, and is only used when the results are
+// identical.
+
+#define SIMD_CHECK_PIXELS 64
+
+static int dgl_yuv_simd_state = 0;	// 0 unchecked, 1 verified, - 1 disabled.
+
+static bool dglYUVCheckSIMD() {
+	uint8_t y[SIMD_CHECK_PIXELS];
+	uint8_t u[SIMD_CHECK_PIXELS / 2];
+	uint8_t v[SIMD_CHECK_PIXELS / 2];
+	uint8_t uv[SIMD_CHECK_PIXELS];
+	uint8_t yuyv[SIMD_CHECK_PIXELS * 2];
+	// Cover the full sample range, including values that clamp.
+	for (int i = 0; i < SIMD_CHECK_PIXELS; i++)
+		y[i] = i * 4 + (i >> 4);
+	for (int i = 0; i < SIMD_CHECK_PIXELS / 2; i++) {
+		u[i] = (i * 37) & 0xFF;
+		v[i] = 255 - ((i * 91) & 0xFF);
+		uv[i * 2] = u[i];
+		uv[i * 2 + 1] = v[i];
+		yuyv[i * 4] = y[i * 2];
+		yuyv[i * 4 + 1] = u[i];
+		yuyv[i * 4 + 2] = y[i * 2 + 1];
+		yuyv[i * 4 + 3] = v[i];
+	}
+	dglYUVRow row[3];
+	row[0].yp = yuyv;
+	row[0].up = yuyv + 1;
+	row[0].vp = yuyv + 3;
+	row[0].y_step = 2;
+	row[0].uv_step = 4;
+	row[1].yp = y;
+	row[1].up = uv;
+	row[1].vp = uv + 1;
+	row[1].y_step = 1;
+	row[1].uv_step = 2;
+	row[2].yp = y;
+	row[2].up = u;
+	row[2].vp = v;
+	row[2].y_step = 1;
+	row[2].uv_step = 1;
+	const uint32_t format[2] = { DGL_FORMAT_XRGB8888, DGL_FORMAT_ABGR8888 };
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 2; j++) {
+			uint8_t c_pixels[SIMD_CHECK_PIXELS * 4];
+			uint8_t simd_pixels[SIMD_CHECK_PIXELS * 4];
+			dglYUVConvertRowC(format[j], &row[i], 0, c_pixels, SIMD_CHECK_PIXELS);
+			dglYUVConvertRowSIMD(&row[i], 0, simd_pixels, SIMD_CHECK_PIXELS,
+				(format[j] & DGL_FORMAT_LSB_ORDER_RGB_BIT) != 0,
+				(format[j] & DGL_FORMAT_ALPHA_BIT) != 0);
+			if (memcmp(c_pixels, simd_pixels, sizeof(c_pixels)) != 0)
+				return false;
+		}
+	return true;
+}
+
+static bool dglYUVUseSIMD() {
+	int state = __atomic_load_n(&dgl_yuv_simd_state, __ATOMIC_RELAXED);
+	if (state == 0) {
+		state = dglYUVCheckSIMD() ? 1 : - 1;
+		if (state < 0)
+			dglMessage(DGL_MESSAGE_WARNING, "dglPutYUVImage: SIMD conversion does "
+				"not match the C code, using the C code\n");
+		__atomic_store_n(&dgl_yuv_simd_state, state, __ATOMIC_RELAXED);
+	}
+	return state > 0;
+}
+
+#endif
+
+// Convert n pixels of a row starting at source pixel sx without scaling.
+
+static void dglYUVConvertRow(uint32_t format, const dglYUVRow *row, int sx, uint8_t *dp,
+int n) {
+#ifdef DGL_YUV_HAVE_SIMD
+	if ((format & DGL_FORMAT_PIXEL_SIZE_16_BIT) == 0 && dglYUVUseSIMD()) {
+		int i = 0;
+		if (sx & 1) {
+			// Start the SIMD kernel at a pixel pair boundary.
+			dglYUVConvertRowC(format, row, sx, dp, 1);
+			i = 1;
+		}
+		int n_simd = (n - i) & ~7;
+		dglYUVConvertRowSIMD(row, sx + i, dp + i * 4, n_simd,
+			(format & DGL_FORMAT_LSB_ORDER_RGB_BIT) != 0,
+			(format & DGL_FORMAT_ALPHA_BIT) != 0);
+		i += n_simd;
+		dglYUVConvertRowC(format, row, sx + i, dp + i * 4, n - i);
+		return;
+	}
+#endif
+	switch (format) {
+	case DGL_FORMAT_XRGB8888 :
+		dglYUVConvertRowC(DGL_FORMAT_XRGB8888, row, sx, dp, n);
+		break;
+	case DGL_FORMAT_ARGB8888 :
+		dglYUVConvertRowC(DGL_FORMAT_ARGB8888, row, sx, dp, n);
+		break;
+	case DGL_FORMAT_XBGR8888 :
+		dglYUVConvertRowC(DGL_FORMAT_XBGR8888, row, sx, dp, n);
+		break;
+	case DGL_FORMAT_ABGR8888 :
+		dglYUVConvertRowC(DGL_FORMAT_ABGR8888, row, sx, dp, n);
+		break;
+	case DGL_FORMAT_RGB565 :
+		dglYUVConvertRowC(DGL_FORMAT_RGB565, row, sx, dp, n);
+		break;
+	default :
+		dglYUVConvertRowC(DGL_FORMAT_BGR565, row, sx, dp, n);
+		break;
+	}
+}
+
+static void dglYUVConvertRowScaledAnyFormat(uint32_t format, const dglYUVRow *row,
+const int *x_map, uint8_t *dp, int n) {
+	switch (format) {
+	case DGL_FORMAT_XRGB8888 :
+		dglYUVConvertRowScaled(DGL_FORMAT_XRGB8888, row, x_map, dp, n);
+		break;
+	case DGL_FORMAT_ARGB8888 :
+		dglYUVConvertRowScaled(DGL_FORMAT_ARGB8888, row, x_map, dp, n);
+		break;
+	case DGL_FORMAT_XBGR8888 :
+		dglYUVConvertRowScaled(DGL_FORMAT_XBGR8888, row, x_map, dp, n);
+		break;
+	case DGL_FORMAT_ABGR8888 :
+		dglYUVConvertRowScaled(DGL_FORMAT_ABGR8888, row, x_map, dp, n);
+		break;
+	case DGL_FORMAT_RGB565 :
+		dglYUVConvertRowScaled(DGL_FORMAT_RGB565, row, x_map, dp, n);
+		break;
+	default :
+		dglYUVConvertRowScaled(DGL_FORMAT_BGR565, row, x_map, dp, n);
+		break;
+	}
+}
+
+// Convert a YUV frame and draw it into the rectangle at (x, y) of size w x h,
+// scaling when the size differs from the frame size. Drawing is clipped to
+// the context's clip rectangle when enabled.
+
+void dglPutYUVImage(dglContext *context, dglYUVImage *yuv, int x, int y, int w, int h) {
+	if (w <= 0 || h <= 0)
+		return;
+	if (context->occlusion)
+		dglFlushOcclusion(context);
+	dglFB *fb;
+	DGL_GET_DRAW_FB(context, fb);
+	// Visible part of the destination rectangle.
+	int x1 = x;
+	int y1 = y;
+	int x2 = x + w;
+	int y2 = y + h;
+	if (context->clip_enabled) {
+		if (context->clip.x1 > x1)
+			x1 = context->clip.x1;
+		if (context->clip.y1 > y1)
+			y1 = context->clip.y1;
+		if (context->clip.x2 < x2)
+			x2 = context->clip.x2;
+		if (context->clip.y2 < y2)
+			y2 = context->clip.y2;
+		if (x1 >= x2 || y1 >= y2)
+			return;
+	}
+	bool scaled = (w != yuv->xres || h != yuv->yres);
+	int *x_map = NULL;
+	if (scaled) {
+		x_map = new int[x2 - x1];
+		for (int i = x1; i < x2; i++)
+			x_map[i - x1] = (int)((int64_t)(i - x) * yuv->xres / w);
+	}
+	int bpp = fb->bytes_per_pixel;
+	int yoffset = context->draw_yoffset;
+	for (int i = y1; i < y2; i++) {
+		int sy = i - y;
+		if (scaled)
+			sy = (int)((int64_t)sy * yuv->yres / h);
+		dglYUVRow row;
+		dglYUVGetRow(yuv, sy, &row);
+		uint8_t *dp = fb->framebuffer_addr + (i + yoffset) * fb->stride + x1 * bpp;
+		if (scaled)
+			dglYUVConvertRowScaledAnyFormat(fb->format, &row, x_map, dp, x2 - x1);
+		else
+			dglYUVConvertRow(fb->format, &row, x1 - x, dp, x2 - x1);
+	}
+	delete [] x_map;
+	if (fb->damage)
+		dglAddDamage(fb->damage, x1, y1 + yoffset, x2 - x1, y2 - y1);
+}
+
+// Video queue.
+
+enum {
+	SLOT_FREE,
+	SLOT_ACQUIRED,
+	SLOT_READY,
+	SLOT_CONVERTING
+};
+
+// Present the page that was just drawn. With three or more pages, the
+// previous flip may still be pending while the next frame is converted;
+// wait for it to complete before flipping again.
+
+static void dglVideoQueuePresent(dglVideoQueue *queue) {
+	dglScreenFB *fb = queue->fb;
+	if (queue->nu_pages >= 3) {
+		if (queue->vsync && queue->nu_frames > 0)
+			dglWaitVSync(fb);
+		dglSetDisplayPage(fb, queue->draw_page);
+	}
+	else if (queue->nu_pages == 2) {
+		dglSetDisplayPage(fb, queue->draw_page);
+		// The other page is still being scanned out until the flip
+		// takes effect.
+		if (queue->vsync)
+			dglWaitVSync(fb);
+	}
+	else if (queue->vsync)
+		dglWaitVSync(fb);
+	else
+		dglFlushShadowFramebuffer(fb);
+	queue->draw_page = (queue->draw_page + 1) % queue->nu_pages;
+	dglSetDrawPage(queue->context, queue->draw_page);
+	queue->nu_frames++;
+}
+
+static void *dglVideoQueueThreadMain(void *arg) {
+	dglVideoQueue *queue = (dglVideoQueue *)arg;
+	pthread_mutex_t *mutex = (pthread_mutex_t *)queue->mutex;
+	pthread_cond_t *cond = (pthread_cond_t *)queue->cond;
+	pthread_mutex_lock(mutex);
+	for (;;) {
+		// Take the oldest submitted frame.
+		int slot = -1;
+		for (int i = 0; i < DGL_VIDEO_QUEUE_SLOTS; i++)
+			if (queue->slot_state[i] == SLOT_READY && (slot < 0 ||
+			(int)(queue->slot_sequence[i] - queue->slot_sequence[slot]) < 0))
+				slot = i;
+		if (slot < 0) {
+			if (queue->stop)
+				break;
+			pthread_cond_wait(cond, mutex);
+			continue;
+		}
+		queue->slot_state[slot] = SLOT_CONVERTING;
+		pthread_mutex_unlock(mutex);
+		dglPutYUVImage(queue->context, queue->slot[slot], queue->x, queue->y,
+			queue->w, queue->h);
+		pthread_mutex_lock(mutex);
+		// The frame buffer can be reused by the decoder.
+		queue->slot_state[slot] = SLOT_FREE;
+		pthread_cond_broadcast(cond);
+		pthread_mutex_unlock(mutex);
+		dglVideoQueuePresent(queue);
+		pthread_mutex_lock(mutex);
+	}
+	pthread_mutex_unlock(mutex);
+	return NULL;
+}
+
+// Create a video queue for frames of the given YUV format and size, which
+// are drawn into the rectangle at (x, y) of size w x h of the screen
+// framebuffer. While the queue exists, its worker thread presents the
+// framebuffer; it flips between up to three pages when the framebuffer
+// supports panning.
+
+dglVideoQueue *dglCreateVideoQueue(dglScreenFB *fb, int yuv_format, int yuv_w, int yuv_h,
+int x, int y, int w, int h, bool vsync) {
+	dglVideoQueue *queue = new dglVideoQueue;
+	for (int i = 0; i < DGL_VIDEO_QUEUE_SLOTS; i++) {
+		queue->slot[i] = dglCreateYUVImage(yuv_format, yuv_w, yuv_h);
+		if (queue->slot[i] == NULL) {
+			for (int j = 0; j < i; j++)
+				dglDestroyYUVImage(queue->slot[j]);
+			delete queue;
+			return NULL;
+		}
+		queue->slot_state[i] = SLOT_FREE;
+		queue->slot_sequence[i] = 0;
+	}
+	queue->fb = fb;
+	queue->x = x;
+	queue->y = y;
+	queue->w = w;
+	queue->h = h;
+	queue->vsync = vsync;
+	queue->nu_pages = 1;
+	if (fb->flags & DGL_FB_FLAG_HAVE_PAN_DISPLAY) {
+		queue->nu_pages = dglGetNumberOfPages(fb);
+		if (queue->nu_pages > 3)
+			queue->nu_pages = 3;
+	}
+	queue->context = dglCreateContext(fb, fb);
+	// Start drawing into a page that is not displayed.
+	queue->draw_page = queue->nu_pages > 1 ? 1 : 0;
+	dglSetDrawPage(queue->context, queue->draw_page);
+	queue->next_sequence = 0;
+	queue->nu_frames = 0;
+	queue->stop = false;
+	pthread_mutex_t *mutex = new pthread_mutex_t;
+	pthread_cond_t *cond = new pthread_cond_t;
+	pthread_mutex_init(mutex, NULL);
+	pthread_cond_init(cond, NULL);
+	queue->mutex = mutex;
+	queue->cond = cond;
+	pthread_t *thread = new pthread_t;
+	queue->thread = thread;
+	if (pthread_create(thread, NULL, dglVideoQueueThreadMain, queue) != 0) {
+		dglMessage(DGL_MESSAGE_WARNING, "dglCreateVideoQueue: "
+			"Could not create thread\n");
+		pthread_mutex_destroy(mutex);
+		pthread_cond_destroy(cond);
+		delete mutex;
+		delete cond;
+		delete thread;
+		dglDestroyContext(queue->context);
+		for (int i = 0; i < DGL_VIDEO_QUEUE_SLOTS; i++)
+			dglDestroyYUVImage(queue->slot[i]);
+		delete queue;
+		return NULL;
+	}
+	return queue;
+}
+
+// Wait until all submitted frames have been presented, stop the worker
+// thread and free the queue.
+
+void dglDestroyVideoQueue(dglVideoQueue *queue) {
+	pthread_mutex_t *mutex = (pthread_mutex_t *)queue->mutex;
+	pthread_cond_t *cond = (pthread_cond_t *)queue->cond;
+	pthread_t *thread = (pthread_t *)queue->thread;
+	pthread_mutex_lock(mutex);
+	queue->stop = true;
+	pthread_cond_broadcast(cond);
+	pthread_mutex_unlock(mutex);
+	pthread_join(*thread, NULL);
+	pthread_mutex_destroy(mutex);
+	pthread_cond_destroy(cond);
+	delete mutex;
+	delete cond;
+	delete thread;
+	dglDestroyContext(queue->context);
+	for (int i = 0; i < DGL_VIDEO_QUEUE_SLOTS; i++)
+		dglDestroyYUVImage(queue->slot[i]);
+	delete queue;
+}
+
+// Return a free frame buffer to decode the next frame into, waiting until
+// one is available.
+
+dglYUVImage *dglVideoQueueAcquireFrame(dglVideoQueue *queue) {
+	pthread_mutex_t *mutex = (pthread_mutex_t *)queue->mutex;
+	pthread_cond_t *cond = (pthread_cond_t *)queue->cond;
+	pthread_mutex_lock(mutex);
+	for (;;) {
+		for (int i = 0; i < DGL_VIDEO_QUEUE_SLOTS; i++)
+			if (queue->slot_state[i] == SLOT_FREE) {
+				queue->slot_state[i] = SLOT_ACQUIRED;
+				pthread_mutex_unlock(mutex);
+				return queue->slot[i];
+			}
+		pthread_cond_wait(cond, mutex);
+	}
+}
+
+// Queue a frame obtained with dglVideoQueueAcquireFrame for presentation.
+
+void dglVideoQueueSubmitFrame(dglVideoQueue *queue, dglYUVImage *frame) {
+	pthread_mutex_t *mutex = (pthread_mutex_t *)queue->mutex;
+	pthread_cond_t *cond = (pthread_cond_t *)queue->cond;
+	pthread_mutex_lock(mutex);
+	for (int i = 0; i < DGL_VIDEO_QUEUE_SLOTS; i++)
+		if (queue->slot[i] == frame) {
+			queue->slot_state[i] = SLOT_READY;
+			queue->slot_sequence[i] = queue->next_sequence++;
+		}
+	pthread_cond_broadcast(cond);
+	pthread_mutex_unlock(mutex);
+}
@@ -40,10 +40,31 @@ enum {
 	DGL_FB_TYPE_PIXMAP = 0,
 	DGL_FB_TYPE_IMAGE = 1,
 	DGL_FB_TYPE_CONSOLE = 2,
+	DGL_FB_TYPE_DRM = 3,
+	DGL_FB_TYPE_SIMULATED = 4,
 	DGL_FB_TYPE_MASK = 0x7,
 	DGL_FB_FLAG_HAVE_COPY_AREA = 0x1000,
 	DGL_FB_FLAG_HAVE_PAN_DISPLAY = 0x2000,
 	DGL_FB_FLAG_HAVE_WAIT_VSYNC = 0x4000,
+	// The framebuffer memory is uncached/write-combined (for example a
+	// memory-mapped console framebuffer). Reads are very slow, writes
+	// should be sequential and are performed with streaming stores.
+	DGL_FB_FLAG_WRITE_COMBINED = 0x8000,
+	// Shadow framebuffer mode is enabled for a screen framebuffer; drawing
+	// goes to a cached copy in system memory (see dglEnableShadowFramebuffer).
+	DGL_FB_FLAG_SHADOW = 0x10000,
+};
+
+// Damage (changed area) tracking with a damaged span for every pixel row.
+// A row is clean when x1 >= x2.
+
+class dglDamage {
+public :
+	int width;
+	int nu_rows;
+	int y1, y2;	// Range of rows that may be damaged (y2 exclusive).
+	int *x1;	// Start of the damaged span for each row.
+	int *x2;	// End of the damaged span for each row (exclusive).
 };
 
 class dglPixelBuffer {
@@ -55,34 +76,174 @@ public :
 	int stride;
 	int total_size;		// Can be derived from dimensions and format.
 	int bytes_per_pixel;	// Can be derived from format.
+	dglDamage *damage;	// Damage tracking, NULL when not enabled.
 };
 
 typedef dglPixelBuffer dglFB;
 typedef dglPixelBuffer dglImage;
 
+// Statistics of dirty-page updates (see dglEnableDirtyPageUpdates). Byte
+// counts are in screen memory.
+
+class dglDirtyPageStats {
+public :
+	int nu_flushes;
+	uint64_t nu_pages_compared;
+	uint64_t nu_pages_written;
+	uint64_t bytes_damaged;		// Bytes in damaged spans.
+	uint64_t bytes_written;
+	uint64_t bytes_avoided;		// Bytes of damaged pages that did not change.
+};
+
+// CopyArea calibration of a screen framebuffer with accelerated CopyArea.
+// Copies are divided into size classes by area; for each class the time per
+// copy of both the CPU and the accelerated (DMA) path was measured, and the
+// faster one is used.
+
+#define DGL_COPY_NU_SIZE_CLASSES 8
+
+class dglCopyCalibration {
+public :
+	// Largest area in pixels of each size class; the last class is unbounded.
+	int max_area[DGL_COPY_NU_SIZE_CLASSES];
+	// Time per copy in seconds.
+	double cpu_time[DGL_COPY_NU_SIZE_CLASSES];
+	double dma_time[DGL_COPY_NU_SIZE_CLASSES];
+	bool use_dma[DGL_COPY_NU_SIZE_CLASSES];
+};
+
 class dglScreenFB : public dglFB {
 public :
 	int virtual_xres;
 	int virtual_yres;
 	int nu_pages;
+	int display_yoffset;	// y offset of the currently displayed area.
+	// The real screen memory when shadow framebuffer mode is enabled.
+	uint8_t *screen_addr;
+	uint32_t shadow_saved_flags;
+	// Pan display (page flip) call statistics.
+	int nu_pan_display_calls;
+	uint64_t pan_display_time_total_ns;
+	uint64_t pan_display_time_max_ns;
+	// CopyArea calibration, or NULL when CopyArea always uses the
+	// accelerated function (see dgl-calibrate.cpp).
+	dglCopyCalibration *copy_calibration;
+	// Dirty-page update mode: a copy of the screen memory contents in
+	// system memory, or NULL when not enabled.
+	uint8_t *front_addr;
+	int dirty_page_size;
+	dglDirtyPageStats dirty_page_stats;
 
 	void (*PanDisplayFunc)(dglScreenFB *fb, int x, int y);
 	void (*WaitVSyncFunc)(dglScreenFB *fb);
 	void (*CopyAreaFunc)(dglScreenFB *fb, int sx, int sy, int dx, int dy, int w, int h);
 };
 
+struct fb_var_screeninfo;
+
 class dglConsoleFB : public dglScreenFB {
 public :
 	int fd;
 	bool graphics_mode_set;
+	// Screen info cached at creation time and reused for every pan
+	// display request.
+	struct fb_var_screeninfo *pan_var;
+	int ypanstep;
 };
 
-class dglContext {
+#define DGL_DRM_MAX_PAGES 4
+
+// DRM/KMS screen framebuffer. The pages are stored in one memory-mapped dumb
+// buffer, laid out like the pages of the console framebuffer.
+
+class dglDRMFB : public dglScreenFB {
 public :
-	dglFB *read_fb;
-	dglFB *draw_fb;
-	int read_yoffset;
-	int draw_yoffset;
+	int fd;
+	uint32_t connector_id;
+	uint32_t crtc_id;
+	int crtc_index;
+	uint32_t handle;		// Dumb buffer handle.
+	uint32_t page_fb_id[DGL_DRM_MAX_PAGES];
+	uint32_t extra_fb_id[2];	// Framebuffers for non-page offsets.
+	int extra_fb_y[2];
+	uint32_t displayed_fb_id;
+	uint32_t pending_fb_id;
+	bool flip_pending;
+	bool vblank_pending;
+	unsigned int event_sequence;	// Vblank sequence of the last event.
+	uint64_t event_time_usec;	// Timestamp of the last event.
+	void *mode;			// drmModeModeInfo.
+	void *saved_crtc;		// drmModeCrtc to restore.
+};
+
+// Pollable vsync events of a screen framebuffer (see dgl-event.cpp). fd
+// becomes readable on every vertical blank and page flip completion.
+
+class dglVSyncEvents {
+public :
+	dglScreenFB *fb;
+	int fd;			// File descriptor to poll for POLLIN.
+	int event_fd;		// eventfd written by the vsync thread, or -1 (DRM).
+	bool present_pending;	// A requested display page is not yet displayed.
+	uint64_t vsync_time_ns;		// Time of the last vertical blank.
+	uint64_t wait_sequence;		// Vsync thread waits started.
+	uint64_t vsync_sequence;	// Vsync thread waits completed.
+	uint64_t request_sequence;	// wait_sequence at the last page request.
+	uint64_t nu_vsyncs;		// Vertical blanks handled.
+	unsigned int last_sequence;	// DRM vblank sequence of the last event.
+	bool stop;
+	void *thread;		// pthread_t, NULL for DRM.
+};
+
+// Frame pacer. Frame time histogram buckets are 0.1 ms wide, the last
+// bucket counts all frame times of 100 ms or more.
+
+#define DGL_FRAME_PACER_HISTOGRAM_BUCKET_MS 0.1
+#define DGL_FRAME_PACER_HISTOGRAM_SIZE 1000
+
+class dglFramePacer {
+public :
+	dglScreenFB *fb;
+	int vsync_interval;		// Vertical blanks per frame.
+	double refresh_period;		// Estimated refresh period in seconds.
+	int nu_refresh_period_samples;	// Measurements in the estimate.
+	double last_vsync_time;		// Time of the last vsync return.
+	bool have_vsync_time;		// last_vsync_time is of a real vsync.
+	double last_frame_time;		// Time of the last presented frame.
+	bool stats_started;
+	int nu_frames;
+	int nu_missed_vblanks;
+	int nu_dropped_frames;
+	double frame_time_sum;
+	double frame_time_sum_sq;
+	double frame_time_max;
+	double latency_sum;
+	double latency_max;
+	double last_latency;
+	int *histogram;
+};
+
+// Frame pacing statistics. All times are in seconds. Latency is the time
+// from the call to dglFramePacerWait until the vsync the frame was
+// presented at. A missed vblank is a refresh at which the previous frame
+// was displayed again because the new frame was late; dropped frames are
+// frame intervals that were skipped to get back on schedule.
+
+class dglFramePacerStats {
+public :
+	double refresh_rate;
+	double target_frame_time;
+	int nu_frames;
+	int nu_missed_vblanks;
+	int nu_dropped_frames;
+	double mean_frame_time;
+	double jitter;			// Standard deviation of the frame time.
+	double max_frame_time;
+	double p50_frame_time;
+	double p90_frame_time;
+	double p99_frame_time;
+	double mean_latency;
+	double max_latency;
 };
 
 class dglClipRectangle {
@@ -93,6 +254,625 @@ public :
 	int y2;
 };
 
+// Region consisting of non-overlapping rectangles (x2 and y2 exclusive),
+// stored in y-x banded form: the rectangles are sorted by y1 and then by
+// x1, rectangles in the same band have the same y1 and y2, and adjacent
+// bands with the same horizontal spans are merged (see dgl-region.cpp).
+// The rectangles can be iterated with rects[0] to rects[nu_rects - 1].
+
+class dglRegionArena;
+
+class dglRegion {
+public :
+	dglClipRectangle extents;	// Bounding box (all zero when empty).
+	int nu_rects;
+	int capacity;
+	dglClipRectangle *rects;
+	dglRegionArena *arena;		// Allocator of the rectangle array, or NULL.
+};
+
+// Arena that recycles the rectangle arrays of regions in power-of-two size
+// classes, carving them from large blocks. An arena must only be used by
+// one thread at a time.
+
+#define DGL_REGION_ARENA_NU_CLASSES 8
+
+class dglRegionArena {
+public :
+	void *free_list[DGL_REGION_ARENA_NU_CLASSES];
+	uint8_t *block;		// Current block; blocks are chained through their first word.
+	int block_used;
+};
+
+// Sprite with transparent pixels, stored as runs of opaque pixels for every
+// row (see dglCreateSpriteFromImage).
+
+class dglSpriteRun {
+public :
+	int x;			// Start of the run within the row.
+	int w;			// Number of opaque pixels.
+	int offset;		// Byte offset of the pixel data of the run.
+};
+
+class dglSprite {
+public :
+	uint32_t format;
+	int bytes_per_pixel;
+	int xres;
+	int yres;
+	int nu_runs;
+	int nu_opaque_pixels;
+	int *row_run;		// Index of the first run of each row (yres + 1 entries).
+	dglSpriteRun *run;
+	uint8_t *pixels;	// Pixel data of all opaque runs.
+};
+
+// Linear or radial color gradient (see dgl-gradient.cpp). The colors are
+// converted once to a lookup table in the pixel format of the framebuffer
+// the gradient is drawn into. Coordinates are relative to the draw page.
+
+#define DGL_GRADIENT_LUT_SIZE 256
+
+enum {
+	DGL_GRADIENT_LINEAR = 0,
+	DGL_GRADIENT_RADIAL = 1,
+};
+
+class dglGradient {
+public :
+	int type;
+	uint32_t format;
+	int x0, y0;		// Start point (linear) or center (radial).
+	int x1, y1;		// End point (linear).
+	int radius;		// Radius (radial).
+	uint32_t *lut;		// DGL_GRADIENT_LUT_SIZE pixels in the destination format.
+};
+
+// Occlusion culling. While an occlusion culler is set for a context, opaque
+// fills and images are recorded instead of drawn. When the operations are
+// flushed they are processed from front to back, and only the parts that
+// are not covered by later operations are drawn (see dgl-occlusion.cpp).
+
+enum {
+	DGL_OCCLUSION_OP_FILL = 0,
+	DGL_OCCLUSION_OP_IMAGE = 1,
+	DGL_OCCLUSION_OP_GRADIENT = 2,
+	DGL_OCCLUSION_OP_PATTERN = 3,
+};
+
+class dglOcclusionOp {
+public :
+	int type;
+	int x, y, w, h;		// Clipped destination area relative to the draw page.
+	uint32_t pixel;		// Fill.
+	int sx, sy;		// Image source position or pattern origin.
+	dglImage *image;	// Image or pattern tile.
+	dglGradient *gradient;
+};
+
+class dglOcclusionStats {
+public :
+	int nu_flushes;
+	int nu_ops;
+	int nu_culled_ops;	// Operations that were completely hidden.
+	int nu_rects_drawn;	// Visible pieces drawn.
+	double pixels_submitted;	// Total area of the recorded operations.
+	double pixels_drawn;
+	double pixels_covered;	// Area covered by the union of the operations.
+	// Average number of times every covered pixel would have been written
+	// without culling (pixels_submitted / pixels_covered).
+	double overdraw;
+	// The same with culling (pixels_drawn / pixels_covered; normally 1).
+	double overdraw_culled;
+};
+
+class dglOcclusionCuller {
+public :
+	int nu_ops;
+	int max_ops;
+	dglOcclusionOp *ops;
+	dglRegionArena *arena;
+	dglRegion *covered;
+	dglRegion *visible;
+	dglRegion *rectangle;
+	int nu_flushes;
+	int nu_ops_total;
+	int nu_culled_ops;
+	int nu_rects_drawn;
+	double pixels_submitted;
+	double pixels_drawn;
+	double pixels_covered;
+};
+
+// Losslessly compressed image that is decoded directly into a framebuffer
+// (see dgl-codec.cpp). The image is divided into independently coded strips
+// of strip_height rows.
+
+#define DGL_COMPRESSED_IMAGE_DEFAULT_STRIP_HEIGHT 16
+
+class dglCompressedImage {
+public :
+	int xres;
+	int yres;
+	int strip_height;
+	int nu_strips;
+	uint32_t *strip_offset;	// Offset of each strip in data (nu_strips + 1 entries).
+	uint8_t *data;
+	int size;		// Size of the compressed data in bytes.
+};
+
+// Thread safety. A context must only be used by one thread at a time, but
+// every thread may have its own context, and contexts in different threads
+// may draw into the same framebuffer concurrently as long as the areas that
+// are written by one thread are not read or written by another thread (a
+// per-context clip rectangle can be used to enforce this). Damage tracking
+// for shadow framebuffers is lock-free and safe to use from multiple
+// threads. Operations on the framebuffer itself (creation and destruction,
+// dglPanDisplay, dglWaitVSync, frame pacing, enabling, disabling and
+// flushing shadow mode) must be performed by one thread while no other
+// thread is drawing into it; a present barrier (dglPresentBarrierWait) can
+// be used to join render threads before presenting a frame. dglMessage and
+// dglSetDebugMessageLevel may be called from any thread.
+
+class dglOcclusionCuller;
+class dglTracer;
+
+class dglContext {
+public :
+	dglFB *read_fb;
+	dglFB *draw_fb;
+	int read_yoffset;
+	int draw_yoffset;
+	bool clip_enabled;
+	// Clip rectangle for drawing functions (x2 and y2 exclusive),
+	// relative to the draw page like drawing coordinates.
+	dglClipRectangle clip;
+	// Occlusion culler that defers opaque drawing operations, or NULL.
+	dglOcclusionCuller *occlusion;
+	// Tracer that records drawing operations, or NULL.
+	dglTracer *tracer;
+};
+
+// Present barrier. Render threads call dglPresentBarrierWait when they have
+// finished drawing a frame; the last thread to arrive calls the present
+// function (for example to flip pages) before any of the threads is
+// released to draw the next frame.
+
+typedef void (*dglPresentFunc)(void *user_data);
+
+class dglPresentBarrier {
+public :
+	int nu_threads;
+	int nu_waiting;
+	unsigned int generation;
+	dglPresentFunc present_func;
+	void *user_data;
+	void *mutex;		// pthread_mutex_t.
+	void *cond;		// pthread_cond_t.
+	int nu_frames;
+	double wait_time_total;	// Time spent waiting by all threads.
+};
+
+// YUV video frames. I420 has a full-resolution Y plane followed by U and V
+// planes at half resolution in both directions; NV12 has a Y plane followed
+// by one plane of interleaved U and V samples at half resolution; YUYV has
+// one plane of Y0, U, Y1, V samples with chroma at half horizontal
+// resolution. The planes and strides may refer to external memory; buffer
+// is the memory freed by dglDestroyYUVImage.
+
+enum {
+	DGL_YUV_FORMAT_I420 = 0,
+	DGL_YUV_FORMAT_NV12 = 1,
+	DGL_YUV_FORMAT_YUYV = 2,
+	DGL_NU_YUV_FORMATS
+};
+
+class dglYUVImage {
+public :
+	int format;
+	int xres;
+	int yres;
+	uint8_t *plane[3];
+	int stride[3];
+	uint8_t *buffer;
+};
+
+// Double-buffered queue of video frames presented by a worker thread (see
+// dglCreateVideoQueue).
+
+#define DGL_VIDEO_QUEUE_SLOTS 2
+
+class dglVideoQueue {
+public :
+	dglScreenFB *fb;
+	dglContext *context;
+	int x, y, w, h;		// Destination rectangle.
+	bool vsync;
+	int nu_pages;
+	int draw_page;
+	dglYUVImage *slot[DGL_VIDEO_QUEUE_SLOTS];
+	int slot_state[DGL_VIDEO_QUEUE_SLOTS];
+	unsigned int slot_sequence[DGL_VIDEO_QUEUE_SLOTS];
+	unsigned int next_sequence;
+	int nu_frames;		// Number of frames presented.
+	bool stop;
+	void *mutex;		// pthread_mutex_t.
+	void *cond;		// pthread_cond_t.
+	void *thread;		// pthread_t.
+};
+
+// Scrolling region (see dgl-scroll.cpp). Drawing into the region is done
+// with the scroller's context, which is clipped to the region.
+
+enum {
+	// The displayed area is panned through the virtual framebuffer.
+	DGL_SCROLL_MODE_PAN = 0,
+	// The region is copied with the framebuffer's accelerated CopyArea.
+	DGL_SCROLL_MODE_COPY_AREA = 1,
+	// The region is copied in software.
+	DGL_SCROLL_MODE_SOFTWARE = 2,
+};
+
+// Do not pan the display even when possible (for example when the
+// application uses page flipping).
+#define DGL_SCROLLER_FLAG_NO_PAN 0x1
+
+class dglScroller {
+public :
+	dglContext *context;	// Context for drawing into the region.
+	dglScreenFB *fb;	// Screen framebuffer that is panned (pan mode only).
+	int x, y, w, h;		// Region, relative to the draw page.
+	uint32_t background;	// Pixel value used for newly exposed rows.
+	int mode;
+	int nu_scrolls;
+	int nu_wrap_copies;	// Copies back to the other end of the ring (pan mode).
+};
+
+// Presentation strategies of a presenter (see dgl-present.cpp).
+
+enum {
+	// Select the best supported strategy when the presenter is created.
+	DGL_PRESENT_MODE_AUTO = - 1,
+	// Draw into successive framebuffer pages and pan the display to the
+	// finished page.
+	DGL_PRESENT_MODE_PAN = 0,
+	// Draw into a spare framebuffer page and copy it to the displayed page
+	// with CopyArea (using DMA when available).
+	DGL_PRESENT_MODE_COPY_AREA = 1,
+	// Draw into a pixmap in system memory and copy the damaged rows to the
+	// displayed page.
+	DGL_PRESENT_MODE_PIXMAP = 2,
+	DGL_NU_PRESENT_MODES = 3
+};
+
+// Do not use pan mode even when possible (for example when a scroller pans
+// the display).
+#define DGL_PRESENTER_FLAG_NO_PAN 0x1
+#define DGL_PRESENTER_MAX_PAGES 3
+
+class dglPresenter {
+public :
+	dglScreenFB *fb;
+	int mode;
+	int nu_pages;		// Pages cycled through (pan mode).
+	int back_page;		// Page being drawn (pan mode).
+	int page_frame[DGL_PRESENTER_MAX_PAGES];	// Frame last presented from a page.
+	dglFB *pixmap;		// Back buffer (pixmap mode).
+	dglContext *copy_context;	// Context for presenting (copy area mode).
+	// When set, pages are presented without blocking with
+	// dglRequestDisplayPage (pan mode).
+	dglVSyncEvents *events;
+	int replaced_page;	// Page displayed before the last request, or -1.
+	int nu_presents;
+	// Measured time of a full-screen present for each mode in seconds,
+	// or 0 when not measured.
+	double present_time[DGL_NU_PRESENT_MODES];
+};
+
+// Frame scheduler (see dgl-scheduler.cpp). Waiters are callbacks that are
+// run when a frame is drawn or after it has been presented; the coroutine
+// interface in dgl-coroutine.h is built on them.
+
+typedef void (*dglFrameWaiterFunc)(void *data);
+
+class dglFrameWaiter {
+public :
+	dglFrameWaiterFunc func;	// Called to resume the waiter.
+	dglFrameWaiterFunc cancel;	// Called when the scheduler is destroyed, or NULL.
+	void *data;
+	int frame;			// Frame at which to resume.
+};
+
+class dglFrameScheduler {
+public :
+	dglScreenFB *fb;
+	dglContext *context;	// Drawing context, set to the back buffer.
+	dglPresenter *presenter;
+	dglVSyncEvents *events;	// Page flips without a pacer (pan mode), or NULL.
+	dglFramePacer *pacer;	// NULL when not synchronized to vsync.
+	int frame;		// Frame being drawn, or the next frame.
+	bool drawing;		// Frame waiters are being resumed.
+	int back_buffer_age;	// Return value of dglPresenterAcquire.
+	int frame_intervals;	// Frame intervals elapsed at the last present.
+	int nu_frames;		// Frames presented.
+	int nu_skipped_frames;	// Frame intervals skipped to catch up.
+	double frame_time;	// Time of the last present (CLOCK_MONOTONIC seconds).
+	bool stop;
+	int nu_waiters;
+	int max_waiters;
+	dglFrameWaiter *waiter;	// Waiting for a frame, in resume order.
+	int nu_vsync_waiters;
+	int max_vsync_waiters;
+	dglFrameWaiter *vsync_waiter;	// Waiting for the next present.
+};
+
+// Simulated screen framebuffer in system memory, for running and testing
+// screen framebuffer code without a display (see dgl-simfb.cpp). It has
+// the given number of pages and supports PanDisplay and WaitVSync, which
+// waits for the next vertical blank of a simulated display.
+
+class dglSimulatedFB : public dglScreenFB {
+public :
+	double refresh_period;	// Seconds.
+};
+
+// Surface shared between a compositor and a client process. The pixels are
+// stored in a memfd shared memory object that is mapped by both, and fb
+// describes them as a pixmap framebuffer that the client draws into.
+
+class dglCompositorSurface {
+public :
+	int id;
+	int x, y, w, h;		// Position and size on the screen.
+	int z;			// Stacking order; higher is on top.
+	bool mapped;		// Visible (after the first damage).
+	int client;		// Owning client (compositor only).
+	uint8_t *addr;		// Shared memory mapping.
+	int size;
+	dglFB *fb;
+};
+
+#define DGL_COMPOSITOR_MAX_CLIENTS 16
+#define DGL_COMPOSITOR_MAX_SURFACES 64
+// Wait for vertical blank before presenting a frame.
+#define DGL_COMPOSITOR_FLAG_VSYNC 0x1
+
+class dglCompositor {
+public :
+	dglScreenFB *fb;
+	int flags;
+	uint32_t background;	// Pixel value where no surface is visible.
+	int listen_fd;
+	char *socket_path;
+	int nu_clients;
+	int client_fd[DGL_COMPOSITOR_MAX_CLIENTS];
+	bool client_frame_pending[DGL_COMPOSITOR_MAX_CLIENTS];
+	int nu_surfaces;
+	dglCompositorSurface *surface[DGL_COMPOSITOR_MAX_SURFACES];	// Bottom to top.
+	int next_surface_id;
+	dglPresenter *presenter;
+	dglContext *context;
+	dglOcclusionCuller *culler;
+	dglRegionArena *arena;
+	dglRegion *damage;	// Damage of the next frame.
+	// Damage of the previous frames (most recent first), to bring older
+	// back buffers up to date.
+	dglRegion *frame_damage[DGL_PRESENTER_MAX_PAGES];
+	dglRegion *repaint;
+	int nu_frames;
+};
+
+class dglCompositorClient {
+public :
+	int fd;
+	uint32_t format;
+	int nu_frames_done;	// FRAME_DONE events received but not yet waited for.
+};
+
+// Recorder that writes captured frames of a screen framebuffer to a file
+// in a background thread (see dgl-capture.cpp). Frames are captured into a
+// bounded number of slots; when all slots are waiting to be written, new
+// frames are dropped instead of blocking the application.
+
+// Compress recorded frames with the lossless image codec.
+#define DGL_RECORDER_FLAG_COMPRESS 0x1
+
+class dglRecorder {
+public :
+	dglScreenFB *fb;
+	int fd;
+	int flags;
+	// Page used for DMA snapshots that the writer thread reads, or - 1.
+	int spare_page;
+	int nu_slots;
+	dglFB **slot;
+	int *slot_state;
+	bool *slot_in_spare_page;	// The pixels are still in the spare page.
+	unsigned int *slot_sequence;
+	unsigned int next_sequence;
+	int nu_frames_recorded;
+	int nu_frames_dropped;
+	int nu_frames_written;
+	uint64_t bytes_written;
+	bool write_error;
+	bool stop;
+	void *mutex;		// pthread_mutex_t.
+	void *cond;		// pthread_cond_t.
+	void *thread;		// pthread_t.
+};
+
+// Recording file opened for reading frames.
+
+class dglRecording {
+public :
+	void *file;		// FILE.
+	uint32_t format;
+	int xres, yres;
+	int flags;
+	int nu_frames_read;
+};
+
+// Tracer that records the drawing calls made with contexts (see
+// dgl-trace.cpp). Framebuffers and images are identified by number in the
+// trace; the contents of a framebuffer are stored when it is first drawn
+// into or read from, and images are stored once per distinct content.
+
+#define DGL_TRACER_FLAG_CHECKSUMS 0x1
+
+class dglTracer {
+public :
+	void *file;		// FILE.
+	int flags;
+	int nu_fbs;
+	int max_fbs;
+	dglFB **fb;
+	// Hash table mapping image checksums to image numbers.
+	int image_table_size;
+	uint64_t *image_checksum;
+	int *image_id;
+	int nu_images;
+	// State of the trace after the last recorded operation.
+	int draw_fb_id;
+	int read_fb_id;
+	int draw_yoffset;
+	int read_yoffset;
+	bool clip_enabled;
+	dglClipRectangle clip;
+	uint8_t *buffer;
+	int buffer_size;
+	int nu_ops;
+	int nu_frames;
+	uint64_t bytes_written;
+	bool write_error;
+};
+
+enum {
+	DGL_TRACE_OP_FILL,
+	DGL_TRACE_OP_COPY_AREA,
+	DGL_TRACE_OP_PUT_IMAGE,
+	DGL_TRACE_OP_PUT_PIXEL,
+	DGL_TRACE_OP_SET_DRAW,
+	DGL_TRACE_OP_SET_READ,
+	DGL_TRACE_OP_SET_CLIP,
+	DGL_TRACE_OP_DISABLE_CLIP,
+	DGL_TRACE_OP_FRAME
+};
+
+// Decoded trace operation. For SET_DRAW and SET_READ, id is the
+// framebuffer number and args[0] the y offset; for PUT_IMAGE, id is the
+// image number; for FRAME, id is the frame number.
+
+class dglTraceOp {
+public :
+	int type;
+	int id;
+	int args[6];
+	uint32_t pixel;
+};
+
+// Trace loaded for replay. The initial contents of every framebuffer are
+// kept as an image of all its rows, and the checksums of the framebuffers
+// defined at each frame (if recorded) in frame_checksum starting at
+// frame_checksum_index[frame].
+
+class dglTrace {
+public :
+	int nu_fbs;
+	int *fb_yres;		// Page height.
+	dglImage **fb_contents;
+	int nu_images;
+	dglImage **image;
+	int nu_ops;
+	dglTraceOp *op;
+	int nu_frames;
+	int *frame_nu_checksums;
+	int *frame_checksum_index;
+	uint64_t *frame_checksum;
+};
+
+// Replay variants, selecting different drawing kernels.
+
+enum {
+	DGL_REPLAY_VARIANT_REGULAR,	// Regular stores.
+	DGL_REPLAY_VARIANT_STREAMING,	// Streaming stores (write-combined path).
+	DGL_REPLAY_VARIANT_OCCLUSION,	// Occlusion culling, flushed every frame.
+	DGL_REPLAY_VARIANT_THREADED,	// Horizontal bands drawn by threads.
+	DGL_NU_REPLAY_VARIANTS
+};
+
+class dglReplayResult {
+public :
+	double time;		// Seconds, excluding checksum verification.
+	int nu_frames_checked;
+	int nu_mismatched_frames;
+	int first_mismatched_frame;
+	int nu_fbs;
+	dglFB **fb;		// Framebuffers after the replay.
+};
+
+// Cache of pre-rendered surfaces, such as widgets, stored in pixmaps in the
+// pixel format of the target framebuffer (see dgl-cache.cpp). Small surfaces
+// are packed into shared atlas pixmaps in cells of a size class. The least
+// recently used surfaces are evicted when the memory budget is exceeded.
+
+class dglSurfaceAtlas {
+public :
+	dglFB *fb;
+	int cell_w, cell_h;
+	int nu_cells;
+	int nu_free_cells;
+	int *free_cell;		// Stack of free cell indices.
+	dglSurfaceAtlas *next;	// Next atlas of the same size class.
+};
+
+class dglCachedSurface {
+public :
+	uint64_t key;
+	dglFB *fb;		// Pixmap containing the surface.
+	int x, y;		// Position of the surface within the pixmap.
+	int w, h;
+	int size;		// Size of the cell or pixmap in bytes.
+	dglSurfaceAtlas *atlas;	// Atlas containing the surface, or NULL.
+	int cell;
+	dglCachedSurface *lru_prev;	// More recently used surface.
+	dglCachedSurface *lru_next;	// Less recently used surface.
+	dglCachedSurface *hash_next;
+};
+
+typedef void (*dglRenderSurfaceFunc)(dglContext *context, int x, int y, void *user_data);
+
+class dglSurfaceCacheStats {
+public :
+	int nu_hits;
+	int nu_misses;
+	int nu_evictions;
+	int nu_surfaces;
+	int nu_pixmaps;		// Atlas and individual pixmaps allocated.
+	int memory_used;	// Bytes of the atlas and individual pixmaps.
+	int memory_budget;
+};
+
+#define DGL_SURFACE_CACHE_NU_SIZE_CLASSES 20
+
+class dglSurfaceCache {
+public :
+	uint32_t format;
+	int bytes_per_pixel;
+	int memory_budget;
+	int memory_used;
+	int nu_surfaces;
+	int nu_pixmaps;
+	int hash_size;		// Power of two.
+	dglCachedSurface **hash;
+	dglCachedSurface *lru_head;	// Most recently used surface.
+	dglCachedSurface *lru_tail;	// Least recently used surface.
+	dglSurfaceAtlas *atlas[DGL_SURFACE_CACHE_NU_SIZE_CLASSES];
+	dglContext *render_context;
+	int nu_hits;
+	int nu_misses;
+	int nu_evictions;
+};
+
 // General functions.
 
 // Messages will only be displayed if the priority is smaller than or equal
@@ -122,9 +902,49 @@ dglConsoleFB *dglCreateConsoleFramebuffer();
 void dglDestroyConsoleFramebuffer(dglConsoleFB *cfb);
 void dglConsoleFBPanDisplay(dglScreenFB *cfb, int x, int y);
 void dglConsoleFBWaitVSync(dglScreenFB *cfb);
-const char *dglGetInfoString(dglConsoleFB *cfb);
+const char *dglGetInfoString(dglScreenFB *fb);
 void dglConsoleFBCopyArea(dglScreenFB *fb, int sx, int sy, int dx, int dy, int w, int h);
 
+// CopyArea calibration. dglCalibrateCopyArea measures the CPU and
+// accelerated CopyArea paths and makes dglCopyArea use the faster one per
+// size class. When cache_filename is not NULL, results stored there for the
+// same mode are reused, and new results are saved. The console framebuffer
+// is calibrated at creation when DGL_COPY_CALIBRATION is set to a file name.
+// dglGetCopyCalibrationString returns a description of the size classes.
+
+bool dglCalibrateCopyArea(dglScreenFB *fb, const char *cache_filename);
+void dglDisableCopyAreaCalibration(dglScreenFB *fb);
+const char *dglGetCopyCalibrationString(dglScreenFB *fb);
+
+DGL_INLINE_ONLY static int dglGetCopySizeClass(const dglCopyCalibration *calibration,
+int w, int h) {
+	int area = w * h;
+	int i = 0;
+	while (i < DGL_COPY_NU_SIZE_CLASSES - 1 && area > calibration->max_area[i])
+		i++;
+	return i;
+}
+
+// Functions specific to the DRM/KMS framebuffer. When device is NULL, the
+// DGL_DRM_DEVICE environment variable or /dev/dri/card0 is used. Requires
+// DGL to be compiled with libdrm.
+
+dglDRMFB *dglCreateDRMFramebuffer(const char *device, int nu_pages);
+void dglDestroyDRMFramebuffer(dglDRMFB *dfb);
+// Non-blocking page flip and vblank event requests, completion of which is
+// handled by dglDRMFBDispatchEvents when the DRM file descriptor is readable.
+bool dglDRMFBRequestPageFlip(dglDRMFB *dfb, int y);
+bool dglDRMFBRequestVBlankEvent(dglDRMFB *dfb);
+// Current vertical blank sequence number of the display (no event).
+unsigned int dglDRMFBGetVBlankSequence(dglDRMFB *dfb);
+void dglDRMFBDispatchEvents(dglDRMFB *dfb, bool wait);
+
+// Functions specific to the simulated screen framebuffer.
+
+dglSimulatedFB *dglCreateSimulatedFramebuffer(uint32_t format, int width, int height,
+int nu_pages);
+void dglDestroySimulatedFramebuffer(dglSimulatedFB *sfb);
+
 // Functions for pixmap framebuffer.
 
 dglFB *dglCreatePixmapFB(uint32_t format, int w, int h);
@@ -137,12 +957,125 @@ void dglPanDisplay(dglScreenFB *fb, int x, int y);
 void dglSetDisplayPage(dglScreenFB *cfb, int page);
 void dglWaitVSync(dglScreenFB *fb);
 
+// Pan display (page flip) latency, measured as the time spent in the
+// backend's pan display function, in seconds.
+
+class dglPanDisplayStats {
+public :
+	int count;
+	double mean_latency;
+	double max_latency;
+};
+
+void dglGetPanDisplayStats(dglScreenFB *fb, dglPanDisplayStats *stats);
+void dglResetPanDisplayStats(dglScreenFB *fb);
+
+// Shadow framebuffer mode. All drawing goes to a cached copy of the screen
+// framebuffer in system memory, so that reads and copies are fast. Changed
+// rows are tracked automatically and written to the real screen memory in
+// one sequential pass when the displayed area changes (dglPanDisplay,
+// dglSetDisplayPage), after dglWaitVSync, or when explicitly flushed. For the
+// console framebuffer, shadow mode is also enabled at creation time when the
+// DGL_SHADOW_FB environment variable is set.
+
+bool dglEnableShadowFramebuffer(dglScreenFB *fb);
+void dglDisableShadowFramebuffer(dglScreenFB *fb);
+void dglFlushShadowFramebuffer(dglScreenFB *fb);
+void dglFlushShadowFramebufferArea(dglScreenFB *fb, int y, int h);
+
+// Dirty-page updates, for displays where every written page of screen
+// memory is transferred over a slow bus (fbdev deferred I/O drivers for SPI
+// and e-paper panels). Enables shadow framebuffer mode and keeps a copy of
+// the screen memory contents; a flush compares each page touched by damage
+// with it and only writes whole pages whose contents changed. page_size is
+// the update granularity in bytes (0 for the system page size). For the
+// console framebuffer, the mode is also enabled at creation time when the
+// DGL_DIRTY_PAGES environment variable is set (to a page size or empty).
+
+bool dglEnableDirtyPageUpdates(dglScreenFB *fb, int page_size);
+void dglDisableDirtyPageUpdates(dglScreenFB *fb);
+void dglGetDirtyPageStats(dglScreenFB *fb, dglDirtyPageStats *stats);
+void dglResetDirtyPageStats(dglScreenFB *fb);
+
+// Event loop integration. dglCreateVSyncEvents returns an event source
+// with a file descriptor (events->fd) that becomes readable at every
+// vertical blank and when a requested page flip has completed: the DRM
+// file descriptor for the DRM framebuffer, otherwise an eventfd written by
+// an internal vsync thread. When it is readable, call dglHandleVSyncEvents,
+// which returns the number of vertical blanks since the previous call and
+// flushes the shadow framebuffer. dglRequestDisplayPage presents a page
+// without blocking; it returns false while a previous request is pending.
+// dglWaitForDisplayPage blocks until a pending request has completed.
+// dglWaitVSync may still be called (the frame scheduler paces with it), but
+// on the DRM framebuffer it consumes the events it waits for, so that the
+// file descriptor does not become readable for those.
+
+dglVSyncEvents *dglCreateVSyncEvents(dglScreenFB *fb);
+void dglDestroyVSyncEvents(dglVSyncEvents *events);
+int dglHandleVSyncEvents(dglVSyncEvents *events);
+bool dglRequestDisplayPage(dglVSyncEvents *events, int page);
+void dglWaitForDisplayPage(dglVSyncEvents *events);
+
+// Damage tracking.
+
+dglDamage *dglCreateDamage(int width, int nu_rows);
+void dglDestroyDamage(dglDamage *damage);
+void dglAddDamage(dglDamage *damage, int x, int y, int w, int h);
+void dglClearDamage(dglDamage *damage, int y, int h);
+
+// Frame pacing. vsync_interval is the number of vertical blanks per frame
+// (1 for the display refresh rate, 2 for 30 fps and 3 for 20 fps on a 60 Hz
+// display). dglFramePacerWait is called instead of dglWaitVSync at the end
+// of each frame and returns the number of frame intervals that elapsed since
+// the previous frame.
+
+dglFramePacer *dglCreateFramePacer(dglScreenFB *fb, int vsync_interval);
+void dglDestroyFramePacer(dglFramePacer *pacer);
+void dglSetFramePacerInterval(dglFramePacer *pacer, int vsync_interval);
+int dglFramePacerWait(dglFramePacer *pacer);
+double dglFramePacerPredictNextVSync(dglFramePacer *pacer);
+void dglGetFramePacerStats(dglFramePacer *pacer, dglFramePacerStats *stats);
+void dglResetFramePacerStats(dglFramePacer *pacer);
+
+// Frame scheduling. A frame scheduler runs the frame loop of an animated
+// application: for each frame it acquires the back buffer of a presenter,
+// resumes every waiter whose frame has come (in the order they were
+// scheduled, so their drawing is batched into that frame), paces and
+// presents the frame and then resumes the vsync waiters. When presenting
+// falls behind, the frame counter advances by the frame intervals that
+// were skipped instead of drawing the missed frames. vsync_interval is as
+// for the frame pacer, or 0 to present without waiting for vsync.
+// dglScheduleFrameWaiter resumes a waiter nu_frames frames after the
+// current one (1 = next frame; from outside a frame, 1 is the upcoming
+// frame) and returns the frame number it is scheduled for.
+// dglRunFrame returns false when no waiters are left.
+
+dglFrameScheduler *dglCreateFrameScheduler(dglScreenFB *fb, int vsync_interval,
+int present_mode);
+void dglDestroyFrameScheduler(dglFrameScheduler *scheduler);
+int dglScheduleFrameWaiter(dglFrameScheduler *scheduler, int nu_frames,
+dglFrameWaiterFunc func, dglFrameWaiterFunc cancel, void *data);
+void dglScheduleVSyncWaiter(dglFrameScheduler *scheduler,
+dglFrameWaiterFunc func, dglFrameWaiterFunc cancel, void *data);
+bool dglRunFrame(dglFrameScheduler *scheduler);
+int dglRunFrameScheduler(dglFrameScheduler *scheduler);
+void dglStopFrameScheduler(dglFrameScheduler *scheduler);
+
 // Context
 
 dglContext *dglCreateContext(dglFB *read_fb, dglFB *draw_fb);
 void dglDestroyContext(dglContext *context);
 void dglSetReadFramebuffer(dglContext *context, dglFB *fb);
 void dglSetDrawFramebuffer(dglContext *context, dglFB *fb);
+void dglSetContextClipRectangle(dglContext *context, int x1, int y1, int x2, int y2);
+void dglDisableContextClipping(dglContext *context);
+
+// Present barrier for multi-threaded rendering. present_func may be NULL.
+
+dglPresentBarrier *dglCreatePresentBarrier(int nu_threads, dglPresentFunc present_func,
+void *user_data);
+void dglDestroyPresentBarrier(dglPresentBarrier *barrier);
+void dglPresentBarrierWait(dglPresentBarrier *barrier);
 
 // Screen framebuffer
 
@@ -164,15 +1097,379 @@ void dglPutPartialImage(dglContext *context, int sx, int sy, int dx, int dy,
 int w, int h, dglImage *image);
 void dglFill(dglContext *context, int x, int y, int w, int h, uint32_t pixel);
 
+// Sprites. The sprite must have the same pixel size as the draw framebuffer.
+
+dglSprite *dglCreateSpriteFromImage(dglImage *image, uint32_t color_key);
+dglSprite *dglCreateSpriteFromImageWithAlpha(dglImage *image, int alpha_threshold);
+void dglDestroySprite(dglSprite *sprite);
+void dglPutSprite(dglContext *context, int x, int y, dglSprite *sprite);
+
+// Gradient and pattern fills. Gradient colors are specified as 0xRRGGBB; by
+// default the gradient runs from color0 to color1, with the end colors
+// extended beyond the end points. dglSetGradientColorStops replaces the
+// colors by nu_stops colors at increasing positions from 0 to 1. The tile
+// used by dglFillPattern must have the same pixel size as the draw
+// framebuffer and is repeated with its top-left corner at (origin_x,
+// origin_y).
+
+dglGradient *dglCreateLinearGradient(uint32_t format, int x0, int y0, int x1, int y1,
+uint32_t color0, uint32_t color1);
+dglGradient *dglCreateRadialGradient(uint32_t format, int x, int y, int radius,
+uint32_t color0, uint32_t color1);
+void dglSetGradientColorStops(dglGradient *gradient, int nu_stops, const float *position,
+const uint32_t *color);
+void dglDestroyGradient(dglGradient *gradient);
+void dglFillGradient(dglContext *context, int x, int y, int w, int h,
+dglGradient *gradient);
+void dglFillPattern(dglContext *context, int x, int y, int w, int h, dglImage *tile,
+int origin_x, int origin_y);
+
+// Compressed images. The decoder converts to the pixel format of the draw
+// framebuffer. The threaded variant decodes strips in parallel using
+// nu_threads threads.
+
+dglCompressedImage *dglCompressImage(dglImage *image, int strip_height);
+void dglDestroyCompressedImage(dglCompressedImage *cimage);
+bool dglSaveCompressedImage(dglCompressedImage *cimage, const char *filename);
+dglCompressedImage *dglLoadCompressedImage(const char *filename);
+void dglPutCompressedImage(dglContext *context, int x, int y, dglCompressedImage *cimage);
+void dglPutCompressedImageThreaded(dglContext *context, int x, int y,
+dglCompressedImage *cimage, int nu_threads);
+
+// Screen capture. dglCaptureScreen copies the displayed page of a screen
+// framebuffer into a pixmap of the same size and pixel format, and
+// dglCaptureScreenRegion only the area covered by a region. When spare_page
+// is a page that is neither displayed nor drawn into and the framebuffer
+// has accelerated CopyArea, the area is first copied there with DMA, which
+// takes a consistent snapshot; otherwise (or in shadow mode, where the
+// cached copy is read) the displayed page is read directly.
+// A recorder writes frames to a file in a background thread, keeping up to
+// max_queued_frames captured frames. dglRecordFrame captures the displayed
+// page and returns false when the frame was dropped because the queue is
+// full. With a spare page, the writer thread reads the DMA snapshot, so
+// that the application thread does not read the screen; frames are also
+// dropped while the previous snapshot has not been read yet.
+// dglReadRecordingFrame reads the next frame of a recording into a
+// framebuffer of the same size (and, for uncompressed recordings, format).
+
+bool dglCaptureScreen(dglScreenFB *fb, dglFB *dest, int spare_page);
+bool dglCaptureScreenRegion(dglScreenFB *fb, dglFB *dest, const dglRegion *region,
+int spare_page);
+dglRecorder *dglCreateRecorder(dglScreenFB *fb, const char *filename, int max_queued_frames,
+int spare_page, int flags);
+void dglDestroyRecorder(dglRecorder *recorder);
+bool dglRecordFrame(dglRecorder *recorder);
+dglRecording *dglOpenRecording(const char *filename);
+void dglCloseRecording(dglRecording *recording);
+bool dglReadRecordingFrame(dglRecording *recording, dglFB *dest);
+
+// YUV video frames. dglPutYUVImage converts a frame to the pixel format of
+// the draw framebuffer and scales it to w x h pixels. The video queue lets
+// a decoder thread fill one frame while the previous frame is converted and
+// presented.
+
+dglYUVImage *dglCreateYUVImage(int format, int w, int h);
+dglYUVImage *dglCreateYUVImageFromBuffer(int format, int w, int h, uint8_t *buffer);
+int dglGetYUVImageSize(int format, int w, int h);
+void dglDestroyYUVImage(dglYUVImage *yuv);
+void dglPutYUVImage(dglContext *context, dglYUVImage *yuv, int x, int y, int w, int h);
+dglVideoQueue *dglCreateVideoQueue(dglScreenFB *fb, int yuv_format, int yuv_w, int yuv_h,
+int x, int y, int w, int h, bool vsync);
+void dglDestroyVideoQueue(dglVideoQueue *queue);
+dglYUVImage *dglVideoQueueAcquireFrame(dglVideoQueue *queue);
+void dglVideoQueueSubmitFrame(dglVideoQueue *queue, dglYUVImage *frame);
+
+// Presentation. dglPresenterAcquire sets the draw and read framebuffer and
+// page of a context to the back buffer and returns its age: the number of
+// frames since its contents were presented (1 when it still holds the
+// previous frame), or 0 when the contents are undefined and the whole frame
+// must be drawn. dglPresenterPresent displays the back buffer; call
+// dglFramePacerWait or dglWaitVSync first to present at vertical blank.
+// With a vsync event source set in presenter->events, pan mode presents
+// do not block, and dglPresenterAcquire waits until the requested page is
+// displayed when the back buffer is the page that it replaces.
+
+bool dglIsPresentModeSupported(dglScreenFB *fb, int mode, int flags);
+dglPresenter *dglCreatePresenter(dglScreenFB *fb, int mode, int flags);
+void dglDestroyPresenter(dglPresenter *presenter);
+int dglPresenterAcquire(dglPresenter *presenter, dglContext *context);
+void dglPresenterPresent(dglPresenter *presenter);
+
+// Compositor. A compositor process owns the screen framebuffer and hands out
+// shared-memory surfaces to client processes that connect to its Unix
+// socket. Clients draw into surface->fb and report the changed area with
+// dglDamageCompositorSurface; the compositor reads the surfaces directly
+// when it composites the damaged screen area, so a client should wait for
+// the next frame (dglWaitCompositorFrame) before drawing again.
+// dglCompositorDispatch handles client requests for up to timeout_ms
+// milliseconds (- 1 waits indefinitely) and returns the number of requests
+// handled, and dglCompositorComposite draws and presents a frame when the
+// screen is damaged, returning whether it did.
+
+dglCompositor *dglCreateCompositor(dglScreenFB *fb, const char *socket_path,
+uint32_t background, int flags);
+void dglDestroyCompositor(dglCompositor *compositor);
+int dglCompositorDispatch(dglCompositor *compositor, int timeout_ms);
+bool dglCompositorComposite(dglCompositor *compositor);
+dglCompositorClient *dglConnectCompositor(const char *socket_path);
+void dglDisconnectCompositor(dglCompositorClient *client);
+dglCompositorSurface *dglCreateCompositorSurface(dglCompositorClient *client, int x, int y,
+int w, int h, int z);
+void dglDestroyCompositorSurface(dglCompositorClient *client, dglCompositorSurface *surface);
+void dglDamageCompositorSurface(dglCompositorClient *client, dglCompositorSurface *surface,
+int x, int y, int w, int h);
+void dglMoveCompositorSurface(dglCompositorClient *client, dglCompositorSurface *surface,
+int x, int y);
+bool dglWaitCompositorFrame(dglCompositorClient *client);
+
+// Scrolling. dglScroll scrolls the contents of the region up by dy pixels
+// (down when dy is negative) and fills the exposed rows with the background
+// pixel; new contents should then be drawn with scroller->context.
+
+dglScroller *dglCreateScroller(dglContext *context, int x, int y, int w, int h,
+uint32_t background, int flags);
+void dglDestroyScroller(dglScroller *scroller);
+void dglScroll(dglScroller *scroller, int dy);
+
+// Surface cache. dglGetCachedSurface returns the surface with the given key
+// and size, calling the render function to draw it at (x, y) of the context
+// it is passed when the surface is not in the cache; the render function
+// must draw every pixel of the w x h area. The returned surface
+// remains valid until the next call that adds a surface to the cache.
+// dglHashSurfaceKey can be used to derive a key from a description of the
+// surface contents.
+
+dglSurfaceCache *dglCreateSurfaceCache(uint32_t format, int memory_budget);
+void dglDestroySurfaceCache(dglSurfaceCache *cache);
+dglCachedSurface *dglGetCachedSurface(dglSurfaceCache *cache, uint64_t key, int w, int h,
+dglRenderSurfaceFunc render_func, void *user_data);
+void dglRemoveCachedSurface(dglSurfaceCache *cache, uint64_t key);
+void dglPutCachedSurface(dglContext *context, int x, int y, dglCachedSurface *surface);
+void dglGetSurfaceCacheStats(dglSurfaceCache *cache, dglSurfaceCacheStats *stats);
+void dglResetSurfaceCacheStats(dglSurfaceCache *cache);
+uint64_t dglHashSurfaceKey(const void *data, int size);
+
+// Regions. The destination of a set operation may be one of the operands.
+// dglFillRegion fills all rectangles of a region, dglCopyAreaRegion copies
+// the area covered by a region by (dx, dy), ordering the rectangles so that
+// overlapping copies within the same framebuffer are correct, and
+// dglPutImageRegion draws an image at (x, y) only where it lies within the
+// region.
+
+dglRegionArena *dglCreateRegionArena();
+void dglDestroyRegionArena(dglRegionArena *arena);
+dglRegion *dglCreateRegion(dglRegionArena *arena);
+void dglDestroyRegion(dglRegion *region);
+void dglClearRegion(dglRegion *region);
+void dglSetRegionRectangle(dglRegion *region, int x, int y, int w, int h);
+void dglCopyRegion(dglRegion *dest, const dglRegion *src);
+void dglUnionRegion(dglRegion *dest, const dglRegion *region1, const dglRegion *region2);
+void dglIntersectRegion(dglRegion *dest, const dglRegion *region1, const dglRegion *region2);
+void dglSubtractRegion(dglRegion *dest, const dglRegion *region1, const dglRegion *region2);
+void dglAddRegionRectangle(dglRegion *region, int x, int y, int w, int h);
+void dglTranslateRegion(dglRegion *region, int dx, int dy);
+bool dglRegionContainsPoint(const dglRegion *region, int x, int y);
+int dglGetRegionArea(const dglRegion *region);
+void dglFillRegion(dglContext *context, const dglRegion *region, uint32_t pixel);
+void dglCopyAreaRegion(dglContext *context, const dglRegion *region, int dx, int dy);
+void dglPutImageRegion(dglContext *context, int x, int y, dglImage *image,
+const dglRegion *region);
+
+DGL_INLINE_ONLY static bool dglRegionIsEmpty(const dglRegion *region) {
+	return region->nu_rects == 0;
+}
+
+// Occlusion culling. dglSetOcclusionCuller enables deferred drawing for a
+// context (NULL disables it); dglFill, dglPutImage, dglPutPartialImage,
+// dglFillGradient, dglFillPattern and dglFillRegion are then recorded,
+// and images, gradients and tiles must stay valid until the operations are
+// flushed. Operations are flushed by dglFlushOcclusion (for example before
+// presenting a frame), when the draw framebuffer or page changes, and
+// before any other drawing function, which is drawn in order.
+
+dglOcclusionCuller *dglCreateOcclusionCuller();
+void dglDestroyOcclusionCuller(dglOcclusionCuller *culler);
+void dglSetOcclusionCuller(dglContext *context, dglOcclusionCuller *culler);
+void dglFlushOcclusion(dglContext *context);
+dglOcclusionOp *dglAddOcclusionOp(dglOcclusionCuller *culler, int type, int x, int y,
+int w, int h);
+void dglGetOcclusionStats(dglOcclusionCuller *culler, dglOcclusionStats *stats);
+void dglResetOcclusionStats(dglOcclusionCuller *culler);
+
+// Tracing and replay. dglSetTracer records dglFill, dglCopyArea,
+// dglPutImage, dglPutPartialImage and dglPutPixel calls made with a context
+// (NULL stops recording); other drawing functions are not recorded, so
+// framebuffers in the trace should only be drawn into with these. A tracer
+// may be shared by the contexts of one thread. dglTraceFrame marks the end
+// of a frame, storing the checksums of all traced framebuffers with
+// DGL_TRACER_FLAG_CHECKSUMS. dglReplayTrace replays a trace into pixmaps
+// with a kernel variant, comparing the framebuffers to the stored checksums
+// at every frame; nu_threads is used by the threaded variant.
+
+dglTracer *dglCreateTracer(const char *filename, int flags);
+void dglDestroyTracer(dglTracer *tracer);
+void dglSetTracer(dglContext *context, dglTracer *tracer);
+void dglTraceFrame(dglContext *context);
+uint64_t dglGetFramebufferChecksum(dglFB *fb);
+dglTrace *dglLoadTrace(const char *filename);
+void dglDestroyTrace(dglTrace *trace);
+bool dglReplayTrace(dglTrace *trace, int variant, int nu_threads, dglReplayResult *result);
+void dglFreeReplayResult(dglReplayResult *result);
+void dglTraceFill(dglContext *context, int x, int y, int w, int h, uint32_t pixel);
+void dglTraceCopyArea(dglContext *context, int sx, int sy, int dx, int dy, int w, int h);
+void dglTracePutImage(dglContext *context, int sx, int sy, int dx, int dy, int w, int h,
+dglImage *image);
+void dglTracePutPixel(dglContext *context, int x, int y, uint32_t pixel);
+
+// Low-level memory functions that write sequentially in aligned bursts and
+// never read from the destination, suitable for write-combined memory.
+
+void dglStreamFill32(uint8_t *dest, uint32_t pixel, int n);
+void dglStreamFill16(uint8_t *dest, uint32_t pixel, int n);
+void dglStreamCopy(uint8_t *dest, const uint8_t *src, int size);
+
+// Copy rows between cached buffers with different strides, using unrolled
+// kernels for narrow rows (see dgl-memory.cpp).
+
+void dglCopyRows(uint8_t *dest, int dest_stride, const uint8_t *src, int src_stride,
+int row_size, int h);
+
+// Frame-sized copies with a prefetching kernel. The prefetch distance is
+// calibrated once by dglInitLargeCopy, which is called when a screen
+// framebuffer or presenter is created, unless it is set explicitly or with
+// the DGL_LARGE_COPY_PREFETCH environment variable. Copies never start the
+// calibration; before it, a default distance is used.
+
+#define DGL_LARGE_COPY_THRESHOLD (64 * 1024)
+
+void dglCopyRowsLarge(uint8_t *dest, int dest_stride, const uint8_t *src, int src_stride,
+int row_size, int h, bool streaming);
+void dglInitLargeCopy();
+int dglCalibrateLargeCopy();
+void dglSetLargeCopyPrefetchDistance(int distance);
+int dglGetLargeCopyPrefetchDistance();
+
+// Pixel format conversion (see dgl-convert.cpp). The tables are generated at
+// compile time. expand5 and expand6 widen 5- and 6-bit components to 8 bits
+// by bit replication, reduce5 and reduce6 round 8-bit components to 5 and 6
+// bits, and the dithered variants add the ordered dither threshold of
+// dither_matrix, with index (y & 3) * 4 + (x & 3). OR-ing unpack565_low and
+// unpack565_high of the two bytes of an RGB565 pixel gives the XRGB8888
+// pixel with an alpha of 0xFF (and BGR565 gives XBGR8888). srgb_to_linear
+// converts 8-bit sRGB values to 16-bit linear light, linear_to_srgb 12-bit
+// linear values to 8-bit sRGB.
+
+class dglConversionTables {
+public :
+	uint8_t expand5[32];
+	uint8_t expand6[64];
+	uint8_t reduce5[256];
+	uint8_t reduce6[256];
+	uint8_t reduce5_dither[16][256];
+	uint8_t reduce6_dither[16][256];
+	uint8_t dither_matrix[4][4];	// 4x4 Bayer matrix, values 0 to 15.
+	uint32_t unpack565_low[256];
+	uint32_t unpack565_high[256];
+	uint16_t srgb_to_linear[256];
+	uint8_t linear_to_srgb[4096];
+};
+
+extern const dglConversionTables dgl_conversion_tables;
+
+// Convert between a pixel value and 0xAARRGGBB. Formats without alpha
+// unpack to an alpha of 0xFF and pack with zero in the unused bits. With a
+// constant format, these compile to shifts and table lookups.
+
+DGL_INLINE_ONLY static uint32_t dglPixelToARGB(uint32_t format, uint32_t pixel) {
+	const dglConversionTables *t = &dgl_conversion_tables;
+	uint32_t p;
+	switch (format) {
+	case DGL_FORMAT_XRGB8888 :
+		return pixel | 0xFF000000;
+	case DGL_FORMAT_ARGB8888 :
+		return pixel;
+	case DGL_FORMAT_XBGR8888 :
+		return (pixel & 0xFF00) | ((pixel >> 16) & 0xFF) | ((pixel & 0xFF) << 16) |
+			0xFF000000;
+	case DGL_FORMAT_ABGR8888 :
+		return (pixel & 0xFF00FF00) | ((pixel >> 16) & 0xFF) | ((pixel & 0xFF) << 16);
+	case DGL_FORMAT_RGB565 :
+		return t->unpack565_low[pixel & 0xFF] | t->unpack565_high[(pixel >> 8) & 0xFF];
+	default :	// DGL_FORMAT_BGR565
+		p = t->unpack565_low[pixel & 0xFF] | t->unpack565_high[(pixel >> 8) & 0xFF];
+		return (p & 0xFF00FF00) | ((p >> 16) & 0xFF) | ((p & 0xFF) << 16);
+	}
+}
+
+DGL_INLINE_ONLY static uint32_t dglPack565(const uint8_t *reduce5, const uint8_t *reduce6,
+uint32_t r, uint32_t g, uint32_t b) {
+	return ((uint32_t)reduce5[r] << 11) | ((uint32_t)reduce6[g] << 5) | reduce5[b];
+}
+
+DGL_INLINE_ONLY static uint32_t dglARGBToPixel(uint32_t format, uint32_t argb) {
+	const dglConversionTables *t = &dgl_conversion_tables;
+	switch (format) {
+	case DGL_FORMAT_XRGB8888 :
+		return argb & 0xFFFFFF;
+	case DGL_FORMAT_ARGB8888 :
+		return argb;
+	case DGL_FORMAT_XBGR8888 :
+		return (argb & 0xFF00) | ((argb >> 16) & 0xFF) | ((argb & 0xFF) << 16);
+	case DGL_FORMAT_ABGR8888 :
+		return (argb & 0xFF00FF00) | ((argb >> 16) & 0xFF) | ((argb & 0xFF) << 16);
+	case DGL_FORMAT_RGB565 :
+		return dglPack565(t->reduce5, t->reduce6, (argb >> 16) & 0xFF,
+			(argb >> 8) & 0xFF, argb & 0xFF);
+	default :	// DGL_FORMAT_BGR565
+		return dglPack565(t->reduce5, t->reduce6, argb & 0xFF,
+			(argb >> 8) & 0xFF, (argb >> 16) & 0xFF);
+	}
+}
+
+// Like dglARGBToPixel, but with ordered dithering when reducing to a 16-bit
+// format. x and y select the dither threshold.
+
+DGL_INLINE_ONLY static uint32_t dglARGBToPixelDither(uint32_t format, uint32_t argb,
+int x, int y) {
+	if (!(format & DGL_FORMAT_PIXEL_SIZE_16_BIT))
+		return dglARGBToPixel(format, argb);
+	const dglConversionTables *t = &dgl_conversion_tables;
+	int i = ((y & 3) << 2) | (x & 3);
+	if (format == DGL_FORMAT_RGB565)
+		return dglPack565(t->reduce5_dither[i], t->reduce6_dither[i],
+			(argb >> 16) & 0xFF, (argb >> 8) & 0xFF, argb & 0xFF);
+	return dglPack565(t->reduce5_dither[i], t->reduce6_dither[i],
+		argb & 0xFF, (argb >> 8) & 0xFF, (argb >> 16) & 0xFF);
+}
+
+// Convert rows of pixels between any two pixel formats. With
+// DGL_CONVERT_FLAG_DITHER, reduction to a 16-bit format is dithered, with
+// the dither pattern aligned to the first pixel.
+
+#define DGL_CONVERT_FLAG_DITHER 0x1
+
+void dglConvertRows(uint32_t dest_format, uint8_t *dest, int dest_stride,
+uint32_t src_format, const uint8_t *src, int src_stride, int w, int h, int flags);
+
 // Miscellaneous.
 
 uint32_t dglConvertColor(uint32_t format, float r, float g, float b);
 
+// Time in seconds and nanoseconds of the monotonic clock, and sleeping until
+// a given time of that clock. dglSleepUntilNextNominalVSync sleeps until the
+// next multiple of the refresh period, for displays without vsync support.
+double dglGetTime();
+uint64_t dglGetTimeNs();
+void dglSleepUntil(double t);
+void dglSleepUntilNextNominalVSync(double refresh_period);
+
 DGL_INLINE_ONLY static void dglSetReadYOffset(dglContext *context, int yoffset) {
 	context->read_yoffset = yoffset;
 }
 
 DGL_INLINE_ONLY static void dglSetDrawYOffset(dglContext *context, int yoffset) {
+	if (context->occlusion)
+		dglFlushOcclusion(context);
 	context->draw_yoffset = yoffset;
 }
 
@@ -181,6 +1478,8 @@ DGL_INLINE_ONLY static void dglSetReadPage(dglContext *context, int page) {
 }
 
 DGL_INLINE_ONLY static void dglSetDrawPage(dglContext *context, int page) {
+	if (context->occlusion)
+		dglFlushOcclusion(context);
 	context->draw_yoffset = page * context->draw_fb->yres;
 }
 
@@ -224,22 +1523,65 @@ DGL_INLINE_ONLY static void dglClip(const dglClipRectangle *cr, int& x, int& y)
 
 #define DGL_FORMAT_GET_BYTES_PER_PIXEL(format) (4 - ((format & DGL_FORMAT_PIXEL_SIZE_16_BIT) >> 1))
 
+// Lock-free minimum and maximum updates used for damage tracking, so that
+// multiple threads can draw into the same framebuffer. The common case of
+// an already damaged area costs only a load.
+
+DGL_INLINE_ONLY static void dglAtomicMin(int *p, int value) {
+	int old = __atomic_load_n(p, __ATOMIC_RELAXED);
+	while (value < old && !__atomic_compare_exchange_n(p, &old, value, true,
+	__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+DGL_INLINE_ONLY static void dglAtomicMax(int *p, int value) {
+	int old = __atomic_load_n(p, __ATOMIC_RELAXED);
+	while (value > old && !__atomic_compare_exchange_n(p, &old, value, true,
+	__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+DGL_INLINE_ONLY static void dglAddDamagePixel(dglDamage *damage, int x, int y) {
+	dglAtomicMin(&damage->x1[y], x);
+	dglAtomicMax(&damage->x2[y], x + 1);
+	dglAtomicMin(&damage->y1, y);
+	dglAtomicMax(&damage->y2, y + 1);
+}
+
 // Inline PutPixel functions
 
 DGL_INLINE_ONLY void dglPutPixel32(dglContext *context, int x, int y, uint32_t pixel) {
+	if (context->tracer)
+		dglTracePutPixel(context, x, y, pixel);
+	// Deferred operations must be drawn first to keep the drawing order.
+	if (context->occlusion)
+		dglFlushOcclusion(context);
+	if (context->clip_enabled && (x < context->clip.x1 || x >= context->clip.x2 ||
+	y < context->clip.y1 || y >= context->clip.y2))
+		return;
 	y += context->draw_yoffset;
 	dglFB *fb;
 	DGL_GET_DRAW_FB(context, fb);
 	uint8_t *dp = fb->framebuffer_addr + y * fb->stride + x * 4;
 	*((uint32_t *)dp) = pixel;
+	if (fb->damage)
+		dglAddDamagePixel(fb->damage, x, y);
 }
 
 DGL_INLINE_ONLY void dglPutPixel16(dglContext *context, int x, int y, uint32_t pixel) {
+	if (context->tracer)
+		dglTracePutPixel(context, x, y, pixel);
+	// Deferred operations must be drawn first to keep the drawing order.
+	if (context->occlusion)
+		dglFlushOcclusion(context);
+	if (context->clip_enabled && (x < context->clip.x1 || x >= context->clip.x2 ||
+	y < context->clip.y1 || y >= context->clip.y2))
+		return;
 	y += context->draw_yoffset;
 	dglFB *fb;
 	DGL_GET_DRAW_FB(context, fb);
 	uint8_t *dp = fb->framebuffer_addr + y * fb->stride + x * 2;
 	*((uint16_t *)dp) = pixel;
+	if (fb->damage)
+		dglAddDamagePixel(fb->damage, x, y);
 }
 
 
@@ -21,6 +21,9 @@ OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include <stdint.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/wait.h>
 #include <dstTimer.h>
 #include <dstRandom.h>
 
@@ -74,30 +77,34 @@ static void DrawPattern(dglContext *context) {
 	}
 }
 
+static uint32_t RGBColor(float r, float g, float b) {
+	return ((uint32_t)floorf(r * 255.5f) << 16) | ((uint32_t)floorf(g * 255.5f) << 8) |
+		(uint32_t)floorf(b * 255.5f);
+}
+
 static dglImage *CreateImage(dglContext *console_context) {
 	dglFB *console_fb;
 	DGL_GET_DRAW_FB(console_context, console_fb);
 	dglImage *image = dglCreateImage(console_fb->format,
 		PUT_IMAGE_WIDTH, PUT_IMAGE_HEIGHT);
-	// Draw into the image.
+	// Draw a radial gradient into the image, with red and blue fading out
+	// towards the corners and green ramping up in five bands.
 	dglContext *context = dglCreateContext(NULL, image);
-	float x_center = (float)image->xres / 2 - 0.5f;
-	float y_center = (float)image->yres / 2 - 0.5f;
 	float max_dist = sqrtf((float)image->xres * image->xres / 4 +
 		image->yres * image->yres / 4);
-	for (int y = 0; y < image->yres; y++)
-		for (int x = 0; x < image->xres; x++) {
-			float dx = fabsf(x - x_center);
-			float dy = fabsf(y - y_center);
-			float dist = sqrtf(dx * dx + dy * dy);
-			float r, g, b;
-			r = 1.0f - (dist / max_dist);
-			g = fmodf(dist / max_dist, 0.2f) / 0.3f;
-			b = 0.5f - (dist / max_dist) * 0.5f;
-			uint32_t pixel = dglConvertColor(image->format,
-				r, g, b);
-			dglPutPixel(context, x, y, pixel);
-		}
+	dglGradient *gradient = dglCreateRadialGradient(image->format, image->xres / 2,
+		image->yres / 2, (int)ceilf(max_dist), 0, 0);
+	float position[10];
+	uint32_t color[10];
+	for (int i = 0; i < 10; i++) {
+		float t = ((i + 1) / 2) * 0.2f;
+		position[i] = t;
+		float g = (i & 1) ? 0.2f / 0.3f : 0;
+		color[i] = RGBColor(1.0f - t, g, 0.5f - t * 0.5f);
+	}
+	dglSetGradientColorStops(gradient, 10, position, color);
+	dglFillGradient(context, 0, 0, image->xres, image->yres, gradient);
+	dglDestroyGradient(gradient);
 	dglDestroyContext(context);
 	return image;
 }
@@ -151,10 +158,952 @@ dglImage *image) {
 	return (uint64_t)n * image->xres * image->yres;
 }
 
+// Compare PutSprite and PutImage throughput for an image of which only the
+// pixels in a pattern of rings are opaque. Throughputs are stored in pixels
+// (of the image area) per second.
+
+static void SpriteTest(dglContext *context, dstThreadedTimeout *tt,
+double *throughput_sprite, double *throughput_image, float *opaque_fraction) {
+	dglImage *image = CreateImage(context);
+	uint32_t color_key = dglConvertColor(image->format, 1.0f, 0.0f, 1.0f);
+	float x_center = (float)image->xres / 2 - 0.5f;
+	float y_center = (float)image->yres / 2 - 0.5f;
+	for (int y = 0; y < image->yres; y++)
+		for (int x = 0; x < image->xres; x++) {
+			float dx = x - x_center;
+			float dy = y - y_center;
+			float dist = sqrtf(dx * dx + dy * dy);
+			if (dist > image->xres / 2 || fmodf(dist, 32.0f) < 8.0f) {
+				uint8_t *p = image->framebuffer_addr + y * image->stride +
+					x * image->bytes_per_pixel;
+				if (image->bytes_per_pixel == 4)
+					*(uint32_t *)p = color_key;
+				else
+					*(uint16_t *)p = color_key;
+			}
+		}
+	dglSprite *sprite = dglCreateSpriteFromImage(image, color_key);
+	*opaque_fraction = (float)sprite->nu_opaque_pixels / (sprite->xres * sprite->yres);
+	dglFB *fb;
+	DGL_GET_DRAW_FB(context, fb);
+	dstTimer timer;
+	tt->Start(BENCHMARK_DURATION);
+	timer.Start();
+	int n = 0;
+	for (;;) {
+		int x = rng->RandomInt(fb->xres - sprite->xres);
+		int y = rng->RandomInt(fb->yres - sprite->yres);
+		dglPutSprite(context, x, y, sprite);
+		n++;
+		if (tt->StopSignalled())
+			break;
+	}
+	*throughput_sprite = (double)n * sprite->xres * sprite->yres / timer.Elapsed();
+	tt->Start(BENCHMARK_DURATION);
+	timer.Start();
+	uint64_t pixels = PutImageTest(context, tt, image);
+	*throughput_image = pixels / timer.Elapsed();
+	dglDestroySprite(sprite);
+	dglDestroyImage(image);
+}
+
+// Compare the throughput of decoding a screen-sized compressed image, with
+// one thread and with multiple threads, to that of PutImage with the same
+// uncompressed image. Throughputs are stored in pixels per second.
+
+#define DECODE_THREADS 4
+
+enum {
+	DECODE_TEST_PUT_IMAGE,
+	DECODE_TEST_DECODE,
+	DECODE_TEST_DECODE_THREADED,
+	NU_DECODE_TESTS
+};
+
+static const char *decode_test_name[NU_DECODE_TESTS] = {
+	"PutImage (uncompressed)", "PutCompressedImage",
+	"PutCompressedImageThreaded"
+};
+
+static void DecodeTest(dglContext *context, dstThreadedTimeout *tt,
+double throughput[NU_DECODE_TESTS], float *compression_ratio) {
+	dglFB *fb;
+	DGL_GET_DRAW_FB(context, fb);
+	// Create an image with both flat areas and a gradient.
+	dglImage *image = dglCreateImage(fb->format, fb->xres, fb->yres);
+	dglContext *image_context = dglCreateContext(image, image);
+	DrawPattern(image_context);
+	dglImage *gradient_image = CreateImage(context);
+	dglPutImage(image_context, (image->xres - gradient_image->xres) / 2,
+		(image->yres - gradient_image->yres) / 2, gradient_image);
+	dglDestroyImage(gradient_image);
+	dglDestroyContext(image_context);
+	dglCompressedImage *cimage = dglCompressImage(image, 0);
+	*compression_ratio = (float)image->total_size / cimage->size;
+	for (int i = 0; i < NU_DECODE_TESTS; i++) {
+		dstTimer timer;
+		tt->Start(BENCHMARK_DURATION);
+		timer.Start();
+		int n = 0;
+		for (;;) {
+			if (i == DECODE_TEST_PUT_IMAGE)
+				dglPutImage(context, 0, 0, image);
+			else if (i == DECODE_TEST_DECODE)
+				dglPutCompressedImage(context, 0, 0, cimage);
+			else
+				dglPutCompressedImageThreaded(context, 0, 0, cimage,
+					DECODE_THREADS);
+			n++;
+			if (tt->StopSignalled())
+				break;
+		}
+		throughput[i] = (double)n * image->xres * image->yres / timer.Elapsed();
+	}
+	dglDestroyCompressedImage(cimage);
+	dglDestroyImage(image);
+}
+
+// Measure YUV to RGB conversion throughput for each YUV format, both
+// unscaled and scaled to the full screen, and the frame rate of the video
+// queue presenting full-screen frames. Throughputs are stored in destination
+// pixels per second, indexed by [format][scaled].
+
+#define YUV_FRAME_WIDTH 640
+#define YUV_FRAME_HEIGHT 360
+
+static const char *yuv_format_name[DGL_NU_YUV_FORMATS] = {
+	"I420", "NV12", "YUYV"
+};
+
+static void FillYUVFrame(dglYUVImage *yuv, int frame) {
+	// Moving luma gradient with constant chroma bars.
+	for (int y = 0; y < yuv->yres; y++)
+		for (int x = 0; x < yuv->xres; x++) {
+			int luma = 16 + ((x + y + frame * 4) & 0xFF) * 219 / 255;
+			int u = 64 + (x * 128 / yuv->xres);
+			int v = 192 - (y * 128 / yuv->yres);
+			if (yuv->format == DGL_YUV_FORMAT_YUYV) {
+				uint8_t *p = yuv->plane[0] + y * yuv->stride[0] + x * 2;
+				p[0] = luma;
+				p[1] = (x & 1) ? v : u;
+				continue;
+			}
+			yuv->plane[0][y * yuv->stride[0] + x] = luma;
+			if ((x & 1) || (y & 1))
+				continue;
+			if (yuv->format == DGL_YUV_FORMAT_NV12) {
+				uint8_t *p = yuv->plane[1] + (y / 2) * yuv->stride[1] + x;
+				p[0] = u;
+				p[1] = v;
+			}
+			else {
+				yuv->plane[1][(y / 2) * yuv->stride[1] + x / 2] = u;
+				yuv->plane[2][(y / 2) * yuv->stride[2] + x / 2] = v;
+			}
+		}
+}
+
+static void YUVTest(dglContext *context, dglScreenFB *screen_fb, dstThreadedTimeout *tt,
+double throughput[DGL_NU_YUV_FORMATS][2], float *fps_video_queue) {
+	dglFB *fb;
+	DGL_GET_DRAW_FB(context, fb);
+	for (int format = 0; format < DGL_NU_YUV_FORMATS; format++) {
+		dglYUVImage *yuv = dglCreateYUVImage(format, YUV_FRAME_WIDTH, YUV_FRAME_HEIGHT);
+		FillYUVFrame(yuv, 0);
+		for (int scaled = 0; scaled < 2; scaled++) {
+			int w = scaled ? fb->xres : YUV_FRAME_WIDTH;
+			int h = scaled ? fb->yres : YUV_FRAME_HEIGHT;
+			dstTimer timer;
+			tt->Start(BENCHMARK_DURATION);
+			timer.Start();
+			int n = 0;
+			for (;;) {
+				dglPutYUVImage(context, yuv, 0, 0, w, h);
+				n++;
+				if (tt->StopSignalled())
+					break;
+			}
+			throughput[format][scaled] = (double)n * w * h / timer.Elapsed();
+		}
+		dglDestroyYUVImage(yuv);
+	}
+
+	dglVideoQueue *queue = dglCreateVideoQueue(screen_fb, DGL_YUV_FORMAT_I420,
+		YUV_FRAME_WIDTH, YUV_FRAME_HEIGHT, 0, 0, screen_fb->xres, screen_fb->yres, false);
+	dstTimer timer;
+	tt->Start(BENCHMARK_DURATION);
+	timer.Start();
+	int nu_frames = 0;
+	for (;;) {
+		dglYUVImage *yuv = dglVideoQueueAcquireFrame(queue);
+		FillYUVFrame(yuv, nu_frames);
+		dglVideoQueueSubmitFrame(queue, yuv);
+		nu_frames++;
+		if (tt->StopSignalled())
+			break;
+	}
+	// Destroying the queue presents the remaining submitted frames.
+	dglDestroyVideoQueue(queue);
+	*fps_video_queue = nu_frames / timer.Elapsed();
+	dglSetDisplayPage(screen_fb, 0);
+}
+
+// Measure the throughput of gradient and pattern fills of the whole screen,
+// compared to a plain Fill. Throughputs are stored in pixels per second.
+
+#define PATTERN_TILE_SIZE 64
+
+enum {
+	GRADIENT_TEST_FILL,
+	GRADIENT_TEST_VERTICAL,
+	GRADIENT_TEST_HORIZONTAL,
+	GRADIENT_TEST_DIAGONAL,
+	GRADIENT_TEST_RADIAL,
+	GRADIENT_TEST_PATTERN,
+	NU_GRADIENT_TESTS
+};
+
+static const char *gradient_test_name[NU_GRADIENT_TESTS] = {
+	"Fill", "Vertical gradient fill", "Horizontal gradient fill",
+	"Diagonal gradient fill", "Radial gradient fill", "Pattern fill"
+};
+
+static void GradientTest(dglContext *context, dstThreadedTimeout *tt,
+double throughput[NU_GRADIENT_TESTS]) {
+	dglFB *fb;
+	DGL_GET_DRAW_FB(context, fb);
+	int w = fb->xres;
+	int h = fb->yres;
+	dglGradient *gradient[NU_GRADIENT_TESTS];
+	gradient[GRADIENT_TEST_VERTICAL] = dglCreateLinearGradient(fb->format, 0, 0, 0, h - 1,
+		0x0000FF, 0xFFFF00);
+	gradient[GRADIENT_TEST_HORIZONTAL] = dglCreateLinearGradient(fb->format, 0, 0, w - 1, 0,
+		0xFF0000, 0x00FFFF);
+	gradient[GRADIENT_TEST_DIAGONAL] = dglCreateLinearGradient(fb->format, 0, 0, w - 1, h - 1,
+		0x00FF00, 0xFF00FF);
+	gradient[GRADIENT_TEST_RADIAL] = dglCreateRadialGradient(fb->format, w / 2, h / 2, h / 2,
+		0xFFFFFF, 0x000080);
+	// Checkerboard tile.
+	dglImage *tile = dglCreateImage(fb->format, PATTERN_TILE_SIZE, PATTERN_TILE_SIZE);
+	dglContext *tile_context = dglCreateContext(NULL, tile);
+	for (int i = 0; i < 4; i++)
+		dglFill(tile_context, (i & 1) * PATTERN_TILE_SIZE / 2, (i >> 1) * PATTERN_TILE_SIZE / 2,
+			PATTERN_TILE_SIZE / 2, PATTERN_TILE_SIZE / 2, dglConvertColor(fb->format,
+			(i == 0 || i == 3) ? 1.0f : 0.2f, 0.5f, 0.5f));
+	dglDestroyContext(tile_context);
+	for (int i = 0; i < NU_GRADIENT_TESTS; i++) {
+		dstTimer timer;
+		tt->Start(BENCHMARK_DURATION);
+		timer.Start();
+		int n = 0;
+		for (;;) {
+			if (i == GRADIENT_TEST_FILL)
+				dglFill(context, 0, 0, w, h, dglConvertColor(fb->format,
+					0.5f, 0.5f, 0.5f));
+			else if (i == GRADIENT_TEST_PATTERN)
+				dglFillPattern(context, 0, 0, w, h, tile, n, 0);
+			else
+				dglFillGradient(context, 0, 0, w, h, gradient[i]);
+			n++;
+			if (tt->StopSignalled())
+				break;
+		}
+		throughput[i] = (double)n * w * h / timer.Elapsed();
+	}
+	for (int i = GRADIENT_TEST_VERTICAL; i <= GRADIENT_TEST_RADIAL; i++)
+		dglDestroyGradient(gradient[i]);
+	dglDestroyImage(tile);
+}
+
+// Measure the number of text lines per second that can be scrolled into the
+// whole screen, with the best scroll mode available and with panning
+// disabled. Every new line is drawn as a row of random character cells.
+
+#define SCROLL_LINE_HEIGHT 16
+#define SCROLL_CELL_WIDTH 8
+
+static const char *scroll_mode_name[3] = {
+	"pan", "accelerated CopyArea", "software CopyArea"
+};
+
+static void ScrollTest(dglContext *context, dstThreadedTimeout *tt,
+double lines_per_second[2], int mode[2], int nu_wrap_copies[2]) {
+	dglFB *fb;
+	DGL_GET_DRAW_FB(context, fb);
+	for (int i = 0; i < 2; i++) {
+		dglScroller *scroller = dglCreateScroller(context, 0, 0, fb->xres, fb->yres,
+			0, i == 0 ? 0 : DGL_SCROLLER_FLAG_NO_PAN);
+		mode[i] = scroller->mode;
+		dstTimer timer;
+		tt->Start(BENCHMARK_DURATION);
+		timer.Start();
+		int n = 0;
+		for (;;) {
+			dglScroll(scroller, SCROLL_LINE_HEIGHT);
+			int y = fb->yres - SCROLL_LINE_HEIGHT;
+			for (int x = 0; x < fb->xres; x += SCROLL_CELL_WIDTH)
+				if (rng->RandomInt(2))
+					dglFill(scroller->context, x + 1, y + 2, SCROLL_CELL_WIDTH - 2,
+						SCROLL_LINE_HEIGHT - 4, dglConvertColor(fb->format,
+						0.8f, 0.8f, 0.8f));
+			n++;
+			if (tt->StopSignalled())
+				break;
+		}
+		lines_per_second[i] = n / timer.Elapsed();
+		nu_wrap_copies[i] = scroller->nu_wrap_copies;
+		if (scroller->mode == DGL_SCROLL_MODE_PAN)
+			dglSetDisplayPage(scroller->fb, 0);
+		dglDestroyScroller(scroller);
+	}
+}
+
+// Compare the frame rate of a user interface that redraws a grid of widgets
+// (labels with a gradient background and text-like cells) every frame with
+// one that draws them from a surface cache.
+
+#define WIDGET_WIDTH 120
+#define WIDGET_HEIGHT 24
+#define WIDGET_CACHE_BUDGET (4 * 1024 * 1024)
+
+static void RenderWidget(dglContext *context, int x, int y, void *user_data) {
+	int index = *(int *)user_data;
+	dglFB *fb;
+	DGL_GET_DRAW_FB(context, fb);
+	dglGradient *gradient = dglCreateLinearGradient(fb->format, x, y, x,
+		y + WIDGET_HEIGHT - 1, 0x4060A0, 0x102040);
+	dglFillGradient(context, x, y, WIDGET_WIDTH, WIDGET_HEIGHT, gradient);
+	dglDestroyGradient(gradient);
+	uint32_t text_pixel = dglConvertColor(fb->format, 1.0f, 1.0f, 1.0f);
+	for (int i = 0; i < 12; i++)
+		if ((index >> (i % 8)) & 1)
+			dglFill(context, x + 6 + i * 9, y + 6, 6, WIDGET_HEIGHT - 12, text_pixel);
+}
+
+static void SurfaceCacheTest(dglContext *context, dstThreadedTimeout *tt,
+float fps[2], dglSurfaceCacheStats *stats) {
+	dglFB *fb;
+	DGL_GET_DRAW_FB(context, fb);
+	int columns = fb->xres / WIDGET_WIDTH;
+	int rows = fb->yres / WIDGET_HEIGHT;
+	dglSurfaceCache *cache = dglCreateSurfaceCache(fb->format, WIDGET_CACHE_BUDGET);
+	for (int cached = 0; cached < 2; cached++) {
+		dstTimer timer;
+		tt->Start(BENCHMARK_DURATION);
+		timer.Start();
+		int nu_frames = 0;
+		for (;;) {
+			for (int i = 0; i < rows * columns; i++) {
+				int x = (i % columns) * WIDGET_WIDTH;
+				int y = (i / columns) * WIDGET_HEIGHT;
+				if (cached) {
+					dglCachedSurface *surface = dglGetCachedSurface(cache, i,
+						WIDGET_WIDTH, WIDGET_HEIGHT, RenderWidget, &i);
+					dglPutCachedSurface(context, x, y, surface);
+				}
+				else
+					RenderWidget(context, x, y, &i);
+			}
+			nu_frames++;
+			if (tt->StopSignalled())
+				break;
+		}
+		fps[cached] = nu_frames / timer.Elapsed();
+	}
+	dglGetSurfaceCacheStats(cache, stats);
+	dglDestroySurfaceCache(cache);
+}
+
+// Compare filling a set of overlapping rectangles one by one with filling
+// their union as a region (which touches every pixel once), and measure the
+// rate of region set operations on the same rectangles.
+
+#define REGION_NU_RECTANGLES 64
+
+static void RegionTest(dglContext *context, dstThreadedTimeout *tt, float fps[2],
+double *ops_per_second, int *nu_region_rects) {
+	dglFB *fb;
+	DGL_GET_DRAW_FB(context, fb);
+	dstRNG *rng = dstGetDefaultRNG();
+	dglClipRectangle rects[REGION_NU_RECTANGLES];
+	for (int i = 0; i < REGION_NU_RECTANGLES; i++) {
+		rects[i].x1 = rng->RandomInt(fb->xres * 3 / 4);
+		rects[i].y1 = rng->RandomInt(fb->yres * 3 / 4);
+		rects[i].x2 = rects[i].x1 + 16 + rng->RandomInt(fb->xres / 4 - 16);
+		rects[i].y2 = rects[i].y1 + 16 + rng->RandomInt(fb->yres / 4 - 16);
+	}
+	dglRegionArena *arena = dglCreateRegionArena();
+	dglRegion *region = dglCreateRegion(arena);
+	for (int i = 0; i < REGION_NU_RECTANGLES; i++)
+		dglAddRegionRectangle(region, rects[i].x1, rects[i].y1,
+			rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1);
+	*nu_region_rects = region->nu_rects;
+	for (int use_region = 0; use_region < 2; use_region++) {
+		dstTimer timer;
+		tt->Start(BENCHMARK_DURATION);
+		timer.Start();
+		int nu_frames = 0;
+		for (;;) {
+			uint32_t pixel = rng->RandomInt(0x1000000);
+			if (use_region)
+				dglFillRegion(context, region, pixel);
+			else
+				for (int i = 0; i < REGION_NU_RECTANGLES; i++)
+					dglFill(context, rects[i].x1, rects[i].y1,
+						rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1, pixel);
+			nu_frames++;
+			if (tt->StopSignalled())
+				break;
+		}
+		fps[use_region] = nu_frames / timer.Elapsed();
+	}
+	// Union, intersect and subtract a region with a rectangle from the set.
+	dglRegion *r = dglCreateRegion(arena);
+	dglRegion *result = dglCreateRegion(arena);
+	dstTimer timer;
+	tt->Start(BENCHMARK_DURATION);
+	timer.Start();
+	int nu_ops = 0;
+	for (;;) {
+		dglClipRectangle *rect = &rects[nu_ops % REGION_NU_RECTANGLES];
+		dglSetRegionRectangle(r, rect->x1, rect->y1, rect->x2 - rect->x1,
+			rect->y2 - rect->y1);
+		dglUnionRegion(result, region, r);
+		dglIntersectRegion(result, region, r);
+		dglSubtractRegion(result, region, r);
+		nu_ops += 3;
+		if (tt->StopSignalled())
+			break;
+	}
+	*ops_per_second = nu_ops / timer.Elapsed();
+	dglDestroyRegion(result);
+	dglDestroyRegion(r);
+	dglDestroyRegion(region);
+	dglDestroyRegionArena(arena);
+}
+
+// Compare regular shadow framebuffer mode with dirty-page updates for
+// frames that clear the whole screen and draw a few moving squares, which
+// change only a small part of the screen memory. The frame rate includes
+// flushing the shadow framebuffer each frame. stats receives the dirty-page
+// statistics.
+
+#define DIRTY_PAGE_NU_SQUARES 4
+#define DIRTY_PAGE_SQUARE_SIZE 32
+
+static void DirtyPageTest(dglContext *context, dglScreenFB *screen_fb, dstThreadedTimeout *tt,
+float fps[2], dglDirtyPageStats *stats) {
+	bool shadow_enabled = (screen_fb->flags & DGL_FB_FLAG_SHADOW) != 0;
+	bool dirty_pages_enabled = (screen_fb->front_addr != NULL);
+	dglEnableShadowFramebuffer(screen_fb);
+	dglDisableDirtyPageUpdates(screen_fb);
+	int w = screen_fb->xres - DIRTY_PAGE_SQUARE_SIZE;
+	int h = screen_fb->yres - DIRTY_PAGE_SQUARE_SIZE;
+	for (int dirty_pages = 0; dirty_pages < 2; dirty_pages++) {
+		if (dirty_pages)
+			dglEnableDirtyPageUpdates(screen_fb, 0);
+		dstTimer timer;
+		tt->Start(BENCHMARK_DURATION);
+		timer.Start();
+		int nu_frames = 0;
+		for (;;) {
+			dglFill(context, 0, 0, screen_fb->xres, screen_fb->yres, 0);
+			for (int i = 0; i < DIRTY_PAGE_NU_SQUARES; i++) {
+				int t = nu_frames * (i + 1) * 3;
+				int x = t % (2 * w);
+				int y = (t / 2) % (2 * h);
+				if (x >= w)
+					x = 2 * w - x;
+				if (y >= h)
+					y = 2 * h - y;
+				dglFill(context, x, y, DIRTY_PAGE_SQUARE_SIZE, DIRTY_PAGE_SQUARE_SIZE,
+					0xFFFFFFFF >> (8 * i));
+			}
+			dglFlushShadowFramebuffer(screen_fb);
+			nu_frames++;
+			if (tt->StopSignalled())
+				break;
+		}
+		fps[dirty_pages] = nu_frames / timer.Elapsed();
+	}
+	dglGetDirtyPageStats(screen_fb, stats);
+	if (!dirty_pages_enabled)
+		dglDisableDirtyPageUpdates(screen_fb);
+	if (!shadow_enabled)
+		dglDisableShadowFramebuffer(screen_fb);
+}
+
+// Run a poll-based event loop that draws a frame into the back page and
+// requests it to be displayed without blocking whenever the previous
+// request has completed, handling vsync events from the pollable file
+// descriptor. Measures the frame rate and the rate of vertical blanks.
+
+static void EventLoopTest(dglContext *context, dglScreenFB *screen_fb, dstThreadedTimeout *tt,
+float *fps, float *vsync_rate) {
+	dglVSyncEvents *events = dglCreateVSyncEvents(screen_fb);
+	if (events == NULL) {
+		*fps = 0;
+		*vsync_rate = 0;
+		return;
+	}
+	struct pollfd pfd;
+	pfd.fd = events->fd;
+	pfd.events = POLLIN;
+	int draw_page = 1;
+	int nu_frames = 0;
+	dstTimer timer;
+	tt->Start(BENCHMARK_DURATION);
+	timer.Start();
+	for (;;) {
+		if (!events->present_pending) {
+			dglSetDrawPage(context, draw_page);
+			uint32_t pixel = dglConvertColor(screen_fb->format,
+				(nu_frames & 63) / 63.0f, 0, 0.5f);
+			dglFill(context, 0, 0, screen_fb->xres, screen_fb->yres, pixel);
+			dglRequestDisplayPage(events, draw_page);
+			draw_page ^= 1;
+			nu_frames++;
+		}
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 100) > 0 && (pfd.revents & POLLIN))
+			dglHandleVSyncEvents(events);
+		if (tt->StopSignalled())
+			break;
+	}
+	double elapsed = timer.Elapsed();
+	*fps = nu_frames / elapsed;
+	*vsync_rate = events->nu_vsyncs / elapsed;
+	dglDestroyVSyncEvents(events);
+	dglSetDisplayPage(screen_fb, 0);
+	dglSetDrawPage(context, 0);
+}
+
+// Measure the frame rate of a presenter with each supported presentation
+// mode, drawing a moving square over a background. Only the area that
+// changed is redrawn when the back buffer holds the previous frame. Frame
+// rates of unsupported modes are set to zero.
+
+#define PRESENT_SQUARE_SIZE 64
+
+static const char *present_mode_name[DGL_NU_PRESENT_MODES] = {
+	"pan", "CopyArea", "pixmap"
+};
+
+static void PresentTest(dglContext *context, dglScreenFB *screen_fb, dstThreadedTimeout *tt,
+float fps[DGL_NU_PRESENT_MODES], int *auto_mode, double present_time[DGL_NU_PRESENT_MODES]) {
+	dglPresenter *presenter = dglCreatePresenter(screen_fb, DGL_PRESENT_MODE_AUTO, 0);
+	*auto_mode = presenter->mode;
+	for (int i = 0; i < DGL_NU_PRESENT_MODES; i++)
+		present_time[i] = presenter->present_time[i];
+	dglDestroyPresenter(presenter);
+	int range_x = screen_fb->xres - PRESENT_SQUARE_SIZE;
+	int range_y = screen_fb->yres - PRESENT_SQUARE_SIZE;
+	for (int mode = 0; mode < DGL_NU_PRESENT_MODES; mode++) {
+		fps[mode] = 0;
+		if (!dglIsPresentModeSupported(screen_fb, mode, 0))
+			continue;
+		presenter = dglCreatePresenter(screen_fb, mode, 0);
+		dstTimer timer;
+		tt->Start(BENCHMARK_DURATION);
+		timer.Start();
+		int nu_frames = 0;
+		for (;;) {
+			int age = dglPresenterAcquire(presenter, context);
+			int x = (nu_frames * 5) % range_x;
+			int y = (nu_frames * 3) % range_y;
+			if (age == 1) {
+				int previous_x = ((nu_frames - 1) * 5) % range_x;
+				int previous_y = ((nu_frames - 1) * 3) % range_y;
+				dglFill(context, previous_x, previous_y, PRESENT_SQUARE_SIZE,
+					PRESENT_SQUARE_SIZE, 0x000000);
+			}
+			else
+				dglFill(context, 0, 0, screen_fb->xres, screen_fb->yres, 0x000000);
+			dglFill(context, x, y, PRESENT_SQUARE_SIZE, PRESENT_SQUARE_SIZE, 0xFFFFFF);
+			dglPresenterPresent(presenter);
+			nu_frames++;
+			if (tt->StopSignalled())
+				break;
+		}
+		fps[mode] = nu_frames / timer.Elapsed();
+		dglDestroyPresenter(presenter);
+	}
+	dglSetDrawFramebuffer(context, screen_fb);
+	dglSetReadFramebuffer(context, screen_fb);
+	dglSetDrawPage(context, 0);
+	dglSetReadPage(context, 0);
+}
+
+// Run a compositor on a simulated screen framebuffer of the same size as
+// the screen, with client processes that each animate a square inside a
+// surface, send damage for the changed area and wait for the next frame.
+// Returns the frame rate of the compositor.
+
+#define NU_COMPOSITOR_CLIENTS 3
+#define COMPOSITOR_SOCKET_PATH "/tmp/test-dgl-compositor"
+
+static void CompositorClient(int index, int w, int h) {
+	dglCompositorClient *client = dglConnectCompositor(COMPOSITOR_SOCKET_PATH);
+	if (client == NULL)
+		_exit(0);
+	dglCompositorSurface *surface = dglCreateCompositorSurface(client,
+		index * w / 2, index * h / 2, w, h, index);
+	if (surface == NULL)
+		_exit(0);
+	dglContext *context = dglCreateContext(surface->fb, surface->fb);
+	dglFill(context, 0, 0, w, h, 0x404040 + index * 0x202020);
+	dglDamageCompositorSurface(client, surface, 0, 0, w, h);
+	int size = h / 4;
+	int range = w - size;
+	int nu_frames = 0;
+	dstTimer timer;
+	timer.Start();
+	while (timer.Elapsed() < BENCHMARK_DURATION / 1000000.0) {
+		if (!dglWaitCompositorFrame(client))
+			break;
+		int x = (nu_frames * 4) % range;
+		int previous_x = ((nu_frames - 1 + range) * 4) % range;
+		dglFill(context, previous_x, size, size, size, 0x404040 + index * 0x202020);
+		dglFill(context, x, size, size, size, 0xFFFFFF);
+		dglDamageCompositorSurface(client, surface, previous_x, size, size, size);
+		dglDamageCompositorSurface(client, surface, x, size, size, size);
+		nu_frames++;
+	}
+	dglDestroyCompositorSurface(client, surface);
+	dglDisconnectCompositor(client);
+	_exit(0);
+}
+
+static float CompositorTest(dglScreenFB *screen_fb) {
+	dglSimulatedFB *fb = dglCreateSimulatedFramebuffer(screen_fb->format,
+		screen_fb->xres, screen_fb->yres, 2);
+	dglCompositor *compositor = dglCreateCompositor(fb, COMPOSITOR_SOCKET_PATH, 0x000000, 0);
+	pid_t pid[NU_COMPOSITOR_CLIENTS];
+	for (int i = 0; i < NU_COMPOSITOR_CLIENTS; i++) {
+		pid[i] = fork();
+		if (pid[i] == 0)
+			CompositorClient(i, fb->xres / 2, fb->yres / 2);
+	}
+	dstTimer timer;
+	timer.Start();
+	int nu_running = NU_COMPOSITOR_CLIENTS;
+	while (nu_running > 0) {
+		dglCompositorDispatch(compositor, 1);
+		while (dglCompositorDispatch(compositor, 0) > 0);
+		dglCompositorComposite(compositor);
+		for (int i = 0; i < NU_COMPOSITOR_CLIENTS; i++) {
+			if (pid[i] > 0 && waitpid(pid[i], NULL, WNOHANG) == pid[i]) {
+				pid[i] = 0;
+				nu_running--;
+			}
+		}
+	}
+	float fps = compositor->nu_frames / timer.Elapsed();
+	dglDestroyCompositor(compositor);
+	dglDestroySimulatedFramebuffer(fb);
+	return fps;
+}
+
+// Measure full-screen capture rates reading the displayed page directly and
+// through a DMA snapshot in spare page 1 (zero when not supported), and the
+// frame rate of an animation recorded with an uncompressed and a compressed
+// recorder, stored in fps_record[compress] with the number of frames
+// dropped by the recorder.
+
+#define CAPTURE_FILENAME "/tmp/test-dgl-capture.rec"
+#define CAPTURE_MAX_QUEUED_FRAMES 4
+#define CAPTURE_SQUARE_SIZE 64
+
+static void CaptureTest(dglContext *context, dglScreenFB *screen_fb, dstThreadedTimeout *tt,
+float fps_capture[2], float fps_record[2], int nu_dropped[2]) {
+	dglFB *dest = dglCreatePixmapFB(screen_fb->format, screen_fb->xres, screen_fb->yres);
+	dglSetDrawPage(context, 0);
+	dglFill(context, 0, 0, screen_fb->xres, screen_fb->yres, 0x2040C0);
+	for (int snapshot = 0; snapshot < 2; snapshot++) {
+		fps_capture[snapshot] = 0;
+		if (snapshot && (!(screen_fb->flags & DGL_FB_FLAG_HAVE_COPY_AREA) ||
+		screen_fb->virtual_yres < screen_fb->yres * 2))
+			continue;
+		dstTimer timer;
+		tt->Start(BENCHMARK_DURATION);
+		timer.Start();
+		int nu_frames = 0;
+		for (;;) {
+			dglCaptureScreen(screen_fb, dest, snapshot ? 1 : - 1);
+			nu_frames++;
+			if (tt->StopSignalled())
+				break;
+		}
+		fps_capture[snapshot] = nu_frames / timer.Elapsed();
+	}
+	dglDestroyPixmapFB(dest);
+	int spare_page = screen_fb->virtual_yres >= screen_fb->yres * 2 ? 1 : - 1;
+	int range_x = screen_fb->xres - CAPTURE_SQUARE_SIZE;
+	int range_y = screen_fb->yres - CAPTURE_SQUARE_SIZE;
+	for (int compress = 0; compress < 2; compress++) {
+		dglRecorder *recorder = dglCreateRecorder(screen_fb, CAPTURE_FILENAME,
+			CAPTURE_MAX_QUEUED_FRAMES, spare_page, compress ? DGL_RECORDER_FLAG_COMPRESS : 0);
+		fps_record[compress] = 0;
+		nu_dropped[compress] = 0;
+		if (recorder == NULL)
+			continue;
+		dstTimer timer;
+		tt->Start(BENCHMARK_DURATION);
+		timer.Start();
+		int nu_frames = 0;
+		for (;;) {
+			int x = (nu_frames * 5) % range_x;
+			int y = (nu_frames * 3) % range_y;
+			dglFill(context, x, y, CAPTURE_SQUARE_SIZE, CAPTURE_SQUARE_SIZE,
+				0xFFFFFF - nu_frames);
+			dglRecordFrame(recorder);
+			nu_frames++;
+			if (tt->StopSignalled())
+				break;
+		}
+		fps_record[compress] = nu_frames / timer.Elapsed();
+		nu_dropped[compress] = recorder->nu_frames_dropped;
+		dglDestroyRecorder(recorder);
+		unlink(CAPTURE_FILENAME);
+	}
+}
+
+// Compare Fill, PutImage and software CopyArea throughput with and without
+// streaming stores for write-combined framebuffer memory. Throughputs are
+// stored in pixels per second, indexed by [streaming][test].
+
+enum {
+	STREAMING_TEST_FILL,
+	STREAMING_TEST_PUT_IMAGE,
+	STREAMING_TEST_COPY_AREA,
+	NU_STREAMING_TESTS
+};
+
+static const char *streaming_test_name[NU_STREAMING_TESTS] = {
+	"Fill", "PutImage", "CopyArea (software blit)"
+};
+
+static void StreamingTest(dglContext *context, dstThreadedTimeout *tt,
+double throughput[2][NU_STREAMING_TESTS]) {
+	dglFB *fb;
+	DGL_GET_DRAW_FB(context, fb);
+	dglImage *image = CreateImage(context);
+	int flags = fb->flags;
+	for (int streaming = 0; streaming < 2; streaming++) {
+		fb->flags = flags & ~(DGL_FB_FLAG_WRITE_COMBINED |
+			DGL_FB_FLAG_HAVE_COPY_AREA);
+		if (streaming)
+			fb->flags |= DGL_FB_FLAG_WRITE_COMBINED;
+		dstTimer timer;
+		tt->Start(BENCHMARK_DURATION);
+		timer.Start();
+		uint64_t pixels = FillTest(context, tt);
+		throughput[streaming][STREAMING_TEST_FILL] = pixels / timer.Elapsed();
+		tt->Start(BENCHMARK_DURATION);
+		timer.Start();
+		pixels = PutImageTest(context, tt, image);
+		throughput[streaming][STREAMING_TEST_PUT_IMAGE] = pixels / timer.Elapsed();
+		DrawPattern(context);
+		tt->Start(BENCHMARK_DURATION);
+		timer.Start();
+		pixels = CopyTest(context, tt);
+		throughput[streaming][STREAMING_TEST_COPY_AREA] = pixels / timer.Elapsed();
+	}
+	fb->flags = flags;
+	dglDestroyImage(image);
+}
+
+// Measure the throughput of full-height copies of narrow columns between
+// pixmaps with different strides, for a sweep of column widths, comparing
+// a memcpy call per row with dglCopyArea (which uses dglCopyRows).
+// Throughputs are stored in pixels per second, indexed by [method][width].
+
+#define NU_COPY_WIDTHS 9
+#define COPY_WIDTH_DURATION (BENCHMARK_DURATION / 4)
+
+static const int copy_width[NU_COPY_WIDTHS] = { 1, 2, 4, 8, 16, 32, 64, 128, 512 };
+
+static void CopyRowsMemcpy(dglFB *read_fb, dglFB *draw_fb, int x, int w, int h) {
+	const uint8_t *sp = read_fb->framebuffer_addr + x * read_fb->bytes_per_pixel;
+	uint8_t *dp = draw_fb->framebuffer_addr + x * draw_fb->bytes_per_pixel;
+	for (int i = 0; i < h; i++) {
+		memcpy(dp, sp, w * draw_fb->bytes_per_pixel);
+		sp += read_fb->stride;
+		dp += draw_fb->stride;
+	}
+}
+
+static void CopyWidthTest(dglScreenFB *screen_fb, dstThreadedTimeout *tt,
+double throughput[2][NU_COPY_WIDTHS]) {
+	int w = screen_fb->xres;
+	int h = screen_fb->yres;
+	dglFB *read_fb = dglCreatePixmapFB(screen_fb->format, w, h);
+	// Use a different stride for the destination.
+	dglFB *draw_fb = dglCreatePixmapFB(screen_fb->format, w + 8, h);
+	memset(read_fb->framebuffer_addr, 0x55, read_fb->total_size);
+	dglContext *context = dglCreateContext(read_fb, draw_fb);
+	for (int i = 0; i < NU_COPY_WIDTHS; i++)
+		for (int method = 0; method < 2; method++) {
+			int column_w = copy_width[i];
+			dstTimer timer;
+			tt->Start(COPY_WIDTH_DURATION);
+			timer.Start();
+			uint64_t pixels = 0;
+			for (;;) {
+				for (int x = 0; x + column_w <= w; x += column_w) {
+					if (method == 0)
+						CopyRowsMemcpy(read_fb, draw_fb, x, column_w, h);
+					else
+						dglCopyArea(context, x, 0, x, 0, column_w, h);
+				}
+				pixels += (uint64_t)(w / column_w) * column_w * h;
+				if (tt->StopSignalled())
+					break;
+			}
+			throughput[method][i] = pixels / timer.Elapsed();
+		}
+	dglDestroyContext(context);
+	dglDestroyPixmapFB(draw_fb);
+	dglDestroyPixmapFB(read_fb);
+}
+
+// Measure the throughput of frame-sized copies between pixmaps with
+// different strides, comparing a memcpy call per row with the large copy
+// kernel at a range of prefetch distances. Afterwards the large copy is
+// calibrated again, which returns the prefetch distance it selects.
+// Throughputs are stored in bytes per second; index 0 is memcpy.
+
+#define NU_LARGE_COPY_DISTANCES 6
+#define LARGE_COPY_DURATION (BENCHMARK_DURATION / 4)
+
+static const int large_copy_distance[NU_LARGE_COPY_DISTANCES] = {
+	0, 64, 128, 256, 512, 1024 };
+
+static int LargeCopyTest(dglScreenFB *screen_fb, dstThreadedTimeout *tt,
+double throughput[NU_LARGE_COPY_DISTANCES + 1]) {
+	int w = screen_fb->xres;
+	int h = screen_fb->yres;
+	dglFB *read_fb = dglCreatePixmapFB(screen_fb->format, w, h);
+	dglFB *draw_fb = dglCreatePixmapFB(screen_fb->format, w + 8, h);
+	memset(read_fb->framebuffer_addr, 0x55, read_fb->total_size);
+	memset(draw_fb->framebuffer_addr, 0, draw_fb->total_size);
+	int row_size = w * read_fb->bytes_per_pixel;
+	for (int method = 0; method <= NU_LARGE_COPY_DISTANCES; method++) {
+		if (method > 0)
+			dglSetLargeCopyPrefetchDistance(large_copy_distance[method - 1]);
+		dstTimer timer;
+		tt->Start(LARGE_COPY_DURATION);
+		timer.Start();
+		uint64_t bytes = 0;
+		for (;;) {
+			if (method == 0)
+				CopyRowsMemcpy(read_fb, draw_fb, 0, w, h);
+			else
+				dglCopyRowsLarge(draw_fb->framebuffer_addr, draw_fb->stride,
+					read_fb->framebuffer_addr, read_fb->stride, row_size, h,
+					false);
+			bytes += (uint64_t)row_size * h;
+			if (tt->StopSignalled())
+				break;
+		}
+		throughput[method] = bytes / timer.Elapsed();
+	}
+	dglDestroyPixmapFB(draw_fb);
+	dglDestroyPixmapFB(read_fb);
+	return dglCalibrateLargeCopy();
+}
+
+// Measure the throughput of converting a screen-sized pixmap between pixel
+// formats with dglConvertRows. Throughputs are stored in pixels per second.
+
+#define NU_CONVERSIONS 5
+#define CONVERT_DURATION (BENCHMARK_DURATION / 4)
+
+static const uint32_t conversion_format[NU_CONVERSIONS][2] = {
+	{ DGL_FORMAT_XRGB8888, DGL_FORMAT_RGB565 },
+	{ DGL_FORMAT_XRGB8888, DGL_FORMAT_RGB565 },	// Dithered.
+	{ DGL_FORMAT_RGB565, DGL_FORMAT_XRGB8888 },
+	{ DGL_FORMAT_XRGB8888, DGL_FORMAT_XBGR8888 },
+	{ DGL_FORMAT_BGR565, DGL_FORMAT_RGB565 }
+};
+
+static const char *conversion_name[NU_CONVERSIONS] = {
+	"XRGB8888 to RGB565", "XRGB8888 to RGB565 dithered", "RGB565 to XRGB8888",
+	"XRGB8888 to XBGR8888", "BGR565 to RGB565"
+};
+
+static void ConvertTest(dglScreenFB *screen_fb, dstThreadedTimeout *tt,
+double throughput[NU_CONVERSIONS]) {
+	int w = screen_fb->xres;
+	int h = screen_fb->yres;
+	for (int i = 0; i < NU_CONVERSIONS; i++) {
+		dglFB *read_fb = dglCreatePixmapFB(conversion_format[i][0], w, h);
+		dglFB *draw_fb = dglCreatePixmapFB(conversion_format[i][1], w, h);
+		for (int j = 0; j < read_fb->total_size; j++)
+			read_fb->framebuffer_addr[j] = j * 7;
+		int flags = i == 1 ? DGL_CONVERT_FLAG_DITHER : 0;
+		dstTimer timer;
+		tt->Start(CONVERT_DURATION);
+		timer.Start();
+		uint64_t pixels = 0;
+		for (;;) {
+			dglConvertRows(draw_fb->format, draw_fb->framebuffer_addr, draw_fb->stride,
+				read_fb->format, read_fb->framebuffer_addr, read_fb->stride,
+				w, h, flags);
+			pixels += (uint64_t)w * h;
+			if (tt->StopSignalled())
+				break;
+		}
+		throughput[i] = pixels / timer.Elapsed();
+		dglDestroyPixmapFB(draw_fb);
+		dglDestroyPixmapFB(read_fb);
+	}
+}
+
+// Check that dglConvertRows round-trips all RGB565 values through XRGB8888
+// unchanged, and that RGB565 to BGR565 swaps the red and blue fields (and
+// back). Returns the number of pixels that differ.
+
+static int ConvertRoundTripTest() {
+	dglFB *rgb565_fb = dglCreatePixmapFB(DGL_FORMAT_RGB565, 256, 256);
+	dglFB *xrgb_fb = dglCreatePixmapFB(DGL_FORMAT_XRGB8888, 256, 256);
+	dglFB *bgr565_fb = dglCreatePixmapFB(DGL_FORMAT_BGR565, 256, 256);
+	dglFB *result_fb = dglCreatePixmapFB(DGL_FORMAT_RGB565, 256, 256);
+	uint16_t *rgb565 = (uint16_t *)rgb565_fb->framebuffer_addr;
+	uint16_t *bgr565 = (uint16_t *)bgr565_fb->framebuffer_addr;
+	uint16_t *result = (uint16_t *)result_fb->framebuffer_addr;
+	for (int i = 0; i < 65536; i++)
+		rgb565[i] = i;
+	int nu_errors = 0;
+	dglConvertRows(DGL_FORMAT_XRGB8888, xrgb_fb->framebuffer_addr, xrgb_fb->stride,
+		DGL_FORMAT_RGB565, rgb565_fb->framebuffer_addr, rgb565_fb->stride, 256, 256, 0);
+	dglConvertRows(DGL_FORMAT_RGB565, result_fb->framebuffer_addr, result_fb->stride,
+		DGL_FORMAT_XRGB8888, xrgb_fb->framebuffer_addr, xrgb_fb->stride, 256, 256, 0);
+	for (int i = 0; i < 65536; i++)
+		if (result[i] != rgb565[i])
+			nu_errors++;
+	dglConvertRows(DGL_FORMAT_BGR565, bgr565_fb->framebuffer_addr, bgr565_fb->stride,
+		DGL_FORMAT_RGB565, rgb565_fb->framebuffer_addr, rgb565_fb->stride, 256, 256, 0);
+	dglConvertRows(DGL_FORMAT_RGB565, result_fb->framebuffer_addr, result_fb->stride,
+		DGL_FORMAT_BGR565, bgr565_fb->framebuffer_addr, bgr565_fb->stride, 256, 256, 0);
+	for (int i = 0; i < 65536; i++) {
+		int swapped = ((i & 0x1F) << 11) | (i & 0x07E0) | (i >> 11);
+		if (bgr565[i] != swapped || result[i] != rgb565[i])
+			nu_errors++;
+	}
+	dglDestroyPixmapFB(result_fb);
+	dglDestroyPixmapFB(bgr565_fb);
+	dglDestroyPixmapFB(xrgb_fb);
+	dglDestroyPixmapFB(rgb565_fb);
+	return nu_errors;
+}
+
 static void PageFlipTest(dglContext *context, int max_pages) {
 	dglFB *fb;
 	DGL_GET_DRAW_FB(context, fb);
-	int nu_pages = maxi(((dglScreenFB *)fb)->nu_pages, max_pages);
+	int nu_pages = ((dglScreenFB *)fb)->nu_pages;
+	if (nu_pages > max_pages)
+		nu_pages = max_pages;
 	for (int i = 0; i < nu_pages; i++) {
 		float r, g, b;
 		r = g = b = 0.0f;
@@ -192,24 +1141,7 @@ public :
 #define MAX_VELOCITY 100.0f
 #define MAX_OBJECT_RADIUS 35.0f
 
-// Animated demo showing squares of different sizes moving with
-// different velocities and varying directions. Intended to demonstrate
-// page flipping and animation techniques using an off-screen buffer.
-
-static float AnimatedDemo(dglContext *context, int mode, int max_pages,
-bool vsync, bool half_size) {
-	dglFB *console_fb, *pixmap_fb;
-	DGL_GET_DRAW_FB(context, console_fb);
-	int window_x = 0;
-	int window_y = 0;
-	int window_w = console_fb->xres;
-	int window_h = console_fb->yres;
-	if (half_size) {
-		window_w = console_fb->xres / 2;
-		window_h = console_fb->yres / 2;
-		window_x = (console_fb->xres - window_w) / 2;
-		window_y = (console_fb->yres - window_h) / 2;
-	}
+static MovingObject *CreateMovingObjects(int window_w, int window_h) {
 	MovingObject *object = new MovingObject[NU_MOVING_OBJECTS];
 	for (int i = 0; i < NU_MOVING_OBJECTS; i++) {
 		float scale_factor = 1.0f;
@@ -231,6 +1163,48 @@ bool vsync, bool half_size) {
 				break;
 		}
 	}
+	return object;
+}
+
+// Update object positions.
+
+static void MoveObjects(MovingObject *object, float dt) {
+	for (int i = 0; i < NU_MOVING_OBJECTS; i++) {
+		object[i].heading += dt * object[i].turn;
+		float dx = dt * object[i].velocity * cosf(object[i].heading);
+		float dy = dt * object[i].velocity * sinf(object[i].heading);
+		object[i].x += dx;
+		object[i].y += dy;
+		// Change turn direction on average once every 10 seconds
+		if (rng->RandomFloat(1.0f) < 0.1f * dt)
+			object[i].turn = rng->RandomInt(3) * 0.2f * M_PI - 0.1f * M_PI;
+	}
+}
+
+// Animated demo showing squares of different sizes moving with
+// different velocities and varying directions. Intended to demonstrate
+// page flipping and animation techniques using an off-screen buffer.
+// With occlusion culling, the parts of the background and the squares that
+// are covered by other squares are not drawn. When trace_filename is not
+// NULL, the drawing operations are recorded with a checksum every frame.
+
+static float AnimatedDemo(dglContext *context, int mode, int max_pages,
+bool vsync, int vsync_interval, bool half_size, bool occlusion,
+const char *trace_filename, dglFramePacerStats *pacer_stats,
+dglOcclusionStats *occlusion_stats) {
+	dglFB *console_fb, *pixmap_fb;
+	DGL_GET_DRAW_FB(context, console_fb);
+	int window_x = 0;
+	int window_y = 0;
+	int window_w = console_fb->xres;
+	int window_h = console_fb->yres;
+	if (half_size) {
+		window_w = console_fb->xres / 2;
+		window_h = console_fb->yres / 2;
+		window_x = (console_fb->xres - window_w) / 2;
+		window_y = (console_fb->yres - window_h) / 2;
+	}
+	MovingObject *object = CreateMovingObjects(window_w, window_h);
 	int draw_page = 0;
 	if (mode == DEMO_MODE_DMA) {
 		// Draw into offscreen framebuffer page.
@@ -261,6 +1235,19 @@ bool vsync, bool half_size) {
 		dglSetClipRectangle(window_x, window_y, window_x + window_w,
 			window_y + window_h, clip_rect);
 	}
+	dglFramePacer *pacer = NULL;
+	if (vsync)
+		pacer = dglCreateFramePacer((dglScreenFB *)console_fb, vsync_interval);
+	dglOcclusionCuller *culler = NULL;
+	if (occlusion) {
+		culler = dglCreateOcclusionCuller();
+		dglSetOcclusionCuller(context, culler);
+	}
+	dglTracer *tracer = NULL;
+	if (trace_filename != NULL) {
+		tracer = dglCreateTracer(trace_filename, DGL_TRACER_FLAG_CHECKSUMS);
+		dglSetTracer(context, tracer);
+	}
 	dstThreadedTimeout *tt = new dstThreadedTimeout;
 	tt->Start(DEMO_DURATION);
 	int nu_frames = 0;
@@ -293,20 +1280,26 @@ bool vsync, bool half_size) {
 				object[i].rgb[1], object[i].rgb[2]);
 			dglFill(context, x1, y1, x2 - x1, y2 - y1, pixel);
 		}
+		if (occlusion)
+			dglFlushOcclusion(context);
+		if (tracer != NULL)
+			dglTraceFrame(context);
 		if (mode == DEMO_MODE_DMA) {
 			dglSetDrawPage(context, 0);
 			dglSetReadPage(context, 1);
 			if (vsync)
-				dglWaitVSync((dglScreenFB *)console_fb);
+				dglFramePacerWait(pacer);
 			dglCopyArea(context, window_x, window_y, window_x, window_y,
 				window_w, window_h);
 			dglSetDrawPage(context, 1);
 		}
 		else if (mode == DEMO_MODE_PAGEFLIP) {
 			if (vsync)
-				dglWaitVSync((dglScreenFB *)console_fb);
+				dglFramePacerWait(pacer);
 			dglSetDisplayPage((dglScreenFB *)console_fb, draw_page);
-			int nu_pages = maxi(((dglScreenFB *)console_fb)->nu_pages, max_pages);
+			int nu_pages = ((dglScreenFB *)console_fb)->nu_pages;
+			if (nu_pages > max_pages)
+				nu_pages = max_pages;
 			draw_page = (draw_page + 1) % nu_pages;
 			dglSetDrawPage(context, draw_page);
 		}
@@ -314,7 +1307,7 @@ bool vsync, bool half_size) {
 			dglSetDrawFramebuffer(context, console_fb);
 			// Copy offscreen pixmap to screen.
 			if (vsync)
-				dglWaitVSync((dglScreenFB *)console_fb);
+				dglFramePacerWait(pacer);
 			dglCopyArea(context, 0, 0, window_x, window_y,
                                 window_w, window_h);
 			dglSetDrawFramebuffer(context, pixmap_fb);
@@ -323,17 +1316,16 @@ bool vsync, bool half_size) {
 		if (tt->StopSignalled())
 			break;
 		float dt = timer.Elapsed();
-		// Update object positions.
-		for (int i = 0; i < NU_MOVING_OBJECTS; i++) {
-			object[i].heading += dt * object[i].turn;
-			float dx = dt * object[i].velocity * cosf(object[i].heading);
-			float dy = dt * object[i].velocity * sinf(object[i].heading);
-			object[i].x += dx;
-			object[i].y += dy;
-			// Change turn direction on average once every 10 seconds
-			if (rng->RandomFloat(1.0f) < 0.1f * dt)
-				object[i].turn = rng->RandomInt(3) * 0.2f * M_PI - 0.1f * M_PI;
-		}
+		MoveObjects(object, dt);
+	}
+	if (tracer != NULL) {
+		dglSetTracer(context, NULL);
+		dglDestroyTracer(tracer);
+	}
+	if (occlusion) {
+		dglSetOcclusionCuller(context, NULL);
+		dglGetOcclusionStats(culler, occlusion_stats);
+		dglDestroyOcclusionCuller(culler);
 	}
 	if (mode == DEMO_MODE_PAGEFLIP)
 		dglSetDisplayPage((dglScreenFB *)console_fb, 0);
@@ -342,38 +1334,268 @@ bool vsync, bool half_size) {
 		dglSetDrawFramebuffer(context, console_fb);
 		dglDestroyPixmapFB(pixmap_fb);
 	}
+	if (vsync) {
+		dglGetFramePacerStats(pacer, pacer_stats);
+		dglDestroyFramePacer(pacer);
+	}
 	return nu_frames / timer2.Elapsed();
 }
 
+// Multi-threaded variant of the animated demo. The window is divided into
+// horizontal bands, and each band is drawn by a separate render thread
+// using its own context with a clip rectangle, directly into the screen
+// framebuffer. A present barrier joins the threads at the end of each
+// frame, after which the last thread flips pages (when possible) and
+// updates the object positions.
+
+#define NU_RENDER_THREADS 4
+
+class ThreadedDemoState {
+public :
+	dglScreenFB *fb;
+	int window_x, window_y, window_w, window_h;
+	MovingObject *object;
+	int nu_pages;
+	int draw_page;
+	bool vsync;
+	bool stop;
+	int nu_frames;
+	dstThreadedTimeout *tt;
+	dstTimer timer;
+	dglPresentBarrier *barrier;
+};
+
+class RenderThread {
+public :
+	ThreadedDemoState *demo;
+	dglContext *context;
+	pthread_t thread;
+};
+
+// Called by the last render thread to finish a frame, while the other
+// threads are waiting.
+
+static void ThreadedDemoPresent(void *user_data) {
+	ThreadedDemoState *demo = (ThreadedDemoState *)user_data;
+	if (demo->vsync)
+		dglWaitVSync(demo->fb);
+	if (demo->nu_pages > 1) {
+		dglSetDisplayPage(demo->fb, demo->draw_page);
+		demo->draw_page = (demo->draw_page + 1) % demo->nu_pages;
+	}
+	else
+		dglFlushShadowFramebuffer(demo->fb);
+	demo->nu_frames++;
+	if (demo->tt->StopSignalled())
+		demo->stop = true;
+	MoveObjects(demo->object, demo->timer.Elapsed());
+}
+
+static void *RenderThreadMain(void *arg) {
+	RenderThread *thread = (RenderThread *)arg;
+	ThreadedDemoState *demo = thread->demo;
+	dglContext *context = thread->context;
+	for (;;) {
+		dglSetDrawPage(context, demo->draw_page);
+		// Drawing is clipped to the band of the thread.
+		dglFill(context, demo->window_x, demo->window_y, demo->window_w,
+			demo->window_h, 0);
+		for (int i = 0; i < NU_MOVING_OBJECTS; i++) {
+			MovingObject *object = &demo->object[i];
+			int x1 = demo->window_x + object->x - object->size;
+			int y1 = demo->window_y + object->y - object->size;
+			uint32_t pixel = dglConvertColor(demo->fb->format,
+				object->rgb[0], object->rgb[1], object->rgb[2]);
+			dglFill(context, x1, y1, object->size * 2, object->size * 2, pixel);
+		}
+		dglPresentBarrierWait(demo->barrier);
+		if (demo->stop)
+			break;
+	}
+	return NULL;
+}
+
+static float ThreadedDemo(dglScreenFB *fb, int max_pages, bool vsync, bool half_size,
+float *barrier_wait_time) {
+	ThreadedDemoState *demo = new ThreadedDemoState;
+	demo->fb = fb;
+	demo->window_x = 0;
+	demo->window_y = 0;
+	demo->window_w = fb->xres;
+	demo->window_h = fb->yres;
+	if (half_size) {
+		demo->window_w = fb->xres / 2;
+		demo->window_h = fb->yres / 2;
+		demo->window_x = (fb->xres - demo->window_w) / 2;
+		demo->window_y = (fb->yres - demo->window_h) / 2;
+	}
+	demo->object = CreateMovingObjects(demo->window_w, demo->window_h);
+	demo->nu_pages = 1;
+	if (fb->flags & DGL_FB_FLAG_HAVE_PAN_DISPLAY) {
+		demo->nu_pages = fb->nu_pages;
+		if (demo->nu_pages > max_pages)
+			demo->nu_pages = max_pages;
+	}
+	demo->draw_page = 0;
+	if (demo->nu_pages > 1)
+		demo->draw_page = 1;
+	demo->vsync = vsync;
+	demo->stop = false;
+	demo->nu_frames = 0;
+	demo->barrier = dglCreatePresentBarrier(NU_RENDER_THREADS, ThreadedDemoPresent, demo);
+	demo->tt = new dstThreadedTimeout;
+	demo->tt->Start(DEMO_DURATION);
+	demo->timer.Start();
+	dstTimer timer;
+	timer.Start();
+	RenderThread thread[NU_RENDER_THREADS];
+	for (int i = 0; i < NU_RENDER_THREADS; i++) {
+		thread[i].demo = demo;
+		thread[i].context = dglCreateContext(fb, fb);
+		int y1 = demo->window_y + demo->window_h * i / NU_RENDER_THREADS;
+		int y2 = demo->window_y + demo->window_h * (i + 1) / NU_RENDER_THREADS;
+		dglSetContextClipRectangle(thread[i].context, demo->window_x, y1,
+			demo->window_x + demo->window_w, y2);
+		pthread_create(&thread[i].thread, NULL, RenderThreadMain, &thread[i]);
+	}
+	for (int i = 0; i < NU_RENDER_THREADS; i++) {
+		pthread_join(thread[i].thread, NULL);
+		dglDestroyContext(thread[i].context);
+	}
+	float fps = demo->nu_frames / timer.Elapsed();
+	*barrier_wait_time = demo->barrier->wait_time_total /
+		(demo->barrier->nu_frames * NU_RENDER_THREADS);
+	if (demo->nu_pages > 1)
+		dglSetDisplayPage(fb, 0);
+	dglDestroyPresentBarrier(demo->barrier);
+	delete demo->tt;
+	delete [] demo->object;
+	delete demo;
+	return fps;
+}
+
+static void PrintFramePacerStats(const char *name, dglFramePacerStats *stats) {
+	printf("Demo (%s) frame pacing: %d frames, refresh rate %.2f Hz, target frame time "
+		"%.2f ms\n", name, stats->nu_frames, stats->refresh_rate,
+		stats->target_frame_time * 1000.0);
+	printf("    frame time mean %.2f ms, jitter %.3f ms, p50 %.1f ms, p90 %.1f ms, "
+		"p99 %.1f ms, max %.2f ms\n", stats->mean_frame_time * 1000.0,
+		stats->jitter * 1000.0, stats->p50_frame_time * 1000.0,
+		stats->p90_frame_time * 1000.0, stats->p99_frame_time * 1000.0,
+		stats->max_frame_time * 1000.0);
+	printf("    vsync latency mean %.2f ms, max %.2f ms, missed vblanks %d, "
+		"dropped frames %d\n", stats->mean_latency * 1000.0,
+		stats->max_latency * 1000.0, stats->nu_missed_vblanks,
+		stats->nu_dropped_frames);
+}
+
+static void PrintOcclusionStats(const char *name, dglOcclusionStats *stats) {
+	printf("Demo (%s) occlusion culling: %d ops, %d culled, %d rectangles drawn, "
+		"overdraw %.2f without culling, %.2f with culling\n", name, stats->nu_ops,
+		stats->nu_culled_ops, stats->nu_rects_drawn, stats->overdraw,
+		stats->overdraw_culled);
+}
+
 int main(int argc, char *argv[]) {
 	bool copyarea_dma = false;
 	bool copyarea_memcpy = false;
+	bool copyarea_calibrated = false;
 	bool fill_nodma = false;
 	bool putimage_memcpy = false;
+	bool streaming = false;
+	bool copy_width_sweep = false;
+	bool large_copy = false;
+	bool convert = false;
+	bool putsprite = false;
+	bool decode = false;
+	bool yuv = false;
+	bool gradient = false;
+	bool scroll = false;
+	bool cache = false;
+	bool region = false;
+	bool dirty_pages = false;
+	bool event_loop = false;
+	bool present = false;
+	bool compositor = false;
+	bool capture = false;
 	bool test_pageflip = false;
 	bool demo_dma = false;
 	bool demo_pageflip = false;
 	bool demo_memcpy = false;
+	bool demo_threads = false;
 	int max_pages = 3;
 	bool vsync = false;
+	int vsync_interval = 1;
 	bool demo_half_size = false;
+	bool occlusion = false;
+	bool trace = false;
+	bool shadow = false;
+	bool drm = false;
 	if (argc == 1) {
 		printf("test-dgl: Test extended framebuffer for RPi.\n"
 			"Syntax: test-dgl [commands/options]\n\n"
 			"Commands:\n\n"
 			"copyarea-dma      Benchmark CopyArea performance using DMA.\n"
 			"copyarea-memcpy   Benchmark CopyArea performance using memcpy.\n"
+			"copyarea-calibrated Calibrate CopyArea size classes for DMA or memcpy and\n"
+			"                  benchmark CopyArea performance with the calibration.\n"
 			"fill              Benchmark Fill performance without DMA.\n"
 			"putimage          Benchmark PutImage performance without DMA.\n"
+			"putsprite         Benchmark PutSprite (transparent sprite) performance\n"
+			"                  compared to PutImage.\n"
+			"decode            Benchmark decoding a compressed image into the screen\n"
+			"                  compared to PutImage of the uncompressed image.\n"
+			"gradient          Benchmark gradient and pattern fills compared to Fill.\n"
+			"scroll            Benchmark scrolling text lines into the screen with and\n"
+			"                  without panning.\n"
+			"cache             Compare redrawing a grid of widgets every frame with drawing\n"
+			"                  them from a surface cache.\n"
+			"region            Compare filling overlapping rectangles one by one with\n"
+			"                  filling their union region, and measure region operations.\n"
+			"dirty-pages       Compare shadow framebuffer flushes with dirty-page updates\n"
+			"                  that only write changed pages of screen memory.\n"
+			"event-loop        Page-flip from a poll-based event loop using pollable vsync\n"
+			"                  events and non-blocking display page requests.\n"
+			"present           Measure the frame rate of each presentation mode (pan,\n"
+			"                  CopyArea from a spare page, pixmap) and show which one is\n"
+			"                  selected automatically.\n"
+			"compositor        Run a compositor on a simulated screen framebuffer with\n"
+			"                  animated client processes and report the frame rate.\n"
+			"capture           Benchmark screen capture with and without a DMA snapshot and\n"
+			"                  the frame rate while recording frames to a file.\n"
+			"yuv               Benchmark YUV to RGB conversion of video frames and the\n"
+			"                  video queue frame rate.\n"
+			"streaming         Compare Fill, PutImage and CopyArea performance with and\n"
+			"                  without streaming stores to write-combined memory.\n"
+			"copy-width        Compare copying narrow columns between pixmaps with a\n"
+			"                  memcpy per row and with the 2D row copy, for a sweep of\n"
+			"                  widths.\n"
+			"large-copy        Compare frame-sized copies between pixmaps with a memcpy\n"
+			"                  per row and with the large copy kernel at a range of\n"
+			"                  prefetch distances.\n"
+			"convert           Benchmark pixel format conversion between pixmaps.\n"
 			"test-pageflip     Page-flipping test (should show red, green, and possibly blue).\n"
 			"demo-dma          Perform animated demo using DMA from offscreen buffer.\n"
 			"demo-pageflip     Perform amimated demo using page-flipping.\n"
-			"demo-memcpy       Perform animated demo using memcpy from offscreen buffer.\n\n"
+			"demo-memcpy       Perform animated demo using memcpy from offscreen buffer.\n"
+			"demo-threads      Perform animated demo with multiple render threads drawing\n"
+			"                  into the screen framebuffer.\n\n"
 			"Options:\n\n"
 			"double-buffer     Use double-buffering instead of triple-buffering when using \n"
 			"                  page flipping.\n"
-			"vsync             Force wait for vsync after drawing each frame.\n"
-			"half-size         Use half the display resolution for the animated demo window.\n");
+			"vsync             Force wait for vsync after drawing each frame and report\n"
+			"                  frame pacing statistics.\n"
+			"fps30, fps20      Pace the animated demo to a half or a third of the display\n"
+			"                  refresh rate (implies vsync).\n"
+			"half-size         Use half the display resolution for the animated demo window.\n"
+			"occlusion         Use occlusion culling in the animated demo and report the\n"
+			"                  overdraw.\n"
+			"trace             Record the drawing operations of the animated demo to\n"
+			"                  /tmp/test-dgl-<mode>.trace for replay with dgl-replay.\n"
+			"shadow            Enable shadow framebuffer mode (draw into a copy in system\n"
+			"                  memory).\n"
+			"drm               Use the DRM/KMS framebuffer (DGL_DRM_DEVICE or /dev/dri/card0)\n"
+			"                  instead of the console framebuffer.\n");
 		exit(0);
 	}
 	for (int i = 1; i < argc; i++) {
@@ -381,10 +1603,44 @@ int main(int argc, char *argv[]) {
 			copyarea_dma = true;
 		else if (strcmp(argv[i], "copyarea-memcpy") == 0)
 			copyarea_memcpy = true;
+		else if (strcmp(argv[i], "copyarea-calibrated") == 0)
+			copyarea_calibrated = true;
 		else if (strcmp(argv[i], "fill") == 0)
 			fill_nodma = true;
 		else if (strcmp(argv[i], "putimage") == 0)
 			putimage_memcpy = true;
+		else if (strcmp(argv[i], "putsprite") == 0)
+			putsprite = true;
+		else if (strcmp(argv[i], "decode") == 0)
+			decode = true;
+		else if (strcmp(argv[i], "gradient") == 0)
+			gradient = true;
+		else if (strcmp(argv[i], "scroll") == 0)
+			scroll = true;
+		else if (strcmp(argv[i], "cache") == 0)
+			cache = true;
+		else if (strcmp(argv[i], "region") == 0)
+			region = true;
+		else if (strcmp(argv[i], "dirty-pages") == 0)
+			dirty_pages = true;
+		else if (strcmp(argv[i], "event-loop") == 0)
+			event_loop = true;
+		else if (strcmp(argv[i], "present") == 0)
+			present = true;
+		else if (strcmp(argv[i], "compositor") == 0)
+			compositor = true;
+		else if (strcmp(argv[i], "capture") == 0)
+			capture = true;
+		else if (strcmp(argv[i], "yuv") == 0)
+			yuv = true;
+		else if (strcmp(argv[i], "streaming") == 0)
+			streaming = true;
+		else if (strcmp(argv[i], "copy-width") == 0)
+			copy_width_sweep = true;
+		else if (strcmp(argv[i], "large-copy") == 0)
+			large_copy = true;
+		else if (strcmp(argv[i], "convert") == 0)
+			convert = true;
 		else if (strcmp(argv[i], "test-pageflip") == 0)
 			test_pageflip = true;
 		else if (strcmp(argv[i], "demo-dma") == 0)
@@ -393,25 +1649,54 @@ int main(int argc, char *argv[]) {
 			demo_pageflip = true;
 		else if (strcmp(argv[i], "demo-memcpy") == 0)
 			demo_memcpy = true;
+		else if (strcmp(argv[i], "demo-threads") == 0)
+			demo_threads = true;
 		else if (strcmp(argv[i], "double-buffer") == 0)
 			max_pages = 2;
 		else if (strcmp(argv[i], "vsync") == 0)
 			vsync = true;
+		else if (strcmp(argv[i], "fps30") == 0) {
+			vsync = true;
+			vsync_interval = 2;
+		}
+		else if (strcmp(argv[i], "fps20") == 0) {
+			vsync = true;
+			vsync_interval = 3;
+		}
 		else if (strcmp(argv[i], "half-size") == 0)
 			demo_half_size = true;
+		else if (strcmp(argv[i], "occlusion") == 0)
+			occlusion = true;
+		else if (strcmp(argv[i], "trace") == 0)
+			trace = true;
+		else if (strcmp(argv[i], "shadow") == 0)
+			shadow = true;
+		else if (strcmp(argv[i], "drm") == 0)
+			drm = true;
 		else {
 			printf("test-dgl: Unrecognized option.\n");
 			exit(1);
 		}
 	}
 
-	dglConsoleFB *cfb = dglCreateConsoleFramebuffer();
+	dglScreenFB *cfb;
+	if (drm)
+		cfb = dglCreateDRMFramebuffer(NULL, max_pages);
+	else
+		cfb = dglCreateConsoleFramebuffer();
 	if (cfb == NULL) {
 		printf("Initialization error.\n");
 		exit(1);
 	}
+	if (shadow)
+		dglEnableShadowFramebuffer(cfb);
 	dglContext *context = dglCreateContext(cfb, cfb);
 
+	if (event_loop && ((cfb->flags & DGL_FB_FLAG_HAVE_PAN_DISPLAY) == 0 ||
+	dglGetNumberOfPages(cfb) < 2)) {
+		event_loop = false;
+		printf("Event loop test (event_loop): PanDisplay with two pages not available.\n");
+	}
 	if (test_pageflip && (cfb->flags & DGL_FB_FLAG_HAVE_PAN_DISPLAY) == 0) {
 		test_pageflip = false;
 		printf("Page-flipping test (test_pageflip): PanDisplay not available.\n");
@@ -420,6 +1705,11 @@ int main(int argc, char *argv[]) {
 		copyarea_dma = false;
 		printf("CopyArea benchmark (copyarea_dma): accelerated DMA CopyArea not available.\n");
 	}
+	if (copyarea_calibrated && (cfb->flags & DGL_FB_FLAG_HAVE_COPY_AREA) == 0) {
+		copyarea_calibrated = false;
+		printf("CopyArea benchmark (copyarea_calibrated): accelerated DMA CopyArea not "
+			"available.\n");
+	}
 	if (demo_dma && (cfb->flags & DGL_FB_FLAG_HAVE_COPY_AREA) == 0) {
 		demo_dma = false;
 		printf("Animated demo (demo_dma): accelerated DMA CopyArea not available.\n");
@@ -438,9 +1728,12 @@ int main(int argc, char *argv[]) {
 	dstTimer timer;
 
 	double elapsed_fill, elapsed_copyarea_memcpy, elapsed_copyarea_dma,
-		elapsed_putimage_memcpy;
+		elapsed_copyarea_calibrated, elapsed_putimage_memcpy;
 	uint64_t pixels_fill, pixels_copyarea_memcpy, pixels_copyarea_dma,
-		pixels_putimage_memcpy;
+		pixels_copyarea_calibrated, pixels_putimage_memcpy;
+	// The memcpy and DMA benchmarks bypass any CopyArea calibration.
+	dglCopyCalibration *copy_calibration = cfb->copy_calibration;
+	cfb->copy_calibration = NULL;
 	if (fill_nodma) {
 		tt->Start(BENCHMARK_DURATION);
 		timer.Start();
@@ -467,6 +1760,17 @@ int main(int argc, char *argv[]) {
 		elapsed_copyarea_dma = timer.Elapsed();
 		cfb->flags = flags;
 	}
+	cfb->copy_calibration = copy_calibration;
+	const char *copy_calibration_str = NULL;
+	if (copyarea_calibrated) {
+		dglCalibrateCopyArea(cfb, NULL);
+		copy_calibration_str = dglGetCopyCalibrationString(cfb);
+		DrawPattern(context);
+		tt->Start(BENCHMARK_DURATION);
+		timer.Start();
+		pixels_copyarea_calibrated = CopyTest(context, tt);
+		elapsed_copyarea_calibrated = timer.Elapsed();
+	}
 
 	if (putimage_memcpy) {
 		dglImage *image = CreateImage(context);
@@ -477,30 +1781,131 @@ int main(int argc, char *argv[]) {
 		dglDestroyImage(image);
 	}
 
+	double throughput_putsprite, throughput_putsprite_image;
+	float sprite_opaque_fraction;
+	if (putsprite)
+		SpriteTest(context, tt, &throughput_putsprite, &throughput_putsprite_image,
+			&sprite_opaque_fraction);
+
+	double throughput_decode[NU_DECODE_TESTS];
+	float compression_ratio;
+	if (decode)
+		DecodeTest(context, tt, throughput_decode, &compression_ratio);
+
+	double throughput_gradient[NU_GRADIENT_TESTS];
+	if (gradient)
+		GradientTest(context, tt, throughput_gradient);
+
+	double lines_per_second_scroll[2];
+	int scroll_mode[2], scroll_wrap_copies[2];
+	if (scroll)
+		ScrollTest(context, tt, lines_per_second_scroll, scroll_mode, scroll_wrap_copies);
+
+	float fps_cache[2];
+	dglSurfaceCacheStats cache_stats;
+	if (cache)
+		SurfaceCacheTest(context, tt, fps_cache, &cache_stats);
+
+	float fps_region[2];
+	double ops_per_second_region;
+	int nu_region_rects;
+	if (region)
+		RegionTest(context, tt, fps_region, &ops_per_second_region, &nu_region_rects);
+
+	float fps_dirty_pages[2];
+	dglDirtyPageStats dirty_page_stats;
+	if (dirty_pages)
+		DirtyPageTest(context, cfb, tt, fps_dirty_pages, &dirty_page_stats);
+
+	float fps_event_loop, vsync_rate_event_loop;
+	if (event_loop)
+		EventLoopTest(context, cfb, tt, &fps_event_loop, &vsync_rate_event_loop);
+
+	float fps_present[DGL_NU_PRESENT_MODES];
+	int present_auto_mode = DGL_PRESENT_MODE_PIXMAP;
+	double present_time[DGL_NU_PRESENT_MODES] = {};
+	if (present)
+		PresentTest(context, cfb, tt, fps_present, &present_auto_mode, present_time);
+
+	float fps_compositor = 0;
+	if (compositor)
+		fps_compositor = CompositorTest(cfb);
+
+	float fps_capture[2], fps_record[2];
+	int nu_dropped_record[2];
+	if (capture)
+		CaptureTest(context, cfb, tt, fps_capture, fps_record, nu_dropped_record);
+
+	double throughput_yuv[DGL_NU_YUV_FORMATS][2];
+	float fps_video_queue;
+	if (yuv)
+		YUVTest(context, cfb, tt, throughput_yuv, &fps_video_queue);
+
+	double throughput_streaming[2][NU_STREAMING_TESTS];
+	if (streaming)
+		StreamingTest(context, tt, throughput_streaming);
+
+	double throughput_copy_width[2][NU_COPY_WIDTHS];
+	if (copy_width_sweep)
+		CopyWidthTest(cfb, tt, throughput_copy_width);
+
+	double throughput_large_copy[NU_LARGE_COPY_DISTANCES + 1];
+	int large_copy_calibrated_distance = 0;
+	if (large_copy)
+		large_copy_calibrated_distance = LargeCopyTest(cfb, tt, throughput_large_copy);
+
+	double throughput_convert[NU_CONVERSIONS];
+	int convert_round_trip_errors = 0;
+	if (convert) {
+		convert_round_trip_errors = ConvertRoundTripTest();
+		ConvertTest(cfb, tt, throughput_convert);
+	}
+
 	if (test_pageflip) {
 		PageFlipTest(context, max_pages);
 	}
 
 	float fps_pageflip, fps_dma, fps_memcpy;
-	if (demo_pageflip)
+	dglPanDisplayStats pan_display_stats;
+	dglFramePacerStats pacer_stats_pageflip, pacer_stats_dma, pacer_stats_memcpy;
+	dglOcclusionStats occlusion_stats_pageflip, occlusion_stats_dma, occlusion_stats_memcpy;
+	if (demo_pageflip) {
+		dglResetPanDisplayStats(cfb);
 		fps_pageflip = AnimatedDemo(context, DEMO_MODE_PAGEFLIP, max_pages, vsync,
-			demo_half_size);
+			vsync_interval, demo_half_size, occlusion,
+			trace ? "/tmp/test-dgl-pageflip.trace" : NULL, &pacer_stats_pageflip,
+			&occlusion_stats_pageflip);
+		dglGetPanDisplayStats(cfb, &pan_display_stats);
+	}
 	if (demo_dma)
 		fps_dma = AnimatedDemo(context, DEMO_MODE_DMA, max_pages, vsync,
-			demo_half_size);
+			vsync_interval, demo_half_size, occlusion,
+			trace ? "/tmp/test-dgl-dma.trace" : NULL, &pacer_stats_dma,
+			&occlusion_stats_dma);
 	if (demo_memcpy)
 		fps_memcpy = AnimatedDemo(context, DEMO_MODE_MEMCPY, max_pages, vsync,
-			demo_half_size);
+			vsync_interval, demo_half_size, occlusion,
+			trace ? "/tmp/test-dgl-memcpy.trace" : NULL, &pacer_stats_memcpy,
+			&occlusion_stats_memcpy);
+	float fps_threads, barrier_wait_time_threads;
+	if (demo_threads)
+		fps_threads = ThreadedDemo(cfb, max_pages, vsync, demo_half_size,
+			&barrier_wait_time_threads);
 
-	if (fill_nodma || copyarea_memcpy || copyarea_dma || putimage_memcpy
-	|| test_pageflip || demo_pageflip || demo_dma || demo_memcpy) {
+	if (fill_nodma || copyarea_memcpy || copyarea_dma || copyarea_calibrated || putimage_memcpy
+	|| putsprite || decode || gradient || scroll || cache || region || dirty_pages || event_loop
+	|| present || capture || yuv || streaming || test_pageflip || demo_pageflip || demo_dma
+	|| demo_memcpy || demo_threads) {
 		// Clear the screen if any tests were performed.
 		dglSetDrawPage(context, 0);
 		dglFill(context, 0, 0, cfb->xres, cfb->yres, 0x000000);
 	}
 
 	const char *info_str = dglGetInfoString(cfb);
-	dglDestroyConsoleFramebuffer(cfb);
+	if (drm)
+		dglDestroyDRMFramebuffer((dglDRMFB *)cfb);
+	else
+		dglDestroyConsoleFramebuffer((dglConsoleFB *)cfb);
 //	system("clear");
 	printf("%s", info_str);
 	delete [] info_str;
@@ -531,12 +1936,153 @@ int main(int argc, char *argv[]) {
 			throughput_dma / pow(10.0d, 6.0d),
 			throughput_dma * cfb->bytes_per_pixel / pow(2.0d, 20.0d));
 	}
+	if (copyarea_calibrated) {
+		printf("%s", copy_calibration_str);
+		delete [] copy_calibration_str;
+		double throughput_calibrated = pixels_copyarea_calibrated /
+			elapsed_copyarea_calibrated;
+		printf("CopyArea pixel throughput (calibrated): %.5G Mpix/s (%.5G MB/s)\n",
+			throughput_calibrated / pow(10.0d, 6.0d),
+			throughput_calibrated * cfb->bytes_per_pixel / pow(2.0d, 20.0d));
+	}
+	if (putsprite)
+		printf("PutSprite (%dx%d, %.0f%% opaque) pixel throughput: %.5G Mpix/s "
+			"(PutImage %.5G Mpix/s)\n", PUT_IMAGE_WIDTH, PUT_IMAGE_HEIGHT,
+			sprite_opaque_fraction * 100.0f, throughput_putsprite / pow(10.0d, 6.0d),
+			throughput_putsprite_image / pow(10.0d, 6.0d));
+	if (decode) {
+		printf("Compressed screen image: compression ratio %.2f\n", compression_ratio);
+		for (int i = 0; i < NU_DECODE_TESTS; i++)
+			printf("%s throughput: %.5G Mpix/s (%.5G MB/s)\n", decode_test_name[i],
+				throughput_decode[i] / pow(10.0d, 6.0d),
+				throughput_decode[i] * cfb->bytes_per_pixel / pow(2.0d, 20.0d));
+	}
+	if (gradient)
+		for (int i = 0; i < NU_GRADIENT_TESTS; i++)
+			printf("%s pixel throughput: %.5G Mpix/s (%.5G MB/s)\n", gradient_test_name[i],
+				throughput_gradient[i] / pow(10.0d, 6.0d),
+				throughput_gradient[i] * cfb->bytes_per_pixel / pow(2.0d, 20.0d));
+	if (scroll)
+		for (int i = 0; i < 2; i++)
+			printf("Scroll (%s, %d pixel lines) throughput: %.5G lines/s, %d wrap copies\n",
+				scroll_mode_name[scroll_mode[i]], SCROLL_LINE_HEIGHT,
+				lines_per_second_scroll[i], scroll_wrap_copies[i]);
+	if (cache)
+		printf("Widget grid fps: %f redrawn, %f from surface cache (%d hits, %d misses, "
+			"%d pixmaps, %d KB)\n", fps_cache[0], fps_cache[1], cache_stats.nu_hits,
+			cache_stats.nu_misses, cache_stats.nu_pixmaps, cache_stats.memory_used / 1024);
+	if (region) {
+		printf("Overlapping rectangles (%d) fill fps: %f one by one, %f as region "
+			"(%d rectangles)\n", REGION_NU_RECTANGLES, fps_region[0], fps_region[1],
+			nu_region_rects);
+		printf("Region operations: %.5G ops/s\n", ops_per_second_region);
+	}
+	if (event_loop)
+		printf("Event loop page flip fps: %f (%f vsync events/s)\n", fps_event_loop,
+			vsync_rate_event_loop);
+	if (dirty_pages && dirty_page_stats.nu_flushes > 0) {
+		int n = dirty_page_stats.nu_flushes;
+		printf("Full clear and %d squares fps: %f shadow framebuffer, %f dirty pages\n",
+			DIRTY_PAGE_NU_SQUARES, fps_dirty_pages[0], fps_dirty_pages[1]);
+		printf("Dirty pages per frame: %.1f KB damaged, %.1f KB written, %.1f KB avoided "
+			"(%.1f of %.1f pages written)\n",
+			dirty_page_stats.bytes_damaged / 1024.0 / n,
+			dirty_page_stats.bytes_written / 1024.0 / n,
+			dirty_page_stats.bytes_avoided / 1024.0 / n,
+			(double)dirty_page_stats.nu_pages_written / n,
+			(double)dirty_page_stats.nu_pages_compared / n);
+	}
+	if (present) {
+		for (int i = 0; i < DGL_NU_PRESENT_MODES; i++)
+			if (fps_present[i] > 0)
+				printf("Present (%s) fps: %f\n", present_mode_name[i], fps_present[i]);
+		printf("Present mode selected automatically: %s", present_mode_name[present_auto_mode]);
+		if (present_time[DGL_PRESENT_MODE_COPY_AREA] > 0)
+			printf(" (full-screen present %.3f ms with CopyArea, %.3f ms from pixmap)",
+				present_time[DGL_PRESENT_MODE_COPY_AREA] * 1000.0,
+				present_time[DGL_PRESENT_MODE_PIXMAP] * 1000.0);
+		printf("\n");
+	}
+	if (compositor)
+		printf("Compositor (%d clients, simulated framebuffer) fps: %f\n",
+			NU_COMPOSITOR_CLIENTS, fps_compositor);
+	if (capture) {
+		printf("Screen capture fps: %f direct", fps_capture[0]);
+		if (fps_capture[1] > 0)
+			printf(", %f with DMA snapshot", fps_capture[1]);
+		printf("\n");
+		printf("Recording fps: %f uncompressed (%d frames dropped), %f compressed "
+			"(%d frames dropped)\n", fps_record[0], nu_dropped_record[0], fps_record[1],
+			nu_dropped_record[1]);
+	}
+	if (yuv) {
+		for (int i = 0; i < DGL_NU_YUV_FORMATS; i++)
+			printf("PutYUVImage %s (%dx%d) pixel throughput: %.5G Mpix/s unscaled, "
+				"%.5G Mpix/s scaled to %dx%d\n", yuv_format_name[i],
+				YUV_FRAME_WIDTH, YUV_FRAME_HEIGHT, throughput_yuv[i][0] / pow(10.0d, 6.0d),
+				throughput_yuv[i][1] / pow(10.0d, 6.0d), cfb->xres, cfb->yres);
+		printf("Video queue (I420 %dx%d, full screen) fps: %f\n", YUV_FRAME_WIDTH,
+			YUV_FRAME_HEIGHT, fps_video_queue);
+	}
+	if (streaming)
+		for (int i = 0; i < NU_STREAMING_TESTS; i++)
+			printf("%s pixel throughput: %.5G Mpix/s regular stores, "
+				"%.5G Mpix/s streaming stores\n", streaming_test_name[i],
+				throughput_streaming[0][i] / pow(10.0d, 6.0d),
+				throughput_streaming[1][i] / pow(10.0d, 6.0d));
+	if (copy_width_sweep)
+		for (int i = 0; i < NU_COPY_WIDTHS; i++)
+			printf("Copy width %d pixels pixel throughput: %.5G Mpix/s memcpy per row, "
+				"%.5G Mpix/s 2D row copy\n", copy_width[i],
+				throughput_copy_width[0][i] / pow(10.0d, 6.0d),
+				throughput_copy_width[1][i] / pow(10.0d, 6.0d));
+	if (large_copy) {
+		printf("Large copy throughput: %.5G MB/s memcpy per row\n",
+			throughput_large_copy[0] / pow(10.0d, 6.0d));
+		for (int i = 0; i < NU_LARGE_COPY_DISTANCES; i++)
+			printf("Large copy throughput: %.5G MB/s prefetch distance %d\n",
+				throughput_large_copy[i + 1] / pow(10.0d, 6.0d),
+				large_copy_distance[i]);
+		printf("Large copy calibrated prefetch distance: %d\n",
+			large_copy_calibrated_distance);
+	}
+	if (convert) {
+		printf("Conversion round trip (RGB565 via XRGB8888, RGB565 via BGR565): %s "
+			"(%d pixels differ)\n", convert_round_trip_errors == 0 ? "exact" : "FAILED",
+			convert_round_trip_errors);
+		for (int i = 0; i < NU_CONVERSIONS; i++)
+			printf("Conversion %s pixel throughput: %.5G Mpix/s\n",
+				conversion_name[i], throughput_convert[i] / pow(10.0d, 6.0d));
+	}
 	if (demo_dma)
 		printf("Demo (DMA) fps: %f\n", fps_dma);
-	if (demo_pageflip)
+	if (demo_pageflip) {
 		printf("Demo (page flip) fps: %f\n", fps_pageflip);
+		printf("Demo (page flip) pan display latency: mean %.1f us, max %.1f us "
+			"(%d flips)\n", pan_display_stats.mean_latency * 1000000.0,
+			pan_display_stats.max_latency * 1000000.0, pan_display_stats.count);
+	}
 	if (demo_memcpy)
 		printf("Demo (memcpy) fps: %f\n", fps_memcpy);
+	if (demo_threads)
+		printf("Demo (%d render threads) fps: %f, mean present barrier wait %.3f ms\n",
+			NU_RENDER_THREADS, fps_threads, barrier_wait_time_threads * 1000.0);
+	if (vsync) {
+		if (demo_dma)
+			PrintFramePacerStats("DMA", &pacer_stats_dma);
+		if (demo_pageflip)
+			PrintFramePacerStats("page flip", &pacer_stats_pageflip);
+		if (demo_memcpy)
+			PrintFramePacerStats("memcpy", &pacer_stats_memcpy);
+	}
+	if (occlusion) {
+		if (demo_dma)
+			PrintOcclusionStats("DMA", &occlusion_stats_dma);
+		if (demo_pageflip)
+			PrintOcclusionStats("page flip", &occlusion_stats_pageflip);
+		if (demo_memcpy)
+			PrintOcclusionStats("memcpy", &occlusion_stats_memcpy);
+	}
 
 	exit(0);
 }